@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,25 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets,
+// each with its own spin-lock, so lookups of different blocks
+// don't contend.  A bucket's lock protects the chain and the
+// dev, blockno, refcnt, and lastuse fields of the buffers on it.
+// Each buffer records when it was last released; a miss
+// recycles the unused buffer with the oldest timestamp.
+//
+// File data lives in the page cache (see pcache.c), so the
+// fs releases the buffers it reads and writes file data
+// through with bforget(), which makes them the first to be
+// recycled; the buffer cache is left to metadata.
+//
+// Disk operations go through the queue in blk.c. They may be
+// started with blksubmit() and finish after the buffer has
+// been released. b->disk is 1
+// while the disk owns b->data: such buffers are never recycled,
+// and bget() waits for the disk before handing one out, on a
+// cache hit as well as a miss.
 
 
 #include "types.h"
@@ -22,70 +41,172 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
+
+#define NBUCKET 31
 
 struct {
+  // serializes recycling, which is the only thing that
+  // moves buffers between buckets or holds two bucket
+  // locks at once.
   struct spinlock lock;
   struct buf buf[NBUF];
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // hash chains through next, one per bucket.
+  struct {
+    struct spinlock lock;
+    struct buf *head;
+  } bucket[NBUCKET];
+
+  uint64 nhit;    // bget()s of cached blocks
+  uint64 nmiss;   // and of blocks it recycled a buffer for
 } bcache;
 
+static uint
+bhash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NBUCKET;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  int i;
 
   initlock(&bcache.lock, "bcache");
+  for(i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head = 0;
+  }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // Start with all buffers in bucket 0; bget() moves
+  // them to the right bucket as they are recycled.
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->next = bcache.bucket[0].head;
+    bcache.bucket[0].head = b;
   }
 }
 
+// Look for block blockno on device dev in bucket h.
+// Caller must hold bucket h's lock.
+static struct buf*
+bfind(int h, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bcache.bucket[h].head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// If every buffer is in use, returns 0 if canfail,
+// and panics otherwise.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int canfail)
 {
-  struct buf *b;
+  struct buf *b, *victim, **pp;
+  int h, i, vh;
 
-  acquire(&bcache.lock);
+  h = bhash(dev, blockno);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  acquire(&bcache.bucket[h].lock);
+  if((b = bfind(h, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bcache.bucket[h].lock);
+    __sync_fetch_and_add(&bcache.nhit, 1);
+    acquiresleep(&b->lock);
+    if(b->disk)
+      blkwait(b);
+    return b;
   }
+  release(&bcache.bucket[h].lock);
 
   // Not cached.
+  // Only one recycler at a time; check again in case another
+  // process cached the block while we didn't hold any lock.
+  acquire(&bcache.lock);
+  acquire(&bcache.bucket[h].lock);
+  if((b = bfind(h, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bcache.bucket[h].lock);
+    release(&bcache.lock);
+    __sync_fetch_and_add(&bcache.nhit, 1);
+    acquiresleep(&b->lock);
+    if(b->disk)
+      blkwait(b);
+    return b;
+  }
+  release(&bcache.bucket[h].lock);
+
   // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Keep holding the lock of the bucket containing the best
+  // candidate so far, so that it can't be taken from under us.
+  victim = 0;
+  vh = -1;
+  for(i = 0; i < NBUCKET; i++){
+    int better = 0;
+    acquire(&bcache.bucket[i].lock);
+    for(b = bcache.bucket[i].head; b; b = b->next){
+      if(b->refcnt == 0 && b->disk == 0 &&
+         (victim == 0 || b->lastuse < victim->lastuse)){
+        victim = b;
+        better = 1;
+      }
+    }
+    if(better){
+      if(vh >= 0)
+        release(&bcache.bucket[vh].lock);
+      vh = i;
+    } else {
+      release(&bcache.bucket[i].lock);
     }
   }
-  panic("bget: no buffers");
+  if(victim == 0){
+    release(&bcache.lock);
+    if(canfail)
+      return 0;
+    panic("bget: no buffers");
+  }
+
+  // Move the victim to bucket h.
+  if(vh != h){
+    for(pp = &bcache.bucket[vh].head; *pp != victim; pp = &(*pp)->next)
+      ;
+    *pp = victim->next;
+    acquire(&bcache.bucket[h].lock);
+    victim->next = bcache.bucket[h].head;
+    bcache.bucket[h].head = victim;
+  }
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->filedata = 0;
+  victim->refcnt = 1;
+  if(vh != h)
+    release(&bcache.bucket[h].lock);
+  release(&bcache.bucket[vh].lock);
+  bcache.nmiss++;
+  release(&bcache.lock);
+
+  acquiresleep(&victim->lock);
+  return victim;
+}
+
+// Count a block read from disk against the process it's for.
+static void
+countread(void)
+{
+  struct proc *p = myproc();
+
+  if(p)
+    p->usage.nblock++;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,60 +215,182 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    blkrw(b, 0);
     b->valid = 1;
+    countread();
   }
   return b;
 }
 
+// Read the n blocks from start on into bufs[], locked, like n
+// bread()s, but with the reads queued together, so they merge,
+// and one wait for all of them. The caller holds all n bufs at
+// once, so n should be small.
+void
+breadn(uint dev, uint start, int n, struct buf **bufs)
+{
+  int i;
+
+  blkplug();
+  for(i = 0; i < n; i++){
+    bufs[i] = bget(dev, start + i, 0);
+    if(!bufs[i]->valid){
+      blksubmit(bufs[i], 0);
+      countread();
+    }
+  }
+  blkunplug();
+  for(i = 0; i < n; i++){
+    if(!bufs[i]->valid){
+      blkwait(bufs[i]);
+      bufs[i]->valid = 1;
+    }
+  }
+}
+
+// Start reading the indicated block into the cache,
+// if it isn't there already, but don't wait for the disk.
+// Gives up quietly if there is no buffer to spare.
+void
+bprefetch(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bget(dev, blockno, 1)) == 0)
+    return;
+  if(!b->valid) {
+    blksubmit(b, 0);
+    countread();
+    // both of bget()'s lookups wait for b->disk before
+    // handing b out, so no one sees the data before it
+    // has arrived, and the buffer can count as valid now.
+    b->valid = 1;
+  }
+  brelse(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  blkrw(b, 1);
 }
 
-// Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Write the n locked bufs in bufs[] to disk, queueing all
+// the writes before waiting for any.
 void
-brelse(struct buf *b)
+bwriten(struct buf **bufs, int n)
+{
+  int i;
+
+  blkplug();
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bufs[i]->lock))
+      panic("bwriten");
+    blksubmit(bufs[i], 1);
+  }
+  blkunplug();
+  for(i = 0; i < n; i++)
+    blkwait(bufs[i]);
+}
+
+// Start writing b's contents to disk, but don't wait for
+// the disk.  Must be locked. b may be released right away:
+// the next bget() of it waits until the write is done.
+void
+bawrite(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bawrite");
+  blksubmit(b, 1);
+}
+
+// Wait for any disk operation on b to finish.
+// The caller must hold a reference to b,
+// but need not hold its lock.
+void
+bwait(struct buf *b)
+{
+  blkwait(b);
+}
+
+// Release a locked buffer, for brelse() or bforget().
+// b->filedata says which released it last: a block that
+// held file data may be freed and reused for metadata.
+static void
+brelse1(struct buf *b, int filedata)
 {
+  int h;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  h = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
+  b->filedata = filedata;
+  if (filedata) {
+    b->lastuse = 0;
+  } else if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
   }
-  
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
+}
+
+// Release a locked buffer.
+// Stamp it with the time, for LRU recycling.
+void
+brelse(struct buf *b)
+{
+  brelse1(b, 0);
+}
+
+// Release a locked buffer holding file data, which the
+// page cache keeps, and make it the first to be recycled.
+void
+bforget(struct buf *b)
+{
+  brelse1(b, 1);
 }
 
+// The caller holds a reference, so b can't move
+// to another bucket while these run.
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
+// Describe the buffer cache's hits and misses in buf, of n
+// bytes, for /proc/bio. Returns the length.
+int
+bstat(char *buf, int n)
+{
+  int i, used;
 
+  used = 0;
+  for(i = 0; i < NBUF; i++)
+    if(bcache.buf[i].refcnt)
+      used++;
+  return snprintf(buf, n, "bufs %d used %d hits %ld misses %ld\n",
+                  NBUF, used, bcache.nhit, bcache.nmiss);
+}
@@ -0,0 +1,235 @@
+// Block I/O queue.
+//
+// bio.c hands disk requests to blksubmit(), which keeps them
+// in a queue sorted by device and block number rather than
+// passing them straight to the driver. The queue drains in
+// elevator (C-LOOK) order: upward from the block after the
+// last one dispatched, then around again from the lowest.
+// A run of queued requests in one direction for consecutive
+// blocks goes to the disk as a single request.
+//
+// A request is dispatched as soon as the driver has room,
+// unless the queue is plugged: blkplug() holds requests back
+// while a caller queues a batch, such as the log's writes, so
+// that they can merge, and blkunplug() lets them go. Waiting
+// for a request that is still queued dispatches it, so a plug
+// never keeps anyone waiting for long.
+//
+// There is a queue for each of the driver's queues, which
+// each hart submits to in turn, so that harts don't contend
+// for one lock. A hart's batch merges within its own queue.
+//
+// b->disk is 1 from blksubmit() until the disk is done with
+// b; b->queued while b is still in the queue, which is
+// b->hwq.
+//
+// Lock order: a queue's lock, then the driver's lock.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+#include "stat.h"
+
+struct blkq {
+  struct spinlock lock;
+  struct buf *queue;    // sorted by dev and blockno, through qnext
+  uint headdev;         // the elevator dispatches from here on
+  uint headblock;
+  int depth;            // bufs in queue
+  int maxdepth;
+  uint64 nblock;
+  uint64 nreq;
+};
+
+struct {
+  int plugged;          // blkplug()s without blkunplug()s
+  struct blkq q[NCPU];
+} blk;
+
+void
+blkinit(void)
+{
+  for(int i = 0; i < NCPU; i++)
+    initlock(&blk.q[i].lock, "blk");
+}
+
+// Does block b come before block (dev, blockno)?
+static int
+before(struct buf *b, uint dev, uint blockno)
+{
+  return b->dev < dev || (b->dev == dev && b->blockno < blockno);
+}
+
+// Hand q's requests to the driver, in elevator order,
+// merging runs of them, until q is empty or the driver's
+// queue is full.
+// Caller must hold q->lock.
+static void
+dispatch(struct blkq *q)
+{
+  struct buf **pp, *b, *last, *x;
+  int n;
+
+  while(q->queue){
+    for(pp = &q->queue; *pp && before(*pp, q->headdev, q->headblock); pp = &(*pp)->qnext)
+      ;
+    if(*pp == 0)
+      pp = &q->queue;  // wrap around
+    b = *pp;
+    n = 1;
+    for(last = b; n < MAXMERGE && (x = last->qnext) != 0; last = x, n++){
+      if(x->dev != b->dev || x->blockno != last->blockno + 1 || x->write != b->write)
+        break;
+    }
+
+    // take the run off the queue, so the driver
+    // can link it with the others it has finished.
+    *pp = last->qnext;
+    last->qnext = 0;
+    for(x = b; x; x = x->qnext)
+      x->queued = 0;
+    if(virtio_disk_start(q - blk.q, b, n, b->write) < 0){
+      // put it back; a completion will dispatch again.
+      for(x = b; x; x = x->qnext)
+        x->queued = 1;
+      last->qnext = *pp;
+      *pp = b;
+      return;
+    }
+
+    q->headdev = b->dev;
+    q->headblock = b->blockno + n;
+    q->depth -= n;
+    q->nreq++;
+  }
+}
+
+// Queue a read (write == 0) or write of b,
+// and return without waiting for it.
+// The caller must not touch b->data, or release b to a
+// process that might, before blkwait(b).
+void
+blksubmit(struct buf *b, int write)
+{
+  struct blkq *q;
+  struct buf **pp;
+
+  push_off();
+  b->hwq = cpuid() % virtio_disk_nqueue();
+  pop_off();
+  q = &blk.q[b->hwq];
+
+  acquire(&q->lock);
+  if(b->disk)
+    panic("blksubmit");
+  b->disk = 1;
+  b->queued = 1;
+  b->write = write;
+  for(pp = &q->queue; *pp && before(*pp, b->dev, b->blockno); pp = &(*pp)->qnext)
+    ;
+  b->qnext = *pp;
+  *pp = b;
+
+  q->nblock++;
+  if(++q->depth > q->maxdepth)
+    q->maxdepth = q->depth;
+  if(blk.plugged == 0)
+    dispatch(q);
+  release(&q->lock);
+}
+
+// Wait for the disk to be done with b.
+// b->hwq can't change meanwhile, since only the holder of
+// b's lock submits it, and not while the disk owns it.
+void
+blkwait(struct buf *b)
+{
+  struct blkq *q = &blk.q[b->hwq];
+
+  acquire(&q->lock);
+  if(b->queued)
+    dispatch(q);
+  while(b->disk)
+    sleep(b, &q->lock);
+  release(&q->lock);
+}
+
+void
+blkrw(struct buf *b, int write)
+{
+  blksubmit(b, write);
+  blkwait(b);
+}
+
+// Hold back requests until the matching blkunplug().
+void
+blkplug(void)
+{
+  __sync_fetch_and_add(&blk.plugged, 1);
+}
+
+void
+blkunplug(void)
+{
+  struct blkq *q;
+
+  if(__sync_sub_and_fetch(&blk.plugged, 1) > 0)
+    return;
+  // a blksubmit() that saw the plug queued its request
+  // before releasing the queue's lock.
+  for(q = blk.q; q < blk.q + virtio_disk_nqueue(); q++){
+    acquire(&q->lock);
+    dispatch(q);
+    release(&q->lock);
+  }
+}
+
+// Called by the driver with the bufs of the requests
+// that have finished on its queue qi, chained through qnext.
+void
+blkdone(int qi, struct buf *b)
+{
+  struct blkq *q = &blk.q[qi];
+  struct buf *next;
+
+  acquire(&q->lock);
+  for(; b; b = next){
+    next = b->qnext;
+    b->qnext = 0;
+    b->disk = 0;
+    wakeup(b);
+  }
+  // the driver has room again. dispatch even if plugged:
+  // someone may be waiting for a request that didn't fit.
+  dispatch(q);
+  release(&q->lock);
+}
+
+// Copy device dev's statistics, summed over the queues,
+// to *st. Returns -1 if there's no such device.
+int
+blkstat(uint dev, struct blkstat *st)
+{
+  struct blkq *q;
+
+  if(dev != ROOTDEV)
+    return -1;
+  memset(st, 0, sizeof(*st));
+  st->dev = dev;
+  st->nqueue = virtio_disk_nqueue();
+  for(q = blk.q; q < blk.q + st->nqueue; q++){
+    acquire(&q->lock);
+    st->depth += q->depth;
+    if(q->maxdepth > st->maxdepth)
+      st->maxdepth = q->maxdepth;
+    st->nblock += q->nblock;
+    st->nreq += q->nreq;
+    release(&q->lock);
+  }
+  return 0;
+}
@@ -1,12 +1,17 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int queued;  // waiting in blk.c's queue?
+  int write;   // is the disk request a write?
+  int hwq;     // which of blk.c's queues
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  uint lastuse;     // ticks at last brelse(), for LRU
+  int filedata;     // file data, also in the page cache
+  struct buf *next; // hash chain
+  struct buf *qnext; // blk.c's queue, or the bufs of one disk request
   uchar data[BSIZE];
 };
 
@@ -17,6 +17,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "file.h"
+#include "fcntl.h"
 #include "memlayout.h"
 #include "riscv.h"
 #include "defs.h"
@@ -27,8 +28,8 @@
 
 //
 // send one character to the uart.
-// called by printf(), and to echo input characters,
-// but not from write().
+// called by printf() when it doesn't use the log,
+// and to echo input characters, but not from write().
 //
 void
 consputc(int c)
@@ -50,6 +51,7 @@ struct {
   uint r;  // Read index
   uint w;  // Write index
   uint e;  // Edit index
+  struct pollhead ph;  // poll()s waiting for input
 } cons;
 
 //
@@ -58,13 +60,16 @@ struct {
 int
 consolewrite(int user_src, uint64 src, int n)
 {
-  int i;
-
-  for(i = 0; i < n; i++){
-    char c;
-    if(either_copyin(&c, user_src, src+i, 1) == -1)
+  char buf[128];
+  int i, m;
+
+  // a span at a time, copied in before uartwrite()
+  // takes its spinlock, since copyin() may sleep.
+  for(i = 0; i < n; i += m){
+    m = n - i < sizeof(buf) ? n - i : sizeof(buf);
+    if(either_copyin(buf, user_src, src+i, m) == -1)
       break;
-    uartputc(c);
+    uartwrite(buf, m);
   }
 
   return i;
@@ -126,6 +131,23 @@ consoleread(int user_dst, uint64 dst, int n)
   return target - n;
 }
 
+//
+// poll() of the console: there is input once a
+// whole line has arrived, and output never blocks.
+//
+int
+consolepoll(struct pollhead **ph)
+{
+  int mask = POLLOUT;
+
+  acquire(&cons.lock);
+  if(cons.r != cons.w)
+    mask |= POLLIN;
+  release(&cons.lock);
+  *ph = &cons.ph;
+  return mask;
+}
+
 //
 // the console input interrupt handler.
 // uartintr() calls this for input character.
@@ -170,6 +192,7 @@ consoleintr(int c)
         // has arrived.
         cons.w = cons.e;
         wakeup(&cons.r);
+        pollwake(&cons.ph);
       }
     }
     break;
@@ -189,4 +212,5 @@ consoleinit(void)
   // to consoleread and consolewrite.
   devsw[CONSOLE].read = consoleread;
   devsw[CONSOLE].write = consolewrite;
+  devsw[CONSOLE].poll = consolepoll;
 }
@@ -0,0 +1,200 @@
+// Directory name lookup cache.
+//
+// The dcache remembers the results of dirlookup(): for a
+// directory (dev, dinum) and a name, the i-number the name
+// refers to, or 0 if the directory has no entry with that
+// name (a negative entry).
+//
+// Entries for a directory only change while the directory's
+// inode is locked: dirlookup() fills them in, dirlink() and
+// sys_unlink() update them as they add and remove names, and
+// iput() purges them when it frees the directory. So a cached
+// entry always agrees with the directory's content.
+//
+// Lock order: dcache.lock, then itable.lock.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+
+#define NDHASH 127
+
+struct dentry {
+  uint dev;
+  uint dinum;           // directory, 0 if the entry is unused
+  char name[DIRSIZ];
+  uint inum;            // 0 for a negative entry
+  uint off;             // offset of the dirent in the directory
+  struct dentry *next;  // hash chain
+  struct dentry *prev;  // LRU list
+  struct dentry *lnext;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry entry[NDCACHE];
+  struct dentry *hash[NDHASH];
+
+  // Least recently used list of all entries.
+  // head.lnext is most recent, head.prev is least.
+  struct dentry head;
+} dcache;
+
+static uint
+dhash(uint dev, uint dinum, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev * 31 + dinum;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+// Move d to the front of the LRU list.
+// Caller must hold dcache.lock.
+static void
+dtouch(struct dentry *d)
+{
+  d->lnext->prev = d->prev;
+  d->prev->lnext = d->lnext;
+  d->lnext = dcache.head.lnext;
+  d->prev = &dcache.head;
+  dcache.head.lnext->prev = d;
+  dcache.head.lnext = d;
+}
+
+// Take d off its hash chain and mark it unused.
+// Caller must hold dcache.lock.
+static void
+dunhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  pp = &dcache.hash[dhash(d->dev, d->dinum, d->name)];
+  for(; *pp != d; pp = &(*pp)->next)
+    ;
+  *pp = d->next;
+  d->dinum = 0;
+}
+
+static struct dentry*
+dfind(uint h, uint dev, uint dinum, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[h]; d; d = d->next)
+    if(d->dev == dev && d->dinum == dinum && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+void
+dcinit(void)
+{
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.head.prev = &dcache.head;
+  dcache.head.lnext = &dcache.head;
+  for(d = dcache.entry; d < dcache.entry+NDCACHE; d++){
+    d->lnext = dcache.head.lnext;
+    d->prev = &dcache.head;
+    dcache.head.lnext->prev = d;
+    dcache.head.lnext = d;
+  }
+}
+
+// Look name up in directory dinum.
+// Returns 1 and sets *inum (0 if name is known to be absent)
+// and, for a present name, *poff if the cache knows;
+// returns 0 if the cache doesn't know.
+int
+dclookup(uint dev, uint dinum, char *name, uint *inum, uint *poff)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dhash(dev, dinum, name), dev, dinum, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  *inum = d->inum;
+  if(poff)
+    *poff = d->off;
+  dtouch(d);
+  release(&dcache.lock);
+  return 1;
+}
+
+// The lock-free path walk in namex(): if the cache knows
+// whether name is in directory dinum, set *known and return
+// name's inode, or 0 if absent. The inode is referenced with
+// iget() while dcache.lock is held, so that a concurrent
+// unlink can't free it in between; the directory itself
+// needn't be locked.
+struct inode*
+dcget(uint dev, uint dinum, char *name, int *known)
+{
+  struct dentry *d;
+  struct inode *ip;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dhash(dev, dinum, name), dev, dinum, name)) == 0){
+    release(&dcache.lock);
+    *known = 0;
+    return 0;
+  }
+  *known = 1;
+  ip = d->inum ? iget(dev, d->inum) : 0;
+  dtouch(d);
+  release(&dcache.lock);
+  return ip;
+}
+
+// Record that name in directory dinum refers to inum,
+// whose dirent is at offset off; or, if inum is 0, that
+// the directory has no such name.
+// Caller must hold the directory's inode lock.
+void
+dcenter(uint dev, uint dinum, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+  uint h;
+
+  acquire(&dcache.lock);
+  h = dhash(dev, dinum, name);
+  if((d = dfind(h, dev, dinum, name)) == 0){
+    // Recycle the least recently used entry.
+    d = dcache.head.prev;
+    if(d->dinum)
+      dunhash(d);
+    d->dev = dev;
+    d->dinum = dinum;
+    strncpy(d->name, name, DIRSIZ);
+    d->next = dcache.hash[h];
+    dcache.hash[h] = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  dtouch(d);
+  release(&dcache.lock);
+}
+
+// Forget everything about directory dinum,
+// which is being freed.
+void
+dcpurge(uint dev, uint dinum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.entry; d < dcache.entry+NDCACHE; d++)
+    if(d->dinum == dinum && d->dev == dev)
+      dunhash(d);
+  release(&dcache.lock);
+}
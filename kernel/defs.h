@@ -2,58 +2,128 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct iovec;
+struct logstat;
+struct mm;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct timer;
+struct pollfd;
+struct pollhead;
+struct blkstat;
+struct callstat;
+struct vtime;
+struct vma;
+struct spawnact;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            breadn(uint, uint, int, struct buf**);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwriten(struct buf**, int);
+void            bawrite(struct buf*);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bstat(char*, int);
+void            bprefetch(uint, uint);
+void            bforget(struct buf*);
+
+// blk.c
+void            blkinit(void);
+void            blksubmit(struct buf*, int);
+void            blkwait(struct buf*);
+void            blkrw(struct buf*, int);
+void            blkplug(void);
+void            blkunplug(void);
+void            blkdone(int, struct buf*);
+int             blkstat(uint, struct blkstat*);
 
 // console.c
 void            consoleinit(void);
 void            consoleintr(int);
 void            consputc(int);
 
+// dcache.c
+void            dcinit(void);
+int             dclookup(uint, uint, char*, uint*, uint*);
+void            dcenter(uint, uint, char*, uint, uint);
+void            dcpurge(uint, uint);
+struct inode*   dcget(uint, uint, char*, int*);
+
 // exec.c
 int             exec(char*, char**);
 
+// futex.c
+void            futexinit(void);
+int             futexwait(uint64, int);
+int             futexwake(uint64);
+
 // file.c
+int             fdalloc(struct file*);
+void            fdcloseall(struct proc*);
+int             fdcopy(struct proc*, struct proc*);
+void            fdfree(int);
+int             fdspawn(struct spawnact*, int);
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
-int             fileread(struct file*, uint64, int n);
+int             fileread(struct file*, int, uint64, int n);
+int             filereadv(struct file*, int, struct iovec*, int, uint*);
+int             filepoll(struct file**, struct pollfd*, int, int);
+int             filesplice(struct file*, struct file*, int);
 int             filestat(struct file*, uint64 addr);
-int             filewrite(struct file*, uint64, int n);
+int             filesync(struct file*);
+int             filewrite(struct file*, int, uint64, int n);
+int             filewritev(struct file*, int, struct iovec*, int, uint*);
+void            pollwake(struct pollhead*);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+void            dirunlink(struct inode*, uint);
+int             dirempty(struct inode*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+struct inode*   iget(uint, uint);
 void            iinit();
+int             istat(char*, int);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
+void            ilockshared(struct inode*);
+void            iunlockshared(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+int             breadi(struct inode*, int, uint64, uint, uint);
+int             dwritei(struct inode*, int, uint64, uint, uint);
+int             iflush(struct inode*);
+int             breserve(int);
+void            bunreserve(int);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
 
+// procfs.c
+void            procfsinit(void);
+
+// prof.c
+void            profinit(void);
+uint64          profintr(uint64);
+int             profctl(int, uint64, int);
+
 // ramdisk.c
 void            ramdiskinit(void);
 void            ramdiskintr(void);
@@ -63,39 +133,105 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kinithart(void);
+void            kinitwait(void);
+void            kmemdump(void);
+int             kmemstat(char*, int);
+void            kdup(void *);
+void*           kzalloc(void);
+void            kzeroer(void*);
+void*           kmegalloc(void);
+void            kmegafree(void *);
+void            kmegasplit(void *);
+int             krefs(void *);
+uint64          kfreepages(void);
+
+// kmalloc.c
+void            kminit(void);
+void*           kmalloc(uint);
+void            kmfree(void*);
+int             kmreclaim(void);
+void            kmdump(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
+void            begin_opn(int);
+int             logcap(void);
 void            end_op(void);
+void            end_opn(int);
+void            logstat(struct logstat*);
+void            logsync(void);
+
+// mmap.c
+uint64          mmap(uint64, uint64, int, int, struct file*, uint);
+int             munmap(uint64, uint64);
+void            munmapall(void);
+int             vmacopy(struct proc*, struct proc*);
+void            vmauncopy(struct proc*, uint64);
+int             vmafault(uint64, int);
+struct vma*     vmafind(struct mm*, uint64);
+int             vmaexec(struct mm*, uint64, uint64, int, struct file*, uint);
+void            vmadrop(struct mm*);
+uint64          vmalow(struct mm*);
+
+// pcache.c
+void            pcinit(void);
+char*           pcget(struct inode*, uint);
+char*           pcpeek(struct inode*, uint);
+char*           pcwrite(struct inode*, uint, int);
+char*           pcdirty(struct inode*, uint);
+char*           pcshare(struct inode*, uint, int);
+char*           pcprivate(struct inode*, uint, char*);
+void            pcclean(struct inode*, uint);
+void            pcdrop(struct inode*, uint, uint);
+int             pcreclaim(void);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, int, struct iovec*, int);
+int             pipewrite(struct pipe*, int, struct iovec*, int);
+int             pipefill(struct pipe*, struct file*, int);
+int             pipedrain(struct pipe*, struct file*, int);
+int             pipepoll(struct pipe*, int, struct pollhead**);
 
 // printf.c
 int            printf(char*, ...) __attribute__ ((format (printf, 1, 2)));
+int             snprintf(char*, int, char*, ...) __attribute__ ((format (printf, 3, 4)));
 void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
+void            klogstart(void);
+int             klogc(void);
+int             dmesg(uint64, int);
 
 // proc.c
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
-void            proc_mapstacks(pagetable_t);
+int             clone(uint64, uint64, uint64);
+int             spawn(char*, char**, struct spawnact*, int);
+uint64          growproc(int);
+uint64          growhuge(int);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+int             kthread_create(void (*)(void*), void*, char*);
+void            kthreadinit(void);
+int             nice(int, int);
+int             proccallstat(int, struct callstat*);
+int             procstat(char*, int);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
 void            procinit(void);
+struct mm*      mmalloc(struct proc*);
+void            mmfree(struct mm*);
+void            mmput(struct mm*, uint64);
+void            mmexit(struct proc*);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
@@ -114,6 +250,7 @@ void            swtch(struct context*, struct context*);
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+int             lockstat(uint64, int);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
@@ -121,6 +258,8 @@ void            pop_off(void);
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
+void            acquiresleepshared(struct sleeplock*);
+void            releasesleepshared(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
@@ -139,23 +278,40 @@ int             argstr(int, char*, int);
 void            argaddr(int, uint64 *);
 int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
+void            syscallinit(void);
 void            syscall();
+int             ringdrain(void);
+int             sysstat(int, uint64, int);
+int             traceread(uint64, int);
 
 // trap.c
 extern uint     ticks;
+extern struct vtime *vtime;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            clockalarm(uint64);
+void            clockset(uint64);
+
+// timer.c
+void            wheelinit(void);
+uint64          timerexpire(uint64);
+int             timersleep(uint64);
+void            timerstart(struct timer*, uint64, void (*)(void*), void*);
+void            timerstop(struct timer*);
 
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
-void            uartputc(int);
+void            uartwrite(char*, int);
 void            uartputc_sync(int);
+void            uartkick(void);
 int             uartgetc(void);
 
 // vm.c
+extern int      asids;
+extern pagetable_t kernel_pagetable;
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
@@ -165,6 +321,15 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int);
+uint64          uvmmega(pagetable_t, uint64, uint64);
+int             uvmsplit(pagetable_t, uint64);
+uint64          uvmlazy(pagetable_t, uint64);
+void            tlbstale(pagetable_t);
+uint64          tlbnewgen(void);
+int             uvmcow(pagetable_t, uint64);
+int             uvmfault(uint64, int);
+uint64          uvmwaddr(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -182,7 +347,8 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_nqueue(void);
+int             virtio_disk_start(int, struct buf *, int, int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -6,8 +6,12 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
+static int loadseg(pde_t *, uint64, struct inode *, uint, uint, int);
 
 int flags2perm(int flags)
 {
@@ -19,6 +23,16 @@ int flags2perm(int flags)
     return perm;
 }
 
+int flags2prot(int flags)
+{
+    int prot = PROT_READ;
+    if(flags & 0x1)
+      prot |= PROT_EXEC;
+    if(flags & 0x2)
+      prot |= PROT_WRITE;
+    return prot;
+}
+
 int
 exec(char *path, char **argv)
 {
@@ -28,7 +42,11 @@ exec(char *path, char **argv)
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
-  pagetable_t pagetable = 0, oldpagetable;
+  struct file *f = 0;
+  uint64 n;
+  pagetable_t pagetable = 0;
+  struct mm *mm = 0, *oldmm;
+  uint64 oldtfva;
   struct proc *p = myproc();
 
   begin_op();
@@ -37,7 +55,7 @@ exec(char *path, char **argv)
     end_op();
     return -1;
   }
-  ilock(ip);
+  ilockshared(ip);
 
   // Check ELF header
   if(readi(ip, 0, (uint64)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -46,10 +64,14 @@ exec(char *path, char **argv)
   if(elf.magic != ELF_MAGIC)
     goto bad;
 
-  if((pagetable = proc_pagetable(p)) == 0)
+  if((mm = mmalloc(p)) == 0)
     goto bad;
+  pagetable = mm->pagetable;
 
-  // Load program into memory.
+  // Load program into memory. The whole pages of a segment
+  // are left for vmafault() to read in as they are touched;
+  // the rest, and the zeroed pages past the file's part, are
+  // filled in now.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -61,19 +83,36 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
+    if(ph.vaddr < sz)
+      goto bad;
+    sz = ph.vaddr + ph.filesz;
+    n = 0;
+    if(ph.off % PGSIZE == 0 && PGROUNDDOWN(ph.filesz) > 0){
+      if(f == 0 && (f = filealloc()) != 0){
+        f->type = FD_INODE;
+        f->ip = idup(ip);
+        f->readable = 1;
+      }
+      if(f && vmaexec(mm, ph.vaddr, PGROUNDDOWN(ph.filesz), flags2prot(ph.flags), f, ph.off) == 0)
+        n = PGROUNDDOWN(ph.filesz);
+    }
+    if(loadseg(pagetable, ph.vaddr + n, ip, ph.off + n, ph.filesz - n, flags2perm(ph.flags)) < 0)
+      goto bad;
     uint64 sz1;
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
       goto bad;
     sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
-      goto bad;
   }
-  iunlockput(ip);
+  iunlockshared(ip);
+  iput(ip);
   end_op();
   ip = 0;
+  // the mappings hold the file now.
+  if(f)
+    fileclose(f);
+  f = 0;
 
   p = myproc();
-  uint64 oldsz = p->sz;
 
   // Allocate some pages at the next page boundary.
   // Make the first inaccessible as a stack guard.
@@ -120,46 +159,78 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
-  // Commit to the user image.
-  oldpagetable = p->pagetable;
+  // Commit to the user image. Other threads sharing
+  // the old one keep it.
+  mmexit(p);
+  p->ring = 0;
+  oldmm = p->mm;
+  oldtfva = p->tfva;
+  mm->sz = sz;
+  if(sz > p->usage.maxmem)
+    p->usage.maxmem = sz;
+  p->mm = mm;
   p->pagetable = pagetable;
-  p->sz = sz;
+  p->tfva = TRAPFRAME;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
-  proc_freepagetable(oldpagetable, oldsz);
+  mmput(oldmm, oldtfva);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
-  if(pagetable)
-    proc_freepagetable(pagetable, sz);
+  if(mm){
+    mm->sz = sz;
+    vmadrop(mm);
+    mmput(mm, TRAPFRAME);
+  }
   if(ip){
-    iunlockput(ip);
+    iunlockshared(ip);
+    iput(ip);
     end_op();
   }
+  if(f)
+    fileclose(f);
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
+// Map a program segment into pagetable at virtual address va,
+// with permissions perm.
+// va must be page-aligned and the pages from va to va+sz
+// must not be mapped yet.
+// Whole pages at page-aligned file offsets are mapped from the
+// page cache: read-only ones shared, writable ones copy-on-write.
+// The rest are read into fresh pages, zeroed past sz.
 // Returns 0 on success, -1 on failure.
 static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz, int perm)
 {
   uint i, n;
-  uint64 pa;
+  char *pa;
+  int flags;
 
   for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
+    if((offset + i) % PGSIZE == 0 && sz - i >= PGSIZE &&
+       (pa = pcget(ip, (offset + i) / PGSIZE)) != 0){
+      flags = PTE_R | PTE_U | perm;
+      if(flags & PTE_W)
+        flags = (flags & ~PTE_W) | PTE_COW;
+    } else {
+      if((pa = kzalloc()) == 0)
+        return -1;
+      if(sz - i < PGSIZE)
+        n = sz - i;
+      else
+        n = PGSIZE;
+      if(readi(ip, 0, (uint64)pa, offset+i, n) != n){
+        kfree(pa);
+        return -1;
+      }
+      flags = PTE_R | PTE_U | perm;
+    }
+    if(mappages(pagetable, va + i, PGSIZE, (uint64)pa, flags) != 0){
+      kfree(pa);
       return -1;
+    }
   }
   
   return 0;
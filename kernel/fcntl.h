@@ -3,3 +3,54 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+#define O_EXTENT  0x800
+
+// mmap() protections and flags.
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2
+#define PROT_EXEC   0x4
+#define MAP_SHARED  0x1
+#define MAP_PRIVATE 0x2
+
+// futex() operations.
+#define FUTEX_WAIT  0
+#define FUTEX_WAKE  1
+
+// prof() commands.
+#define PROF_ON     0
+#define PROF_OFF    1
+#define PROF_READ   2
+
+// getrusage() whos.
+#define RUSAGE_SELF      0
+#define RUSAGE_CHILDREN  1
+
+// poll() events.
+#define POLLIN      0x01  // there is data to read
+#define POLLOUT     0x04  // writing won't block
+#define POLLERR     0x08  // no one to read what is written
+#define POLLHUP     0x10  // no one left to write
+#define POLLNVAL    0x20  // fd isn't open
+
+struct pollfd {
+  int fd;
+  short events;   // POLLIN, POLLOUT wanted
+  short revents;  // what's ready; POLLERR, POLLHUP, POLLNVAL always count
+};
+
+// A file action for spawn(), done in the child before
+// it runs the program.
+#define SPAWN_DUP2  0  // make newfd a copy of fd
+#define SPAWN_CLOSE 1  // close fd
+
+struct spawnact {
+  int op;
+  int fd;
+  int newfd;
+};
+
+// A buffer for readv() and writev().
+struct iovec {
+  void *iov_base;
+  uint iov_len;
+};
@@ -12,17 +12,37 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "fcntl.h"
+#include "timer.h"
 
 struct devsw devsw[NDEV];
+
+// Open files come from kmalloc(). ftable.lock protects
+// their reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
 } ftable;
 
+// poll(): a process waiting on several files hooks a
+// struct pollwait onto the pollhead of each pipe or device
+// it watches, and those call pollwake() whenever they may
+// have become ready. So a wakeup costs the number of poll()s
+// waiting on the file, and a poll() looks again only at the
+// files it watches. pollock protects the pollhead lists and
+// the pollers; it comes after the pipe, console, and timer
+// locks, and before the sleep queue locks.
+struct poller {
+  int ready;    // pollwake() since the poller last looked
+  int expired;  // the timeout has passed
+};
+
+struct spinlock pollock;
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  initlock(&pollock, "poll");
 }
 
 // Allocate a file structure.
@@ -31,16 +51,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmalloc(sizeof(*f))) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,19 +84,138 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kmfree(f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
+    if(ff.type == FD_INODE && ff.writable)
+      iflush(ff.ip);
     begin_op();
     iput(ff.ip);
     end_op();
   }
 }
 
+// File descriptors. A process's fd table starts out as the
+// NOFILE slots in p->ofile0, and moves to a page of MAXOFILE
+// slots the first time they're all in use. p->fdmap has a bit
+// for each fd in use, so fdalloc() finds the lowest free fd a
+// word at a time. The table is private to the process.
+
+// Allocate the lowest free file descriptor for f.
+// Takes over file reference from caller on success.
+int
+fdalloc(struct file *f)
+{
+  struct proc *p = myproc();
+  struct file **t;
+  int w, fd;
+
+  fd = -1;
+  for(w = 0; w*64 < p->nofile; w++){
+    if(~p->fdmap[w]){
+      fd = w*64 + __builtin_ctzl(~p->fdmap[w]);
+      break;
+    }
+  }
+  if(fd < 0 || fd >= p->nofile){
+    if(p->nofile == MAXOFILE || (t = (struct file**)kalloc()) == 0)
+      return -1;
+    memset(t, 0, PGSIZE);
+    memmove(t, p->ofile, p->nofile*sizeof(t[0]));
+    fd = p->nofile;
+    p->ofile = t;
+    p->nofile = MAXOFILE;
+  }
+  p->ofile[fd] = f;
+  p->fdmap[fd/64] |= 1L << (fd%64);
+  return fd;
+}
+
+// Release file descriptor fd, without closing its file.
+void
+fdfree(int fd)
+{
+  struct proc *p = myproc();
+
+  p->ofile[fd] = 0;
+  p->fdmap[fd/64] &= ~(1L << (fd%64));
+}
+
+// Do a spawn()ed child's n file actions, in order, to its
+// fd table. Returns -1 if one names a closed or bad fd.
+int
+fdspawn(struct spawnact *act, int n)
+{
+  struct proc *p = myproc();
+  struct spawnact *a;
+
+  for(a = act; a < act + n; a++){
+    if(a->fd < 0 || a->fd >= p->nofile || p->ofile[a->fd] == 0)
+      return -1;
+    if(a->op == SPAWN_DUP2){
+      if(a->newfd < 0 || a->newfd >= p->nofile)
+        return -1;
+      if(a->newfd == a->fd)
+        continue;
+      if(p->ofile[a->newfd])
+        fileclose(p->ofile[a->newfd]);
+      p->ofile[a->newfd] = filedup(p->ofile[a->fd]);
+      p->fdmap[a->newfd/64] |= 1L << (a->newfd%64);
+    } else if(a->op == SPAWN_CLOSE){
+      fileclose(p->ofile[a->fd]);
+      fdfree(a->fd);
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Give np, a new child of p, references to all of
+// p's open files. Returns -1 if out of memory.
+int
+fdcopy(struct proc *np, struct proc *p)
+{
+  int fd;
+
+  if(p->nofile > NOFILE){
+    if((np->ofile = (struct file**)kalloc()) == 0){
+      np->ofile = np->ofile0;
+      return -1;
+    }
+    memset(np->ofile, 0, PGSIZE);
+    np->nofile = p->nofile;
+  }
+  for(fd = 0; fd < p->nofile; fd++)
+    if(p->ofile[fd])
+      np->ofile[fd] = filedup(p->ofile[fd]);
+  memmove(np->fdmap, p->fdmap, sizeof(p->fdmap));
+  return 0;
+}
+
+// Close all of p's open files, and shrink its
+// fd table back to p->ofile0.
+void
+fdcloseall(struct proc *p)
+{
+  int fd;
+
+  for(fd = 0; fd < p->nofile; fd++){
+    if(p->ofile[fd]){
+      fileclose(p->ofile[fd]);
+      p->ofile[fd] = 0;
+    }
+  }
+  if(p->ofile != p->ofile0)
+    kfree((char*)p->ofile);
+  p->ofile = p->ofile0;
+  p->nofile = NOFILE;
+  memset(p->fdmap, 0, sizeof(p->fdmap));
+}
+
 // Get metadata about file f.
 // addr is a user virtual address, pointing to a struct stat.
 int
@@ -91,9 +225,9 @@ filestat(struct file *f, uint64 addr)
   struct stat st;
   
   if(f->type == FD_INODE || f->type == FD_DEVICE){
-    ilock(f->ip);
+    ilockshared(f->ip);
     stati(f->ip, &st);
-    iunlock(f->ip);
+    iunlockshared(f->ip);
     if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
       return -1;
     return 0;
@@ -101,82 +235,405 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
-// Read from file f.
-// addr is a user virtual address.
+// Write file f's dirty pages to disk, and wait
+// for them to be committed.
 int
-fileread(struct file *f, uint64 addr, int n)
+filesync(struct file *f)
+{
+  int r;
+
+  if(f->type != FD_INODE)
+    return -1;
+  r = iflush(f->ip);
+  logsync();
+  return r;
+}
+
+// filereadv(), but for counting the bytes.
+static int
+readv1(struct file *f, int user_dst, struct iovec *iov, int niov, uint *off)
 {
-  int r = 0;
+  int i, r, tot, shared;
 
   if(f->readable == 0)
     return -1;
+  if(off && f->type != FD_INODE)
+    return -1;
+
+  if(f->type == FD_PIPE)
+    return piperead(f->pipe, user_dst, iov, niov);
 
-  if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+  tot = 0;
+  if(f->type == FD_DEVICE && f->major >= 0 && f->major < NDEV && devsw[f->major].pread){
+    for(i = 0; i < niov; i++){
+      r = devsw[f->major].pread(f->minor, user_dst, (uint64)iov[i].iov_base, f->off, iov[i].iov_len);
+      if(r < 0)
+        return tot > 0 ? tot : -1;
+      f->off += r;
+      tot += r;
+      if(r < iov[i].iov_len)
+        break;
+    }
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
-    r = devsw[f->major].read(1, addr, n);
+    for(i = 0; i < niov; i++){
+      r = devsw[f->major].read(user_dst, (uint64)iov[i].iov_base, iov[i].iov_len);
+      if(r < 0)
+        return tot > 0 ? tot : -1;
+      tot += r;
+      if(r < iov[i].iov_len)
+        break;
+    }
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    // another process (or thread) can only start sharing f by
+    // raising f->ref first, and then it reads exclusively.
+    shared = off != 0 || f->ref == 1;
+    if(off == 0)
+      off = &f->off;
+    if(shared)
+      ilockshared(f->ip);
+    else
+      ilock(f->ip);
+    for(i = 0; i < niov; i++){
+      r = readi(f->ip, user_dst, (uint64)iov[i].iov_base, *off, iov[i].iov_len);
+      if(r < 0){
+        if(tot == 0)
+          tot = -1;
+        break;
+      }
+      *off += r;
+      tot += r;
+      if(r < iov[i].iov_len)
+        break;
+    }
+    if(shared)
+      iunlockshared(f->ip);
+    else
+      iunlock(f->ip);
   } else {
     panic("fileread");
   }
 
+  return tot;
+}
+
+// Read from file f into the niov buffers of iov, which
+// are user virtual addresses if user_dst is set, else
+// kernel addresses. An inode is read at *off, which is
+// advanced, or at f->off if off is 0, and is locked just
+// once for all the buffers, shared with other readers
+// unless f->off needs updating and f is open elsewhere too.
+// Pipes and devices have no offset, but for devices with a
+// pread, like /proc's files, which read from f->off.
+// The bytes read count toward the process's usage.
+int
+filereadv(struct file *f, int user_dst, struct iovec *iov, int niov, uint *off)
+{
+  int r;
+
+  if((r = readv1(f, user_dst, iov, niov, off)) > 0)
+    myproc()->usage.nread += r;
   return r;
 }
 
-// Write to file f.
-// addr is a user virtual address.
+// Read from file f.
+// addr is a user virtual address if user_dst is set,
+// else a kernel address.
 int
-filewrite(struct file *f, uint64 addr, int n)
+fileread(struct file *f, int user_dst, uint64 addr, int n)
 {
-  int r, ret = 0;
+  struct iovec iov;
+
+  if(n < 0)
+    return -1;
+  iov.iov_base = (void*)addr;
+  iov.iov_len = n;
+  return filereadv(f, user_dst, &iov, 1, 0);
+}
+
+// Write n bytes to inode file f at *off through the log.
+// Returns n, or -1 if they couldn't all be written.
+static int
+writethrough(struct file *f, int user_src, uint64 addr, int n, uint *off)
+{
+  int r, i = 0;
+
+  // write a few blocks at a time to avoid exceeding
+  // the maximum log transaction size, including
+  // i-node, indirect block, allocation blocks,
+  // and 2 blocks of slop for non-aligned writes.
+  // this really belongs lower down, since writei()
+  // might be writing a device like the console.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  while(i < n){
+    int n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+
+    begin_op();
+    ilock(f->ip);
+    if ((r = writei(f->ip, user_src, addr + i, *off, n1)) > 0)
+      *off += r;
+    iunlock(f->ip);
+    end_op();
+
+    if(r != n1){
+      // error from writei
+      break;
+    }
+    i += r;
+  }
+  return i == n ? n : -1;
+}
+
+// filewritev(), but for counting the bytes.
+static int
+writev1(struct file *f, int user_src, struct iovec *iov, int niov, uint *off)
+{
+  int i, done, tot;
 
   if(f->writable == 0)
     return -1;
+  if(off && f->type != FD_INODE)
+    return -1;
 
-  if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
-  } else if(f->type == FD_DEVICE){
+  if(f->type == FD_PIPE)
+    return pipewrite(f->pipe, user_src, iov, niov);
+
+  tot = 0;
+  if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    for(i = 0; i < niov; i++){
+      done = devsw[f->major].write(user_src, (uint64)iov[i].iov_base, iov[i].iov_len);
+      if(done < 0)
+        return tot > 0 ? tot : -1;
+      tot += done;
+      if(done < iov[i].iov_len)
+        break;
+    }
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
+    if(off == 0)
+      off = &f->off;
 
-      if(r != n1){
-        // error from writei
-        break;
+    // a regular file is written into the page cache, with
+    // the inode locked once and no transaction; its blocks
+    // are allocated when iflush() writes it back.
+    i = done = 0;
+    ilock(f->ip);
+    if(f->ip->type == T_FILE){
+      for(; i < niov; i++){
+        done = dwritei(f->ip, user_src, (uint64)iov[i].iov_base, *off, iov[i].iov_len);
+        *off += done;
+        tot += done;
+        if(done < iov[i].iov_len)
+          break;
+        done = 0;
       }
-      i += r;
     }
-    ret = (i == n ? n : -1);
+    iunlock(f->ip);
+    if(i < niov && tot > 0){
+      // out of room for dirty pages: make some, or
+      // write the rest through.
+      iflush(f->ip);
+    }
+
+    // done bytes of iov[i] are written already.
+    for(; i < niov; i++, done = 0){
+      if(writethrough(f, user_src, (uint64)iov[i].iov_base + done,
+                      iov[i].iov_len - done, off) < 0)
+        return -1;
+      tot += iov[i].iov_len - done;
+    }
   } else {
     panic("filewrite");
   }
 
-  return ret;
+  return tot;
+}
+
+// Write to file f from the niov buffers of iov,
+// which filereadv() describes.
+// The bytes written count toward the process's usage.
+int
+filewritev(struct file *f, int user_src, struct iovec *iov, int niov, uint *off)
+{
+  int r;
+
+  if((r = writev1(f, user_src, iov, niov, off)) > 0)
+    myproc()->usage.nwrite += r;
+  return r;
+}
+
+// Write to file f.
+// addr is a user virtual address if user_src is set,
+// else a kernel address.
+int
+filewrite(struct file *f, int user_src, uint64 addr, int n)
+{
+  struct iovec iov;
+
+  if(n < 0)
+    return -1;
+  iov.iov_base = (void*)addr;
+  iov.iov_len = n;
+  return filewritev(f, user_src, &iov, 1, 0);
+}
+
+// Wake the poll()s waiting on h.
+void
+pollwake(struct pollhead *h)
+{
+  struct pollwait *w;
+
+  // racy, but a poll() hooks itself on before it
+  // looks at the state the caller has just changed.
+  if(h->first == 0)
+    return;
+  acquire(&pollock);
+  for(w = h->first; w; w = w->next){
+    w->pl->ready = 1;
+    wakeup(w->pl);
+  }
+  release(&pollock);
+}
+
+static void
+pollhook(struct pollhead *h, struct pollwait *w, struct poller *pl)
+{
+  acquire(&pollock);
+  w->pl = pl;
+  w->next = h->first;
+  if(h->first)
+    h->first->pprev = &w->next;
+  w->pprev = &h->first;
+  h->first = w;
+  release(&pollock);
+}
+
+static void
+pollunhook(struct pollwait *w)
+{
+  acquire(&pollock);
+  *w->pprev = w->next;
+  if(w->next)
+    w->next->pprev = w->pprev;
+  release(&pollock);
+}
+
+// The poll() timeout, called by the timer wheel.
+static void
+pollexpire(void *arg)
+{
+  struct poller *pl = arg;
+
+  acquire(&pollock);
+  pl->ready = 1;
+  pl->expired = 1;
+  wakeup(pl);
+  release(&pollock);
+}
+
+// Which POLL events are ready on f? Sets *ph to the
+// pollhead to wait on for more, or 0 if there is none.
+static int
+fpoll(struct file *f, struct pollhead **ph)
+{
+  int mask;
+
+  *ph = 0;
+  if(f->type == FD_PIPE)
+    return pipepoll(f->pipe, f->writable, ph);
+  if(f->type == FD_DEVICE && f->major >= 0 && f->major < NDEV && devsw[f->major].poll)
+    return devsw[f->major].poll(ph);
+  // files and other devices never block.
+  mask = 0;
+  if(f->readable)
+    mask |= POLLIN;
+  if(f->writable)
+    mask |= POLLOUT;
+  return mask;
+}
+
+// Wait until some of the n files f are ready for the events
+// in pfd, or for ms milliseconds, or forever if ms < 0, and
+// set each pfd's revents. f[i] is 0 if pfd[i].fd isn't open.
+// Returns the number of files ready, or -1 if killed.
+int
+filepoll(struct file **f, struct pollfd *pfd, int n, int ms)
+{
+  struct pollwait w[NPOLL];
+  struct pollhead *ph;
+  struct poller pl;
+  struct timer t;
+  int i, nready, hooked, timed;
+
+  if(n > NPOLL)
+    return -1;
+  pl.ready = pl.expired = 0;
+  for(i = 0; i < n; i++)
+    w[i].pl = 0;
+  if((timed = ms > 0))
+    timerstart(&t, r_time() + (uint64)ms * (TIMEHZ/1000), pollexpire, &pl);
+
+  for(;;){
+    nready = hooked = 0;
+    for(i = 0; i < n; i++){
+      pfd[i].revents = 0;
+      if(pfd[i].fd < 0)
+        continue;
+      if(f[i] == 0){
+        pfd[i].revents = POLLNVAL;
+      } else {
+        pfd[i].revents = fpoll(f[i], &ph) & (pfd[i].events|POLLERR|POLLHUP);
+        if(ph && w[i].pl == 0){
+          pollhook(ph, &w[i], &pl);
+          hooked = 1;
+        }
+      }
+      if(pfd[i].revents)
+        nready++;
+    }
+    if(nready > 0 || ms == 0)
+      break;
+    if(killed(myproc())){
+      nready = -1;
+      break;
+    }
+    // a file that became ready before it was hooked
+    // didn't wake us, so look once more first.
+    if(hooked)
+      continue;
+    acquire(&pollock);
+    while(!pl.ready && !killed(myproc()))
+      sleep(&pl, &pollock);
+    pl.ready = 0;
+    if(pl.expired)
+      ms = 0;  // look once more, then give up
+    release(&pollock);
+  }
+
+  for(i = 0; i < n; i++)
+    if(w[i].pl)
+      pollunhook(&w[i]);
+  if(timed)
+    timerstop(&t);
+  return nready;
+}
+
+// Move up to n bytes from file in to file out, one of
+// which must be a pipe and the other not, without copying
+// them through user memory.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if(in->type == FD_PIPE && out->type != FD_PIPE)
+    return pipedrain(in->pipe, out, n);
+  if(in->type != FD_PIPE && out->type == FD_PIPE)
+    return pipefill(out->pipe, in, n);
+  return -1;
 }
 
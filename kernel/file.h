@@ -5,8 +5,9 @@ struct file {
   char writable;
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
-  uint off;          // FD_INODE
+  uint off;          // FD_INODE, and FD_DEVICE with a pread
   short major;       // FD_DEVICE
+  short minor;       // FD_DEVICE
 };
 
 #define major(dev)  ((dev) >> 16 & 0xFFFF)
@@ -18,6 +19,10 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // hash chain, protected by itable.lock
+  struct inode *fnext;   // free list, protected by itable.lock
+  struct inode *fprev;
+  struct inode *anext;   // list of all inodes, which never changes once set
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,15 +31,49 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint flags;
+  uint addrs[NDIRECT+2];
+
+  // sequential readahead state, see readahead() in fs.c.
+  uint ranext;        // block a sequential reader reads next
+  uint rawin;         // readahead window, 0 if not sequential
+  uint raend;         // blocks below this have been prefetched
+
+  uint lastblock;     // last block allocated for ip, a hint for balloc()
+  int ndirty;         // dirty pages in the page cache, see dwritei()
 };
 
 // map major device number to device functions.
+// A list of the poll() calls waiting for some
+// pipe or device to become ready. See file.c.
+struct pollwait {
+  struct poller *pl;          // the poll() call
+  struct pollwait *next;
+  struct pollwait **pprev;
+};
+
+struct pollhead {
+  struct pollwait *first;
+};
+
 struct devsw {
   int (*read)(int, uint64, int);
   int (*write)(int, uint64, int);
+  int (*poll)(struct pollhead**);  // POLL bits; may be 0 for always ready
+  // for a device whose minors read like files, from an offset,
+  // instead of read: (minor, user_dst, dst, off, n).
+  int (*pread)(int, int, uint64, uint, int);
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define PROCFS  2   // the files in /proc, see procfs.c
+
+// PROCFS minors.
+#define PROC_PROCS  0   // processes, and the CPU time each used
+#define PROC_MEM    1   // free pages on each hart
+#define PROC_BIO    2   // buffer cache hits and misses
+#define PROC_INODES 3   // inode cache use
+#define PROC_LOG    4   // log commits
+#define NPROCFS     5
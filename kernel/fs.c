@@ -22,10 +22,36 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+#define RAMIN  2   // initial readahead window, in blocks
+#define RAMAX 16   // largest readahead window
+
+#define MAXBMAP 256  // largest free bit map, in blocks
+#define NIHASH  251  // inode table hash buckets
+#define FLUSHPG   4  // most dirty pages iflush() writes per transaction
+// log blocks for npg of them: the data, indirect or extent
+// blocks, bitmap blocks, and the inode.
+#define FLUSHBLOCKS(npg) ((npg)*(PGSIZE/BSIZE) + 6)
+
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
 
+// In-memory summary of the free bit map, so that balloc()
+// can skip full bitmap blocks without reading them.
+struct {
+  struct spinlock lock;
+  uint cursor;            // where balloc() looks when given no goal
+  int n;                  // number of bitmap blocks
+  ushort nfree[MAXBMAP];  // free blocks in each bitmap block
+  int free;               // free blocks in all
+  int reserved;           // of those, promised to dirty pages
+} freemap;
+
+static void freemapinit(int);
+static void writeback(void*);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,6 +70,9 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  freemapinit(dev);
+  if(kthread_create(writeback, 0, "writeback") < 0)
+    panic("fsinit: writeback thread");
 }
 
 // Zero a block.
@@ -60,26 +89,117 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Count the free blocks under each bitmap block.
+// Called after log recovery, which may change the bitmap.
+static void
+freemapinit(int dev)
+{
+  struct buf *bufs[MAXMERGE];
+  int i, j, n, bi;
+
+  initlock(&freemap.lock, "freemap");
+  freemap.n = (sb.size + BPB - 1) / BPB;
+  if(freemap.n > MAXBMAP)
+    panic("freemapinit: bitmap too big");
+  freemap.cursor = sb.size - sb.nblocks;
+  for(i = 0; i < freemap.n; i += n){
+    n = min(freemap.n - i, MAXMERGE);
+    breadn(dev, sb.bmapstart + i, n, bufs);
+    for(j = 0; j < n; j++){
+      for(bi = 0; bi < BPB && (i+j)*BPB + bi < sb.size; bi++){
+        if((bufs[j]->data[bi/8] & (1 << (bi % 8))) == 0)
+          freemap.nfree[i+j]++;
+      }
+      freemap.free += freemap.nfree[i+j];
+      brelse(bufs[j]);
+    }
+  }
+}
+
+// Set aside n free blocks for dirty pages in the page
+// cache, which get their blocks only when written back,
+// so that a write() that can't be written back fails now.
+// Returns 0, or -1 if there aren't n unpromised free blocks.
+int
+breserve(int n)
+{
+  int r = -1;
+
+  acquire(&freemap.lock);
+  if(freemap.free - freemap.reserved >= n){
+    freemap.reserved += n;
+    r = 0;
+  }
+  release(&freemap.lock);
+  return r;
+}
+
+void
+bunreserve(int n)
+{
+  acquire(&freemap.lock);
+  freemap.reserved -= n;
+  release(&freemap.lock);
+}
+
+// Return the first free block in [b, end) of bitmap block bp,
+// or 0 if there is none. Bytes with all blocks in use are
+// skipped whole.
+static uint
+bscan(struct buf *bp, uint b, uint end)
+{
+  uint bi;
+
+  while(b < end){
+    bi = b % BPB;
+    if(bi % 8 == 0 && b + 8 <= end && bp->data[bi/8] == 0xff){
+      b += 8;
+      continue;
+    }
+    if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+      return b;
+    b++;
+  }
+  return 0;
+}
+
+// Allocate a zeroed disk block, the first free one at or
+// after goal, so that callers extending a file can ask for
+// the block just past its last one. With no goal, start at
+// the block after the one allocated last.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal)
 {
-  int b, bi, m;
+  int i, k;
+  uint b, start, end;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  acquire(&freemap.lock);
+  if(goal == 0 || goal >= sb.size)
+    goal = freemap.cursor;
+  release(&freemap.lock);
+
+  // visit the goal's bitmap block twice: from goal to its end
+  // first, and from its start after going all the way around.
+  for(k = 0; k <= freemap.n; k++){
+    i = (goal / BPB + k) % freemap.n;
+    if(freemap.nfree[i] == 0)
+      continue;  // racy, but only a hint; bscan() decides.
+    start = k == 0 ? goal : i * BPB;
+    end = k == freemap.n ? goal : min((i + 1) * BPB, sb.size);
+    bp = bread(dev, sb.bmapstart + i);
+    if((b = bscan(bp, start, end)) != 0){
+      bp->data[(b % BPB)/8] |= 1 << (b % 8);  // Mark block in use.
+      log_write(bp);
+      acquire(&freemap.lock);
+      freemap.nfree[i]--;
+      freemap.free--;
+      freemap.cursor = b + 1 < sb.size ? b + 1 : 0;
+      release(&freemap.lock);
+      brelse(bp);
+      bzero(dev, b);
+      return b;
     }
     brelse(bp);
   }
@@ -87,21 +207,52 @@ balloc(uint dev)
   return 0;
 }
 
-// Free a disk block.
+// Mark block b free in the bitmap. *bpp caches the bitmap
+// block between calls, so freeing many blocks reads and logs
+// each bitmap block once; bflush() ends the batch.
 static void
-bfree(int dev, uint b)
+bunmark(int dev, uint b, struct buf **bpp)
 {
   struct buf *bp;
   int bi, m;
 
-  bp = bread(dev, BBLOCK(b, sb));
+  bp = *bpp;
+  if(bp == 0 || bp->blockno != BBLOCK(b, sb)){
+    if(bp){
+      log_write(bp);
+      brelse(bp);
+    }
+    bp = *bpp = bread(dev, BBLOCK(b, sb));
+  }
   bi = b % BPB;
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
-  log_write(bp);
-  brelse(bp);
+  acquire(&freemap.lock);
+  freemap.nfree[b / BPB]++;
+  freemap.free++;
+  release(&freemap.lock);
+}
+
+static void
+bflush(struct buf **bpp)
+{
+  if(*bpp){
+    log_write(*bpp);
+    brelse(*bpp);
+    *bpp = 0;
+  }
+}
+
+// Free a disk block.
+static void
+bfree(int dev, uint b)
+{
+  struct buf *bp = 0;
+
+  bunmark(dev, b, &bp);
+  bflush(&bp);
 }
 
 // Inodes.
@@ -140,7 +291,7 @@ bfree(int dev, uint b)
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid when it frees the inode on disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -164,10 +315,20 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
+// The itable is hashed by (dev, inum). An entry whose ref has
+// fallen to zero stays in its hash chain, and also goes on a
+// free list, least recently used first. iget() of such an
+// inode takes it off the free list, and keeps the contents
+// if they are valid; otherwise iget() recycles the entry at the
+// head of the free list. iinit() allocates NINODE entries
+// from kmalloc(), and iget() allocates more only when none
+// is free. Entries are never freed.
+//
 // The itable.lock spin-lock protects the allocation of itable
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// holds, one must hold itable.lock while using any of those fields,
+// or the hash chains and free list.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
@@ -175,45 +336,133 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  int n;                // inodes allocated
+  struct inode *all;    // all of them; they're kept for reuse, never freed
+  struct inode *hash[NIHASH];
+  struct inode free;    // head of the free list
+  uint ihint;           // no free inode below this inum
 } itable;
 
+static uint
+ihash(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % NIHASH;
+}
+
+// Append ip to the free list, or take it off.
+// Caller must hold itable.lock.
+static void
+ifreeadd(struct inode *ip)
+{
+  ip->fnext = &itable.free;
+  ip->fprev = itable.free.fprev;
+  itable.free.fprev->fnext = ip;
+  itable.free.fprev = ip;
+}
+
+static void
+ifreedel(struct inode *ip)
+{
+  ip->fnext->fprev = ip->fprev;
+  ip->fprev->fnext = ip->fnext;
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
+  struct inode *ip;
+
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  itable.free.fnext = itable.free.fprev = &itable.free;
+  for(; itable.n < NINODE; itable.n++){
+    if((ip = kmalloc(sizeof(*ip))) == 0)
+      panic("iinit");
+    memset(ip, 0, sizeof(*ip));
+    initsleeplock(&ip->lock, "inode");
+    ip->anext = itable.all;
+    itable.all = ip;
+    ifreeadd(ip);
   }
+  itable.ihint = 1;
 }
 
-static struct inode* iget(uint dev, uint inum);
+// Describe the inode table's use in buf, of n bytes, for
+// /proc/inodes: entries allocated, in use, and holding a
+// valid inode while not in use. Returns the length.
+int
+istat(char *buf, int n)
+{
+  struct inode *ip;
+  int nused, ncached;
+
+  nused = ncached = 0;
+  acquire(&itable.lock);
+  for(ip = itable.all; ip; ip = ip->anext){
+    if(ip->ref)
+      nused++;
+    else if(ip->valid)
+      ncached++;
+  }
+  release(&itable.lock);
+  return snprintf(buf, n, "inodes %d used %d cached %d\n",
+                  itable.n, nused, ncached);
+}
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode,
 // or NULL if there is no free inode.
+// The search starts at itable.ihint and reads each
+// inode block once. The hint's block usually has a free
+// inode, so it's read alone; past it, a search that has
+// to scan reads MAXMERGE inode blocks at a time.
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
-  struct buf *bp;
+  int inum, n, i, nb, k;
+  struct buf *bufs[MAXMERGE];
   struct dinode *dip;
+  uint bno;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
+  acquire(&itable.lock);
+  inum = itable.ihint;
+  release(&itable.lock);
+
+  // bufs[i] holds inum's block, and bufs[i+1..nb) the next ones.
+  i = nb = 0;
+  for(n = 1; n < sb.ninodes; n++, inum++){
+    if(inum >= sb.ninodes)
+      inum = 1;
+    bno = IBLOCK(inum, sb);
+    if(nb == 0 || bufs[i]->blockno != bno){
+      if(nb > 0)
+        brelse(bufs[i++]);
+      if(i == nb || bufs[i]->blockno != bno){
+        while(i < nb)
+          brelse(bufs[i++]);
+        k = nb == 0 ? 1 : min(MAXMERGE, IBLOCK(sb.ninodes - 1, sb) - bno + 1);
+        breadn(dev, bno, k, bufs);
+        i = 0;
+        nb = k;
+      }
+    }
+    dip = (struct dinode*)bufs[i]->data + inum%IPB;
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
+      if(type == T_FILE)
+        dip->flags = I_INLINE;  // until it grows past NINLINE
+      log_write(bufs[i]);   // mark it allocated on the disk
+      while(i < nb)
+        brelse(bufs[i++]);
+      acquire(&itable.lock);
+      itable.ihint = inum + 1;
+      release(&itable.lock);
       return iget(dev, inum);
     }
-    brelse(bp);
   }
+  while(i < nb)
+    brelse(bufs[i++]);
   printf("ialloc: no inodes\n");
   return 0;
 }
@@ -235,6 +484,7 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
+  dip->flags = ip->flags;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
@@ -243,34 +493,55 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
-static struct inode*
+struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
+  uint h;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  h = ihash(dev, inum);
+  for(ip = itable.hash[h]; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        ifreedel(ip);
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+  // Recycle the least recently used free entry, or, if
+  // they're all in use, allocate another.
+  ip = 0;
+  if(itable.free.fnext == &itable.free){
+    if((ip = kmalloc(sizeof(*ip))) != 0){
+      memset(ip, 0, sizeof(*ip));
+      initsleeplock(&ip->lock, "inode");
+      ip->anext = itable.all;
+      itable.all = ip;
+      itable.n++;
+    }
+  }
+  if(ip == 0){
+    ip = itable.free.fnext;
+    if(ip == &itable.free)
+      panic("iget: no inodes");
+    ifreedel(ip);
+    if(ip->inum){
+      for(pp = &itable.hash[ihash(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->next)
+        ;
+      *pp = ip->next;
+    }
+  }
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->next = itable.hash[h];
+  itable.hash[h] = ip;
   release(&itable.lock);
 
   return ip;
@@ -287,19 +558,14 @@ idup(struct inode *ip)
   return ip;
 }
 
-// Lock the given inode.
-// Reads the inode from disk if necessary.
-void
-ilock(struct inode *ip)
+// Read the inode from disk if necessary.
+// Caller must hold ip->lock exclusively.
+static void
+iload(struct inode *ip)
 {
   struct buf *bp;
   struct dinode *dip;
 
-  if(ip == 0 || ip->ref < 1)
-    panic("ilock");
-
-  acquiresleep(&ip->lock);
-
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
     dip = (struct dinode*)bp->data + ip->inum%IPB;
@@ -308,14 +574,52 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
+    ip->flags = dip->flags;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->lastblock = 0;
+    ip->ranext = 0;
+    ip->rawin = 0;
+    ip->raend = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
   }
 }
 
+// Lock the given inode.
+// Reads the inode from disk if necessary.
+void
+ilock(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilock");
+
+  acquiresleep(&ip->lock);
+  iload(ip);
+}
+
+// Lock the given inode shared, to read it and its content
+// alongside other readers; see sleeplock.c. readi(),
+// stati(), and dirlookup() can be called with ip locked
+// either way, the rest need ilock().
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  acquiresleepshared(&ip->lock);
+  if(ip->valid == 0){
+    // read it in under the exclusive lock. once valid, it
+    // stays valid while the caller's reference keeps it.
+    releasesleepshared(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+    acquiresleepshared(&ip->lock);
+  }
+}
+
 // Unlock the given inode.
 void
 iunlock(struct inode *ip)
@@ -326,6 +630,16 @@ iunlock(struct inode *ip)
   releasesleep(&ip->lock);
 }
 
+// Undo ilockshared().
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("iunlockshared");
+
+  releasesleepshared(&ip->lock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
 // be recycled.
@@ -347,6 +661,8 @@ iput(struct inode *ip)
 
     release(&itable.lock);
 
+    if(ip->type == T_DIR)
+      dcpurge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -355,9 +671,12 @@ iput(struct inode *ip)
     releasesleep(&ip->lock);
 
     acquire(&itable.lock);
+    if(ip->inum < itable.ihint)
+      itable.ihint = ip->inum;
   }
 
-  ip->ref--;
+  if(--ip->ref == 0)
+    ifreeadd(ip);
   release(&itable.lock);
 }
 
@@ -374,50 +693,239 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. Block ip->addrs[NDIRECT+1]
+// lists NINDIRECT more indirect blocks, for the
+// NINDIRECT*NINDIRECT blocks after that.
+//
+// An inode with I_EXTENT set instead describes its content as
+// a list of extents, runs of consecutive disk blocks; see
+// struct extent in fs.h.
+//
+// A new or truncated regular file starts out I_INLINE, with
+// its content in addrs[] itself, so that reading a small file
+// costs no disk access past the inode's block. It has no blocks
+// until bwritei() writes past NINLINE and calls iunline().
+
+// Allocate a block for ip's content. With no goal, ask for
+// the block after the last one allocated for ip, so
+// sequentially written files stay close together on disk.
+static uint
+iballoc(struct inode *ip, uint goal)
+{
+  uint b;
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-// returns 0 if out of disk space.
+  if(goal == 0 && ip->lastblock)
+    goal = ip->lastblock + 1;
+  if((b = balloc(ip->dev, goal)) != 0)
+    ip->lastblock = b;
+  return b;
+}
+
+// Return a pointer to extent i of extent inode ip.
+// Extents past NIEXTENT live in the extent block,
+// which is read into *bpp on first use.
+// Returns 0 if ip has no extent block yet.
+static struct extent*
+extent(struct inode *ip, struct buf **bpp, uint i)
+{
+  if(i < NIEXTENT)
+    return (struct extent*)ip->addrs + i;
+  if(*bpp == 0){
+    if(ip->addrs[NDIRECT] == 0)
+      return 0;
+    *bpp = bread(ip->dev, ip->addrs[NDIRECT]);
+  }
+  return (struct extent*)(*bpp)->data + (i - NIEXTENT);
+}
+
+// bmap() for extent inodes.
+// Files only grow at the end, so a new block either
+// extends the last extent, if balloc() could place it
+// right after that extent, or starts a new one.
 static uint
-bmap(struct inode *ip, uint bn)
+emap(struct inode *ip, uint bn, int alloc)
 {
-  uint addr, *a;
+  struct extent *x, *last;
   struct buf *bp;
+  uint i, base, goal, addr;
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[bn] = addr;
+  bp = 0;
+  x = last = 0;
+  base = 0;
+  addr = 0;
+  for(i = 0; i < NIEXTENT + NEXTENTBLK; i++){
+    if((x = extent(ip, &bp, i)) == 0 || x->len == 0)
+      break;
+    if(bn < base + x->len){
+      addr = x->start + (bn - base);
+      goto out;
     }
-    return addr;
+    base += x->len;
+    last = x;
   }
-  bn -= NDIRECT;
-
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
+  if(!alloc || bn != base)
+    goto out;
+
+  goal = last ? last->start + last->len : 0;
+  if((addr = iballoc(ip, goal)) == 0)
+    goto out;
+  if(last && addr == goal){
+    last->len++;
+    i--;
+  } else {
+    if(i == NIEXTENT + NEXTENTBLK){
+      // out of extents.
+      bfree(ip->dev, addr);
+      addr = 0;
+      goto out;
     }
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
-        log_write(bp);
+    if(x == 0){
+      if((ip->addrs[NDIRECT] = iballoc(ip, 0)) == 0){
+        bfree(ip->dev, addr);
+        addr = 0;
+        goto out;
       }
+      x = extent(ip, &bp, i);
     }
+    x->start = addr;
+    x->len = 1;
+  }
+  if(i >= NIEXTENT)
+    log_write(bp);
+
+out:
+  if(bp)
     brelse(bp);
-    return addr;
+  return addr;
+}
+
+// Return entry i of indirect block addr, allocating a block
+// for it first if it is missing and alloc is set.
+// Returns 0 if the entry is missing.
+static uint
+indirect(struct inode *ip, uint addr, uint i, int alloc)
+{
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((addr = a[i]) == 0 && alloc){
+    addr = iballoc(ip, 0);
+    if(addr){
+      a[i] = addr;
+      log_write(bp);
+    }
+  }
+  brelse(bp);
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one if alloc is set,
+// and otherwise returns 0.
+// returns 0 if out of disk space.
+static uint
+bmap(struct inode *ip, uint bn, int alloc)
+{
+  uint addr;
+  int slot;
+
+  if(ip->flags & I_INLINE)
+    panic("bmap: inline");
+  if(ip->flags & I_EXTENT)
+    return emap(ip, bn, alloc);
+
+  if(bn < NDIRECT){
+    slot = bn;
+  } else if(bn - NDIRECT < NINDIRECT){
+    slot = NDIRECT;
+    bn -= NDIRECT;
+  } else if(bn - NDIRECT - NINDIRECT < NINDIRECT*NINDIRECT){
+    slot = NDIRECT+1;
+    bn -= NDIRECT + NINDIRECT;
+  } else
+    panic("bmap: out of range");
+
+  // Load the block in addrs[], allocating if necessary.
+  if((addr = ip->addrs[slot]) == 0){
+    if(!alloc)
+      return 0;
+    addr = iballoc(ip, 0);
+    if(addr == 0)
+      return 0;
+    ip->addrs[slot] = addr;
+  }
+
+  if(slot == NDIRECT+1){
+    addr = indirect(ip, addr, bn / NINDIRECT, alloc);
+    if(addr == 0)
+      return 0;
+    bn %= NINDIRECT;
   }
+  if(slot >= NDIRECT)
+    addr = indirect(ip, addr, bn, alloc);
+  return addr;
+}
+
+// Move inline ip's content to its first block, leaving ip
+// in the block or extent format its other flags say.
+// Returns -1 if out of disk space.
+static int
+iunline(struct inode *ip)
+{
+  char data[NINLINE];
+  struct buf *bp;
+  uint addr;
 
-  panic("bmap: out of range");
+  memmove(data, ip->addrs, NINLINE);
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  ip->flags &= ~I_INLINE;
+  if(ip->size == 0)
+    return 0;
+  if((addr = bmap(ip, 0, 1)) == 0){
+    memmove(ip->addrs, data, NINLINE);
+    ip->flags |= I_INLINE;
+    return -1;
+  }
+  bp = bread(ip->dev, addr);
+  memmove(bp->data, data, min(ip->size, NINLINE));
+  log_write(bp);
+  bforget(bp);
+  return 0;
+}
+
+// Free the blocks listed in indirect block addr, and, if
+// depth is 2, the blocks those list. Then free addr itself.
+// bitmap updates are batched in *bpp, see bunmark().
+static void
+ifree(struct inode *ip, uint addr, int depth, struct buf **bpp)
+{
+  struct buf *bp;
+  uint *a;
+  int j, k;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(depth > 1 && j % MAXMERGE == 0){
+      // start reading the next MAXMERGE indirect blocks
+      // below together, rather than one by one.
+      blkplug();
+      for(k = j; k < j + MAXMERGE && k < NINDIRECT; k++)
+        if(a[k])
+          bprefetch(ip->dev, a[k]);
+      blkunplug();
+    }
+    if(a[j] == 0)
+      continue;
+    if(depth > 1)
+      ifree(ip, a[j], depth - 1, bpp);
+    else
+      bunmark(ip->dev, a[j], bpp);
+  }
+  brelse(bp);
+  bunmark(ip->dev, addr, bpp);
 }
 
 // Truncate inode (discard contents).
@@ -426,28 +934,40 @@ void
 itrunc(struct inode *ip)
 {
   int i, j;
-  struct buf *bp;
-  uint *a;
-
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
+  struct buf *bp, *bmp;
+  struct extent *x;
+
+  pcdrop(ip, 0, ip->size);
+  bmp = 0;
+  if(ip->flags & I_INLINE){
+    // no blocks.
+  } else if(ip->flags & I_EXTENT){
+    bp = 0;
+    for(i = 0; i < NIEXTENT + NEXTENTBLK; i++){
+      if((x = extent(ip, &bp, i)) == 0 || x->len == 0)
+        break;
+      for(j = 0; j < x->len; j++)
+        bunmark(ip->dev, x->start + j, &bmp);
     }
-  }
-
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+    if(bp){
+      brelse(bp);
+      bunmark(ip->dev, ip->addrs[NDIRECT], &bmp);
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+  } else {
+    for(i = 0; i < NDIRECT; i++){
+      if(ip->addrs[i])
+        bunmark(ip->dev, ip->addrs[i], &bmp);
+    }
+    if(ip->addrs[NDIRECT])
+      ifree(ip, ip->addrs[NDIRECT], 1, &bmp);
+    if(ip->addrs[NDIRECT+1])
+      ifree(ip, ip->addrs[NDIRECT+1], 2, &bmp);
   }
+  bflush(&bmp);
 
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  if(ip->type == T_FILE)
+    ip->flags |= I_INLINE;
   ip->size = 0;
   iupdate(ip);
 }
@@ -464,33 +984,157 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Called by readi() just before it reads block bn of ip.
+// If the reads of ip look sequential, start reading the next
+// few blocks into the buffer cache, so the disk works ahead
+// of the reader. The window doubles, up to RAMAX blocks,
+// for as long as the reads stay sequential.
+// Caller must hold ip->lock. Readers holding it shared may
+// race on the window, but that only costs a wasted prefetch.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint b, addr, end;
+
+  if(bn + 1 == ip->ranext)
+    return;  // same block as last time
+  if(bn == ip->ranext){
+    ip->rawin = ip->rawin ? min(2*ip->rawin, RAMAX) : RAMIN;
+  } else {
+    ip->rawin = 0;
+    ip->raend = 0;
+  }
+  ip->ranext = bn + 1;
+  if(ip->rawin == 0)
+    return;
+
+  end = min(bn + 1 + ip->rawin, (ip->size + BSIZE - 1) / BSIZE);
+  for(b = max(bn + 1, ip->raend); b < end; b++){
+    if((addr = bmap(ip, b, 0)) == 0)
+      break;
+    bprefetch(ip->dev, addr);
+  }
+  ip->raend = max(ip->raend, b);
+}
+
+// Read n bytes at off of ip's content, which must lie
+// within the file, from its blocks in the buffer cache.
+// The page cache reads file pages with this; readi()
+// reads directories.
+// A block that was never written back, because the
+// system crashed while it was dirty, reads as zeroes,
+// as does an inline file's content past NINLINE.
+// Caller must hold ip->lock.
+int
+breadi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  uint tot, m;
+  struct buf *bp;
+  static char zeroes[BSIZE];
+
+  if(ip->flags & I_INLINE){
+    m = off < NINLINE ? min(n, NINLINE - off) : 0;
+    if(either_copyout(user_dst, dst, (char*)ip->addrs + off, m) == -1)
+      return -1;
+    for(tot = m; tot < n; tot += m){
+      m = min(n - tot, BSIZE);
+      if(either_copyout(user_dst, dst + tot, zeroes, m) == -1)
+        return -1;
+    }
+    return n;
+  }
+
+  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    m = min(n - tot, BSIZE - off%BSIZE);
+    uint addr = bmap(ip, off/BSIZE, 0);
+    if(addr == 0){
+      if(either_copyout(user_dst, dst, zeroes, m) == -1){
+        tot = -1;
+        break;
+      }
+      continue;
+    }
+    readahead(ip, off/BSIZE);
+    bp = bread(ip->dev, addr);
+    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+      brelse(bp);
+      tot = -1;
+      break;
+    }
+    if(ip->type == T_FILE)
+      bforget(bp);
+    else
+      brelse(bp);
+  }
+  return tot;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
+// Regular files are read through the page cache.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
-  struct buf *bp;
+  char *pa;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(ip->type != T_FILE)
+    return breadi(ip, user_dst, dst, off, n);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    if((pa = pcget(ip, off/PGSIZE)) == 0)
+      break;
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if(either_copyout(user_dst, dst, pa + (off % PGSIZE), m) == -1) {
+      kfree(pa);
+      tot = -1;
+      break;
+    }
+    kfree(pa);
+  }
+  return tot;
+}
+
+// Write n bytes to ip's blocks at off through the buffer
+// cache, and so the log.
+// Returns the number of bytes written.
+static uint
+bwritei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+{
+  uint tot, m;
+  struct buf *bp;
+
+  if(ip->flags & I_INLINE){
+    if(off + n <= NINLINE){
+      if(either_copyin((char*)ip->addrs + off, user_src, src, n) == -1)
+        return 0;
+      return n;
+    }
+    if(iunline(ip) < 0)
+      return 0;
+  }
+
+  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
+    uint addr = bmap(ip, off/BSIZE, 1);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+    if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
-      tot = -1;
       break;
     }
-    brelse(bp);
+    log_write(bp);
+    if(ip->type == T_FILE)
+      bforget(bp);
+    else
+      brelse(bp);
   }
   return tot;
 }
@@ -505,26 +1149,33 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, want;
+  char *pa;
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(!(ip->flags & I_EXTENT) && off + n > MAXFILE*BSIZE)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    uint addr = bmap(ip, off/BSIZE);
-    if(addr == 0)
-      break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
-      brelse(bp);
+    want = min(n - tot, PGSIZE - off%PGSIZE);
+    if(ip->type == T_FILE && (pa = pcpeek(ip, off/PGSIZE)) != 0 &&
+       (pa = pcprivate(ip, off/PGSIZE, pa)) != 0){
+      // keep the cached page up to date.
+      m = 0;
+      if(either_copyin(pa + (off % PGSIZE), user_src, src, want) != -1)
+        m = bwritei(ip, 0, (uint64)pa + (off % PGSIZE), off, want);
+      if(m != want)
+        pcdrop(ip, off, want);
+      kfree(pa);
+    } else {
+      m = bwritei(ip, user_src, src, off, want);
+    }
+    if(m != want){
+      tot += m;
+      off += m;
       break;
     }
-    log_write(bp);
-    brelse(bp);
   }
 
   if(off > ip->size)
@@ -538,6 +1189,126 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   return tot;
 }
 
+// Write data to regular file ip like writei(), but only into
+// the page cache, leaving the pages dirty for iflush(). Their
+// blocks are allocated and logged only then, so the caller
+// needn't be in a transaction.
+// Returns the number of bytes written, which is short if the
+// cache has no room for more dirty pages or the disk might
+// not have room for them; the caller should iflush() ip and
+// writei() the rest.
+// Caller must hold ip->lock.
+int
+dwritei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+{
+  uint tot, m;
+  char *pa;
+
+  if(ip->type != T_FILE || off > ip->size || off + n < off)
+    return 0;
+  if(!(ip->flags & I_EXTENT) && off + n > MAXFILE*BSIZE)
+    return 0;
+
+  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    // a page written from its start to the end of
+    // the file needn't be read first.
+    pa = pcwrite(ip, off/PGSIZE, off%PGSIZE != 0 || off + m < ip->size);
+    if(pa == 0)
+      break;
+    if(either_copyin(pa + (off % PGSIZE), user_src, src, m) == -1){
+      kfree(pa);
+      break;
+    }
+    kfree(pa);
+    if(off + m > ip->size)
+      ip->size = off + m;
+  }
+  return tot;
+}
+
+// Write ip's dirty pages to disk, lowest first and FLUSHPG,
+// or as many as the log holds, to a transaction, allocating
+// their blocks as it goes, so
+// that the blocks of a file written in one go end up
+// together. The pages of a file with no links are dropped.
+// Returns 0, or -1 if some pages couldn't be written, which
+// are dropped too.
+// ip must be referenced but not locked.
+int
+iflush(struct inode *ip)
+{
+  uint pg, off, n;
+  char *pa;
+  int k, r, npg;
+
+  // mkfs and initlog() allow a log of MAXOPBLOCKS, which
+  // holds only one page.
+  npg = min(FLUSHPG, (logcap() - FLUSHBLOCKS(0)) / (PGSIZE/BSIZE));
+  if(npg < 1 || FLUSHBLOCKS(npg) > logcap())
+    panic("iflush: log too small");
+  r = 0;
+  pg = 0;
+  for(;;){
+    begin_opn(FLUSHBLOCKS(npg));
+    ilock(ip);
+    if(ip->ndirty == 0 || pg * PGSIZE >= ip->size){
+      iunlock(ip);
+      end_opn(FLUSHBLOCKS(npg));
+      return r;
+    }
+    if(ip->nlink == 0)
+      pcdrop(ip, 0, ip->size);
+    for(k = 0; k < npg && pg * PGSIZE < ip->size; pg++){
+      if((pa = pcdirty(ip, pg)) == 0)
+        continue;
+      off = pg * PGSIZE;
+      n = min(ip->size - off, PGSIZE);
+      if(bwritei(ip, 0, (uint64)pa, off, n) == n){
+        pcclean(ip, pg);
+      } else {
+        pcdrop(ip, off, n);
+        r = -1;
+      }
+      kfree(pa);
+      k++;
+    }
+    if(k > 0)
+      iupdate(ip);
+    iunlock(ip);
+    end_opn(FLUSHBLOCKS(npg));
+  }
+}
+
+// The writeback kernel thread: every WBTICKS ticks, iflush()
+// the inodes with dirty pages, so that data written by a file
+// that stays open reaches the disk.
+static void
+writeback(void *arg)
+{
+  struct inode *ip, *all;
+
+  for(;;){
+    timersleep(r_time() + WBTICKS*TICKCYCLES);
+    acquire(&itable.lock);
+    all = itable.all;
+    release(&itable.lock);
+    for(ip = all; ip; ip = ip->anext){
+      acquire(&itable.lock);
+      if(ip->ref == 0 || ip->ndirty == 0){  // ndirty is racy, but iflush() checks
+        release(&itable.lock);
+        continue;
+      }
+      ip->ref++;
+      release(&itable.lock);
+      iflush(ip);
+      begin_op();
+      iput(ip);
+      end_op();
+    }
+  }
+}
+
 // Directories
 
 int
@@ -546,42 +1317,316 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Length of name, which is NUL-terminated only
+// if it is shorter than DIRSIZ.
+static int
+namelen(const char *name)
+{
+  int n;
+
+  for(n = 0; n < DIRSIZ && name[n]; n++)
+    ;
+  return n;
+}
+
+// Hash of a directory entry name, for indexed directories.
+// mkfs has a copy.
+static uint
+dirhash(char *name, int len)
+{
+  uint h;
+  int i;
+
+  h = 2166136261;
+  for(i = 0; i < len; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// The dirent after de in directory block bp, or 0 if de is
+// the last. Panics if reclen doesn't lead to a dirent in
+// the block, which would make callers loop forever.
+static struct dirent*
+denext(struct buf *bp, struct dirent *de)
+{
+  uint off;
+
+  off = (uchar*)de - bp->data + de->reclen;
+  if(de->reclen < DIRENTSIZE(0) || off > BSIZE)
+    panic("denext: bad dirent");
+  if(off == BSIZE)
+    return 0;
+  return (struct dirent*)(bp->data + off);
+}
+
+// Make directory block bp one free dirent.
+static void
+deinit(struct buf *bp)
+{
+  struct dirent *de = (struct dirent*)bp->data;
+
+  de->inum = 0;
+  de->reclen = BSIZE;
+  de->namelen = 0;
+}
+
+// Find the dirent for the len bytes of name in block bp.
+static struct dirent*
+defind(struct buf *bp, char *name, int len)
+{
+  struct dirent *de;
+
+  for(de = (struct dirent*)bp->data; de; de = denext(bp, de))
+    if(de->inum != 0 && de->namelen == len && memcmp(de->name, name, len) == 0)
+      return de;
+  return 0;
+}
+
+// Add the dirent (name, inum) to block bp, in a free dirent
+// or the room to spare past a name, if there is enough.
+// Returns the new dirent, or 0 if the block is full.
+static struct dirent*
+deadd(struct buf *bp, char *name, int len, uint inum)
+{
+  struct dirent *de, *nde;
+  uint used;
+
+  for(de = (struct dirent*)bp->data; de; de = denext(bp, de)){
+    used = de->inum ? DIRENTSIZE(de->namelen) : 0;
+    if(de->reclen - used < DIRENTSIZE(len))
+      continue;
+    if(used){
+      nde = (struct dirent*)((uchar*)de + used);
+      nde->reclen = de->reclen - used;
+      de->reclen = used;
+      de = nde;
+    }
+    de->inum = inum;
+    de->namelen = len;
+    memmove(de->name, name, len);
+    return de;
+  }
+  return 0;
+}
+
+static uchar*
+dx(struct buf *bp, int i)
+{
+  return bp->data + DXBYTE(i);
+}
+
+// Read the bucket of indexed directory dp that holds name.
+// Sets *pib to the locked index buffer, if pib isn't 0.
+static struct buf*
+dxbucket(struct inode *dp, char *name, int len, struct buf **pib, uint *pb)
+{
+  struct buf *ib, *bp;
+  uint b;
+
+  ib = bread(dp->dev, bmap(dp, 0, 0));
+  b = *dx(ib, DXSLOT(dirhash(name, len) & ((1 << *dx(ib, DXDEPTH)) - 1)));
+  bp = bread(dp->dev, bmap(dp, b, 0));
+  if(pib)
+    *pib = ib;
+  else
+    brelse(ib);
+  *pb = b;
+  return bp;
+}
+
+// Look for name in directory dp: only in name's bucket, if dp
+// is indexed, or else in dp's one block.
+// Returns the inum and sets *poff, or returns 0 if not found.
+static uint
+dlookup(struct inode *dp, char *name, uint *poff)
+{
+  struct buf *bp;
+  struct dirent *de;
+  uint b, inum;
+  int len;
+
+  if(dp->size == 0)
+    return 0;
+  len = namelen(name);
+  if(dp->flags & I_HASHDIR){
+    bp = dxbucket(dp, name, len, 0, &b);
+  } else {
+    b = 0;
+    bp = bread(dp->dev, bmap(dp, 0, 0));
+  }
+  inum = 0;
+  if((de = defind(bp, name, len)) != 0){
+    inum = de->inum;
+    *poff = b*BSIZE + ((uchar*)de - bp->data);
+  }
+  brelse(bp);
+  return inum;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
-  struct dirent de;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
+  if(dclookup(dp->dev, dp->inum, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  if((inum = dlookup(dp, name, &off)) == 0){
+    dcenter(dp->dev, dp->inum, name, 0, 0);
+    return 0;
+  }
+  if(poff)
+    *poff = off;
+  dcenter(dp->dev, dp->inum, name, inum, off);
+  return iget(dp->dev, inum);
+}
+
+// Turn linear directory dp, whose one block is full, into an
+// indexed directory: its entries move to block 1, the first
+// bucket, and block 0 becomes the index.
+static int
+dxconvert(struct inode *dp)
+{
+  struct buf *ib, *bp;
+  uint addr;
+
+  if((addr = bmap(dp, 1, 1)) == 0)
+    return -1;
+  ib = bread(dp->dev, bmap(dp, 0, 0));
+  bp = bread(dp->dev, addr);
+  memmove(bp->data, ib->data, BSIZE);
+  memset(ib->data, 0, BSIZE);
+  deinit(ib);
+  *dx(ib, DXDEPTH) = 0;
+  *dx(ib, DXSLOT(0)) = 1;
+  *dx(ib, DXLDEPTH(1)) = 0;
+  log_write(bp);
+  log_write(ib);
+  brelse(bp);
+  brelse(ib);
+
+  dp->size = 2*BSIZE;
+  dp->flags |= I_HASHDIR;
+  iupdate(dp);
+  dcpurge(dp->dev, dp->inum);  // entries have moved
+  return 0;
+}
+
+// Split full bucket b of indexed directory dp, whose index
+// is in ib: names with bit ld of the hash set move to a new
+// bucket at the end of dp, doubling the index first if needed.
+// Both buckets are packed afresh.
+static int
+dxsplit(struct inode *dp, struct buf *ib, struct buf *bp, uint b)
+{
+  struct buf *nbp;
+  struct dirent *de;
+  uint nb, addr, ld, depth, s, off;
+  uchar *old;
+
+  ld = *dx(ib, DXLDEPTH(b));
+  depth = *dx(ib, DXDEPTH);
+  nb = dp->size / BSIZE;
+  if(ld == DXMAXDEPTH || nb > DXMAXBUCKET)
+    return -1;
+  if((old = kmalloc(BSIZE)) == 0)
+    return -1;
+  if((addr = bmap(dp, nb, 1)) == 0){
+    kmfree(old);
+    return -1;
+  }
+
+  if(ld == depth){
+    for(s = 0; s < (1 << depth); s++)
+      *dx(ib, DXSLOT(s + (1 << depth))) = *dx(ib, DXSLOT(s));
+    *dx(ib, DXDEPTH) = ++depth;
+  }
+  for(s = 0; s < (1 << depth); s++)
+    if(*dx(ib, DXSLOT(s)) == b && (s >> ld) & 1)
+      *dx(ib, DXSLOT(s)) = nb;
+  *dx(ib, DXLDEPTH(b)) = *dx(ib, DXLDEPTH(nb)) = ld + 1;
+
+  // a name that fit in the old bucket fits in whichever
+  // bucket it goes to now.
+  nbp = bread(dp->dev, addr);
+  memmove(old, bp->data, BSIZE);
+  deinit(bp);
+  deinit(nbp);
+  for(off = 0; off < BSIZE; off += de->reclen){
+    de = (struct dirent*)(old + off);
+    if(de->inum == 0)
       continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
-    }
+    if((dirhash(de->name, de->namelen) >> ld) & 1)
+      deadd(nbp, de->name, de->namelen, de->inum);
+    else
+      deadd(bp, de->name, de->namelen, de->inum);
   }
+  kmfree(old);
+  log_write(nbp);
+  brelse(nbp);
+  log_write(bp);
+  log_write(ib);
 
+  dp->size += BSIZE;
+  iupdate(dp);
+  dcpurge(dp->dev, dp->inum);  // entries have moved
   return 0;
 }
 
+// dirlink() for indexed directories. Splits name's bucket
+// if it is full; give up if it is still full after that,
+// which takes uncommonly similar hashes.
+static int
+dxlink(struct inode *dp, char *name, uint inum)
+{
+  struct buf *ib, *bp;
+  struct dirent *de;
+  uint b, off;
+  int tries, len;
+
+  len = namelen(name);
+  for(tries = 0; tries < 2; tries++){
+    bp = dxbucket(dp, name, len, &ib, &b);
+    if((de = deadd(bp, name, len, inum)) != 0){
+      log_write(bp);
+      off = b*BSIZE + ((uchar*)de - bp->data);
+      brelse(bp);
+      brelse(ib);
+      dcenter(dp->dev, dp->inum, name, inum, off);
+      return 0;
+    }
+    if(tries > 0 || dxsplit(dp, ib, bp, b) < 0){
+      brelse(bp);
+      brelse(ib);
+      return -1;
+    }
+    brelse(bp);
+    brelse(ib);
+  }
+  return -1;
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 // Returns 0 on success, -1 on failure (e.g. out of disk blocks).
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
-  struct dirent de;
+  struct dirent *de;
+  struct buf *bp;
   struct inode *ip;
+  uint addr, off;
 
   // Check that name is not present.
   if((ip = dirlookup(dp, name, 0)) != 0){
@@ -589,20 +1634,88 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if(!(dp->flags & I_HASHDIR)){
+    if(dp->size == 0){
+      // a new directory's first block.
+      if((addr = bmap(dp, 0, 1)) == 0)
+        return -1;
+      bp = bread(dp->dev, addr);
+      deinit(bp);
+      dp->size = BSIZE;
+      iupdate(dp);
+    } else {
+      bp = bread(dp->dev, bmap(dp, 0, 0));
+    }
+    if((de = deadd(bp, name, namelen(name), inum)) != 0){
+      log_write(bp);
+      off = (uchar*)de - bp->data;
+      brelse(bp);
+      dcenter(dp->dev, dp->inum, name, inum, off);
+      return 0;
+    }
+    brelse(bp);
+
+    // a full linear directory becomes indexed.
+    if(dxconvert(dp) < 0)
+      return -1;
   }
 
-  strncpy(de.name, name, DIRSIZ);
-  de.inum = inum;
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    return -1;
+  return dxlink(dp, name, inum);
+}
 
-  return 0;
+// Remove the directory entry at offset off of dp, which
+// dirlookup() found. Its space goes to the dirent before it,
+// if any, so that free space doesn't fragment; the other
+// dirents stay put, and so do their dcache entries.
+void
+dirunlink(struct inode *dp, uint off)
+{
+  struct buf *bp;
+  struct dirent *de, *prev;
+
+  bp = bread(dp->dev, bmap(dp, off / BSIZE, 0));
+  prev = 0;
+  for(de = (struct dirent*)bp->data; de; de = denext(bp, de)){
+    if((uchar*)de - bp->data == off % BSIZE)
+      break;
+    prev = de;
+  }
+  if(de == 0 || de->inum == 0)
+    panic("dirunlink");
+  if(prev)
+    prev->reclen += de->reclen;
+  else
+    de->inum = 0;
+  log_write(bp);
+  brelse(bp);
+}
+
+// Is the directory dp empty except for "." and ".." ?
+int
+dirempty(struct inode *dp)
+{
+  struct buf *bp;
+  struct dirent *de;
+  uint bn;
+  int empty;
+
+  // "." and ".." are not always first: an indexed directory
+  // keeps them wherever their hash puts them.
+  empty = 1;
+  for(bn = 0; empty && bn < dp->size / BSIZE; bn++){
+    bp = bread(dp->dev, bmap(dp, bn, 0));
+    for(de = (struct dirent*)bp->data; de; de = denext(bp, de)){
+      if(de->inum == 0)
+        continue;
+      if(!(de->namelen == 1 && de->name[0] == '.') &&
+         !(de->namelen == 2 && de->name[0] == '.' && de->name[1] == '.')){
+        empty = 0;
+        break;
+      }
+    }
+    brelse(bp);
+  }
+  return empty;
 }
 
 // Paths
@@ -648,10 +1761,16 @@ skipelem(char *path, char *name)
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
 // Must be called inside a transaction since it calls iput().
+//
+// Components the dcache knows about are resolved without
+// locking the directory (see dcget()); only on a miss does
+// namex() lock the directory and call dirlookup(), which
+// fills in the cache for next time.
 static struct inode*
 namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
+  int known;
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
@@ -659,21 +1778,32 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
-    if(ip->type != T_DIR){
-      iunlockput(ip);
-      return 0;
-    }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
+      ilock(ip);
+      if(ip->type != T_DIR){
+        iunlockput(ip);
+        return 0;
+      }
       iunlock(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
-      return 0;
+    // Only directories have dcache entries, so a hit
+    // needs no T_DIR check.
+    next = dcget(ip->dev, ip->inum, name, &known);
+    if(!known){
+      ilockshared(ip);
+      if(ip->type != T_DIR){
+        iunlockshared(ip);
+        iput(ip);
+        return 0;
+      }
+      next = dirlookup(ip, name, 0);
+      iunlockshared(ip);
     }
-    iunlockput(ip);
+    iput(ip);
+    if(next == 0)
+      return 0;
     ip = next;
   }
   if(nameiparent){
@@ -24,9 +24,35 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+// Most data blocks one log transaction can hold:
+// as many block numbers as fit in a log header block.
+#define LOGMAX (BSIZE/sizeof(uint) - 3)
+
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT)
+
+// dinode flags
+#define I_EXTENT 0x1    // addrs[] holds extents, not block numbers
+#define I_HASHDIR 0x2   // indexed directory, see below
+#define I_INLINE 0x4    // addrs[] holds the content itself
+
+// An extent inode keeps its first NIEXTENT extents in the
+// direct slots of addrs[], and up to NEXTENTBLK more in the
+// block named by addrs[NDIRECT]. Extents map consecutive
+// runs of the file; an extent with len 0 ends the list.
+struct extent {
+  uint start;           // first disk block of the run
+  uint len;             // number of blocks in the run
+};
+
+#define NIEXTENT (NDIRECT*sizeof(uint) / sizeof(struct extent))
+#define NEXTENTBLK (BSIZE / sizeof(struct extent))
+
+// An I_INLINE regular file keeps up to NINLINE bytes of
+// content in addrs[], and moves it to a block of its own,
+// in the format the other flags say, once it grows past.
+#define NINLINE ((NDIRECT+2)*sizeof(uint))
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +61,8 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint flags;           // I_EXTENT, I_HASHDIR, I_INLINE
+  uint addrs[NDIRECT+2];   // Data block addresses
 };
 
 // Inodes per block.
@@ -50,11 +77,40 @@ struct dinode {
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
 
-// Directory is a file containing a sequence of dirent structures.
-#define DIRSIZ 14
+// A directory is a file of blocks, each holding a run of
+// variable-length dirents that exactly fills it. A dirent's
+// reclen leads to the next one in the block, and a dirent
+// with inum 0 is free space. A dirent may have room to spare
+// past its name, so that adding a name can split it.
+// Names are at most DIRSIZ bytes, not NUL-terminated on disk.
+#define DIRSIZ 60
 
 struct dirent {
   ushort inum;
-  char name[DIRSIZ];
+  ushort reclen;        // bytes from this dirent to the next
+  uchar namelen;
+  char name[];          // namelen bytes
 };
 
+// Bytes a dirent with an n-byte name takes, rounded up so
+// that dirents stay aligned.
+#define DIRENTSIZE(n) ((sizeof(struct dirent) + (n) + 3) & ~3)
+
+// A directory that outgrows its first block becomes indexed
+// (I_HASHDIR): block 0 is an index, and the other blocks are
+// buckets of dirents. Byte DXSLOT(s) of the index is the bucket
+// holding the names whose hash has s in its low DXDEPTH bits;
+// DXLDEPTH(b) is how many low hash bits all names in bucket b
+// have in common. A full bucket splits in two.
+// The index bytes follow a free dirent that covers the whole
+// block, so that code that reads the directory's dirents sees
+// the index block as free space.
+#define DXMAXDEPTH 8
+#define DXSLOTS (1 << DXMAXDEPTH)
+#define DXMAXBUCKET 255
+#define DXDEPTH 0
+#define DXSLOT(s) (1 + (s))
+#define DXLDEPTH(b) (1 + DXSLOTS + (b))
+// Offset in the index block of index byte i.
+#define DXBYTE(i) (DIRENTSIZE(0) + (i))
+
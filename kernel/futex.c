@@ -0,0 +1,87 @@
+// Futexes.
+//
+// A user-space lock needs the kernel only when it is
+// contended: futex(addr, FUTEX_WAIT, val) sleeps if the int
+// at addr still holds val, and futex(addr, FUTEX_WAKE, 0)
+// wakes the threads sleeping on addr.
+//
+// Sleepers are keyed by the physical address of the int, so
+// processes that share the page with mmap(MAP_SHARED) can use
+// it as well as threads. A hashed lock covers the check of the
+// int and the sleep, so a wakeup that follows a store to the
+// int can't slip in between them and be lost.
+//
+// Lock order: mm->lock and the futex locks are never held
+// together; a futex lock comes before the sleep queue locks.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NFUTEX 31
+
+struct spinlock futexlock[NFUTEX];
+
+void
+futexinit(void)
+{
+  int i;
+
+  for(i = 0; i < NFUTEX; i++)
+    initlock(&futexlock[i], "futex");
+}
+
+// The physical address of the int at user address addr,
+// or 0 if it isn't mapped writable. A copy-on-write page is
+// copied first, so that the waiter and the waker, whose
+// store to the int would copy it, key on the same page.
+static uint64
+futexaddr(uint64 addr)
+{
+  if(addr % sizeof(int))
+    return 0;
+  return uvmwaddr(myproc()->pagetable, addr);
+}
+
+// Sleep on addr if the int there holds val.
+// Returns 0 once woken, -1 if the int didn't hold val,
+// addr is bad, or the caller was killed.
+int
+futexwait(uint64 addr, int val)
+{
+  struct spinlock *lk;
+  uint64 pa;
+
+  if((pa = futexaddr(addr)) == 0)
+    return -1;
+  lk = &futexlock[(pa / sizeof(int)) % NFUTEX];
+  acquire(lk);
+  if(*(volatile int*)pa != val || killed(myproc())){
+    release(lk);
+    return -1;
+  }
+  sleep((void*)pa, lk);
+  release(lk);
+  return 0;
+}
+
+// Wake the sleepers on addr. They all wake, and those
+// that lose the race for the lock sleep again.
+int
+futexwake(uint64 addr)
+{
+  struct spinlock *lk;
+  uint64 pa;
+
+  if((pa = futexaddr(addr)) == 0)
+    return -1;
+  lk = &futexlock[(pa / sizeof(int)) % NFUTEX];
+  acquire(lk);
+  wakeup((void*)pa);
+  release(lk);
+  return 0;
+}
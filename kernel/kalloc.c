@@ -1,42 +1,186 @@
 // Physical memory allocator, for user processes,
-// kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// kernel stacks, page-table pages, pipe buffers,
+// and kmalloc()'s slabs. Allocates whole 4096-byte pages.
+//
+// Each hart has its own free list and lock, so that
+// kalloc() and kfree() on different harts don't contend.
+// A hart whose list runs dry steals a batch of pages
+// from another hart's list. At boot, every hart that
+// starts puts pages on its own list, a chunk at a time,
+// so that no one hart has to touch all of memory.
+//
+// Pages shared copy-on-write by fork() have a reference
+// count; kfree() only frees a page when its count drops
+// to zero.
+//
+// kzalloc() hands out zeroed pages from a pool that the
+// zeroer kernel thread fills at the lowest priority, so
+// that page tables and new user memory needn't be zeroed
+// on the spot.
+//
+// The top NMEGAPG megapages of RAM are kept apart, whole,
+// for user heaps that hugesbrk() backs with megapages.
+// A megapage split into ordinary pages goes back to the
+// megapage pool once all of its pages have been freed.
+//
+// Building with DEBUG_POISON fills freed and newly
+// allocated pages with junk, to catch dangling and
+// uninitialized uses.
 
 #include "types.h"
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
 #include "riscv.h"
+#include "proc.h"
 #include "defs.h"
 
-void freerange(void *pa_start, void *pa_end);
-
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define NSTEAL 64  // max pages moved by one steal
+#define NZPOOL 64  // pre-zeroed pages kept for kzalloc()
+#define INITCHUNK (256*PGSIZE)  // memory freed at a time at boot
+
 struct run {
   struct run *next;
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  uint64 nfree;   // pages on freelist
+  uint64 nalloc;  // pages handed out by kalloc() on this hart
+  uint64 nsteal;  // pages stolen from other harts
+} kmem[NCPU];
+
+// References to each page, updated with atomic
+// instructions rather than under a lock.
+int kref[(PHYSTOP - KERNBASE) / PGSIZE];
 
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+} zpool;
+
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int inuse[NMEGAPG];  // pages of a split megapage not yet freed
+} megapool;
+
+// kinithart()'s progress through the pages below MEGABASE.
+struct {
+  char *start;
+  uint64 nchunk;
+  uint64 next;    // next INITCHUNK to claim
+  uint64 done;    // chunks on free lists
+} kinitmem;
+
+#define KREF(pa) (kref[((uint64)(pa) - KERNBASE) / PGSIZE])
+
+#define MEGABASE (PHYSTOP - NMEGAPG*MEGAPGSIZE)
+#define MEGAINDEX(pa) (((uint64)(pa) - MEGABASE) / MEGAPGSIZE)
+
+// Called by hart 0 before the other harts start. The
+// ordinary pages are freed by kinithart() on every hart.
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  char *p;
+
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&zpool.lock, "zpool");
+  initlock(&megapool.lock, "megapool");
+  kinitmem.start = (char*)PGROUNDUP((uint64)end);
+  kinitmem.nchunk = ((char*)MEGABASE - kinitmem.start + INITCHUNK - 1) / INITCHUNK;
+  for(p = (char*)MEGABASE; p < (char*)PHYSTOP; p += MEGAPGSIZE)
+    kmegafree(p);
 }
 
-void
-freerange(void *pa_start, void *pa_end)
+// Put page pa on hart id's free list.
+static void
+kpush(int id, void *pa)
+{
+  struct run *r;
+
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kfree");
+
+#ifdef DEBUG_POISON
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE);
+#endif
+
+  r = (struct run*)pa;
+
+  acquire(&kmem[id].lock);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = r;
+  kmem[id].nfree++;
+  release(&kmem[id].lock);
+}
+
+// Put the pages from pa_start to pa_end on hart id's
+// free list, taking its lock just once.
+static void
+freerange(int id, char *pa_start, char *pa_end)
 {
+  struct run *head, *r;
+  uint64 n;
   char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+
+  head = 0;
+  n = 0;
+  for(p = pa_end - PGSIZE; p >= pa_start; p -= PGSIZE){
+#ifdef DEBUG_POISON
+    memset(p, 1, PGSIZE);
+#endif
+    r = (struct run*)p;
+    r->next = head;
+    head = r;
+    n++;
+  }
+  if(head == 0)
+    return;
+
+  acquire(&kmem[id].lock);
+  r = (struct run*)(pa_end - PGSIZE);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = head;
+  kmem[id].nfree += n;
+  release(&kmem[id].lock);
+}
+
+// Run by each hart at boot, before paging is on: free
+// chunks of memory onto this hart's list until there are
+// none left to claim. Harts that start later, or are
+// slower, get fewer, and harts that never start none.
+void
+kinithart(void)
+{
+  uint64 c;
+  char *s, *e;
+
+  while((c = __sync_fetch_and_add(&kinitmem.next, 1)) < kinitmem.nchunk){
+    s = kinitmem.start + c*INITCHUNK;
+    e = s + INITCHUNK;
+    if(e > (char*)MEGABASE)
+      e = (char*)MEGABASE;
+    freerange(cpuid(), s, e);
+    __sync_fetch_and_add(&kinitmem.done, 1);
+  }
+}
+
+// Wait for the other harts' kinithart()s to finish
+// the chunks they claimed.
+void
+kinitwait(void)
+{
+  while(__atomic_load_n(&kinitmem.done, __ATOMIC_ACQUIRE) < kinitmem.nchunk)
+    ;
 }
 
 // Free the page of physical memory pointed at by pa,
@@ -45,21 +189,107 @@ freerange(void *pa_start, void *pa_end)
 // initializing the allocator; see kinit above.)
 void
 kfree(void *pa)
+{
+  int n;
+
+  if((char*)pa >= end && (uint64)pa < PHYSTOP){
+    if((n = __sync_sub_and_fetch(&KREF(pa), 1)) < 0)
+      panic("kfree: ref");
+    if(n > 0)
+      return;
+  }
+  if((uint64)pa >= MEGABASE && (uint64)pa < PHYSTOP){
+    // a piece of a split megapage.
+    if(__sync_sub_and_fetch(&megapool.inuse[MEGAINDEX(pa)], 1) == 0)
+      kmegafree((void*)(MEGABASE + MEGAINDEX(pa)*MEGAPGSIZE));
+    return;
+  }
+  push_off();
+  kpush(cpuid(), pa);
+  pop_off();
+}
+
+// Move up to NSTEAL pages from some other hart's free list
+// to hart id's free list. Never holds two kmem locks at once,
+// so two harts stealing from each other can't deadlock.
+// Returns the number of pages moved.
+static int
+ksteal(int id)
+{
+  struct run *head, *tail;
+  struct kmem *v;
+  int i, n;
+
+  for(i = 1; i < NCPU; i++){
+    v = &kmem[(id + i) % NCPU];
+    acquire(&v->lock);
+    head = tail = v->freelist;
+    for(n = 0; tail && n < NSTEAL-1 && tail->next; n++)
+      tail = tail->next;
+    if(head){
+      n++;
+      v->freelist = tail->next;
+      v->nfree -= n;
+    }
+    release(&v->lock);
+
+    if(head){
+      acquire(&kmem[id].lock);
+      tail->next = kmem[id].freelist;
+      kmem[id].freelist = head;
+      kmem[id].nfree += n;
+      kmem[id].nsteal += n;
+      release(&kmem[id].lock);
+      return n;
+    }
+  }
+  return 0;
+}
+
+// Take a page from the zeroed pool, if it has one.
+// The page is all zeroes but for r->next.
+static struct run*
+zpop(void)
 {
   struct run *r;
 
-  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
-    panic("kfree");
+  acquire(&zpool.lock);
+  if((r = zpool.list) != 0){
+    zpool.list = r->next;
+    zpool.n--;
+  }
+  release(&zpool.lock);
+  return r;
+}
 
-  // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+// Take a page from this hart's free list,
+// stealing from the other harts if it is empty.
+static struct run*
+kpop(void)
+{
+  struct run *r;
+  int id;
 
-  r = (struct run*)pa;
+  push_off();
+  id = cpuid();
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  acquire(&kmem[id].lock);
+  r = kmem[id].freelist;
+  if(r == 0){
+    release(&kmem[id].lock);
+    ksteal(id);
+    acquire(&kmem[id].lock);
+    r = kmem[id].freelist;
+  }
+  if(r){
+    kmem[id].freelist = r->next;
+    kmem[id].nfree--;
+    kmem[id].nalloc++;
+  }
+  release(&kmem[id].lock);
+
+  pop_off();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +300,175 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  r = kpop();
 
-  if(r)
+  // the zeroed pool, kmalloc()'s magazines, and then the
+  // page cache are the last resorts.
+  if(r == 0)
+    r = zpop();
+  if(r == 0 && kmreclaim() > 0)
+    r = kpop();
+  while(r == 0 && pcreclaim() > 0)
+    r = kpop();
+
+  if(r){
+    KREF(r) = 1;
+#ifdef DEBUG_POISON
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  }
+  return (void*)r;
+}
+
+// Allocate one zeroed page.
+// Returns 0 if the memory cannot be allocated.
+void *
+kzalloc(void)
+{
+  struct run *r;
+
+  if((r = zpop()) != 0){
+    r->next = 0;
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Zero a page for kzalloc(), if the pool isn't full.
+// Returns 1 if it added a page, 0 if not.
+static int
+kzfill(void)
+{
+  struct run *r;
+
+  if(zpool.n >= NZPOOL)
+    return 0;  // racy, but only costs a page too many
+  // not kalloc(), which would take pages from the page cache.
+  if((r = kpop()) == 0)
+    return 0;
+  KREF(r) = 1;
+  memset((char*)r, 0, PGSIZE);
+  acquire(&zpool.lock);
+  r->next = zpool.list;
+  zpool.list = r;
+  zpool.n++;
+  release(&zpool.lock);
+  return 1;
+}
+
+// The zeroer kernel thread. It runs only when nothing else
+// wants the CPU, and looks at the pool once a tick; kzalloc()
+// doesn't wake it, since it may be called with p->lock held.
+void
+kzeroer(void *arg)
+{
+  struct proc *p = myproc();
+
+  acquire(&p->lock);
+  p->nice = p->prio = NPRIO-1;
+  release(&p->lock);
+  for(;;){
+    while(kzfill())
+      ;
+    timersleep(r_time() + TICKCYCLES);
+  }
+}
+
+// How many pages are free? Racy; for sizing caches at boot.
+uint64
+kfreepages(void)
+{
+  uint64 n = 0;
+
+  for(int i = 0; i < NCPU; i++)
+    n += kmem[i].nfree;
+  return n;
+}
+
+// Add a reference to page pa, which is being shared.
+void
+kdup(void *pa)
+{
+  __sync_fetch_and_add(&KREF(pa), 1);
+}
+
+// How many references are there to page pa?
+int
+krefs(void *pa)
+{
+  return __atomic_load_n(&KREF(pa), __ATOMIC_SEQ_CST);
+}
+
+// Allocate one zeroed megapage, MEGAPGSIZE bytes
+// aligned to MEGAPGSIZE.
+// Returns 0 if all the megapages are in use.
+void *
+kmegalloc(void)
+{
+  struct run *r;
+
+  acquire(&megapool.lock);
+  if((r = megapool.list) != 0)
+    megapool.list = r->next;
+  release(&megapool.lock);
+  if(r)
+    memset((char*)r, 0, MEGAPGSIZE);
   return (void*)r;
 }
+
+// Free a megapage returned by kmegalloc().
+void
+kmegafree(void *pa)
+{
+  struct run *r = (struct run*)pa;
+
+  if(((uint64)pa % MEGAPGSIZE) != 0 || (uint64)pa < MEGABASE || (uint64)pa >= PHYSTOP)
+    panic("kmegafree");
+  acquire(&megapool.lock);
+  r->next = megapool.list;
+  megapool.list = r;
+  release(&megapool.lock);
+}
+
+// The megapage at pa is being split into ordinary pages,
+// each of which will be freed with kfree().
+void
+kmegasplit(void *pa)
+{
+  for(int i = 0; i < MEGAPGSIZE/PGSIZE; i++)
+    KREF((char*)pa + i*PGSIZE) = 1;
+  megapool.inuse[MEGAINDEX(pa)] = MEGAPGSIZE/PGSIZE;
+}
+
+// Print per-hart allocator counters.  For debugging.
+// No lock, like procdump().
+void
+kmemdump(void)
+{
+  for(int i = 0; i < NCPU; i++){
+    if(kmem[i].nalloc == 0 && kmem[i].nsteal == 0 && kmem[i].nfree == 0)
+      continue;
+    printf("kmem %d: free %ld alloc %ld steal %ld\n",
+           i, kmem[i].nfree, kmem[i].nalloc, kmem[i].nsteal);
+  }
+}
+
+// Describe each hart's free list in buf, of n bytes, for
+// /proc/mem. No lock, like kmemdump(). Returns the length.
+int
+kmemstat(char *buf, int n)
+{
+  int len;
+
+  len = snprintf(buf, n, "hart free alloc steal\n");
+  for(int i = 0; i < NCPU; i++){
+    if(kmem[i].nalloc == 0 && kmem[i].nsteal == 0 && kmem[i].nfree == 0)
+      continue;
+    len += snprintf(buf + len, n - len, "%d %ld %ld %ld\n",
+                    i, kmem[i].nfree, kmem[i].nalloc, kmem[i].nsteal);
+  }
+  len += snprintf(buf + len, n - len, "zeroed %d\n", zpool.n);
+  return len;
+}
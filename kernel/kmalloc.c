@@ -0,0 +1,298 @@
+// Allocator for kernel objects smaller than a page.
+//
+// kmalloc(n) rounds n up to a power of two from KMINSIZE to
+// KMAXSIZE bytes, its class, and hands out an object of that
+// size from a slab: a kalloc() page cut into objects of one
+// class, with a struct slab at the start of the page. So
+// kmfree() finds an object's slab, and its size, by rounding
+// its address down to a page. A slab whose objects are all
+// free goes back to kalloc().
+//
+// Each hart keeps a magazine of free objects of each class,
+// so that most kmalloc()s and kmfree()s touch only that hart's
+// memory, and a lock no other hart takes unless kalloc() is
+// out of pages and calls kmreclaim(). A hart whose magazine
+// runs dry or fills up moves half a magazine from or to the
+// slabs, under the class's lock.
+//
+// Anything bigger than KMAXSIZE gets a whole page, which
+// kmfree() recognizes since no slab object is page-aligned.
+//
+// Lock order: a hart's magazine lock, then a class's lock,
+// then the kmem locks.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "proc.h"
+#include "defs.h"
+
+#define KMINSHIFT 5
+#define KMINSIZE  (1 << KMINSHIFT)
+#define KMAXSIZE  1024
+#define NKCLASS   6    // KMINSIZE, 2*KMINSIZE, ..., KMAXSIZE
+#define NMAG      32   // objects in a hart's magazine
+
+struct obj {
+  struct obj *next;
+};
+
+struct slab {
+  struct slab *next;    // class's list of slabs with free objects
+  struct slab **pprev;  // the pointer to this one in that list
+  struct obj *free;     // free objects in this slab
+  int nfree;
+  int cls;
+};
+
+struct {
+  struct spinlock lock;
+  struct slab *partial;  // slabs with free objects
+  uint64 nslab;          // slabs in use
+} kclass[NKCLASS];
+
+struct mag {
+  int n;
+  void *obj[NMAG];
+};
+
+struct {
+  struct spinlock lock;
+  struct mag mag[NKCLASS];
+} kmag[NCPU];
+
+static uint
+objsize(int c)
+{
+  return KMINSIZE << c;
+}
+
+// Offset of a slab's first object: past the struct slab,
+// and aligned to the object size.
+static uint
+objstart(int c)
+{
+  uint sz = objsize(c);
+
+  return (sizeof(struct slab) + sz - 1) / sz * sz;
+}
+
+void
+kminit(void)
+{
+  for(int i = 0; i < NKCLASS; i++)
+    initlock(&kclass[i].lock, "kclass");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmag[i].lock, "kmag");
+}
+
+// Put s on class c's list of slabs with free objects.
+// Caller must hold kclass[c].lock.
+static void
+slabadd(int c, struct slab *s)
+{
+  s->next = kclass[c].partial;
+  if(s->next)
+    s->next->pprev = &s->next;
+  s->pprev = &kclass[c].partial;
+  kclass[c].partial = s;
+}
+
+static void
+slabdel(struct slab *s)
+{
+  *s->pprev = s->next;
+  if(s->next)
+    s->next->pprev = s->pprev;
+}
+
+// Cut a new page into a slab of class c.
+static struct slab*
+slabnew(int c)
+{
+  struct slab *s;
+  struct obj *o;
+  char *pg;
+  uint off;
+
+  if((pg = kalloc()) == 0)
+    return 0;
+  s = (struct slab*)pg;
+  s->free = 0;
+  s->nfree = 0;
+  s->cls = c;
+  for(off = PGSIZE - objsize(c); off >= objstart(c); off -= objsize(c)){
+    o = (struct obj*)(pg + off);
+    o->next = s->free;
+    s->free = o;
+    s->nfree++;
+  }
+  return s;
+}
+
+// Fill half of magazine m with objects of class c.
+// Caller must hold m's hart's magazine lock.
+static void
+refill(int c, struct mag *m)
+{
+  struct slab *s;
+  struct obj *o;
+
+  acquire(&kclass[c].lock);
+  while(m->n < NMAG/2){
+    if((s = kclass[c].partial) == 0){
+      // not kalloc() under the lock, which it may hold
+      // for a while if it reclaims the page cache.
+      release(&kclass[c].lock);
+      s = slabnew(c);
+      acquire(&kclass[c].lock);
+      if(s == 0)
+        break;
+      kclass[c].nslab++;
+      slabadd(c, s);
+    }
+    while(m->n < NMAG/2 && (o = s->free) != 0){
+      s->free = o->next;
+      s->nfree--;
+      m->obj[m->n++] = o;
+    }
+    if(s->free == 0)
+      slabdel(s);
+  }
+  release(&kclass[c].lock);
+}
+
+// Return magazine m's objects of class c to their slabs until
+// it holds keep of them, freeing the slabs that are then wholly
+// free. Returns the number of slabs freed.
+// Caller must hold m's hart's magazine lock.
+static int
+flush(int c, struct mag *m, int keep)
+{
+  struct slab *s;
+  struct obj *o;
+  int nobj, freed;
+
+  nobj = (PGSIZE - objstart(c)) / objsize(c);
+  freed = 0;
+  acquire(&kclass[c].lock);
+  while(m->n > keep){
+    o = m->obj[--m->n];
+    s = (struct slab*)PGROUNDDOWN((uint64)o);
+    if(s->nfree++ == 0)
+      slabadd(c, s);
+    o->next = s->free;
+    s->free = o;
+    if(s->nfree == nobj){
+      slabdel(s);
+      kclass[c].nslab--;
+      kfree((void*)s);
+      freed++;
+    }
+  }
+  release(&kclass[c].lock);
+  return freed;
+}
+
+// Allocate n bytes of kernel memory, aligned to the
+// power of two n rounds up to, or to a page if n is
+// more than KMAXSIZE.
+// Returns 0 if n is more than a page or out of memory.
+void*
+kmalloc(uint n)
+{
+  struct mag *m;
+  void *p;
+  int c, id;
+
+  if(n > KMAXSIZE)
+    return n <= PGSIZE ? kalloc() : 0;
+  for(c = 0; objsize(c) < n; c++)
+    ;
+
+  push_off();
+  id = cpuid();
+  acquire(&kmag[id].lock);
+  m = &kmag[id].mag[c];
+  if(m->n == 0)
+    refill(c, m);
+  p = m->n > 0 ? m->obj[--m->n] : 0;
+  release(&kmag[id].lock);
+  pop_off();
+
+#ifdef DEBUG_POISON
+  if(p)
+    memset(p, 5, objsize(c));
+#endif
+  return p;
+}
+
+// Free memory returned by kmalloc().
+void
+kmfree(void *p)
+{
+  struct slab *s;
+  struct mag *m;
+  int c, id;
+
+  if((uint64)p % PGSIZE == 0){
+    kfree(p);
+    return;
+  }
+  s = (struct slab*)PGROUNDDOWN((uint64)p);
+  c = s->cls;
+  if(c < 0 || c >= NKCLASS || ((uint64)p % PGSIZE) % objsize(c) != 0)
+    panic("kmfree");
+
+#ifdef DEBUG_POISON
+  memset(p, 1, objsize(c));
+#endif
+
+  push_off();
+  id = cpuid();
+  acquire(&kmag[id].lock);
+  m = &kmag[id].mag[c];
+  if(m->n == NMAG)
+    flush(c, m, NMAG/2);
+  m->obj[m->n++] = p;
+  release(&kmag[id].lock);
+  pop_off();
+}
+
+// Empty all the harts' magazines, for kalloc(), which is out
+// of pages. Does nothing if this hart is refilling a magazine,
+// which is what called kalloc(): two harts doing that could
+// each wait for the other's magazine lock.
+// Returns the number of slab pages freed.
+int
+kmreclaim(void)
+{
+  int id, c, n, busy;
+
+  push_off();
+  busy = holding(&kmag[cpuid()].lock);
+  pop_off();
+  if(busy)
+    return 0;
+
+  n = 0;
+  for(id = 0; id < NCPU; id++){
+    acquire(&kmag[id].lock);
+    for(c = 0; c < NKCLASS; c++)
+      n += flush(c, &kmag[id].mag[c], 0);
+    release(&kmag[id].lock);
+  }
+  return n;
+}
+
+// Print how many slab pages each class uses.
+// For debugging. No lock, like procdump().
+void
+kmdump(void)
+{
+  for(int c = 0; c < NKCLASS; c++)
+    if(kclass[c].nslab)
+      printf("kmalloc %d: slabs %ld\n", objsize(c), kclass[c].nslab);
+}
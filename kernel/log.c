@@ -6,50 +6,88 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "stat.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction only commits when there are no FS system
+// calls active in it. Thus there is never any reasoning required
+// about whether a commit might write an uncommitted system call's
+// updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the transaction commits.
+//
+// Group commit: while one transaction is being written to
+// disk, the next one is open and keeps accepting system calls.
+// The committer first copies its blocks into log buffers while
+// begin_op() holds off new system calls (no disk I/O needed),
+// then lets the next transaction start and writes the log
+// blocks as one batch of asynchronous disk writes.
+//
+// Commits are done by the log's kernel thread (see logd()),
+// so end_op() returns without waiting for the disk. A system
+// call whose updates must be on disk when it returns, like
+// fsync(), calls logsync().
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// The log area is split into two halves, used by alternate
+// transactions. The on-disk format of each half:
+//   header block, containing a sequence number and
+//     block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// A transaction's header is written in its half only after all
+// of its log blocks are on disk; that is the commit point.
+// Transactions commit one at a time, and each one's blocks are
+// installed in their home locations before the next one commits,
+// so recovery only needs to replay the half with the newest
+// sequence number. Installing writes the cached copy of each
+// block, which may include changes from the open transaction;
+// until that transaction commits, replaying the newer header
+// undoes them.
+
+// mkfs records the size of the log area in the superblock,
+// and initlog() sizes transactions to fit it.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  uint seq;
+  int block[LOGMAX];
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks in each half, including its header
+  int cap;         // max data blocks per transaction
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks the outstanding ones may write.
+  int committing;  // a transaction is being written to disk.
+  int freezing;    // committer is copying blocks, please wait.
+  uint done;       // sequence number of the last transaction committed
   int dev;
-  struct logheader lh;
+  struct logheader lh; // the open transaction
+  struct logstat stat;
 };
 struct log log;
 
+// the transaction being committed, and its log buffers.
+// only the one committer touches these.
+static struct logheader clh;
+static struct buf *lbuf[LOGMAX];
+
 static void recover_from_log(void);
 static void commit();
+static void logd(void*);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -59,55 +97,102 @@ initlog(int dev, struct superblock *sb)
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
+  log.size = sb->nlog / 2;
   log.dev = dev;
+
+  // an open and a committing transaction can each pin cap
+  // blocks in the buffer cache, plus cap log buffers.
+  log.cap = log.size - 1;
+  if(log.cap > LOGMAX)
+    log.cap = LOGMAX;
+  if(log.cap > NBUF/4)
+    log.cap = NBUF/4;
+  if(log.cap < MAXOPBLOCKS)
+    panic("initlog: log too small");
+  log.stat.size = log.cap;
+
   recover_from_log();
+  log.done = log.lh.seq - 1;
+  if(kthread_create(logd, 0, "commit") < 0)
+    panic("initlog: commit thread");
 }
 
-// Copy committed blocks from log to their home location
+// Block number of the header of the log half
+// used by the transaction with sequence number seq.
+static int
+loghead(uint seq)
+{
+  return log.start + (seq % 2) * log.size;
+}
+
+// Copy committed blocks from log to their home location.
+// Writes all of them before waiting for any, with the block
+// queue plugged so that neighbouring blocks merge. Recovery
+// reads the log blocks MAXMERGE at a time.
 static void
-install_trans(int recovering)
+install_trans(struct logheader *lh, int recovering)
 {
-  int tail;
+  int tail, i, n;
+  struct buf *dbuf, *b[MAXMERGE];
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  blkplug();
+  for (tail = 0; tail < lh->n; tail += n) {
+    n = lh->n - tail;
+    if(n > MAXMERGE)
+      n = MAXMERGE;
+    if(recovering)
+      breadn(log.dev, loghead(lh->seq)+tail+1, n, b); // read log blocks
+    for (i = 0; i < n; i++) {
+      dbuf = bread(log.dev, lh->block[tail+i]); // read dst
+      if(recovering){
+        memmove(dbuf->data, b[i]->data, BSIZE);  // copy block to dst
+        brelse(b[i]);
+        bpin(dbuf);
+      }
+      // otherwise the cache already holds the block,
+      // pinned by log_write().
+      bawrite(dbuf);  // write dst to disk
+      lbuf[tail+i] = dbuf;
+      // the open transaction may bread() dbuf before the
+      // write is done; bget() makes it wait for the disk.
+      brelse(dbuf);
+    }
+  }
+  blkunplug();
+  for (tail = 0; tail < lh->n; tail++) {
+    bwait(lbuf[tail]);
+    bunpin(lbuf[tail]);
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the header of log half i from disk into lh.
 static void
-read_head(void)
+read_head(int i, struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  struct buf *buf = bread(log.dev, log.start + i*log.size);
+  struct logheader *hb = (struct logheader *) (buf->data);
+  int j;
+  lh->n = hb->n;
+  lh->seq = hb->seq;
+  for (j = 0; j < lh->n; j++) {
+    lh->block[j] = hb->block[j];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
+// Write the header of transaction lh to disk.
 // This is the true point at which the
-// current transaction commits.
+// transaction commits.
 static void
-write_head(void)
+write_head(struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
+  struct buf *buf = bread(log.dev, loghead(lh->seq));
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = lh->n;
+  hb->seq = lh->seq;
+  for (i = 0; i < lh->n; i++) {
+    hb->block[i] = lh->block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -116,25 +201,53 @@ write_head(void)
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
+  struct logheader h1;
+
+  bprefetch(log.dev, log.start + log.size);  // read both headers at once
+  read_head(0, &log.lh);
+  read_head(1, &h1);
+  if(h1.seq > log.lh.seq)
+    log.lh = h1;
+  install_trans(&log.lh, 1); // if committed, copy from log to disk
+
+  // new transactions go in the other half, and get
+  // higher sequence numbers, so the header just
+  // replayed stays valid until one of them commits.
   log.lh.n = 0;
-  write_head(); // clear the log
+  log.lh.seq++;
 }
 
 // called at the start of each FS system call.
 void
 begin_op(void)
 {
+  begin_opn(MAXOPBLOCKS);
+}
+
+// The most blocks one operation may write.
+int
+logcap(void)
+{
+  return log.cap;
+}
+
+// begin_op() for an operation that may write up to n blocks,
+// which must end with end_opn(n).
+void
+begin_opn(int n)
+{
+  if(n > log.cap)
+    panic("begin_opn: too big");
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.freezing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + n > log.cap){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
@@ -142,19 +255,28 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  end_opn(MAXOPBLOCKS);
+}
 
+// hands the transaction to the commit thread if this was
+// the last outstanding operation and no other commit is
+// under way. if one is, the commit thread will notice this
+// transaction when it's done.
+void
+end_opn(int n)
+{
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
+  log.reserved -= n;
+  if(log.freezing)
+    panic("log.freezing");
+  if(log.outstanding == 0 && !log.committing){
     log.committing = 1;
+    log.freezing = 1;
+    wakeup(&log.committing);
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -162,43 +284,129 @@ end_op(void)
     wakeup(&log);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
+// Wait until every operation that has already ended
+// is committed to disk.
+void
+logsync(void)
+{
+  uint seq;
+
+  acquire(&log.lock);
+  // the open transaction, if it has any blocks,
+  // or else the one before it.
+  seq = log.lh.n > 0 ? log.lh.seq : log.lh.seq - 1;
+  while(log.done < seq)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+}
+
+// The commit thread, which runs commit() whenever
+// end_op() sets log.committing.
+static void
+logd(void *arg)
+{
+  acquire(&log.lock);
+  for(;;){
+    while(!log.committing)
+      sleep(&log.committing, &log.lock);
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
+    release(&log.lock);
     commit();
     acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks from cache to log, and
+// start writing the log blocks to disk. They're
+// contiguous, so they go to the disk as a few
+// large requests.
 static void
 write_log(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
+  blkplug();
+  for (tail = 0; tail < clh.n; tail++) {
+    struct buf *to = bread(log.dev, loghead(clh.seq)+tail+1); // log block
+    struct buf *from = bread(log.dev, clh.block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
     brelse(from);
-    brelse(to);
+    bpin(to);
+    bawrite(to);  // write the log
+    lbuf[tail] = to;
+    brelse(to);  // pinned, and bget() waits for the write
+  }
+  blkunplug();
+}
+
+// Wait for write_log()'s disk writes.
+static void
+wait_log(void)
+{
+  int tail;
+
+  for (tail = 0; tail < clh.n; tail++) {
+    bwait(lbuf[tail]);
+    bunpin(lbuf[tail]);
   }
 }
 
+// Called with log.committing and log.freezing set,
+// and no outstanding operations.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  uint64 t0, t;
+
+  for(;;){
+    t0 = r_time();
+    // No FS system calls are running, so the cached blocks
+    // hold exactly this transaction's updates. Copy them
+    // into the log buffers, then open the next transaction.
+    acquire(&log.lock);
+    clh = log.lh;
+    if(clh.n > 0){
+      log.lh.n = 0;
+      log.lh.seq++;
+    }
+    release(&log.lock);
+    if(clh.n > 0)
+      write_log();
+    acquire(&log.lock);
+    log.freezing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    if (clh.n > 0) {
+      wait_log();          // Log blocks are on disk
+      write_head(&clh);    // Write header to disk -- the real commit
+      install_trans(&clh, 0); // Now install writes to home locations
+    }
+
+    // Commit the next transaction too if it
+    // finished while we were busy.
+    acquire(&log.lock);
+    if(clh.n > 0){
+      log.done = clh.seq;
+      t = r_time() - t0;
+      log.stat.ncommit++;
+      log.stat.nwrite += clh.n;
+      log.stat.cycles += t;
+      if(t > log.stat.maxcycles)
+        log.stat.maxcycles = t;
+    }
+    if(log.outstanding == 0 && log.lh.n > 0){
+      log.freezing = 1;
+      release(&log.lock);
+      continue;
+    }
+    log.committing = 0;
+    wakeup(&log);
+    release(&log.lock);
+    break;
   }
 }
 
@@ -216,8 +424,12 @@ log_write(struct buf *b)
 {
   int i;
 
+  // bget() waited for any write of b by the committing
+  // transaction, so no one changed b under the disk.
+  if (b->disk)
+    panic("log_write: buf on disk");
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -230,7 +442,17 @@ log_write(struct buf *b)
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
     log.lh.n++;
+  } else {
+    log.stat.nabsorb++;
   }
   release(&log.lock);
 }
 
+// Copy out the log statistics.
+void
+logstat(struct logstat *st)
+{
+  acquire(&log.lock);
+  *st = log.stat;
+  release(&log.lock);
+}
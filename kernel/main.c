@@ -4,6 +4,8 @@
 #include "riscv.h"
 #include "defs.h"
 
+// hart 0 sets started to 1 once the other harts can free
+// memory in kinithart(), and to 2 once the kernel is ready.
 volatile static int started = 0;
 
 // start() jumps here in supervisor mode on all CPUs.
@@ -17,24 +19,43 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    __sync_synchronize();
+    started = 1;     // let the other harts help
+    kinithart();     // free this hart's share of memory
+    kinitwait();     // and wait for the others'
+    kminit();        // small-object allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
     trapinit();      // trap vectors
+    wheelinit();     // timer wheel
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    blkinit();       // block I/O queue
     iinit();         // inode table
+    dcinit();        // directory name cache
+    pcinit();        // file page cache
     fileinit();      // file table
+    procfsinit();    // /proc files
+    futexinit();     // futex locks
+    profinit();      // sampling profiler
+    syscallinit();   // system call trace rings
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    kthreadinit();   // kernel threads
     __sync_synchronize();
-    started = 1;
+    started = 2;
+    klogstart();     // printf() to the log from now on
   } else {
     while(started == 0)
       ;
     __sync_synchronize();
+    kinithart();      // free a share of memory
+    while(started < 2)
+      ;
+    __sync_synchronize();
     printf("hart %d starting\n", cpuid());
     kvminithart();    // turn on paging
     trapinithart();   // install kernel trap vector
@@ -54,6 +54,17 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   TIMEPAGE (struct vtime, read-only, for reading the clock)
+//   other threads' trapframes, for clone()
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// threads that share a page table each have a trapframe of
+// their own, in one of NTHREAD slots, slot 0 at TRAPFRAME.
+#define TFRAME(i) (TRAPFRAME - (i)*PGSIZE)
+
+// the kernel's struct vtime, which user code can read, below
+// the lowest trapframe slot.
+#define TIMEPAGE TFRAME(NTHREAD)
+#define MMAPTOP TIMEPAGE  // memory-mapped files go below
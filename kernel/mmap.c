@@ -0,0 +1,473 @@
+// Memory-mapped files.
+//
+// mmap() records a mapping in a struct vma in the process,
+// and vmafault() fills its pages in as they are touched,
+// from the page cache (see pcache.c). Pages of a read-only
+// mapping are the cached pages themselves; so are those of
+// a private writable one, copy-on-write, and a shared
+// writable one, mapped writable only once they are stored
+// to. The first store marks the page dirty, both in the
+// page cache, for iflush() to write back, and in the page
+// table (PTE_D), for munmap() to mark it again in case it is
+// flushed while still mapped.
+//
+// Mappings are placed from just below the trapframes down;
+// the heap may grow up to the lowest of them. exec() maps the
+// whole pages of a program's segments the same way, privately,
+// below the heap, so that they are read in only when touched
+// and shared through the page cache; fork() copies those pages
+// along with the rest of the program.
+//
+// Threads share their mappings, in p->mm, and mm->lock
+// protects the vmas. It isn't held while vmafault() reads
+// a page in, or while munmap() writes one back; mm->nfault
+// counts the faults in progress, so that munmap() can wait
+// for them before it closes the files.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "stat.h"
+#include "fcntl.h"
+
+// The mapping va is in, or 0.
+// Caller must hold mm->lock.
+struct vma*
+vmafind(struct mm *mm, uint64 va)
+{
+  struct vma *v;
+
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++)
+    if(v->len && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// Return one of mm's mappings that overlaps
+// [addr, addr+len), or 0 if none does.
+static struct vma*
+vmaoverlap(struct mm *mm, uint64 addr, uint64 len)
+{
+  struct vma *v;
+
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++)
+    if(v->len && addr < v->addr + v->len && v->addr < addr + len)
+      return v;
+  return 0;
+}
+
+// The lowest address used by mm's mappings,
+// which the heap must stay below.
+// Caller must hold mm->lock.
+uint64
+vmalow(struct mm *mm)
+{
+  struct vma *v;
+  uint64 low;
+
+  low = MMAPTOP;
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++)
+    if(v->len && v->addr + v->len > mm->sz && v->addr < low)
+      low = v->addr;
+  return low;
+}
+
+// Map len bytes of file f, starting at offset off, which
+// must be page-aligned, at addr if that is a free spot and
+// otherwise at the highest free spot.
+// Returns the address of the mapping, or -1.
+uint64
+mmap(uint64 addr, uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct mm *mm = myproc()->mm;
+  struct vma *v, *fv;
+  short type;
+
+  if(len == 0 || len > MMAPTOP || off % PGSIZE != 0 || off + len > (1L << 32))
+    return -1;
+  if((prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)) != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+  ilock(f->ip);
+  type = f->ip->type;
+  iunlock(f->ip);
+  if(type != T_FILE)
+    return -1;
+
+  acquire(&mm->lock);
+  fv = 0;
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++)
+    if(v->len == 0){
+      fv = v;
+      break;
+    }
+  if(fv == 0)
+    goto bad;
+
+  len = PGROUNDUP(len);
+  if(addr % PGSIZE != 0 || addr < PGROUNDUP(mm->sz) || addr + len < addr ||
+     addr + len > MMAPTOP || vmaoverlap(mm, addr, len)){
+    // find the highest gap that fits.
+    addr = MMAPTOP - len;
+    while((v = vmaoverlap(mm, addr, len)) != 0){
+      if(v->addr < len)
+        goto bad;
+      addr = v->addr - len;
+    }
+    if(addr < PGROUNDUP(mm->sz))
+      goto bad;
+  }
+
+  fv->addr = addr;
+  fv->len = len;
+  fv->prot = prot;
+  fv->flags = flags;
+  fv->off = off;
+  fv->f = filedup(f);
+  release(&mm->lock);
+  return addr;
+
+ bad:
+  release(&mm->lock);
+  return -1;
+}
+
+// Map len bytes of f at offset off, both page-aligned, at
+// va in mm, a new address space that exec() is building.
+// Returns 0, or -1 if mm has no free vma.
+int
+vmaexec(struct mm *mm, uint64 va, uint64 len, int prot, struct file *f, uint off)
+{
+  struct vma *v;
+
+  acquire(&mm->lock);
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->len == 0){
+      v->addr = va;
+      v->len = len;
+      v->prot = prot;
+      v->flags = MAP_PRIVATE;
+      v->off = off;
+      v->f = filedup(f);
+      release(&mm->lock);
+      return 0;
+    }
+  }
+  release(&mm->lock);
+  return -1;
+}
+
+// Drop the mappings of mm, a new address space that exec()
+// is giving up on. Its pages are freed with its page table.
+// A fileclose() here may iput(), so the caller must not be
+// in a transaction unless it holds another reference.
+void
+vmadrop(struct mm *mm)
+{
+  struct vma *v;
+
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->len){
+      fileclose(v->f);
+      v->len = 0;
+    }
+  }
+}
+
+// Handle a fault at va in one of the current process's
+// mappings, for access PROT_READ, PROT_WRITE or PROT_EXEC.
+// Returns 0 if the page is now mapped, -1 if the access
+// isn't allowed or memory ran out.
+int
+vmafault(uint64 va, int access)
+{
+  struct proc *p = myproc();
+  struct mm *mm = p->mm;
+  struct vma *v, vv;
+  struct inode *ip;
+  pte_t *pte;
+  char *pa;
+  uint off;
+  int perm, locked, r;
+
+  va = PGROUNDDOWN(va);
+  acquire(&mm->lock);
+  if((v = vmafind(mm, va)) == 0 || (v->prot & access) == 0){
+    release(&mm->lock);
+    return -1;
+  }
+
+  if((pte = walk(p->pagetable, va, 0)) != 0 && (*pte & PTE_V) != 0){
+    if(access != PROT_WRITE || v->flags != MAP_SHARED || (*pte & PTE_W) != 0){
+      release(&mm->lock);
+      return -1;
+    }
+    // the first store to a page of a shared mapping: map
+    // it again, once pcshare() has marked it dirty.
+    uvmunmap(p->pagetable, va, 1, 1);
+    tlbstale(p->pagetable);
+  }
+  vv = *v;
+  mm->nfault++;
+  release(&mm->lock);
+
+  // a copyin() or copyout() on behalf of a system call
+  // may already hold the file's lock. if it holds it shared,
+  // ilockshared() takes it again without waiting.
+  ip = vv.f->ip;
+  if((locked = holdingsleep(&ip->lock)) == 0)
+    ilockshared(ip);
+  off = vv.off + (va - vv.addr);
+  if(vv.flags == MAP_SHARED && (vv.prot & PROT_WRITE))
+    pa = pcshare(ip, off / PGSIZE, access == PROT_WRITE && off < ip->size);
+  else
+    pa = pcget(ip, off / PGSIZE);
+  if(!locked)
+    iunlockshared(ip);
+
+  acquire(&mm->lock);
+  if(--mm->nfault == 0)
+    wakeup(&mm->nfault);
+  if(pa == 0){
+    release(&mm->lock);
+    return -1;
+  }
+  // another thread may have unmapped va, or faulted it in.
+  v = vmafind(mm, va);
+  if(v == 0 || v->f != vv.f || v->off + (va - v->addr) != off ||
+     v->prot != vv.prot || v->flags != vv.flags){
+    release(&mm->lock);
+    kfree(pa);
+    return -1;
+  }
+  if((pte = walk(p->pagetable, va, 0)) != 0 && (*pte & PTE_V) != 0){
+    release(&mm->lock);
+    kfree(pa);
+    return 0;
+  }
+
+  perm = PTE_R | PTE_U | PTE_A;
+  if(vv.prot & PROT_EXEC)
+    perm |= PTE_X;
+  if(vv.prot & PROT_WRITE){
+    if(vv.flags == MAP_PRIVATE)
+      perm |= PTE_COW;
+    else if(access == PROT_WRITE)
+      perm |= PTE_W | PTE_D;
+  }
+  r = 0;
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)pa, perm) != 0){
+    kfree(pa);
+    r = -1;
+  } else {
+    tlbstale(p->pagetable);
+    if(access == PROT_WRITE && (perm & PTE_COW))
+      r = uvmcow(p->pagetable, va);
+  }
+  release(&mm->lock);
+  return r;
+}
+
+// Unmap the pages of v, a piece of a mapping that munmap()
+// has already removed, leaving the dirty pages of a shared
+// mapping dirty in the page cache, or writing them back to
+// the file if they aren't cached. A writable page is always
+// dirty, so no thread can dirty a clean one in the meantime.
+static void
+vmaunmap(struct proc *p, struct vma *v)
+{
+  struct mm *mm = p->mm;
+  struct inode *ip = v->f->ip;
+  pte_t *pte;
+  uint64 va, pa;
+  uint off, n;
+  char *cpa;
+  int dirty;
+
+  for(va = v->addr; va < v->addr + v->len; va += PGSIZE){
+    acquire(&mm->lock);
+    if((pte = walk(mm->pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0){
+      release(&mm->lock);
+      continue;
+    }
+    pa = PTE2PA(*pte);
+    dirty = (*pte & PTE_D) != 0;
+    uvmunmap(mm->pagetable, va, 1, 0);
+    release(&mm->lock);
+    if(v->flags == MAP_SHARED && dirty){
+      off = v->off + (va - v->addr);
+      begin_op();
+      ilock(ip);
+      if(off < ip->size){
+        // iflush() may have cleaned the page since the
+        // first store, so mark it dirty again.
+        if((cpa = pcwrite(ip, off / PGSIZE, 1)) != (char*)pa){
+          n = ip->size - off < PGSIZE ? ip->size - off : PGSIZE;
+          writei(ip, 0, pa, off, n);
+        }
+        if(cpa)
+          kfree(cpa);
+      }
+      iunlock(ip);
+      end_op();
+    }
+    kfree((void*)pa);
+  }
+}
+
+// Remove the current process's mappings of the addresses
+// from addr to end, all of them, or none if a mapping needs
+// splitting and there is no free vma.
+static int
+vmaremove(uint64 addr, uint64 end)
+{
+  struct proc *p = myproc();
+  struct mm *mm = p->mm;
+  struct vma *v, *fv, gone[NVMA];
+  uint64 a, e;
+  int i, n;
+
+  acquire(&mm->lock);
+
+  // a hole in the middle of a mapping splits it in two.
+  fv = 0;
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++)
+    if(v->len == 0)
+      fv = v;
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->len && addr > v->addr && end < v->addr + v->len && fv == 0){
+      release(&mm->lock);
+      return -1;
+    }
+  }
+
+  // take the pieces out of the vmas, so that no fault fills
+  // them in again, and unmap them once mm->lock is released.
+  // each piece holds a reference to its file, so that the
+  // fileclose()s here don't sleep.
+  n = 0;
+  for(v = mm->vma; v < &mm->vma[NVMA]; v++){
+    if(v->len == 0)
+      continue;
+    a = addr > v->addr ? addr : v->addr;
+    e = end < v->addr + v->len ? end : v->addr + v->len;
+    if(a >= e)
+      continue;
+    gone[n] = *v;
+    gone[n].addr = a;
+    gone[n].len = e - a;
+    gone[n].off = v->off + (a - v->addr);
+    filedup(v->f);
+    n++;
+    if(a == v->addr && e == v->addr + v->len){
+      fileclose(v->f);
+      v->len = 0;
+    } else if(a == v->addr){
+      v->off += e - v->addr;
+      v->len -= e - v->addr;
+      v->addr = e;
+    } else if(e == v->addr + v->len){
+      v->len = a - v->addr;
+    } else {
+      *fv = *v;
+      fv->addr = e;
+      fv->off = v->off + (e - v->addr);
+      fv->len = v->addr + v->len - e;
+      filedup(fv->f);
+      v->len = a - v->addr;
+    }
+  }
+  release(&mm->lock);
+
+  for(i = 0; i < n; i++)
+    vmaunmap(p, &gone[i]);
+
+  // a fault that found one of the pieces may still be
+  // reading its file.
+  acquire(&mm->lock);
+  while(mm->nfault > 0)
+    sleep(&mm->nfault, &mm->lock);
+  release(&mm->lock);
+  for(i = 0; i < n; i++)
+    fileclose(gone[i].f);
+  return 0;
+}
+
+// Remove the current process's mappings of the
+// addresses from addr to addr+len.
+// Returns 0, or -1 if the arguments are bad or
+// a mapping needs splitting and there is no free vma.
+int
+munmap(uint64 addr, uint64 len)
+{
+  if(addr % PGSIZE != 0 || len == 0 || addr + len < addr || addr + len > MMAPTOP)
+    return -1;
+  return vmaremove(addr, PGROUNDUP(addr + len));
+}
+
+// Remove all of the current process's mappings,
+// for exit() and exec().
+void
+munmapall(void)
+{
+  vmaremove(0, MMAPTOP);
+}
+
+// Give child np p's mappings, for fork(). Shared mappings
+// share their pages; private ones share them copy-on-write.
+// Returns 0, or -1 with the child's mappings undone.
+// Caller must hold p->mm->lock.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->mm->vma[i];
+    if(v->len == 0)
+      continue;
+    // uvmcopy() has copied exec()'s, below sz.
+    if(v->addr >= p->mm->sz &&
+       uvmcopyrange(p->pagetable, np->pagetable, v->addr, v->addr + v->len,
+                    v->flags == MAP_SHARED) < 0)
+      goto bad;
+    np->mm->vma[i] = *v;
+    filedup(v->f);
+  }
+  return 0;
+
+ bad:
+  vmauncopy(np, p->mm->sz);
+  return -1;
+}
+
+// Undo vmacopy() into np, whose memory below sz uvmcopy()
+// copied, for a fork() that failed. The parent's mappings
+// still hold the files, so these fileclose()s won't sleep.
+void
+vmauncopy(struct proc *np, uint64 sz)
+{
+  struct vma *v;
+
+  for(v = np->mm->vma; v < &np->mm->vma[NVMA]; v++){
+    if(v->len == 0)
+      continue;
+    if(v->addr >= sz)
+      uvmunmap(np->pagetable, v->addr, v->len / PGSIZE, 1);
+    fileclose(v->f);
+    v->len = 0;
+  }
+}
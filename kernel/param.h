@@ -1,14 +1,37 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC      1024  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NPRIO         3  // scheduling priority levels, 0 is highest
+#define TIMEHZ  10000000  // rate of the time CSR, in cycles per second
+#define TICKCYCLES 1000000  // timer cycles per clock tick, about 0.1s
+#define QUANTUM       1  // clock ticks a process runs before it must yield
+#define BOOSTTICKS   10  // clock ticks between raising queued processes to p->nice
+#define IDLETICKS    10  // clock ticks between timer interrupts on an idle CPU
+#define NOFILE       16  // open files per process before its fd table grows
+#define MAXOFILE    512  // open files per process, a page of pointers
+#define NPOLL        16  // max fds one poll() watches
+#define NIOV         16  // max buffers one readv() or writev() moves
+#define NVMA         16  // memory-mapped files per process
+#define NTHREAD      16  // threads sharing one address space
+#define NINODE      500  // i-nodes cached, more only when all are in use
 #define NDEV         10  // maximum major device number
+#define NLOCKCLASS   64  // lock names lockstat() keeps statistics for
+#define NPROFSAMPLE 1024  // profiling samples each CPU holds until read
+#define PROFCYCLES (TIMEHZ/1000)  // timer cycles between profiling samples
+#define NSYSCALL     64  // system call numbers are less than this
+#define NTRACE      128  // traced system calls each CPU holds until read
+#define KLOGSIZE   4096  // bytes of each CPU's kernel log ring
+#define KLOGMSG     256  // max bytes of one printf() in the log
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define NSPAWNACT    32  // max file actions for one spawn()
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGSIZE      (MAXOPBLOCKS*3)  // default data blocks per log transaction
+#define NBUF         256  // size of disk block cache
+#define MAXMERGE      16  // max # of blocks in one disk request
+#define NDCACHE      512  // size of directory name cache
+#define PCFRAC         4  // page cache entries: one per PCFRAC free pages
+#define WBTICKS       30  // clock ticks between write-backs of dirty file pages
+#define NMEGAPG        8  // megapages set aside for huge user heaps
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
@@ -0,0 +1,454 @@
+// Page cache.
+//
+// The page cache holds whole pages of file content, indexed
+// by (dev, inum, page number). readi() and writei() go
+// through it for regular files, so file data is read from
+// disk once and copied once, and the buffer cache is left to
+// hold mostly metadata. exec() maps a program's pages
+// straight from the cache.
+//
+// A cached page is an ordinary kalloc() page with a reference
+// of its own (see kref in kalloc.c). pcget() hands the caller
+// another reference, which exec() keeps in the new page table:
+// text is mapped read-only and shared, data copy-on-write.
+//
+// writei() updates the cached pages of the range it writes,
+// and itrunc() drops them, so a cached page always matches
+// the file. Processes that already map a dropped page keep
+// its old content, and pcprivate() swaps a copy into the
+// cache before a mapped page is written, so a process's
+// text never changes under it. The pages of a shared
+// writable mapping (see pcshare()) are written in place.
+//
+// dwritei() writes file data into the cache alone, marking
+// the pages dirty, and iflush() writes them back later. A
+// dirty page is never evicted or reclaimed. Each one holds
+// a reservation of DIRTYBLOCKS free disk blocks (see
+// breserve()), and no more than half the entries may be
+// dirty, after which dwritei() asks for an iflush().
+//
+// pcinit() sets aside an entry for every PCFRAC pages of free
+// memory. The cache grows until it fills its entries, and
+// kalloc() calls pcreclaim() to take pages back from it when
+// memory runs out.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "stat.h"
+#include "fs.h"
+#include "file.h"
+
+#define NPHASH   1021
+#define NRECLAIM 16    // pages pcreclaim() tries to free
+#define DIRTYBLOCKS (PGSIZE/BSIZE + 1)  // disk blocks reserved per dirty page
+
+struct cpage {
+  uint dev;
+  uint inum;            // 0 if the entry is unused
+  uint pgno;            // page of the file, in PGSIZE units
+  char *pa;
+  int dirty;            // written by dwritei(), not yet by iflush()
+  int shared;           // in a shared writable mapping
+  struct cpage *next;   // hash chain
+  struct cpage *prev;   // LRU list
+  struct cpage *lnext;
+};
+
+struct {
+  struct spinlock lock;
+  int n;                // entries
+  int ndirty;           // dirty entries
+  struct cpage *hash[NPHASH];
+
+  // Least recently used list of all entries.
+  // head.lnext is most recent, head.prev is least.
+  struct cpage head;
+} pcache;
+
+static uint
+phash(uint dev, uint inum, uint pgno)
+{
+  return ((dev * 31 + inum) * 31 + pgno) % NPHASH;
+}
+
+// Move c to the front of the LRU list.
+// Caller must hold pcache.lock.
+static void
+ptouch(struct cpage *c)
+{
+  c->lnext->prev = c->prev;
+  c->prev->lnext = c->lnext;
+  c->lnext = pcache.head.lnext;
+  c->prev = &pcache.head;
+  pcache.head.lnext->prev = c;
+  pcache.head.lnext = c;
+}
+
+// Take c off its hash chain, free its page, mark it
+// unused, and move it to the back of the LRU list,
+// to be reused first.
+// Caller must hold pcache.lock.
+static void
+punhash(struct cpage *c)
+{
+  struct cpage **pp;
+
+  pp = &pcache.hash[phash(c->dev, c->inum, c->pgno)];
+  for(; *pp != c; pp = &(*pp)->next)
+    ;
+  *pp = c->next;
+  c->inum = 0;
+  kfree(c->pa);
+  c->pa = 0;
+
+  c->lnext->prev = c->prev;
+  c->prev->lnext = c->lnext;
+  c->prev = pcache.head.prev;
+  c->lnext = &pcache.head;
+  pcache.head.prev->lnext = c;
+  pcache.head.prev = c;
+}
+
+static struct cpage*
+pfind(uint dev, uint inum, uint pgno)
+{
+  struct cpage *c;
+
+  for(c = pcache.hash[phash(dev, inum, pgno)]; c; c = c->next)
+    if(c->dev == dev && c->inum == inum && c->pgno == pgno)
+      return c;
+  return 0;
+}
+
+// Must run after kinit(), since it sizes the cache
+// from the amount of free memory.
+void
+pcinit(void)
+{
+  struct cpage *c, *e;
+  uint64 n;
+
+  initlock(&pcache.lock, "pcache");
+  pcache.head.prev = &pcache.head;
+  pcache.head.lnext = &pcache.head;
+  n = kfreepages() / PCFRAC;
+  while(n > 0){
+    if((c = kzalloc()) == 0)
+      panic("pcinit");
+    for(e = c + PGSIZE/sizeof(*c); c < e && n > 0; c++, n--){
+      pcache.n++;
+      c->lnext = pcache.head.lnext;
+      c->prev = &pcache.head;
+      pcache.head.lnext->prev = c;
+      pcache.head.lnext = c;
+    }
+  }
+}
+
+// If page pgno of ip is cached, return it with a reference
+// for the caller, who must kfree() it; otherwise return 0.
+char*
+pcpeek(struct inode *ip, uint pgno)
+{
+  struct cpage *c;
+  char *pa;
+
+  pa = 0;
+  acquire(&pcache.lock);
+  if((c = pfind(ip->dev, ip->inum, pgno)) != 0){
+    pa = c->pa;
+    kdup(pa);
+    ptouch(c);
+  }
+  release(&pcache.lock);
+  return pa;
+}
+
+// pcget(), reading the page from disk only if read is set,
+// and otherwise starting it out as zeroes.
+static char*
+pcload(struct inode *ip, uint pgno, int read)
+{
+  struct cpage *c;
+  char *pa;
+  uint off;
+  int n;
+
+  if(ip->type != T_FILE)
+    return 0;
+  if((pa = pcpeek(ip, pgno)) != 0)
+    return pa;
+
+  // readers holding ip->lock shared may read the same page
+  // at once; the first to finish caches it.
+  if((pa = kalloc()) == 0)
+    return 0;
+  off = pgno * PGSIZE;
+  n = 0;
+  if(read && off < ip->size)
+    n = ip->size - off < PGSIZE ? ip->size - off : PGSIZE;
+  if(n > 0 && breadi(ip, 0, (uint64)pa, off, n) != n){
+    kfree(pa);
+    return 0;
+  }
+  memset(pa + n, 0, PGSIZE - n);
+
+  acquire(&pcache.lock);
+  if((c = pfind(ip->dev, ip->inum, pgno)) != 0){
+    kfree(pa);
+    pa = c->pa;
+    kdup(pa);
+    ptouch(c);
+    release(&pcache.lock);
+    return pa;
+  }
+  for(c = pcache.head.prev; c != &pcache.head && c->dirty; c = c->prev)
+    ;
+  if(c == &pcache.head){
+    // no clean entries: pass the page on uncached.
+    release(&pcache.lock);
+    return pa;
+  }
+  if(c->inum)
+    punhash(c);
+  c->dev = ip->dev;
+  c->inum = ip->inum;
+  c->pgno = pgno;
+  c->pa = pa;
+  c->shared = 0;
+  c->next = pcache.hash[phash(c->dev, c->inum, pgno)];
+  pcache.hash[phash(c->dev, c->inum, pgno)] = c;
+  kdup(pa);
+  ptouch(c);
+  release(&pcache.lock);
+  return pa;
+}
+
+// Return page pgno of ip's content, zero past the end of
+// the file, reading it into the cache if it isn't there.
+// The caller gets a reference to the page and must kfree()
+// it when done. Returns 0 if out of memory, the read fails,
+// or ip isn't a regular file, whose pages alone are cached.
+// Caller must hold ip->lock.
+char*
+pcget(struct inode *ip, uint pgno)
+{
+  return pcload(ip, pgno, 1);
+}
+
+// Return page pgno of ip, as pcget() does, for dwritei()
+// to write into, and mark it dirty. If read is clear, the
+// caller is about to write all of the page that is in the
+// file, so it needn't be read from disk.
+// Returns 0 if there's no room for another dirty page.
+// Caller must hold ip->lock.
+char*
+pcwrite(struct inode *ip, uint pgno, int read)
+{
+  struct cpage *c;
+  char *pa;
+
+  if((pa = pcdirty(ip, pgno)) != 0)
+    return pcprivate(ip, pgno, pa);
+  if(pcache.ndirty >= pcache.n / 2)
+    return 0;  // racy, but only costs a page too many
+  if(breserve(DIRTYBLOCKS) < 0)
+    return 0;
+  if((pa = pcload(ip, pgno, read)) == 0){
+    bunreserve(DIRTYBLOCKS);
+    return 0;
+  }
+  acquire(&pcache.lock);
+  if((c = pfind(ip->dev, ip->inum, pgno)) == 0 || c->pa != pa){
+    // uncached, or already evicted again: write through instead.
+    release(&pcache.lock);
+    kfree(pa);
+    bunreserve(DIRTYBLOCKS);
+    return 0;
+  }
+  if(c->dirty){
+    // vmafault() holds ip->lock shared, so another
+    // fault may have got here first.
+    release(&pcache.lock);
+    bunreserve(DIRTYBLOCKS);
+    return pcprivate(ip, pgno, pa);
+  }
+  c->dirty = 1;
+  pcache.ndirty++;
+  ip->ndirty++;
+  release(&pcache.lock);
+  return pcprivate(ip, pgno, pa);
+}
+
+// Return page pgno of ip, as pcget() does, for vmafault()
+// to map into a shared writable mapping, whose stores go
+// straight to the cached page. If dirty is set, mark the
+// page dirty too, as pcwrite() does, if there's room.
+// Caller must hold ip->lock.
+char*
+pcshare(struct inode *ip, uint pgno, int dirty)
+{
+  struct cpage *c;
+  char *pa;
+
+  pa = 0;
+  if(dirty)
+    pa = pcwrite(ip, pgno, 1);
+  if(pa == 0 && (pa = pcget(ip, pgno)) == 0)
+    return 0;
+  acquire(&pcache.lock);
+  if((c = pfind(ip->dev, ip->inum, pgno)) != 0 && c->pa == pa)
+    c->shared = 1;
+  release(&pcache.lock);
+  return pa;
+}
+
+// pa is cached page pgno of ip, which the caller got from
+// pcpeek() or pcwrite() and is about to write. If some
+// process maps pa too, other than through pcshare(),
+// replace it in the cache with a copy and return the copy,
+// to which the caller's reference passes. Returns 0, having
+// dropped the page, if it can't be copied; a dirty page is
+// written in place instead.
+// Caller must hold ip->lock.
+char*
+pcprivate(struct inode *ip, uint pgno, char *pa)
+{
+  struct cpage *c;
+  char *npa;
+  int shared;
+
+  if(krefs(pa) <= 2)
+    return pa;  // the cache's reference and the caller's
+  acquire(&pcache.lock);
+  shared = (c = pfind(ip->dev, ip->inum, pgno)) != 0 && c->pa == pa && c->shared;
+  release(&pcache.lock);
+  if(shared)
+    return pa;
+  if((npa = kalloc()) != 0)
+    memmove(npa, pa, PGSIZE);
+  acquire(&pcache.lock);
+  if((c = pfind(ip->dev, ip->inum, pgno)) == 0 || c->pa != pa){
+    // evicted, so the caller must write through.
+    release(&pcache.lock);
+    if(npa)
+      kfree(npa);
+    kfree(pa);
+    return 0;
+  }
+  if(npa == 0){
+    if(c->dirty){
+      release(&pcache.lock);
+      return pa;
+    }
+    punhash(c);
+    release(&pcache.lock);
+    kfree(pa);
+    return 0;
+  }
+  kdup(npa);
+  c->pa = npa;
+  release(&pcache.lock);
+  kfree(pa);  // the cache's old reference
+  kfree(pa);  // the caller's
+  return npa;
+}
+
+// If page pgno of ip is cached and dirty, return it as
+// pcpeek() does; otherwise return 0.
+// Caller must hold ip->lock.
+char*
+pcdirty(struct inode *ip, uint pgno)
+{
+  struct cpage *c;
+  char *pa;
+
+  pa = 0;
+  acquire(&pcache.lock);
+  if((c = pfind(ip->dev, ip->inum, pgno)) != 0 && c->dirty){
+    pa = c->pa;
+    kdup(pa);
+    ptouch(c);
+  }
+  release(&pcache.lock);
+  return pa;
+}
+
+// iflush() has written page pgno of ip to disk.
+// Caller must hold ip->lock.
+void
+pcclean(struct inode *ip, uint pgno)
+{
+  struct cpage *c;
+  int was;
+
+  acquire(&pcache.lock);
+  was = 0;
+  if((c = pfind(ip->dev, ip->inum, pgno)) != 0 && c->dirty){
+    c->dirty = 0;
+    pcache.ndirty--;
+    ip->ndirty--;
+    was = 1;
+  }
+  release(&pcache.lock);
+  if(was)
+    bunreserve(DIRTYBLOCKS);
+}
+
+// Drop the cached pages of ip that hold any of the n
+// bytes at off, which are about to change or go away,
+// discarding them even if they are dirty.
+// Caller must hold ip->lock.
+void
+pcdrop(struct inode *ip, uint off, uint n)
+{
+  struct cpage *c;
+  uint pg, end;
+  int ndirty;
+
+  if(n == 0)
+    return;
+  end = (off + n - 1) / PGSIZE;
+  ndirty = 0;
+  acquire(&pcache.lock);
+  for(pg = off / PGSIZE; pg <= end; pg++){
+    if((c = pfind(ip->dev, ip->inum, pg)) == 0)
+      continue;
+    if(c->dirty){
+      c->dirty = 0;
+      pcache.ndirty--;
+      ip->ndirty--;
+      ndirty++;
+    }
+    punhash(c);
+  }
+  release(&pcache.lock);
+  if(ndirty)
+    bunreserve(ndirty * DIRTYBLOCKS);
+}
+
+// Free up to NRECLAIM of the least recently used cached
+// pages that no process maps.
+// Returns the number of pages freed.
+int
+pcreclaim(void)
+{
+  struct cpage *c, *prev;
+  int n;
+
+  n = 0;
+  acquire(&pcache.lock);
+  for(c = pcache.head.prev; c != &pcache.head && n < NRECLAIM; c = prev){
+    prev = c->prev;
+    if(c->inum && !c->dirty && krefs(c->pa) == 1){
+      punhash(c);
+      n++;
+    }
+  }
+  release(&pcache.lock);
+  return n;
+}
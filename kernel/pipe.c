@@ -7,16 +7,32 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "fcntl.h"
 
-#define PIPESIZE 512
+// A pipe's data is a ring of PIPESIZE bytes in a page of
+// its own; the struct pipe itself comes from kmalloc().
+// One reader and one writer at a time, holding rlock and
+// wlock, copy whole spans of the ring without holding
+// pi->lock: the bytes between nread and nwrite
+// belong to the reader and the rest to the writer, and
+// only the owner moves its counter, under pi->lock, once
+// its copy is done. So the copies may fault, sleep, or
+// read or write a file, as splice() does.
+
+#define PIPESIZE PGSIZE
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  struct sleeplock rlock; // held by the reader copying out
+  struct sleeplock wlock; // held by the writer copying in
+  char *data;     // the ring
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  struct pollhead ph;  // poll()s waiting on either end
 };
 
 int
@@ -28,13 +44,18 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)kmalloc(sizeof(*pi))) == 0)
+    goto bad;
+  if((pi->data = kalloc()) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->ph.first = 0;
   initlock(&pi->lock, "pipe");
+  initsleeplock(&pi->rlock, "piperead");
+  initsleeplock(&pi->wlock, "pipewrite");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -47,7 +68,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmfree(pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -66,65 +87,219 @@ pipeclose(struct pipe *pi, int writable)
     pi->readopen = 0;
     wakeup(&pi->nwrite);
   }
+  pollwake(&pi->ph);
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kfree(pi->data);
+    kmfree(pi);
   } else
     release(&pi->lock);
 }
 
-int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+// Wait for room in pi, and return the length of the free
+// span at pi->nwrite, at most n. Returns -1 if the read side
+// is closed or the caller is killed.
+// Caller must hold pi->wlock.
+static int
+wspan(struct pipe *pi, int n)
 {
-  int i = 0;
   struct proc *pr = myproc();
+  int m;
 
   acquire(&pi->lock);
-  while(i < n){
+  for(;;){
     if(pi->readopen == 0 || killed(pr)){
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-        break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
-    }
+    if(pi->nwrite != pi->nread + PIPESIZE)
+      break;
+    wakeup(&pi->nread); //DOC: pipewrite-full
+    sleep(&pi->nwrite, &pi->lock);
   }
-  wakeup(&pi->nread);
+  m = min(n, PIPESIZE - (pi->nwrite - pi->nread));
+  m = min(m, PIPESIZE - pi->nwrite % PIPESIZE);
   release(&pi->lock);
+  return m;
+}
 
-  return i;
+// The writer has copied m bytes into the span at pi->nwrite.
+static void
+wdone(struct pipe *pi, int m)
+{
+  acquire(&pi->lock);
+  pi->nwrite += m;
+  wakeup(&pi->nread);
+  release(&pi->lock);
+  pollwake(&pi->ph);
 }
 
-int
-piperead(struct pipe *pi, uint64 addr, int n)
+// Return the length of the data span at pi->nread, at most n.
+// If wait is set and pi is empty, wait for data first, and
+// return -1 if killed meanwhile. Returns 0 at end of file,
+// or if pi is empty and wait is clear.
+// Caller must hold pi->rlock.
+static int
+rspan(struct pipe *pi, int n, int wait)
 {
-  int i;
   struct proc *pr = myproc();
-  char ch;
+  int m;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while(wait && pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
     if(killed(pr)){
       release(&pi->lock);
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
+  m = min(n, pi->nwrite - pi->nread);
+  m = min(m, PIPESIZE - pi->nread % PIPESIZE);
+  release(&pi->lock);
+  return m;
+}
+
+// The reader has copied m bytes out of the span at pi->nread.
+static void
+rdone(struct pipe *pi, int m)
+{
+  acquire(&pi->lock);
+  pi->nread += m;
+  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  release(&pi->lock);
+  pollwake(&pi->ph);
+}
+
+// poll() of the read end of pi, or of the write end if
+// writable is set.
+int
+pipepoll(struct pipe *pi, int writable, struct pollhead **ph)
+{
+  int mask = 0;
+
+  acquire(&pi->lock);
+  if(writable){
+    if(pi->nwrite != pi->nread + PIPESIZE)
+      mask |= POLLOUT;
+    if(pi->readopen == 0)
+      mask |= POLLERR;
+  } else {
+    if(pi->nread != pi->nwrite)
+      mask |= POLLIN;
+    if(pi->writeopen == 0)
+      mask |= POLLHUP;
+  }
+  release(&pi->lock);
+  *ph = &pi->ph;
+  return mask;
+}
+
+// Write all of the niov buffers of iov, which are user
+// virtual addresses if user_src is set, else kernel
+// addresses. Other writers wait until this one is done.
+int
+pipewrite(struct pipe *pi, int user_src, struct iovec *iov, int niov)
+{
+  int i, k, m, tot;
+
+  tot = 0;
+  acquiresleep(&pi->wlock);
+  for(k = 0; k < niov; k++){
+    for(i = 0; i < iov[k].iov_len; i += m){
+      if((m = wspan(pi, iov[k].iov_len - i)) < 0){
+        releasesleep(&pi->wlock);
+        return -1;
+      }
+      if(either_copyin(&pi->data[pi->nwrite % PIPESIZE], user_src,
+                       (uint64)iov[k].iov_base + i, m) == -1)
+        goto out;
+      wdone(pi, m);
+      tot += m;
+    }
+  }
+ out:
+  releasesleep(&pi->wlock);
+  return tot;
+}
+
+// Read into the niov buffers of iov, as pipewrite() writes.
+// Waits only until there is something to read.
+int
+piperead(struct pipe *pi, int user_dst, struct iovec *iov, int niov)
+{
+  int i, k, m, tot;
+
+  tot = 0;
+  acquiresleep(&pi->rlock);
+  for(k = 0; k < niov; k++){
+    for(i = 0; i < iov[k].iov_len; i += m){  //DOC: piperead-copy
+      if((m = rspan(pi, iov[k].iov_len - i, tot == 0)) <= 0){
+        if(tot == 0)
+          tot = m;
+        goto out;
+      }
+      if(either_copyout(user_dst, (uint64)iov[k].iov_base + i,
+                        &pi->data[pi->nread % PIPESIZE], m) == -1)
+        goto out;
+      rdone(pi, m);
+      tot += m;
+    }
+  }
+ out:
+  releasesleep(&pi->rlock);
+  return tot;
+}
+
+// splice() from file f into pi: read up to n bytes of f
+// straight into the ring, stopping early at the end of f.
+int
+pipefill(struct pipe *pi, struct file *f, int n)
+{
+  int i, m, r;
+
+  acquiresleep(&pi->wlock);
+  for(i = 0; i < n; i += r){
+    if((m = wspan(pi, n - i)) < 0){
+      i = i ? i : -1;
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    }
+    r = fileread(f, 0, (uint64)&pi->data[pi->nwrite % PIPESIZE], m);
+    if(r <= 0){
+      if(i == 0)
+        i = r;
       break;
+    }
+    wdone(pi, r);
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
-  release(&pi->lock);
+  releasesleep(&pi->wlock);
+  return i;
+}
+
+// splice() from pi to file f: write up to n bytes from the
+// ring straight to f. Waits only until pi has something.
+int
+pipedrain(struct pipe *pi, struct file *f, int n)
+{
+  int i, m, r;
+
+  acquiresleep(&pi->rlock);
+  for(i = 0; i < n; ){
+    if((m = rspan(pi, n - i, i == 0)) <= 0){
+      if(i == 0)
+        i = m;
+      break;
+    }
+    r = filewrite(f, 0, (uint64)&pi->data[pi->nread % PIPESIZE], m);
+    if(r < 0){
+      if(i == 0)
+        i = -1;
+      break;
+    }
+    rdone(pi, r);
+    i += r;
+    if(r < m)
+      break;
+  }
+  releasesleep(&pi->rlock);
   return i;
 }
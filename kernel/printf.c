@@ -1,6 +1,23 @@
 //
 // formatted console output -- printf, panic.
 //
+// once the kernel is up, printf() doesn't write to the UART
+// itself, which takes about 0.25ms a character, but appends
+// the message to its hart's log ring and returns. the UART's
+// interrupt handler sends the messages from the rings, oldest
+// first, so that harts that print don't wait for each other.
+// dmesg() reads the messages the rings still hold.
+//
+// a ring has a single writer, its hart, with interrupts off,
+// so it needs no lock. each message is a record: a struct
+// lhdr and the text. the writer overwrites the oldest records
+// once the ring is full, moving l->first past them before it
+// does; a reader copies a record and then checks that first
+// hasn't passed it meanwhile.
+//
+// until klogstart(), and once the kernel panics, printf()
+// writes straight to the UART.
+//
 
 #include <stdarg.h>
 
@@ -17,16 +34,250 @@
 
 volatile int panicked = 0;
 
-// lock to avoid interleaving concurrent printf's.
+// lock to avoid interleaving concurrent printf's
+// while they write straight to the UART.
 static struct {
   struct spinlock lock;
   int locking;
+  int async;    // append to the log rings
 } pr;
 
+struct lhdr {
+  uint64 time;  // r_time() when printf() began
+  uint64 len;   // bytes of text that follow
+};
+
+// a record's size in the ring, kept a multiple of 8.
+#define LRECSIZE(len) (sizeof(struct lhdr) + (((len) + 7) & ~7))
+
+// positions count bytes ever written; they
+// index buf modulo KLOGSIZE.
+struct klog {
+  uint64 first;  // oldest record still in buf
+  uint64 w;      // end of the last complete record
+  uint64 pos;    // end of the text of the one being written
+  int on;        // the hart's printf() is writing a record
+  char buf[KLOGSIZE];
+} klog[NCPU];
+
+// the next records for the UART to send, from uartstart(),
+// under the UART's lock.
+static struct {
+  uint64 cur[NCPU];
+  char msg[KLOGMSG];
+  int n;
+  int i;
+} drain;
+
 static char digits[] = "0123456789abcdef";
 
 static void
-printint(long long xx, int base, int sign)
+ringput(struct klog *l, uint64 pos, void *src, int n)
+{
+  char *s = src;
+
+  for(; n > 0; n--)
+    l->buf[pos++ % KLOGSIZE] = *s++;
+}
+
+static void
+ringget(struct klog *l, uint64 pos, void *dst, int n)
+{
+  char *d = dst;
+
+  for(; n > 0; n--)
+    *d++ = l->buf[pos++ % KLOGSIZE];
+}
+
+// make room in this hart's ring for bytes up to end,
+// dropping the oldest records.
+static void
+klogroom(struct klog *l, uint64 end)
+{
+  struct lhdr h;
+  uint64 first;
+
+  first = l->first;
+  if(end - first <= KLOGSIZE)
+    return;
+  while(end - first > KLOGSIZE){
+    ringget(l, first, &h, sizeof(h));
+    first += LRECSIZE(h.len);
+  }
+  __atomic_store_n(&l->first, first, __ATOMIC_RELEASE);
+  // readers must see first move before the bytes change.
+  __sync_synchronize();
+}
+
+static void
+klogbegin(void)
+{
+  struct klog *l = &klog[cpuid()];
+
+  klogroom(l, l->w + sizeof(struct lhdr));
+  l->pos = l->w + sizeof(struct lhdr);
+  l->on = 1;
+}
+
+static void
+klogputc(int c)
+{
+  struct klog *l = &klog[cpuid()];
+
+  if(l->pos - l->w - sizeof(struct lhdr) >= KLOGMSG)
+    return;  // too long; cut it off
+  klogroom(l, l->pos + 1);
+  l->buf[l->pos++ % KLOGSIZE] = c;
+}
+
+static void
+klogend(uint64 time)
+{
+  struct klog *l = &klog[cpuid()];
+  struct lhdr h;
+
+  h.time = time;
+  h.len = l->pos - l->w - sizeof(struct lhdr);
+  ringput(l, l->w, &h, sizeof(h));
+  klogroom(l, l->w + LRECSIZE(h.len));
+  __atomic_store_n(&l->w, l->w + LRECSIZE(h.len), __ATOMIC_RELEASE);
+  l->on = 0;
+}
+
+// copy the record at pos in ring l to *h and, text cut to
+// KLOGMSG, m. returns 0, or -1 if the writer got to it first.
+static int
+klogget(struct klog *l, uint64 pos, struct lhdr *h, char *m)
+{
+  if(pos < __atomic_load_n(&l->first, __ATOMIC_ACQUIRE))
+    return -1;
+  ringget(l, pos, h, sizeof(*h));
+  if(m)
+    ringget(l, pos + sizeof(*h), m, h->len < KLOGMSG ? h->len : KLOGMSG);
+  __sync_synchronize();
+  if(pos < __atomic_load_n(&l->first, __ATOMIC_ACQUIRE) || h->len > KLOGMSG)
+    return -1;
+  return 0;
+}
+
+// copy the text of the oldest record of any hart at or after
+// its position in cur[] to m, and advance that position past
+// it. returns the text's length, or -1 if there's none.
+static int
+klognext(uint64 *cur, char *m)
+{
+  struct klog *l;
+  struct lhdr h;
+  uint64 best;
+  int i, c;
+
+  for(;;){
+    c = -1;
+    best = 0;
+    for(i = 0; i < NCPU; i++){
+      l = &klog[i];
+      if(cur[i] < __atomic_load_n(&l->first, __ATOMIC_ACQUIRE))
+        cur[i] = __atomic_load_n(&l->first, __ATOMIC_ACQUIRE);  // lost some
+      if(cur[i] >= __atomic_load_n(&l->w, __ATOMIC_ACQUIRE))
+        continue;
+      if(klogget(l, cur[i], &h, 0) < 0){
+        i--;  // overwritten meanwhile; look again
+        continue;
+      }
+      if(c < 0 || h.time < best){
+        c = i;
+        best = h.time;
+      }
+    }
+    if(c < 0)
+      return -1;
+    if(klogget(&klog[c], cur[c], &h, m) == 0){
+      cur[c] += LRECSIZE(h.len);
+      return h.len;
+    }
+  }
+}
+
+// the next character of the log for the UART to send, or
+// -1 if it has sent it all. caller must hold the UART's lock.
+int
+klogc(void)
+{
+  while(drain.i >= drain.n){
+    if((drain.n = klognext(drain.cur, drain.msg)) < 0){
+      drain.n = 0;
+      return -1;
+    }
+    drain.i = 0;
+  }
+  return drain.msg[drain.i++];
+}
+
+// copy to user address addr up to n bytes of the messages
+// in the log, oldest first. returns the number of bytes.
+int
+dmesg(uint64 addr, int n)
+{
+  uint64 cur[NCPU];
+  char m[KLOGMSG];
+  int tot, len;
+
+  memset(cur, 0, sizeof(cur));
+  for(tot = 0; tot < n && (len = klognext(cur, m)) >= 0; tot += len){
+    if(len > n - tot)
+      len = n - tot;
+    if(copyout(myproc()->pagetable, addr + tot, m, len) < 0)
+      return -1;
+  }
+  return tot;
+}
+
+// print what the UART hasn't sent yet of the log, for panic().
+// without the UART's lock, which might never come free.
+static void
+klogflush(void)
+{
+  int c;
+
+  while((c = klogc()) >= 0)
+    consputc(c);
+}
+
+// from now on, printf() appends to the log.
+void
+klogstart(void)
+{
+  pr.async = 1;
+}
+
+// printf() has interrupts off, so cpuid() is stable.
+static void
+putch(int c)
+{
+  if(klog[cpuid()].on)
+    klogputc(c);
+  else
+    consputc(c);
+}
+
+// A buffer for snprintf().
+struct sbuf {
+  char *buf;
+  int n;        // its size
+  int len;      // chars in it, not counting the NUL
+};
+
+static void
+emit(struct sbuf *sb, int c)
+{
+  if(sb == 0)
+    putch(c);
+  else if(sb->len < sb->n - 1)
+    sb->buf[sb->len++] = c;
+}
+
+static void
+printint(struct sbuf *sb, long long xx, int base, int sign)
 {
   char buf[16];
   int i;
@@ -46,35 +297,29 @@ printint(long long xx, int base, int sign)
     buf[i++] = '-';
 
   while(--i >= 0)
-    consputc(buf[i]);
+    emit(sb, buf[i]);
 }
 
 static void
-printptr(uint64 x)
+printptr(struct sbuf *sb, uint64 x)
 {
   int i;
-  consputc('0');
-  consputc('x');
+  emit(sb, '0');
+  emit(sb, 'x');
   for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4)
-    consputc(digits[x >> (sizeof(uint64) * 8 - 4)]);
+    emit(sb, digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
-// Print to the console.
-int
-printf(char *fmt, ...)
+// Format fmt's arguments into sb, or to the console if sb is 0.
+static void
+format(struct sbuf *sb, char *fmt, va_list ap)
 {
-  va_list ap;
-  int i, cx, c0, c1, c2, locking;
+  int i, cx, c0, c1, c2;
   char *s;
 
-  locking = pr.locking;
-  if(locking)
-    acquire(&pr.lock);
-
-  va_start(ap, fmt);
   for(i = 0; (cx = fmt[i] & 0xff) != 0; i++){
     if(cx != '%'){
-      consputc(cx);
+      emit(sb, cx);
       continue;
     }
     i++;
@@ -83,86 +328,139 @@ printf(char *fmt, ...)
     if(c0) c1 = fmt[i+1] & 0xff;
     if(c1) c2 = fmt[i+2] & 0xff;
     if(c0 == 'd'){
-      printint(va_arg(ap, int), 10, 1);
+      printint(sb, va_arg(ap, int), 10, 1);
     } else if(c0 == 'l' && c1 == 'd'){
-      printint(va_arg(ap, uint64), 10, 1);
+      printint(sb, va_arg(ap, uint64), 10, 1);
       i += 1;
     } else if(c0 == 'l' && c1 == 'l' && c2 == 'd'){
-      printint(va_arg(ap, uint64), 10, 1);
+      printint(sb, va_arg(ap, uint64), 10, 1);
       i += 2;
     } else if(c0 == 'u'){
-      printint(va_arg(ap, int), 10, 0);
+      printint(sb, va_arg(ap, int), 10, 0);
     } else if(c0 == 'l' && c1 == 'u'){
-      printint(va_arg(ap, uint64), 10, 0);
+      printint(sb, va_arg(ap, uint64), 10, 0);
       i += 1;
     } else if(c0 == 'l' && c1 == 'l' && c2 == 'u'){
-      printint(va_arg(ap, uint64), 10, 0);
+      printint(sb, va_arg(ap, uint64), 10, 0);
       i += 2;
     } else if(c0 == 'x'){
-      printint(va_arg(ap, int), 16, 0);
+      printint(sb, va_arg(ap, int), 16, 0);
     } else if(c0 == 'l' && c1 == 'x'){
-      printint(va_arg(ap, uint64), 16, 0);
+      printint(sb, va_arg(ap, uint64), 16, 0);
       i += 1;
     } else if(c0 == 'l' && c1 == 'l' && c2 == 'x'){
-      printint(va_arg(ap, uint64), 16, 0);
+      printint(sb, va_arg(ap, uint64), 16, 0);
       i += 2;
     } else if(c0 == 'p'){
-      printptr(va_arg(ap, uint64));
+      printptr(sb, va_arg(ap, uint64));
     } else if(c0 == 's'){
       if((s = va_arg(ap, char*)) == 0)
         s = "(null)";
       for(; *s; s++)
-        consputc(*s);
+        emit(sb, *s);
     } else if(c0 == '%'){
-      consputc('%');
+      emit(sb, '%');
     } else if(c0 == 0){
       break;
     } else {
       // Print unknown % sequence to draw attention.
-      consputc('%');
-      consputc(c0);
+      emit(sb, '%');
+      emit(sb, c0);
     }
 
 #if 0
     switch(c){
     case 'd':
-      printint(va_arg(ap, int), 10, 1);
+      printint(sb, va_arg(ap, int), 10, 1);
       break;
     case 'x':
-      printint(va_arg(ap, int), 16, 1);
+      printint(sb, va_arg(ap, int), 16, 1);
       break;
     case 'p':
-      printptr(va_arg(ap, uint64));
+      printptr(sb, va_arg(ap, uint64));
       break;
     case 's':
       if((s = va_arg(ap, char*)) == 0)
         s = "(null)";
       for(; *s; s++)
-        consputc(*s);
+        emit(sb, *s);
       break;
     case '%':
-      consputc('%');
+      emit(sb, '%');
       break;
     default:
       // Print unknown % sequence to draw attention.
-      consputc('%');
-      consputc(c);
+      emit(sb, '%');
+      emit(sb, c);
       break;
     }
 #endif
   }
+}
+
+// Print to the console.
+int
+printf(char *fmt, ...)
+{
+  va_list ap;
+  int locking, async;
+  uint64 time = 0;
+
+  push_off();
+  async = pr.async;
+  if(async){
+    time = r_time();
+    klogbegin();
+  }
+  locking = pr.locking && !async;
+  if(locking)
+    acquire(&pr.lock);
+
+  va_start(ap, fmt);
+  format(0, fmt, ap);
   va_end(ap);
 
   if(locking)
     release(&pr.lock);
+  if(async)
+    klogend(time);
+  pop_off();
+  if(async)
+    uartkick();
 
   return 0;
 }
 
+// Format into buf, of n bytes, like printf(), and NUL-terminate
+// it. Returns the number of chars it holds, not counting the
+// NUL, so unlike the C library's, the result of a call whose
+// output was cut off still indexes the end of buf.
+int
+snprintf(char *buf, int n, char *fmt, ...)
+{
+  struct sbuf sb;
+  va_list ap;
+
+  if(n <= 0)
+    return 0;
+  sb.buf = buf;
+  sb.n = n;
+  sb.len = 0;
+  va_start(ap, fmt);
+  format(&sb, fmt, ap);
+  va_end(ap);
+  buf[sb.len] = '\0';
+  return sb.len;
+}
+
 void
 panic(char *s)
 {
   pr.locking = 0;
+  if(pr.async){
+    pr.async = 0;
+    klogflush();
+  }
   printf("panic: ");
   printf("%s\n", s);
   panicked = 1; // freeze uart output from other CPUs
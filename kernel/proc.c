@@ -8,15 +8,80 @@
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// The process table. Procs are carved out of kalloc() pages
+// as they are needed, up to NPROC of them, and are never freed:
+// an UNUSED proc goes on a free list instead, so allocproc()
+// needn't search for one. A proc's index in ptable.proc fixes
+// its kernel stack address and its ASID. ptable.n only grows,
+// and ptable.proc[i] is set before n is raised past i, so loops
+// over the table needn't hold ptable.lock.
+// Lock order: p->lock, then ptable.lock.
+struct {
+  struct spinlock lock;
+  struct proc *free;          // UNUSED procs
+  int n;                      // procs allocated so far
+  struct proc *proc[NPROC];
+} ptable;
 
 struct proc *initproc;
 
+// Per-CPU queues of RUNNABLE processes. A process is on a
+// queue exactly when it is RUNNABLE; setrunnable() puts it
+// there and scheduler() takes it off. Lock order: p->lock,
+// then a run queue's lock.
+//
+// Each CPU's queue is a multi-level feedback queue, one
+// FIFO per priority level. A process that is still running
+// when the clock ticks drops a level (see yield()); one that
+// goes to sleep goes back up to its static priority, p->nice.
+// Every BOOSTTICKS ticks, each CPU also moves the processes
+// on its queue back up to their static priorities, so that
+// a stream of interactive ones can't starve a demoted one.
+//
+// An idle CPU waits in wfi with its clock slowed to one
+// interrupt every IDLETICKS ticks. There are no inter-processor
+// interrupts to wake it, so setrunnable() doesn't queue work
+// for an idle CPU; it queues it on the CPU doing the wakeup.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n;                       // Number of queued processes
+  int idle;                    // Its CPU is waiting in wfi
+} runq[NCPU];
+
+// Sleeping processes, hashed by wait channel, so that wakeup()
+// only looks at processes sleeping on its channel.
+// Lock order: a sleep queue's lock, then p->lock.
+#define NSLEEPQ 61
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
+static struct sleepq*
+chanq(void *chan)
+{
+  return &sleepq[((uint64)chan >> 3) % NSLEEPQ];
+}
+
+// Processes hashed by pid, so that kill() needn't search the
+// process table. pid_lock protects the hash chains, nextpid,
+// and changes to p->pid (which p->lock also protects).
+// Lock order: p->lock, then pid_lock.
+#define NPIDHASH 127
+
 int nextpid = 1;
 struct spinlock pid_lock;
+struct proc *pidhash[NPIDHASH];
 
 extern void forkret(void);
+static void kthreadret(void);
+static void spawnret(void);
 static void freeproc(struct proc *p);
+static void freeuser(struct proc *p);
+static void adopt(struct proc *parent, struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
@@ -26,36 +91,58 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void
-proc_mapstacks(pagetable_t kpgtbl)
+// Carve a new page into procs and put them on the free list.
+// Each gets a page for its kernel stack, mapped high in memory
+// at KSTACK() of its index, followed by an invalid guard page.
+// The CPUs flush the new mappings from their TLBs in scheduler()
+// before they run any of these procs.
+// Caller must hold ptable.lock.
+static void
+procgrow(void)
 {
+  char *pg, *pa;
   struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+  int i;
+
+  if(ptable.n >= NPROC || (pg = kalloc()) == 0)
+    return;
+  memset(pg, 0, PGSIZE);
+  for(p = (struct proc*)pg; p+1 <= (struct proc*)(pg+PGSIZE) && ptable.n < NPROC; p++){
+    i = ptable.n;
+    if((pa = kalloc()) == 0)
+      break;
+    if(mappages(kernel_pagetable, KSTACK(i), PGSIZE, (uint64)pa, PTE_R | PTE_W) < 0){
+      kfree(pa);
+      break;
+    }
+    initlock(&p->lock, "proc");
+    p->state = UNUSED;
+    p->kstack = KSTACK(i);
+    p->asid = i + 1;  // 0 is the kernel's
+    p->ofile = p->ofile0;
+    p->nofile = NOFILE;
+    p->fnext = ptable.free;
+    ptable.free = p;
+    ptable.proc[i] = p;
+    __sync_synchronize();
+    ptable.n = i + 1;
   }
+  if(p == (struct proc*)pg)
+    kfree(pg);
+  sfence_vma();
 }
 
 // initialize the proc table.
 void
 procinit(void)
 {
-  struct proc *p;
-  
   initlock(&pid_lock, "nextpid");
+  initlock(&ptable.lock, "ptable");
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
-  }
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
 }
 
 // Must be called with interrupts disabled,
@@ -78,6 +165,114 @@ mycpu(void)
   return c;
 }
 
+// Append p to the end of level pr of run queue q.
+// Caller must hold q->lock.
+static void
+runqput(struct runq *q, struct proc *p, int pr)
+{
+  p->rqprio = pr;
+  p->rqnext = 0;
+  if(q->tail[pr])
+    q->tail[pr]->rqnext = p;
+  else
+    q->head[pr] = p;
+  q->tail[pr] = p;
+  q->n++;
+}
+
+// Take the first process of the highest non-empty
+// level of run queue q, if any.
+static struct proc*
+runqget(struct runq *q)
+{
+  struct proc *p;
+  int pr;
+
+  if(q->n == 0)
+    return 0;  // racy, but saves taking the lock of an empty queue
+  acquire(&q->lock);
+  p = 0;
+  for(pr = 0; pr < NPRIO; pr++){
+    if((p = q->head[pr]) != 0){
+      q->head[pr] = p->rqnext;
+      if(q->head[pr] == 0)
+        q->tail[pr] = 0;
+      q->n--;
+      break;
+    }
+  }
+  release(&q->lock);
+  return p;
+}
+
+// Move every process on q that has dropped below its
+// static priority back up to that level. p->prio needs
+// p->lock, which can't be taken with q->lock held, so the
+// scheduler raises it to p->rqprio when it takes p off q.
+// p->nice is read without p->lock: a nice() that races
+// only leaves p a level off until it next runs.
+static void
+runqboost(struct runq *q)
+{
+  struct proc *p, *next;
+  int pr;
+
+  if(q->n == 0)
+    return;
+  acquire(&q->lock);
+  for(pr = 1; pr < NPRIO; pr++){
+    p = q->head[pr];
+    q->head[pr] = q->tail[pr] = 0;
+    for(; p; p = next){
+      next = p->rqnext;
+      q->n--;
+      runqput(q, p, pr > p->nice ? p->nice : pr);
+    }
+  }
+  release(&q->lock);
+}
+
+// Mark p RUNNABLE and queue it on the CPU it last ran on,
+// or on this CPU if that one is idle.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *q = &runq[p->cpu];
+
+  p->state = RUNNABLE;
+  acquire(&q->lock);
+  if(q->idle && q != &runq[cpuid()]){
+    release(&q->lock);
+    q = &runq[cpuid()];
+    acquire(&q->lock);
+  }
+  runqput(q, p, p->prio);
+  release(&q->lock);
+}
+
+// Choose a process for CPU id to run: the head of its own
+// queue, or else one stolen from the busiest other queue.
+static struct proc*
+pickproc(int id)
+{
+  struct proc *p;
+  int i, busiest;
+
+  if((p = runqget(&runq[id])) != 0)
+    return p;
+  for(;;){
+    busiest = -1;
+    for(i = 0; i < NCPU; i++)
+      if(i != id && runq[i].n > 0 && (busiest < 0 || runq[i].n > runq[busiest].n))
+        busiest = i;
+    if(busiest < 0)
+      return 0;
+    if((p = runqget(&runq[busiest])) != 0)
+      return p;
+  }
+}
+
 // Return the current struct proc *, or zero if none.
 struct proc*
 myproc(void)
@@ -89,41 +284,194 @@ myproc(void)
   return p;
 }
 
-int
-allocpid()
+// Give p a new pid, and hash it.
+static void
+allocpid(struct proc *p)
 {
-  int pid;
-  
+  struct proc **pp;
+
   acquire(&pid_lock);
-  pid = nextpid;
+  p->pid = nextpid;
   nextpid = nextpid + 1;
+  pp = &pidhash[p->pid % NPIDHASH];
+  p->pidnext = *pp;
+  *pp = p;
   release(&pid_lock);
+}
 
-  return pid;
+// Take p's pid away, and unhash it.
+static void
+freepid(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(&pid_lock);
+  for(pp = &pidhash[p->pid % NPIDHASH]; *pp != p; pp = &(*pp)->pidnext)
+    ;
+  *pp = p->pidnext;
+  p->pid = 0;
+  release(&pid_lock);
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// Find the process with the given pid, and return it with
+// p->lock held, or return 0 if there is none. procs are never
+// freed, so p can't go away between releasing pid_lock and
+// acquiring p->lock, but its process can exit, so the pid is
+// checked again.
 static struct proc*
-allocproc(void)
+pidfind(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
+  if(pid <= 0)
+    return 0;
+  acquire(&pid_lock);
+  for(p = pidhash[pid % NPIDHASH]; p && p->pid != pid; p = p->pidnext)
+    ;
+  release(&pid_lock);
+  if(p == 0)
+    return 0;
+  acquire(&p->lock);
+  if(p->pid != pid || p->state == UNUSED){
+    release(&p->lock);
+    return 0;
   }
-  return 0;
+  return p;
+}
+
+// Take an UNUSED proc off the free list, growing the
+// table if it's empty. If there is one, give it a pid
+// and return with p->lock held. Otherwise return 0.
+static struct proc*
+procslot(void)
+{
+  struct proc *p;
+
+  acquire(&ptable.lock);
+  if(ptable.free == 0)
+    procgrow();
+  if((p = ptable.free) == 0){
+    release(&ptable.lock);
+    return 0;
+  }
+  ptable.free = p->fnext;
+  release(&ptable.lock);
 
-found:
-  p->pid = allocpid();
+  acquire(&p->lock);
+  allocpid(p);
   p->state = USED;
+  return p;
+}
+
+// Allocate an address space for p, from kmalloc(), with an
+// empty user page table that maps p's trapframe at TRAPFRAME,
+// in slot 0. Returns 0 if out of memory.
+struct mm*
+mmalloc(struct proc *p)
+{
+  struct mm *mm;
+
+  if((mm = kmalloc(sizeof(*mm))) == 0)
+    return 0;
+
+  memset(mm, 0, sizeof(*mm));
+  initlock(&mm->lock, "mm");
+  mm->ref = 1;
+  mm->nlive = 1;
+  mm->slots = 1;
+  mm->tlbgen = tlbnewgen();
+  if((mm->pagetable = proc_pagetable(p)) == 0){
+    mmfree(mm);
+    return 0;
+  }
+  return mm;
+}
+
+// Free mm and the user memory in it.
+void
+mmfree(struct mm *mm)
+{
+  if(mm->pagetable)
+    proc_freepagetable(mm->pagetable, mm->sz);
+  kmfree(mm);
+}
+
+// Map p's trapframe into a free slot of mm, so that p
+// can run as one more thread sharing mm.
+// Returns 0, or -1 if mm has NTHREAD threads.
+static int
+mmshare(struct mm *mm, struct proc *p)
+{
+  int i;
+
+  acquire(&mm->lock);
+  for(i = 0; i < NTHREAD && (mm->slots & (1L << i)); i++)
+    ;
+  if(i == NTHREAD ||
+     mappages(mm->pagetable, TFRAME(i), PGSIZE, (uint64)p->trapframe, PTE_R | PTE_W) < 0){
+    release(&mm->lock);
+    return -1;
+  }
+  mm->slots |= 1L << i;
+  mm->ref++;
+  mm->nlive++;
+  // a TLB may still hold the slot's last trapframe.
+  mm->tlbgen = tlbnewgen();
+  release(&mm->lock);
+  p->mm = mm;
+  p->pagetable = mm->pagetable;
+  p->tfva = TFRAME(i);
+  return 0;
+}
+
+// Drop a proc's use of mm, whose trapframe was at tfva,
+// freeing mm if nothing else uses it.
+void
+mmput(struct mm *mm, uint64 tfva)
+{
+  pte_t *pte;
+  int last;
+
+  acquire(&mm->lock);
+  // only the proc itself used its trapframe's mapping, and
+  // mmshare() has the TLBs flushed before the slot is reused.
+  if((pte = walk(mm->pagetable, tfva, 0)) != 0)
+    *pte = 0;
+  mm->slots &= ~(1L << ((TRAPFRAME - tfva) / PGSIZE));
+  last = --mm->ref == 0;
+  release(&mm->lock);
+  if(last)
+    mmfree(mm);
+}
+
+// p is done with the user memory in p->mm, in exit() or exec().
+// Once no other thread is using it either, write back and
+// remove the memory-mapped files.
+void
+mmexit(struct proc *p)
+{
+  int last;
+
+  acquire(&p->mm->lock);
+  last = --p->mm->nlive == 0;
+  release(&p->mm->lock);
+  if(last)
+    munmapall();
+}
+
+// Look in the process table for an UNUSED proc.
+// If found, initialize state required to run in the kernel,
+// and return with p->lock held. Its user memory is mm, which
+// it shares with mm's other threads, or a new, empty one if
+// mm is 0.
+// If there are no free procs, or a memory allocation fails, return 0.
+static struct proc*
+allocproc(struct mm *mm)
+{
+  struct proc *p;
+
+  if((p = procslot()) == 0)
+    return 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -132,12 +480,21 @@ found:
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
-    freeproc(p);
-    release(&p->lock);
-    return 0;
+  if(mm){
+    if(mmshare(mm, p) < 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+  } else {
+    // An empty user page table.
+    if((p->mm = mmalloc(p)) == 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+    p->pagetable = p->mm->pagetable;
+    p->tfva = TRAPFRAME;
   }
 
   // Set up new context to start executing at forkret,
@@ -149,26 +506,51 @@ found:
   return p;
 }
 
-// free a proc structure and the data hanging from it,
-// including user pages.
+// free p's trapframe and its use of its user memory.
 // p->lock must be held.
 static void
-freeproc(struct proc *p)
+freeuser(struct proc *p)
 {
+  if(p->mm)
+    mmput(p->mm, p->tfva);
+  p->mm = 0;
+  p->pagetable = 0;
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
-  p->sz = 0;
-  p->pid = 0;
+  p->inuser = 0;
+}
+
+// free a proc structure and the data hanging from it,
+// including user pages.
+// p->lock must be held.
+static void
+freeproc(struct proc *p)
+{
+  freeuser(p);
+  if(p->pid)
+    freepid(p);
   p->parent = 0;
   p->name[0] = 0;
   p->chan = 0;
+  p->prio = 0;
+  p->nice = 0;
+  p->cycles = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->ring = 0;
+  p->tracemask = 0;
+  if(p->callstat){
+    kmfree(p->callstat);
+    p->callstat = 0;
+  }
+  memset(&p->usage, 0, sizeof(p->usage));
+  memset(&p->cusage, 0, sizeof(p->cusage));
   p->state = UNUSED;
+  acquire(&ptable.lock);
+  p->fnext = ptable.free;
+  ptable.free = p;
+  release(&ptable.lock);
 }
 
 // Create a user page table for a given process, with no user memory,
@@ -202,6 +584,16 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
+  // map the clock page, for user code to read
+  // the time without a system call.
+  if(mappages(pagetable, TIMEPAGE, PGSIZE,
+              (uint64)vtime, PTE_R | PTE_U) < 0){
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
   return pagetable;
 }
 
@@ -212,6 +604,7 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  uvmunmap(pagetable, TIMEPAGE, 1, 0);
   uvmfree(pagetable, sz);
 }
 
@@ -234,13 +627,13 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy initcode's instructions
   // and data into it.
   uvmfirst(p->pagetable, initcode, sizeof(initcode));
-  p->sz = PGSIZE;
+  p->mm->sz = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
@@ -249,29 +642,145 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
-// Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
+// Start a kernel thread, which runs fn(arg) in the kernel
+// with no user memory, and is scheduled like a process.
+// fn must never return. A kernel thread can't be killed,
+// has no parent, and must not use anything of a process's
+// other than its kernel stack. Returns its pid, or -1.
 int
+kthread_create(void (*fn)(void*), void *arg, char *name)
+{
+  struct proc *p;
+  int pid;
+
+  if((p = procslot()) == 0)
+    return -1;
+  p->kfn = fn;
+  p->karg = arg;
+  memset(&p->context, 0, sizeof(p->context));
+  p->context.ra = (uint64)kthreadret;
+  p->context.sp = p->kstack + PGSIZE;
+  safestrcpy(p->name, name, sizeof(p->name));
+  pid = p->pid;
+  setrunnable(p);
+  release(&p->lock);
+  return pid;
+}
+
+// Zombies waiting for the reaper, most recent first;
+// protected by wait_lock. exit() pushes a process on,
+// and the reaper, or a wait() that gets there first,
+// takes it off.
+static struct proc *reaplist;
+
+// Take p off the reap list, if it's on it.
+// Caller must hold wait_lock.
+static void
+unreap(struct proc *p)
+{
+  if(p->preap == 0)
+    return;
+  *p->preap = p->rnext;
+  if(p->rnext)
+    p->rnext->preap = p->preap;
+  p->rnext = 0;
+  p->preap = 0;
+}
+
+// The reaper kernel thread frees the memory of exited
+// processes, so that wait() needn't.
+static void
+reaper(void *arg)
+{
+  struct proc *p;
+
+  for(;;){
+    acquire(&wait_lock);
+    while((p = reaplist) == 0)
+      sleep(&reaplist, &wait_lock);
+    unreap(p);
+    // p->lock is held from exit() until it is off its
+    // kernel stack; wait() can't free p while we wait
+    // for it, since it needs wait_lock first.
+    acquire(&p->lock);
+    release(&wait_lock);
+    if(p->mm)
+      freeuser(p);
+    release(&p->lock);
+  }
+}
+
+// Start the kernel threads that aren't the file system's.
+void
+kthreadinit(void)
+{
+  if(kthread_create(kzeroer, 0, "zeroer") < 0 ||
+     kthread_create(reaper, 0, "reaper") < 0)
+    panic("kthreadinit");
+}
+
+// Grow or shrink user memory by n bytes.
+// Return the old size, or -1 on failure.
+uint64
 growproc(int n)
 {
-  uint64 sz;
+  uint64 sz, oldsz;
   struct proc *p = myproc();
+  struct mm *mm = p->mm;
 
-  sz = p->sz;
+  acquire(&mm->lock);
+  sz = oldsz = mm->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
-      return -1;
-    }
+    // just claim the addresses; usertrap() allocates
+    // each page when it is first touched.
+    if(sz + n > vmalow(mm))
+      goto bad;
+    sz += n;
   } else if(n < 0){
+    if(uvmsplit(p->pagetable, sz + n) < 0)
+      goto bad;
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
-  p->sz = sz;
-  return 0;
+  mm->sz = sz;
+  release(&mm->lock);
+  if(sz > p->usage.maxmem)
+    p->usage.maxmem = sz;
+  return oldsz;
+
+ bad:
+  release(&mm->lock);
+  return -1;
+}
+
+// Grow user memory by n bytes of megapages, starting at
+// the next megapage boundary; the gap below that is
+// ordinary heap. The new size is rounded up to a megapage.
+// Returns the start of the new memory, or -1.
+uint64
+growhuge(int n)
+{
+  uint64 start, sz;
+  struct proc *p = myproc();
+  struct mm *mm = p->mm;
+
+  if(n <= 0)
+    return -1;
+  acquire(&mm->lock);
+  start = MEGAPGROUNDUP(mm->sz);
+  if(start + n > vmalow(mm) || (sz = uvmmega(p->pagetable, start, start + n)) == 0){
+    release(&mm->lock);
+    return -1;
+  }
+  mm->sz = sz;
+  release(&mm->lock);
+  if(sz > p->usage.maxmem)
+    p->usage.maxmem = sz;
+  return start;
 }
 
 // Create a new process, copying the parent.
@@ -279,22 +788,28 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *p = myproc();
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
     return -1;
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  acquire(&p->mm->lock);
+  if(uvmcopy(p->pagetable, np->pagetable, p->mm->sz) < 0 || vmacopy(p, np) < 0){
+    release(&p->mm->lock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
+  np->mm->sz = p->mm->sz;
+  np->usage.maxmem = np->mm->sz;
+  release(&p->mm->lock);
+  np->ring = p->ring;
+  np->tracemask = p->tracemask;
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -303,9 +818,12 @@ fork(void)
   np->trapframe->a0 = 0;
 
   // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
+  if(fdcopy(np, p) < 0){
+    vmauncopy(np, np->mm->sz);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
   np->cwd = idup(p->cwd);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
@@ -315,16 +833,163 @@ fork(void)
   release(&np->lock);
 
   acquire(&wait_lock);
-  np->parent = p;
+  adopt(p, np);
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  np->cpu = p->cpu;
+  np->nice = np->prio = p->nice;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
 }
 
+// Create a thread: a new process that shares the caller's
+// user memory, and starts by calling fn(arg) with its stack
+// pointer at stack. Like a fork()ed child, it gets copies of
+// the caller's open file descriptors, and is the caller's
+// child, for wait(). fn must not return; the thread ends
+// with exit(), leaving the memory to the other threads.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if((np = allocproc(p->mm)) == 0)
+    return -1;
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack & ~15L;
+  np->trapframe->ra = 0;
+  np->tracemask = p->tracemask;
+
+  if(fdcopy(np, p) < 0){
+    mmexit(np);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->cwd = idup(p->cwd);
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  adopt(p, np);
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->cpu = p->cpu;
+  np->nice = np->prio = p->nice;
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// What spawn() asks its child to run. It lives on the
+// parent's kernel stack, which stays put while the parent
+// waits for the child to exec().
+struct spawnargs {
+  char *path;
+  char **argv;
+  struct spawnact *act;
+  int nact;
+  int done;                    // child has exec()ed, or failed to
+  int err;                     // it failed
+};
+
+// Create a process that runs path with argv, without copying
+// the caller's memory: the child starts with an empty address
+// space and exec()s in spawnret(). It gets the caller's open
+// files, with the nact file actions in act done to them first.
+// Waits, like vfork(), until the child has exec()ed, so that
+// an error is the caller's to report; the child of a failed
+// exec() exits, and init reaps it.
+int
+spawn(char *path, char **argv, struct spawnact *act, int nact)
+{
+  int pid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct spawnargs sa;
+
+  if((np = allocproc(0)) == 0)
+    return -1;
+
+  sa.path = path;
+  sa.argv = argv;
+  sa.act = act;
+  sa.nact = nact;
+  sa.done = 0;
+  sa.err = 0;
+
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  np->tracemask = p->tracemask;
+  if(fdcopy(np, p) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->cwd = idup(p->cwd);
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->spawn = &sa;
+  np->context.ra = (uint64)spawnret;
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  adopt(p, np);
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->cpu = p->cpu;
+  np->nice = np->prio = p->nice;
+  setrunnable(np);
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  while(!sa.done)
+    sleep(&sa, &wait_lock);
+  release(&wait_lock);
+
+  return sa.err ? -1 : pid;
+}
+
+// Make p a child of parent.
+// Caller must hold wait_lock.
+static void
+adopt(struct proc *parent, struct proc *p)
+{
+  p->parent = parent;
+  p->sibling = parent->child;
+  if(p->sibling)
+    p->sibling->psibling = &p->sibling;
+  p->psibling = &parent->child;
+  parent->child = p;
+}
+
+// Take p off its parent's list of children.
+// Caller must hold wait_lock.
+static void
+orphan(struct proc *p)
+{
+  *p->psibling = p->sibling;
+  if(p->sibling)
+    p->sibling->psibling = p->psibling;
+  p->parent = 0;
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -332,12 +997,13 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
-    }
+  if(p->child == 0)
+    return;
+  while((pp = p->child) != 0){
+    orphan(pp);
+    adopt(initproc, pp);
   }
+  wakeup(initproc);
 }
 
 // Exit the current process.  Does not return.
@@ -351,14 +1017,12 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and remove memory-mapped files,
+  // unless other threads still use them.
+  mmexit(p);
+
   // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
-  }
+  fdcloseall(p);
 
   begin_op();
   iput(p->cwd);
@@ -372,6 +1036,14 @@ exit(int status)
 
   // Parent might be sleeping in wait().
   wakeup(p->parent);
+
+  // The reaper will free p's memory.
+  p->rnext = reaplist;
+  if(reaplist)
+    reaplist->preap = &p->rnext;
+  p->preap = &reaplist;
+  reaplist = p;
+  wakeup(&reaplist);
   
   acquire(&p->lock);
 
@@ -385,6 +1057,21 @@ exit(int status)
   panic("zombie exit");
 }
 
+// Add what c records to u.
+static void
+addusage(struct usage *u, struct usage *c)
+{
+  u->utime += c->utime;
+  u->stime += c->stime;
+  u->nvcsw += c->nvcsw;
+  u->nivcsw += c->nivcsw;
+  u->nread += c->nread;
+  u->nwrite += c->nwrite;
+  u->nblock += c->nblock;
+  if(c->maxmem > u->maxmem)
+    u->maxmem = c->maxmem;
+}
+
 // Wait for a child process to exit and return its pid.
 // Return -1 if this process has no children.
 int
@@ -397,30 +1084,32 @@ wait(uint64 addr)
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through the children looking for exited ones.
     havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&pp->lock);
-
-        havekids = 1;
-        if(pp->state == ZOMBIE){
-          // Found one.
-          pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(pp);
+    for(pp = p->child; pp; pp = pp->sibling){
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&pp->lock);
+
+      havekids = 1;
+      if(pp->state == ZOMBIE){
+        // Found one.
+        pid = pp->pid;
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
+                                sizeof(pp->xstate)) < 0) {
           release(&pp->lock);
           release(&wait_lock);
-          return pid;
+          return -1;
         }
+        addusage(&p->cusage, &pp->usage);
+        addusage(&p->cusage, &pp->cusage);
+        unreap(pp);
+        orphan(pp);
+        freeproc(pp);
         release(&pp->lock);
+        release(&wait_lock);
+        return pid;
       }
+      release(&pp->lock);
     }
 
     // No point waiting if we don't have any children.
@@ -446,6 +1135,9 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = c - cpus;
+  int slowed = 0;
+  uint64 start;
 
   c->proc = 0;
   for(;;){
@@ -454,29 +1146,67 @@ scheduler(void)
     // processes are waiting.
     intr_on();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-        found = 1;
+    if(ticks >= c->nextboost){
+      runqboost(&runq[id]);
+      c->nextboost = ticks + BOOSTTICKS;
+    }
+
+    if((p = pickproc(id)) == 0){
+      // every queue is empty; stop running on this core
+      // until an interrupt. interrupts stay off from the
+      // check to the wfi, so that a wakeup in between can't
+      // be missed: wfi still returns for a pending interrupt,
+      // which is taken by the intr_on() above.
+      intr_off();
+      acquire(&runq[id].lock);
+      if(runq[id].n == 0)
+        runq[id].idle = 1;
+      release(&runq[id].lock);
+      if(runq[id].idle){
+        // hart 0 keeps ticking, since it advances ticks.
+        if(id != 0){
+          clockset(r_time() + IDLETICKS*TICKCYCLES);
+          slowed = 1;
+        }
+        asm volatile("wfi");
+        acquire(&runq[id].lock);
+        runq[id].idle = 0;
+        release(&runq[id].lock);
       }
-      release(&p->lock);
+      continue;
     }
-    if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
-      intr_on();
-      asm volatile("wfi");
+
+    acquire(&p->lock);
+    if(slowed){
+      c->nexttick = r_time() + TICKCYCLES;
+      clockset(c->nexttick);
+      slowed = 0;
+    }
+    if(p->state != RUNNABLE)
+      panic("scheduler: queued process not runnable");
+    if(p->rqprio < p->prio && p->rqprio >= p->nice)
+      p->prio = p->rqprio;  // boosted by runqboost()
+    if(c->nkstack != ptable.n){
+      // procgrow() has mapped kernel stacks since this
+      // CPU last looked; don't run on a stale TLB entry.
+      sfence_vma();
+      c->nkstack = ptable.n;
     }
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = id;
+    c->proc = p;
+    c->slice = QUANTUM;
+    start = r_time();
+    swtch(&c->context, &p->context);
+    p->cycles += r_time() - start;
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -508,12 +1238,17 @@ sched(void)
 }
 
 // Give up the CPU for one scheduling round.
+// Called when p has used up its quantum,
+// so it drops a priority level.
 void
 yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  if(p->prio < NPRIO-1)
+    p->prio++;
+  p->usage.nivcsw++;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -542,27 +1277,81 @@ forkret(void)
   usertrapret();
 }
 
+// A spawn()ed child's very first scheduling by scheduler()
+// will swtch to spawnret.
+static void
+spawnret(void)
+{
+  struct proc *p = myproc();
+  struct spawnargs *sa = p->spawn;
+  int r;
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  r = -1;
+  if(fdspawn(sa->act, sa->nact) == 0)
+    r = exec(sa->path, sa->argv);
+  p->spawn = 0;
+
+  // sa is gone once the parent wakes up.
+  acquire(&wait_lock);
+  if(r < 0){
+    sa->err = 1;
+    orphan(p);
+    adopt(initproc, p);
+  }
+  sa->done = 1;
+  wakeup(sa);
+  release(&wait_lock);
+
+  if(r < 0)
+    exit(-1);
+  p->trapframe->a0 = r;
+  usertrapret();
+}
+
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn(p->karg);
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *q = chanq(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold the sleep queue's lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
-  // so it's okay to release lk.
+  // (wakeup locks it), so it's okay to release lk.
 
+  acquire(&q->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
-  // Go to sleep.
+  // Go to sleep. Sleeping marks p as interactive,
+  // so it returns to the top of its priority range.
   p->chan = chan;
   p->state = SLEEPING;
+  p->prio = p->nice;
+  p->sqnext = q->head;
+  q->head = p;
+  release(&q->lock);
 
+  p->usage.nvcsw++;
   sched();
 
   // Tidy up.
@@ -578,16 +1367,57 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  struct sleepq *q = chanq(chan);
+  struct proc *p, **pp;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
+  acquire(&q->lock);
+  for(pp = &q->head; (p = *pp) != 0; ){
+    acquire(&p->lock);
+    if(p->chan == chan){
+      *pp = p->sqnext;
+      setrunnable(p);
+    } else {
+      pp = &p->sqnext;
+    }
+    release(&p->lock);
+  }
+  release(&q->lock);
+}
+
+// Wake p if it is sleeping, whatever its channel.
+// Caller must not hold p->lock.
+static void
+wakeproc(struct proc *p)
+{
+  struct sleepq *q;
+  struct proc **pp;
+  void *chan;
+
+  for(;;){
+    acquire(&p->lock);
+    if(p->state != SLEEPING){
       release(&p->lock);
+      return;
     }
+    chan = p->chan;
+    release(&p->lock);
+
+    // the sleep queue's lock comes first, so p may wake up
+    // and sleep again on another channel meanwhile.
+    q = chanq(chan);
+    acquire(&q->lock);
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->chan == chan){
+      for(pp = &q->head; *pp != p; pp = &(*pp)->sqnext)
+        ;
+      *pp = p->sqnext;
+      setrunnable(p);
+      release(&p->lock);
+      release(&q->lock);
+      return;
+    }
+    release(&p->lock);
+    release(&q->lock);
   }
 }
 
@@ -599,20 +1429,61 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
+  if((p = pidfind(pid)) == 0)
+    return -1;
+  if(p->kfn){
     release(&p->lock);
+    return -1;
   }
-  return -1;
+  p->killed = 1;
+  release(&p->lock);
+  // Wake process from sleep().
+  wakeproc(p);
+  return 0;
+}
+
+// Set the static priority of the process with the given pid,
+// or of the caller if pid is 0. Returns the old one.
+int
+nice(int pid, int prio)
+{
+  struct proc *p;
+  int old;
+
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  if((p = pidfind(pid)) == 0)
+    return -1;
+  old = p->nice;
+  p->nice = p->prio = prio;
+  release(&p->lock);
+  return old;
+}
+
+// Copy the system call statistics of the process with the
+// given pid to cs. A process counts its calls only from the
+// first time they are asked for, so as not to keep a page of
+// statistics in every process.
+// Returns -1 if there's no such process.
+int
+proccallstat(int pid, struct callstat *cs)
+{
+  struct proc *p;
+  struct callstat *pcs;
+
+  if((p = pidfind(pid)) == 0)
+    return -1;
+  if(p->callstat){
+    memmove(cs, p->callstat, NSYSCALL * sizeof(*cs));
+  } else if((pcs = kmalloc(NSYSCALL * sizeof(*pcs))) != 0){
+    memset(pcs, 0, NSYSCALL * sizeof(*pcs));
+    __sync_synchronize();  // runcall() reads p->callstat without p->lock
+    p->callstat = pcs;
+  }
+  release(&p->lock);
+  return 0;
 }
 
 void
@@ -664,6 +1535,40 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
   }
 }
 
+// Describe the processes in buf, of n bytes, for /proc/procs:
+// a line for each, of pid, state, priority and nice, time run
+// in timer cycles, and name. No lock, like procdump().
+// Returns the length.
+int
+procstat(char *buf, int n)
+{
+  static char *states[] = {
+  [UNUSED]    "unused",
+  [USED]      "used",
+  [SLEEPING]  "sleep",
+  [RUNNABLE]  "runnable",
+  [RUNNING]   "run",
+  [ZOMBIE]    "zombie"
+  };
+  struct proc *p;
+  char *state;
+  int i, len;
+
+  len = snprintf(buf, n, "pid state prio nice cycles name\n");
+  for(i = 0; i < ptable.n; i++){
+    p = ptable.proc[i];
+    if(p->state == UNUSED || p->kfn)
+      continue;
+    if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
+      state = states[p->state];
+    else
+      state = "???";
+    len += snprintf(buf + len, n - len, "%d %s %d %d %ld %s\n",
+                    p->pid, state, p->prio, p->nice, p->cycles, p->name);
+  }
+  return len;
+}
+
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
@@ -680,16 +1585,20 @@ procdump(void)
   };
   struct proc *p;
   char *state;
+  int i;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(i = 0; i < ptable.n; i++){
+    p = ptable.proc[i];
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
       state = states[p->state];
     else
       state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
+    printf("%d %s %d/%d %s", p->pid, state, p->prio, p->nice, p->name);
     printf("\n");
   }
+  kmemdump();
+  kmdump();
 }
@@ -24,6 +24,12 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int slice;                  // Clock ticks left in proc's quantum.
+  uint nextboost;             // ticks when its run queue is next boosted.
+  uint64 nexttick;            // Time of the next clock tick.
+  uint64 alarm;               // Time of an earlier timer interrupt, or 0.
+  uint64 tlbgen[NPROC];       // Each ASID's mm->tlbgen when last flushed here.
+  int nkstack;                // Kernel stacks mapped when its TLB was last flushed.
 };
 
 extern struct cpu cpus[NCPU];
@@ -82,6 +88,54 @@ struct trapframe {
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
+// A memory-mapped file, see mmap.c.
+struct vma {
+  uint64 addr;                 // Start, page-aligned
+  uint64 len;                  // Length, in whole pages; 0 if unused
+  int prot;                    // PROT_ bits
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // The mapped file
+  uint off;                    // File offset of addr
+};
+
+// A user address space. A process has its own, and the
+// threads that clone() makes share their creator's.
+struct mm {
+  struct spinlock lock;
+
+  // lock must be held when using these, and when
+  // changing the page table:
+  int ref;                     // Procs that will free it, live or zombie
+  int nlive;                   // Procs that haven't exited or exec()ed yet
+  uint64 slots;                // Trapframe slots in use, see TFRAME()
+  uint64 sz;                   // Size of process memory (bytes)
+  struct vma vma[NVMA];        // Memory-mapped files
+  uint64 tlbgen;               // Changed when its page table changes
+  int nuser;                   // Its procs now in user space, if it's shared
+  int nfault;                  // vmafault()s reading a page in
+
+  pagetable_t pagetable;       // User page table, fixed
+};
+
+// Statistics for one system call; see runcall() in syscall.c.
+struct callstat {
+  uint64 ncall;
+  uint64 cycles;
+  uint64 maxcycles;
+};
+
+// What a process has used, for getrusage().
+struct usage {
+  uint64 utime;     // Clock ticks in user space
+  uint64 stime;     // Clock ticks in the kernel
+  uint64 nvcsw;     // Times it gave up the CPU in sleep()
+  uint64 nivcsw;    // Times yield() took it away
+  uint64 nread;     // Bytes read from files
+  uint64 nwrite;    // Bytes written to files
+  uint64 nblock;    // Blocks read from disk for it
+  uint64 maxmem;    // Most user memory, mm->sz, it has had
+};
+
 struct proc {
   struct spinlock lock;
 
@@ -90,18 +144,55 @@ struct proc {
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
-  int pid;                     // Process ID
+  int pid;                     // Process ID, pid_lock too
+  int cpu;                     // CPU that last ran it, whose run queue it joins
+  int prio;                    // Current priority level, 0 is highest
+  int nice;                    // Static priority: the best level prio gets back to
+  uint64 cycles;               // Time it has run, in timer cycles
+
+  // the run queue's lock must be held when using these:
+  struct proc *rqnext;         // Next RUNNABLE process in the run queue
+  int rqprio;                  // Level it is queued at, which runqboost() may raise
 
-  // wait_lock must be held when using this:
+  // the sleep queue's lock must be held when using this:
+  struct proc *sqnext;         // Next process sleeping in the sleep queue
+
+  // ptable.lock must be held when using this:
+  struct proc *fnext;          // Next UNUSED process in the free list
+
+  // pid_lock must be held when using this:
+  struct proc *pidnext;        // Next process in the pid hash chain
+
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *child;          // First child
+  struct proc *sibling;        // Next child of the same parent
+  struct proc **psibling;      // The pointer to this one in that list
+  struct proc *rnext;          // Next zombie for the reaper
+  struct proc **preap;         // The pointer to this one in that list, or 0
 
   // these are private to the process, so p->lock need not be held.
+  int asid;                    // Address-space ID, fixed when the proc is made
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  struct mm *mm;               // User memory, maybe shared with other threads
+  pagetable_t pagetable;       // mm->pagetable
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 tfva;                 // User address of the trapframe, see TFRAME()
+  int inuser;                  // Counted in mm->nuser
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
+  struct file **ofile;         // Open files, nofile slots of them
+  int nofile;                  // NOFILE, or MAXOFILE once the table has grown
+  uint64 fdmap[MAXOFILE/64];   // Bit fd is set when ofile[fd] is in use
+  struct file *ofile0[NOFILE]; // ofile, until it outgrows NOFILE
   struct inode *cwd;           // Current directory
+  int nshared;                 // Sleep locks held shared, see acquiresleepshared()
+  uint64 ring;                 // User address of its system call ring, or 0
+  uint64 tracemask;            // System calls to trace, a bit per SYS_ number
+  struct callstat *callstat;   // Its system calls, NSYSCALL by number, or 0
+  struct usage usage;          // Resources it has used
+  struct usage cusage;         // And its children, once wait()ed for
+  void (*kfn)(void*);          // A kernel thread's function, 0 for a process
+  void *karg;                  // and its argument
+  struct spawnargs *spawn;     // What a spawn()ed child is to exec()
   char name[16];               // Process name (debugging)
 };
@@ -0,0 +1,67 @@
+// The files in /proc.
+//
+// Each is a device node, major PROCFS, whose minor says which
+// file it is; init makes them. A read regenerates the whole
+// text of the file, from the statistics the rest of the
+// kernel keeps, and returns the part at the file's offset, so
+// a reader that takes a file in more than one read may see
+// pieces of different moments.
+//
+// The text of a file is at most a page.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "fs.h"
+#include "file.h"
+#include "stat.h"
+#include "defs.h"
+
+static int
+logtext(char *buf, int n)
+{
+  struct logstat st;
+
+  logstat(&st);
+  return snprintf(buf, n, "size %d commits %ld writes %ld absorbed %ld cycles %ld maxcycles %ld\n",
+                  st.size, st.ncommit, st.nwrite, st.nabsorb, st.cycles, st.maxcycles);
+}
+
+static int (*gen[NPROCFS])(char*, int) = {
+[PROC_PROCS]  procstat,
+[PROC_MEM]    kmemstat,
+[PROC_BIO]    bstat,
+[PROC_INODES] istat,
+[PROC_LOG]    logtext,
+};
+
+static int
+procfsread(int minor, int user_dst, uint64 dst, uint off, int n)
+{
+  char *buf;
+  int len;
+
+  if(minor < 0 || minor >= NPROCFS || gen[minor] == 0)
+    return -1;
+  if((buf = kalloc()) == 0)
+    return -1;
+  len = gen[minor](buf, PGSIZE);
+  if(off >= len){
+    n = 0;
+  } else {
+    if(n > len - off)
+      n = len - off;
+    if(either_copyout(user_dst, dst, buf + off, n) < 0)
+      n = -1;
+  }
+  kfree(buf);
+  return n;
+}
+
+void
+procfsinit(void)
+{
+  devsw[PROCFS].pread = procfsread;
+}
@@ -0,0 +1,136 @@
+// Sampling profiler.
+//
+// While profiling is on, each hart asks for a timer interrupt
+// every PROFCYCLES, besides its clock ticks, and clockintr()
+// calls profintr(), which records the pc the interrupt stopped,
+// in user space or the kernel, with the pid of the process
+// running there, in the hart's ring of samples. prof() turns
+// profiling on and off, and drains the rings for user/prof.
+//
+// A ring that fills up before it is drained drops samples,
+// and counts them.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "stat.h"
+#include "fcntl.h"
+
+struct profring {
+  struct spinlock lock;
+  uint head;            // next sample to read
+  uint tail;            // next sample to fill in
+  uint64 ndrop;         // samples dropped since PROF_ON
+  uint64 next;          // time of this hart's next sample
+  struct profsample s[NPROFSAMPLE];
+};
+
+struct {
+  int on;
+  struct profring ring[NCPU];
+} prof;
+
+void
+profinit(void)
+{
+  for(int i = 0; i < NCPU; i++)
+    initlock(&prof.ring[i].lock, "prof");
+}
+
+// Called by clockintr() at time now, with the trap's
+// sepc and sstatus still as the trap left them.
+// Returns when this hart's next sample is due,
+// or 0 if profiling is off.
+uint64
+profintr(uint64 now)
+{
+  struct profring *r;
+  struct profsample *s;
+  struct proc *p;
+
+  if(__atomic_load_n(&prof.on, __ATOMIC_RELAXED) == 0)
+    return 0;
+  r = &prof.ring[cpuid()];
+  acquire(&r->lock);
+  if(now >= r->next){
+    r->next = now + PROFCYCLES;
+    if(r->tail - r->head < NPROFSAMPLE){
+      s = &r->s[r->tail++ % NPROFSAMPLE];
+      p = mycpu()->proc;
+      s->pc = r_sepc();
+      s->pid = p ? p->pid : 0;
+      s->user = (r_sstatus() & SSTATUS_SPP) == 0;
+    } else {
+      r->ndrop++;
+    }
+  }
+  release(&r->lock);
+  return r->next;
+}
+
+// Copy up to n samples, oldest first on each hart, to user
+// address addr, an array of struct profsample, and take them
+// off the rings. Returns the number copied.
+static int
+profread(uint64 addr, int n)
+{
+  struct profring *r;
+  struct profsample s;
+  int i;
+
+  i = 0;
+  for(r = prof.ring; r < prof.ring + NCPU && i < n; r++){
+    acquire(&r->lock);
+    while(r->head != r->tail && i < n){
+      // copyout() may fault a page in, so not
+      // with the lock held.
+      s = r->s[r->head++ % NPROFSAMPLE];
+      release(&r->lock);
+      if(copyout(myproc()->pagetable, addr + i*sizeof(s), (char*)&s, sizeof(s)) < 0)
+        return -1;
+      i++;
+      acquire(&r->lock);
+    }
+    release(&r->lock);
+  }
+  return i;
+}
+
+// PROF_ON empties the rings and starts sampling.
+// PROF_OFF stops, and returns the samples dropped.
+// PROF_READ drains up to n samples into addr.
+int
+profctl(int cmd, uint64 addr, int n)
+{
+  struct profring *r;
+  uint64 ndrop;
+
+  switch(cmd){
+  case PROF_ON:
+    for(r = prof.ring; r < prof.ring + NCPU; r++){
+      acquire(&r->lock);
+      r->head = r->tail = 0;
+      r->ndrop = 0;
+      r->next = 0;
+      release(&r->lock);
+    }
+    __atomic_store_n(&prof.on, 1, __ATOMIC_RELEASE);
+    return 0;
+  case PROF_OFF:
+    __atomic_store_n(&prof.on, 0, __ATOMIC_RELEASE);
+    ndrop = 0;
+    for(r = prof.ring; r < prof.ring + NCPU; r++){
+      acquire(&r->lock);
+      ndrop += r->ndrop;
+      release(&r->lock);
+    }
+    return ndrop;
+  case PROF_READ:
+    return profread(addr, n);
+  }
+  return -1;
+}
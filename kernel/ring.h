@@ -0,0 +1,32 @@
+// A system call ring, shared by a process and the kernel,
+// for submitting system calls in batches. See ringdrain()
+// in syscall.c.
+//
+// The process fills in sq[sqtail % RINGSIZE] and then
+// advances sqtail; the kernel runs the calls from sqhead
+// on, each time the process makes a system call, and
+// puts each result in cq[cqtail % RINGSIZE]. The process
+// takes results from cqhead on.
+
+#define RINGSIZE 32
+
+struct sqe {
+  int num;          // SYS_ number
+  int pad;
+  uint64 arg[6];    // arguments, as for the a0-a5 registers
+  uint64 data;      // returned in the completion, for the caller
+};
+
+struct cqe {
+  uint64 data;      // the sqe's data
+  uint64 ret;       // the system call's return value
+};
+
+struct ring {
+  uint sqhead;      // next sqe the kernel runs
+  uint sqtail;      // next sqe the process fills in
+  uint cqhead;      // next cqe the process takes
+  uint cqtail;      // next cqe the kernel fills in
+  struct sqe sq[RINGSIZE];
+  struct cqe cq[RINGSIZE];
+};
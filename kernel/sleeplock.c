@@ -1,4 +1,13 @@
 // Sleeping locks
+//
+// A sleep lock is held either exclusively, by acquiresleep(),
+// or shared, by acquiresleepshared(), so that processes that
+// only read what the lock protects don't wait for each other.
+// A waiting writer holds off new readers, so that a steady
+// stream of readers can't starve it; but a process that
+// already holds some sleep lock shared can always take
+// another shared, since the writer may be waiting for that
+// process to let go of the first one.
 
 #include "types.h"
 #include "riscv.h"
@@ -15,6 +24,8 @@ initsleeplock(struct sleeplock *lk, char *name)
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->nreader = 0;
+  lk->nwriter = 0;
   lk->pid = 0;
 }
 
@@ -22,9 +33,11 @@ void
 acquiresleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
-  while (lk->locked) {
+  lk->nwriter++;
+  while (lk->locked || lk->nreader) {
     sleep(lk, &lk->lk);
   }
+  lk->nwriter--;
   lk->locked = 1;
   lk->pid = myproc()->pid;
   release(&lk->lk);
@@ -40,6 +53,32 @@ releasesleep(struct sleeplock *lk)
   release(&lk->lk);
 }
 
+void
+acquiresleepshared(struct sleeplock *lk)
+{
+  struct proc *p = myproc();
+
+  acquire(&lk->lk);
+  while (lk->locked || (lk->nwriter && p->nshared == 0)) {
+    sleep(lk, &lk->lk);
+  }
+  lk->nreader++;
+  p->nshared++;
+  release(&lk->lk);
+}
+
+void
+releasesleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->nreader < 1 || lk->locked)
+    panic("releasesleepshared");
+  if(--lk->nreader == 0)
+    wakeup(lk);
+  myproc()->nshared--;
+  release(&lk->lk);
+}
+
 int
 holdingsleep(struct sleeplock *lk)
 {
@@ -50,6 +89,3 @@ holdingsleep(struct sleeplock *lk)
   release(&lk->lk);
   return r;
 }
-
-
-
@@ -1,6 +1,9 @@
-// Long-term locks for processes
+// Long-term locks for processes, held either by one
+// process exclusively or by any number of them shared.
 struct sleeplock {
-  uint locked;       // Is the lock held?
+  uint locked;       // Is the lock held exclusively?
+  int nreader;       // Processes holding it shared
+  int nwriter;       // Processes waiting to hold it exclusively
   struct spinlock lk; // spinlock protecting this sleep lock
   
   // For debugging:
@@ -1,4 +1,13 @@
 // Mutual exclusion spin locks.
+//
+// These are ticket locks, so waiters get the lock in the order
+// they asked for it, and an unlucky CPU can't starve under
+// contention. Each waiter spins reading owner, and the only
+// atomic operation per acquire() is the fetch-and-add on next.
+//
+// Every lock also counts toward the statistics for the locks
+// with its name (all the proc locks, say), which lockstat()
+// reports, to show where the CPUs wait.
 
 #include "types.h"
 #include "param.h"
@@ -7,13 +16,67 @@
 #include "riscv.h"
 #include "proc.h"
 #include "defs.h"
+#include "stat.h"
+
+// Each class has a cache line of its own, so that CPUs
+// counting acquires of different locks don't contend.
+struct lockclass {
+  char *name;
+  uint64 nacquire;
+  uint64 ncontend;
+  uint64 nspin;
+  uint64 maxhold;
+} __attribute__((aligned(64)));
+
+struct {
+  uint locked;  // taken with a bare test-and-set: initlock() can't acquire()
+  int n;
+  struct lockclass cls[NLOCKCLASS];
+} lockclasses;
+
+// The class for locks named name, or 0 if there
+// are already NLOCKCLASS other names.
+static struct lockclass*
+lockclass(char *name)
+{
+  struct lockclass *c;
+  int i, n;
+
+  // classes are only ever added, so look without the lock first.
+  n = __atomic_load_n(&lockclasses.n, __ATOMIC_ACQUIRE);
+  for(i = 0; i < n; i++)
+    if(lockclasses.cls[i].name == name)
+      return &lockclasses.cls[i];
+
+  push_off();
+  while(__sync_lock_test_and_set(&lockclasses.locked, 1) != 0)
+    ;
+  __sync_synchronize();
+  c = 0;
+  for(i = 0; i < lockclasses.n; i++){
+    if(strncmp(lockclasses.cls[i].name, name, sizeof(((struct lockstat*)0)->name)) == 0){
+      c = &lockclasses.cls[i];
+      break;
+    }
+  }
+  if(c == 0 && lockclasses.n < NLOCKCLASS){
+    c = &lockclasses.cls[lockclasses.n];
+    c->name = name;
+    __atomic_store_n(&lockclasses.n, lockclasses.n + 1, __ATOMIC_RELEASE);
+  }
+  __sync_lock_release(&lockclasses.locked);
+  pop_off();
+  return c;
+}
 
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
+  lk->cls = lockclass(name);
 }
 
 // Acquire the lock.
@@ -21,15 +84,20 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  struct lockclass *c;
+  uint ticket;
+  uint64 spins;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
+  // On RISC-V, sync_fetch_and_add turns into an atomic add:
   //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
+  //   s1 = &lk->next
+  //   amoadd.w a5, a5, (s1)
+  ticket = __sync_fetch_and_add(&lk->next, 1);
+  for(spins = 0; __atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket; spins++)
     ;
 
   // Tell the C compiler and the processor to not move loads or stores
@@ -40,15 +108,36 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+
+  if((c = lk->cls) != 0){
+    lk->since = r_time();
+    __atomic_fetch_add(&c->nacquire, 1, __ATOMIC_RELAXED);
+    if(spins){
+      __atomic_fetch_add(&c->ncontend, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&c->nspin, spins, __ATOMIC_RELAXED);
+    }
+  }
 }
 
 // Release the lock.
 void
 release(struct spinlock *lk)
 {
+  struct lockclass *c;
+  uint64 held, max;
+
   if(!holding(lk))
     panic("release");
 
+  if((c = lk->cls) != 0){
+    held = r_time() - lk->since;
+    max = __atomic_load_n(&c->maxhold, __ATOMIC_RELAXED);
+    while(held > max &&
+          !__atomic_compare_exchange_n(&c->maxhold, &max, held, 0,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+  }
+
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -59,14 +148,10 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  // Hand the lock to the next ticket. Only the holder writes
+  // owner, and a 32-bit aligned store is a single instruction,
+  // so this needn't be an atomic add.
+  __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
 
   pop_off();
 }
@@ -77,7 +162,7 @@ int
 holding(struct spinlock *lk)
 {
   int r;
-  r = (lk->locked && lk->cpu == mycpu());
+  r = (lk->next != lk->owner && lk->cpu == mycpu());
   return r;
 }
 
@@ -108,3 +193,26 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+// Copy out the statistics for up to n lock classes to
+// user address addr. Returns the number copied.
+int
+lockstat(uint64 addr, int n)
+{
+  struct lockstat st;
+  struct lockclass *c;
+  int i;
+
+  for(i = 0; i < n && i < __atomic_load_n(&lockclasses.n, __ATOMIC_ACQUIRE); i++){
+    c = &lockclasses.cls[i];
+    memset(&st, 0, sizeof(st));
+    safestrcpy(st.name, c->name, sizeof(st.name));
+    st.nacquire = c->nacquire;
+    st.ncontend = c->ncontend;
+    st.nspin = c->nspin;
+    st.maxhold = c->maxhold;
+    if(copyout(myproc()->pagetable, addr + i*sizeof(st), (char*)&st, sizeof(st)) < 0)
+      return -1;
+  }
+  return i;
+}
@@ -1,9 +1,15 @@
 // Mutual exclusion lock.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  // A ticket lock: a CPU takes the next ticket, and holds
+  // the lock once owner reaches it.
+  uint next;         // Next ticket to hand out.
+  uint owner;        // Ticket that holds the lock.
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
-};
 
+  // For lockstat():
+  struct lockclass *cls; // Statistics for locks with this name.
+  uint64 since;          // When the holder acquired it.
+};
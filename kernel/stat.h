@@ -9,3 +9,78 @@ struct stat {
   short nlink; // Number of links to file
   uint64 size; // Size of file in bytes
 };
+
+// Write-ahead log statistics, from logstat().
+struct logstat {
+  int size;        // Data blocks per transaction
+  uint64 ncommit;  // Transactions committed
+  uint64 nwrite;   // Blocks written to the log
+  uint64 nabsorb;  // log_write()s of a block already in the transaction
+  uint64 cycles;   // Total time spent committing, in cycles
+  uint64 maxcycles; // Longest commit, in cycles
+};
+
+// Statistics for the spinlocks with one name, from lockstat().
+struct lockstat {
+  char name[16];
+  uint64 nacquire;  // acquire()s
+  uint64 ncontend;  // acquire()s that had to wait
+  uint64 nspin;     // Times waiters checked the lock
+  uint64 maxhold;   // Longest time held, in cycles
+};
+
+// Block I/O queue statistics for one disk, from blkstat().
+struct blkstat {
+  int dev;
+  int nqueue;       // Hardware queues
+  int depth;        // Blocks queued now
+  int maxdepth;     // Most blocks ever queued at once on one queue
+  uint64 nblock;    // Blocks read and written
+  uint64 nreq;      // Disk requests they were merged into
+};
+
+// Statistics for one system call, from sysstat().
+struct sysstat {
+  uint64 ncall;     // Calls
+  uint64 cycles;    // Total time in them, in cycles
+  uint64 maxcycles; // Longest call, in cycles
+};
+
+// A system call traced with trace(), from traceread().
+struct tracerec {
+  uint64 time;      // When it began, in cycles
+  uint64 cycles;    // How long it took
+  uint64 arg[6];
+  uint64 ret;
+  int pid;
+  int num;          // SYS_ number
+};
+
+// The clock, in the page at TIMEPAGE, which every process
+// can read. The time CSR, also readable from user space,
+// counts hz cycles a second; it read boot at boot.
+struct vtime {
+  uint64 hz;
+  uint64 boot;
+  uint64 ticks;     // As by uptime(), kept up to date
+};
+
+// Resources used by a process, or by its children that
+// it has waited for, from getrusage().
+struct rusage {
+  uint64 utime;     // Clock ticks running in user space
+  uint64 stime;     // Clock ticks running in the kernel
+  uint64 nvcsw;     // Voluntary context switches, to wait
+  uint64 nivcsw;    // Involuntary ones, at the end of a time slice
+  uint64 nread;     // Bytes read
+  uint64 nwrite;    // Bytes written
+  uint64 nblock;    // Blocks read from disk
+  uint64 maxmem;    // Most user memory, in bytes
+};
+
+// A profiling sample, from prof().
+struct profsample {
+  uint64 pc;        // Where the timer interrupted
+  int pid;          // Process running, or 0 if none
+  int user;         // 1 if pc is in user space
+};
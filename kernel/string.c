@@ -1,13 +1,31 @@
 #include "types.h"
 
+// memset, memcmp, and memmove work a uint64 at a time
+// once the pointers are 8-byte aligned, and byte by byte
+// on the ends, or when the two pointers can't both be
+// aligned (RISC-V misaligned loads and stores are slow,
+// if the hardware does them at all).
+
+#define WALIGNED(p) (((uint64)(p) & 7) == 0)
+
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 w;
+
+  for(; n > 0 && !WALIGNED(cdst); n--)
+    *cdst++ = c;
+  if(n >= 8){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    for(; n >= 8; n -= 8, cdst += 8)
+      *(uint64*)cdst = w;
   }
+  while(n-- > 0)
+    *cdst++ = c;
   return dst;
 }
 
@@ -18,6 +36,14 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  if(WALIGNED((uint64)s1 ^ (uint64)s2)){
+    for(; n > 0 && !WALIGNED(s1); n--, s1++, s2++)
+      if(*s1 != *s2)
+        return *s1 - *s2;
+    // skip equal words; a differing one is left to the byte loop.
+    for(; n >= 8 && *(uint64*)s1 == *(uint64*)s2; n -= 8)
+      s1 += 8, s2 += 8;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -41,11 +67,27 @@ memmove(void *dst, const void *src, uint n)
   if(s < d && s + n > d){
     s += n;
     d += n;
+    if(WALIGNED((uint64)s ^ (uint64)d)){
+      for(; n > 0 && !WALIGNED(d); n--)
+        *--d = *--s;
+      for(; n >= 8; n -= 8){
+        d -= 8;
+        s -= 8;
+        *(uint64*)d = *(uint64*)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(WALIGNED((uint64)s ^ (uint64)d)){
+      for(; n > 0 && !WALIGNED(d); n--)
+        *d++ = *s++;
+      for(; n >= 8; n -= 8, d += 8, s += 8)
+        *(uint64*)d = *(uint64*)s;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -6,13 +6,15 @@
 #include "proc.h"
 #include "syscall.h"
 #include "defs.h"
+#include "ring.h"
+#include "stat.h"
 
 // Fetch the uint64 at addr from the current process.
 int
 fetchaddr(uint64 addr, uint64 *ip)
 {
   struct proc *p = myproc();
-  if(addr >= p->sz || addr+sizeof(uint64) > p->sz) // both tests needed, in case of overflow
+  if(addr >= p->mm->sz || addr+sizeof(uint64) > p->mm->sz) // both tests needed, in case of overflow
     return -1;
   if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
     return -1;
@@ -101,6 +103,33 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_logstat(void);
+extern uint64 sys_nice(void);
+extern uint64 sys_nanosleep(void);
+extern uint64 sys_hugesbrk(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_splice(void);
+extern uint64 sys_poll(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_ringsetup(void);
+extern uint64 sys_ringenter(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_futex(void);
+extern uint64 sys_lockstat(void);
+extern uint64 sys_blkstat(void);
+extern uint64 sys_prof(void);
+extern uint64 sys_sysstat(void);
+extern uint64 sys_trace(void);
+extern uint64 sys_traceread(void);
+extern uint64 sys_dmesg(void);
+extern uint64 sys_clocktime(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_getrusage(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -126,8 +155,120 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_logstat] sys_logstat,
+[SYS_nice]    sys_nice,
+[SYS_nanosleep] sys_nanosleep,
+[SYS_hugesbrk] sys_hugesbrk,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_fsync]   sys_fsync,
+[SYS_splice]  sys_splice,
+[SYS_poll]    sys_poll,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
+[SYS_ringsetup] sys_ringsetup,
+[SYS_ringenter] sys_ringenter,
+[SYS_clone]   sys_clone,
+[SYS_futex]   sys_futex,
+[SYS_lockstat] sys_lockstat,
+[SYS_blkstat] sys_blkstat,
+[SYS_prof]    sys_prof,
+[SYS_sysstat] sys_sysstat,
+[SYS_trace]   sys_trace,
+[SYS_traceread] sys_traceread,
+[SYS_dmesg]   sys_dmesg,
+[SYS_clocktime] sys_clocktime,
+[SYS_spawn]   sys_spawn,
+[SYS_getrusage] sys_getrusage,
 };
 
+// System call statistics for the whole system. Each hart
+// keeps its own, so that harts don't share the cache lines.
+static struct callstat callstats[NCPU][NSYSCALL];
+
+// Traced system calls, in a ring for each hart. Tracing
+// doesn't printf(), whose lock would serialize the callers
+// and distort their timings; traceread() drains the rings.
+// A full ring drops records.
+static struct tracering {
+  struct spinlock lock;
+  uint head;            // next record to read
+  uint tail;            // next record to fill in
+  struct tracerec rec[NTRACE];
+} tracerings[NCPU];
+
+void
+syscallinit(void)
+{
+  for(int i = 0; i < NCPU; i++)
+    initlock(&tracerings[i].lock, "trace");
+}
+
+static void
+callcount(struct callstat *st, uint64 cycles)
+{
+  st->ncall++;
+  st->cycles += cycles;
+  if(cycles > st->maxcycles)
+    st->maxcycles = cycles;
+}
+
+// Put a record of a traced call in this hart's ring.
+static void
+tracecall(struct tracerec *t)
+{
+  struct tracering *r;
+
+  push_off();
+  r = &tracerings[cpuid()];
+  acquire(&r->lock);
+  if(r->tail - r->head < NTRACE)
+    r->rec[r->tail++ % NTRACE] = *t;
+  release(&r->lock);
+  pop_off();
+}
+
+// Run system call num, with its arguments in the trapframe,
+// counting it for the process and the system, and tracing
+// it if the process asked to. Returns its result.
+// exit() doesn't return, so it isn't counted.
+static uint64
+runcall(int num)
+{
+  struct proc *p = myproc();
+  struct tracerec t;
+  uint64 t0, ret;
+  int traced;
+
+  traced = (p->tracemask >> num) & 1;
+  if(traced){
+    t.pid = p->pid;
+    t.num = num;
+    for(int i = 0; i < 6; i++)
+      t.arg[i] = argraw(i);
+  }
+  t0 = r_time();
+  ret = syscalls[num]();
+  t.cycles = r_time() - t0;
+
+  // a process's statistics are its own, once proccallstat()
+  // has set them up, but it may move to another hart mid-call.
+  if(p->callstat)
+    callcount(&p->callstat[num], t.cycles);
+  push_off();
+  callcount(&callstats[cpuid()][num], t.cycles);
+  pop_off();
+
+  if(traced){
+    t.time = t0;
+    t.ret = ret;
+    tracecall(&t);
+  }
+  return ret;
+}
+
 void
 syscall(void)
 {
@@ -138,10 +279,143 @@ syscall(void)
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
     // Use num to lookup the system call function for num, call it,
     // and store its return value in p->trapframe->a0
-    p->trapframe->a0 = syscalls[num]();
+    p->trapframe->a0 = runcall(num);
   } else {
     printf("%d %s: unknown sys call %d\n",
             p->pid, p->name, num);
     p->trapframe->a0 = -1;
   }
 }
+
+// User addresses of entry i of a ring's queues.
+#define SQE(ring, i) ((ring) + 4*sizeof(uint) + ((i) % RINGSIZE)*sizeof(struct sqe))
+#define CQE(ring, i) ((ring) + 4*sizeof(uint) + RINGSIZE*sizeof(struct sqe) + \
+                      ((i) % RINGSIZE)*sizeof(struct cqe))
+
+// Run the system calls waiting in the current process's
+// ring, if it has one, as many as there is room for the
+// results of. Called after every system call, with
+// interrupts on, so a process that fills its ring gets the
+// calls run along with the next system call it makes.
+// Calls that replace or copy the trapframe can't be run
+// from the ring, and fail. Returns the number run.
+int
+ringdrain(void)
+{
+  struct proc *p = myproc();
+  struct trapframe tf;
+  struct ring r;
+  struct sqe e;
+  struct cqe c;
+  uint64 ring = p->ring;
+  int num, n;
+
+  if(ring == 0)
+    return 0;
+  if(copyin(p->pagetable, (char*)&r, ring, 4*sizeof(uint)) < 0)
+    return -1;
+  tf = *p->trapframe;
+  for(n = 0; r.sqhead != r.sqtail && r.cqtail - r.cqhead < RINGSIZE; n++){
+    if(copyin(p->pagetable, (char*)&e, SQE(ring, r.sqhead), sizeof(e)) < 0)
+      break;
+    num = e.num;
+    c.data = e.data;
+    c.ret = -1;
+    if(num > 0 && num < NELEM(syscalls) && syscalls[num] &&
+       num != SYS_fork && num != SYS_exec && num != SYS_exit &&
+       num != SYS_ringsetup && num != SYS_ringenter &&
+       num != SYS_clone){
+      p->trapframe->a0 = e.arg[0];
+      p->trapframe->a1 = e.arg[1];
+      p->trapframe->a2 = e.arg[2];
+      p->trapframe->a3 = e.arg[3];
+      p->trapframe->a4 = e.arg[4];
+      p->trapframe->a5 = e.arg[5];
+      p->trapframe->a7 = num;
+      c.ret = runcall(num);
+    }
+    if(copyout(p->pagetable, CQE(ring, r.cqtail), (char*)&c, sizeof(c)) < 0)
+      break;
+    r.sqhead++;
+    r.cqtail++;
+    if(killed(p))
+      break;
+  }
+  *p->trapframe = tf;
+  if(n > 0){
+    copyout(p->pagetable, ring, (char*)&r.sqhead, sizeof(uint));
+    copyout(p->pagetable, ring + 3*sizeof(uint), (char*)&r.cqtail, sizeof(uint));
+  }
+  return n;
+}
+
+// Copy the statistics for up to n system call numbers, from
+// 0 up, to user address addr, an array of struct sysstat:
+// those of the process pid, of the caller if pid is 0, or
+// of the whole system if pid is -1. A process's calls are
+// counted only from the first sysstat() that asks for them.
+// Returns the number copied.
+int
+sysstat(int pid, uint64 addr, int n)
+{
+  struct callstat *cs;
+  struct sysstat st;
+  int i, c;
+
+  if(n > NSYSCALL)
+    n = NSYSCALL;
+  if((cs = kmalloc(NSYSCALL * sizeof(*cs))) == 0)
+    return -1;
+  memset(cs, 0, NSYSCALL * sizeof(*cs));
+  if(pid == -1){
+    // a racing call may be half counted; it's only statistics.
+    for(c = 0; c < NCPU; c++){
+      for(i = 0; i < n; i++){
+        cs[i].ncall += callstats[c][i].ncall;
+        cs[i].cycles += callstats[c][i].cycles;
+        if(callstats[c][i].maxcycles > cs[i].maxcycles)
+          cs[i].maxcycles = callstats[c][i].maxcycles;
+      }
+    }
+  } else if(proccallstat(pid ? pid : myproc()->pid, cs) < 0){
+    kmfree(cs);
+    return -1;
+  }
+
+  for(i = 0; i < n; i++){
+    st.ncall = cs[i].ncall;
+    st.cycles = cs[i].cycles;
+    st.maxcycles = cs[i].maxcycles;
+    if(copyout(myproc()->pagetable, addr + i*sizeof(st), (char*)&st, sizeof(st)) < 0)
+      break;
+  }
+  kmfree(cs);
+  return i;
+}
+
+// Copy up to n traced calls to user address addr, an array
+// of struct tracerec, and take them off the rings. Records
+// are oldest first from each hart, but not across harts.
+// Returns the number copied.
+int
+traceread(uint64 addr, int n)
+{
+  struct tracering *r;
+  struct tracerec t;
+  int i;
+
+  i = 0;
+  for(r = tracerings; r < tracerings + NCPU && i < n; r++){
+    acquire(&r->lock);
+    while(r->head != r->tail && i < n){
+      t = r->rec[r->head++ % NTRACE];
+      release(&r->lock);
+      if(copyout(myproc()->pagetable, addr + i*sizeof(t), (char*)&t, sizeof(t)) < 0)
+        return -1;
+      i++;
+      acquire(&r->lock);
+    }
+    release(&r->lock);
+  }
+  return i;
+}
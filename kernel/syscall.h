@@ -20,3 +20,30 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_logstat 22
+#define SYS_nice   23
+#define SYS_nanosleep 24
+#define SYS_hugesbrk 25
+#define SYS_mmap   26
+#define SYS_munmap 27
+#define SYS_fsync  28
+#define SYS_splice 29
+#define SYS_poll   30
+#define SYS_readv  31
+#define SYS_writev 32
+#define SYS_pread  33
+#define SYS_pwrite 34
+#define SYS_ringsetup 35
+#define SYS_ringenter 36
+#define SYS_clone  37
+#define SYS_futex  38
+#define SYS_lockstat 39
+#define SYS_blkstat 40
+#define SYS_prof   41
+#define SYS_sysstat 42
+#define SYS_trace  43
+#define SYS_traceread 44
+#define SYS_dmesg  45
+#define SYS_clocktime 46
+#define SYS_spawn  47
+#define SYS_getrusage 48
@@ -25,7 +25,7 @@ argfd(int n, int *pfd, struct file **pf)
   struct file *f;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= myproc()->nofile || (f=myproc()->ofile[fd]) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -34,23 +34,6 @@ argfd(int n, int *pfd, struct file **pf)
   return 0;
 }
 
-// Allocate a file descriptor for the given file.
-// Takes over file reference from caller on success.
-static int
-fdalloc(struct file *f)
-{
-  int fd;
-  struct proc *p = myproc();
-
-  for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
-      return fd;
-    }
-  }
-  return -1;
-}
-
 uint64
 sys_dup(void)
 {
@@ -76,7 +59,7 @@ sys_read(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
-  return fileread(f, p, n);
+  return fileread(f, 1, p, n);
 }
 
 uint64
@@ -91,7 +74,89 @@ sys_write(void)
   if(argfd(0, 0, &f) < 0)
     return -1;
 
-  return filewrite(f, p, n);
+  return filewrite(f, 1, p, n);
+}
+
+// Fetch the nth and n+1th system call arguments as an
+// array of struct iovec and its length, into iov.
+// Returns the number of iovecs, or -1.
+static int
+argiov(int n, struct iovec *iov)
+{
+  uint64 addr;
+  int niov;
+
+  argaddr(n, &addr);
+  argint(n+1, &niov);
+  if(niov < 0 || niov > NIOV)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)iov, addr, niov*sizeof(iov[0])) < 0)
+    return -1;
+  return niov;
+}
+
+uint64
+sys_readv(void)
+{
+  struct iovec iov[NIOV];
+  struct file *f;
+  int niov;
+
+  if(argfd(0, 0, &f) < 0 || (niov = argiov(1, iov)) < 0)
+    return -1;
+  return filereadv(f, 1, iov, niov, 0);
+}
+
+uint64
+sys_writev(void)
+{
+  struct iovec iov[NIOV];
+  struct file *f;
+  int niov;
+
+  if(argfd(0, 0, &f) < 0 || (niov = argiov(1, iov)) < 0)
+    return -1;
+  return filewritev(f, 1, iov, niov, 0);
+}
+
+// Read at an offset, leaving the file's offset alone.
+uint64
+sys_pread(void)
+{
+  struct iovec iov;
+  struct file *f;
+  uint64 p;
+  int n;
+  uint off;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, (int*)&off);
+  if(argfd(0, 0, &f) < 0 || n < 0)
+    return -1;
+  iov.iov_base = (void*)p;
+  iov.iov_len = n;
+  return filereadv(f, 1, &iov, 1, &off);
+}
+
+// Write at an offset, leaving the file's offset alone.
+uint64
+sys_pwrite(void)
+{
+  struct iovec iov;
+  struct file *f;
+  uint64 p;
+  int n;
+  uint off;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, (int*)&off);
+  if(argfd(0, 0, &f) < 0 || n < 0)
+    return -1;
+  iov.iov_base = (void*)p;
+  iov.iov_len = n;
+  return filewritev(f, 1, &iov, 1, &off);
 }
 
 uint64
@@ -102,7 +167,7 @@ sys_close(void)
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  fdfree(fd);
   fileclose(f);
   return 0;
 }
@@ -119,6 +184,62 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// Wait for some of an array of struct pollfd to be ready.
+uint64
+sys_poll(void)
+{
+  struct pollfd pfd[NPOLL];
+  struct file *f[NPOLL];
+  struct proc *p = myproc();
+  uint64 addr;
+  int i, n, ms, r;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  argint(2, &ms);
+  if(n < 0 || n > NPOLL)
+    return -1;
+  if(copyin(p->pagetable, (char*)pfd, addr, n*sizeof(pfd[0])) < 0)
+    return -1;
+  // hold the files, in case another thread closes them.
+  for(i = 0; i < n; i++){
+    f[i] = 0;
+    if(pfd[i].fd >= 0 && pfd[i].fd < p->nofile && p->ofile[pfd[i].fd])
+      f[i] = filedup(p->ofile[pfd[i].fd]);
+  }
+  r = filepoll(f, pfd, n, ms);
+  for(i = 0; i < n; i++)
+    if(f[i])
+      fileclose(f[i]);
+  if(r >= 0 && copyout(p->pagetable, addr, (char*)pfd, n*sizeof(pfd[0])) < 0)
+    return -1;
+  return r;
+}
+
+// Move data between a pipe and another file.
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  argint(2, &n);
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
+
+// Write an open file's cached data to disk.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f);
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -169,27 +290,10 @@ bad:
   return -1;
 }
 
-// Is the directory dp empty except for "." and ".." ?
-static int
-isdirempty(struct inode *dp)
-{
-  int off;
-  struct dirent de;
-
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("isdirempty: readi");
-    if(de.inum != 0)
-      return 0;
-  }
-  return 1;
-}
-
 uint64
 sys_unlink(void)
 {
   struct inode *ip, *dp;
-  struct dirent de;
   char name[DIRSIZ], path[MAXPATH];
   uint off;
 
@@ -214,14 +318,13 @@ sys_unlink(void)
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
-  if(ip->type == T_DIR && !isdirempty(ip)){
+  if(ip->type == T_DIR && !dirempty(ip)){
     iunlockput(ip);
     goto bad;
   }
 
-  memset(&de, 0, sizeof(de));
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("unlink: writei");
+  dirunlink(dp, off);
+  dcenter(dp->dev, dp->inum, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -352,6 +455,8 @@ sys_open(void)
   if(ip->type == T_DEVICE){
     f->type = FD_DEVICE;
     f->major = ip->major;
+    f->minor = ip->minor;
+    f->off = 0;
   } else {
     f->type = FD_INODE;
     f->off = 0;
@@ -364,6 +469,14 @@ sys_open(void)
     itrunc(ip);
   }
 
+  // O_EXTENT switches an empty file to the extent format.
+  if((omode & O_EXTENT) && ip->type == T_FILE && ip->size == 0 &&
+     !(ip->flags & I_EXTENT)){
+    itrunc(ip);
+    ip->flags |= I_EXTENT;
+    iupdate(ip);
+  }
+
   iunlock(ip);
   end_op();
 
@@ -474,6 +587,78 @@ sys_exec(void)
   return -1;
 }
 
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  struct spawnact act[NSPAWNACT];
+  int i, n, ret;
+  uint64 uargv, uarg, uact;
+
+  argaddr(1, &uargv);
+  argaddr(2, &uact);
+  argint(3, &n);
+  if(n < 0 || n > NSPAWNACT)
+    return -1;
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)act, uact, n*sizeof(act[0])) < 0)
+    return -1;
+  ret = -1;
+  memset(argv, 0, sizeof(argv));
+  for(i=0;; i++){
+    if(i >= NELEM(argv))
+      goto out;
+    if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0)
+      goto out;
+    if(uarg == 0){
+      argv[i] = 0;
+      break;
+    }
+    argv[i] = kalloc();
+    if(argv[i] == 0)
+      goto out;
+    if(fetchstr(uarg, argv[i], PGSIZE) < 0)
+      goto out;
+  }
+
+  ret = spawn(path, argv, act, n);
+
+ out:
+  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
+    kfree(argv[i]);
+  return ret;
+}
+
+uint64
+sys_logstat(void)
+{
+  uint64 addr; // user pointer to struct logstat
+  struct logstat st;
+
+  argaddr(0, &addr);
+  logstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+uint64
+sys_blkstat(void)
+{
+  int dev;
+  uint64 addr; // user pointer to struct blkstat
+  struct blkstat st;
+
+  argint(0, &dev);
+  argaddr(1, &addr);
+  if(blkstat(dev, &st) < 0)
+    return -1;
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
 uint64
 sys_pipe(void)
 {
@@ -488,18 +673,45 @@ sys_pipe(void)
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      p->ofile[fd0] = 0;
+      fdfree(fd0);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+    fdfree(fd0);
+    fdfree(fd1);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   return 0;
 }
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len;
+  int prot, flags, off;
+  struct file *f;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if(argfd(4, 0, &f) < 0)
+    return -1;
+  return mmap(addr, len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
@@ -5,6 +5,9 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "ring.h"
+#include "fcntl.h"
+#include "stat.h"
 
 uint64
 sys_exit(void)
@@ -38,36 +41,42 @@ sys_wait(void)
 uint64
 sys_sbrk(void)
 {
-  uint64 addr;
   int n;
 
   argint(0, &n);
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
-    return -1;
-  return addr;
+  return growproc(n);
+}
+
+// Like sbrk(), but back the new memory with megapages.
+uint64
+sys_hugesbrk(void)
+{
+  int n;
+
+  argint(0, &n);
+  return growhuge(n);
 }
 
 uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   argint(0, &n);
   if(n < 0)
     n = 0;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(killed(myproc())){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  return timersleep(r_time() + (uint64)n * TICKCYCLES);
+}
+
+// Sleep for a number of nanoseconds, which
+// needn't be a whole number of clock ticks.
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns;
+
+  argaddr(0, &ns);
+  return timersleep(r_time() + ns / (1000000000 / TIMEHZ));
 }
 
 uint64
@@ -79,6 +88,16 @@ sys_kill(void)
   return kill(pid);
 }
 
+uint64
+sys_nice(void)
+{
+  int pid, prio;
+
+  argint(0, &pid);
+  argint(1, &prio);
+  return nice(pid, prio);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
@@ -91,3 +110,180 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// Register a system call ring (see ring.h) at addr,
+// or none if addr is 0.
+uint64
+sys_ringsetup(void)
+{
+  struct proc *p = myproc();
+  uint64 addr;
+  char c;
+
+  argaddr(0, &addr);
+  if(addr % sizeof(uint64) != 0)
+    return -1;
+  if(addr && (copyin(p->pagetable, &c, addr, 1) < 0 ||
+              copyin(p->pagetable, &c, addr + sizeof(struct ring) - 1, 1) < 0))
+    return -1;
+  p->ring = addr;
+  return 0;
+}
+
+// Run the calls waiting in the ring now.
+uint64
+sys_ringenter(void)
+{
+  return ringdrain();
+}
+
+// Start a thread that shares the caller's memory,
+// running fn(arg) on the given stack.
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_futex(void)
+{
+  uint64 addr;
+  int op, val;
+
+  argaddr(0, &addr);
+  argint(1, &op);
+  argint(2, &val);
+  switch(op){
+  case FUTEX_WAIT:
+    return futexwait(addr, val);
+  case FUTEX_WAKE:
+    return futexwake(addr);
+  }
+  return -1;
+}
+
+// Copy statistics for up to n lock names to addr,
+// an array of struct lockstat.
+uint64
+sys_lockstat(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return lockstat(addr, n);
+}
+
+// Control the sampling profiler; see profctl().
+uint64
+sys_prof(void)
+{
+  uint64 addr;
+  int cmd, n;
+
+  argint(0, &cmd);
+  argaddr(1, &addr);
+  argint(2, &n);
+  return profctl(cmd, addr, n);
+}
+
+// Copy statistics for up to n system call numbers to addr,
+// an array of struct sysstat; see sysstat().
+uint64
+sys_sysstat(void)
+{
+  uint64 addr;
+  int pid, n;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  argint(2, &n);
+  return sysstat(pid, addr, n);
+}
+
+// Trace the caller's system calls whose bits are set in the
+// mask, and those of the children it forks from now on.
+uint64
+sys_trace(void)
+{
+  uint64 mask;
+
+  argaddr(0, &mask);
+  myproc()->tracemask = mask;
+  return 0;
+}
+
+// Copy up to n traced system calls to addr, an
+// array of struct tracerec.
+uint64
+sys_traceread(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return traceread(addr, n);
+}
+
+// Copy up to n bytes of the kernel's log to addr.
+uint64
+sys_dmesg(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return dmesg(addr, n);
+}
+
+// nanoseconds since boot, the clock that nanotime()
+// in ulib.c reads without a system call.
+uint64
+sys_clocktime(void)
+{
+  uint64 t = r_time() - vtime->boot;
+
+  return t / vtime->hz * 1000000000 + t % vtime->hz * 1000000000 / vtime->hz;
+}
+
+// Copy the resources this process has used, if who is
+// RUSAGE_SELF, or its children that it has waited for,
+// if RUSAGE_CHILDREN, to user address addr, a struct rusage.
+uint64
+sys_getrusage(void)
+{
+  struct proc *p = myproc();
+  struct usage *u;
+  struct rusage ru;
+  uint64 addr;
+  int who;
+
+  argint(0, &who);
+  argaddr(1, &addr);
+  if(who == RUSAGE_SELF)
+    u = &p->usage;
+  else if(who == RUSAGE_CHILDREN)
+    u = &p->cusage;
+  else
+    return -1;
+  ru.utime = u->utime;
+  ru.stime = u->stime;
+  ru.nvcsw = u->nvcsw;
+  ru.nivcsw = u->nivcsw;
+  ru.nread = u->nread;
+  ru.nwrite = u->nwrite;
+  ru.nblock = u->nblock;
+  ru.maxmem = u->maxmem;
+  if(copyout(p->pagetable, addr, (char*)&ru, sizeof(ru)) < 0)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,197 @@
+// Timer wheel.
+//
+// A timed sleep waits on a struct timer in a hierarchical
+// timer wheel, so that a clock tick wakes only the processes
+// whose deadlines have passed, not every timed sleeper.
+// Deadlines are in cycles of the time CSR.
+//
+// Level 0 of the wheel has a slot for each of the next
+// WHEELSIZE ticks, level 1 a slot for each of the next
+// WHEELSIZE runs of WHEELSIZE ticks, and so on. Each time
+// level 0 wraps around, the current slot of level 1 is
+// cascaded down into it, and likewise for the higher levels.
+//
+// Hart 0 calls timerexpire() on every tick. A sleep that
+// ends before the sleeping CPU's next tick also sets an alarm
+// on that CPU (see clockalarm()), so short sleeps aren't
+// rounded up to a whole tick.
+//
+// Instead of waking a sleeper, a timer can call a function
+// at its deadline (see timerstart()), so that poll() can
+// wait for a file or a timeout at once.
+//
+// Lock order: wheel.lock, then the locks a timer's function
+// takes, then the sleep queue locks.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "timer.h"
+
+#define WHEELBITS 6
+#define WHEELSIZE (1 << WHEELBITS)
+#define NLEVEL    4
+
+struct {
+  struct spinlock lock;
+  uint64 now;           // the tick level 0's current slot is for
+  struct timer *slot[NLEVEL][WHEELSIZE];
+} wheel;
+
+void
+wheelinit(void)
+{
+  initlock(&wheel.lock, "wheel");
+  wheel.now = r_time() / TICKCYCLES;
+}
+
+// Put t in the slot for its deadline.
+// Caller must hold wheel.lock.
+static void
+tadd(struct timer *t)
+{
+  uint64 tick, d;
+  int l;
+
+  tick = t->when / TICKCYCLES;
+  if(tick < wheel.now)
+    tick = wheel.now;
+  d = tick - wheel.now;
+  if(d >= (1L << (WHEELBITS*NLEVEL))){
+    // too far off for the wheel: park it in the last slot,
+    // and it'll be put back when that slot cascades.
+    d = (1L << (WHEELBITS*NLEVEL)) - 1;
+    tick = wheel.now + d;
+  }
+  for(l = 0; d >= (1L << (WHEELBITS*(l+1))); l++)
+    ;
+  t->slot = &wheel.slot[l][(tick >> (WHEELBITS*l)) & (WHEELSIZE-1)];
+  t->next = *t->slot;
+  *t->slot = t;
+}
+
+// Take t off the wheel before it expires.
+// Caller must hold wheel.lock.
+static void
+tdel(struct timer *t)
+{
+  struct timer **pp;
+
+  for(pp = t->slot; *pp != t; pp = &(*pp)->next)
+    ;
+  *pp = t->next;
+  t->slot = 0;
+}
+
+// Move the timers in level l's current slot
+// down to the lower levels.
+static void
+cascade(int l)
+{
+  struct timer *t, *next;
+  int s;
+
+  s = (wheel.now >> (WHEELBITS*l)) & (WHEELSIZE-1);
+  t = wheel.slot[l][s];
+  wheel.slot[l][s] = 0;
+  for(; t; t = next){
+    next = t->next;
+    tadd(t);
+  }
+}
+
+// Wake the sleepers whose deadlines are at or before now.
+// Returns the earliest deadline left in the current tick,
+// or 0 if there is none.
+uint64
+timerexpire(uint64 now)
+{
+  struct timer *t, **pp;
+  uint64 soon;
+  int l;
+
+  acquire(&wheel.lock);
+  for(;;){
+    pp = &wheel.slot[0][wheel.now & (WHEELSIZE-1)];
+    while((t = *pp) != 0){
+      if(t->when <= now){
+        *pp = t->next;
+        t->slot = 0;
+        if(t->fn)
+          t->fn(t->arg);
+        else
+          wakeup(t);
+      } else {
+        pp = &t->next;
+      }
+    }
+    if(wheel.now >= now / TICKCYCLES)
+      break;
+    wheel.now++;
+    for(l = 1; l < NLEVEL && (wheel.now & ((1L << (WHEELBITS*l)) - 1)) == 0; l++)
+      cascade(l);
+  }
+
+  soon = 0;
+  for(t = wheel.slot[0][wheel.now & (WHEELSIZE-1)]; t; t = t->next)
+    if(soon == 0 || t->when < soon)
+      soon = t->when;
+  release(&wheel.lock);
+  return soon;
+}
+
+// Sleep until the time CSR reaches when.
+// Returns -1 if killed first, 0 otherwise.
+int
+timersleep(uint64 when)
+{
+  struct timer t;
+  struct proc *p = myproc();
+
+  if(when <= r_time())
+    return 0;
+  acquire(&wheel.lock);
+  t.when = when;
+  t.fn = 0;
+  tadd(&t);
+  clockalarm(when);
+  while(t.slot){
+    if(killed(p)){
+      tdel(&t);
+      release(&wheel.lock);
+      return -1;
+    }
+    sleep(&t, &wheel.lock);
+  }
+  release(&wheel.lock);
+  return 0;
+}
+
+// Call fn(arg) when the time CSR reaches when, with
+// wheel.lock held, unless timerstop(t) comes first.
+void
+timerstart(struct timer *t, uint64 when, void (*fn)(void*), void *arg)
+{
+  acquire(&wheel.lock);
+  t->when = when;
+  t->fn = fn;
+  t->arg = arg;
+  tadd(t);
+  clockalarm(when);
+  release(&wheel.lock);
+}
+
+// Take t off the wheel, if it hasn't expired. Once this
+// returns, t's function isn't running and won't be called.
+void
+timerstop(struct timer *t)
+{
+  acquire(&wheel.lock);
+  if(t->slot)
+    tdel(t);
+  release(&wheel.lock);
+}
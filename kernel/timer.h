@@ -0,0 +1,8 @@
+// A timed wait on the timer wheel, see timer.c.
+struct timer {
+  uint64 when;          // deadline
+  struct timer *next;
+  struct timer **slot;  // wheel slot it is on, 0 once expired
+  void (*fn)(void*);    // called at the deadline; 0 to wakeup(t)
+  void *arg;
+};
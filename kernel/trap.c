@@ -5,9 +5,12 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fcntl.h"
+#include "stat.h"
 
 struct spinlock tickslock;
 uint ticks;
+struct vtime *vtime;  // mapped read-only at TIMEPAGE in every process
 
 extern char trampoline[], uservec[], userret[];
 
@@ -20,6 +23,11 @@ void
 trapinit(void)
 {
   initlock(&tickslock, "time");
+  if((vtime = kalloc()) == 0)
+    panic("trapinit: vtime");
+  memset(vtime, 0, PGSIZE);
+  vtime->hz = TIMEHZ;
+  vtime->boot = r_time();
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -46,6 +54,12 @@ usertrap(void)
   w_stvec((uint64)kernelvec);
 
   struct proc *p = myproc();
+
+  // see mmwait() in vm.c.
+  if(p->inuser){
+    __sync_fetch_and_sub(&p->mm->nuser, 1);
+    p->inuser = 0;
+  }
   
   // save user program counter.
   p->trapframe->epc = r_sepc();
@@ -65,8 +79,21 @@ usertrap(void)
     intr_on();
 
     syscall();
+
+    // then the ones the process queued in its ring.
+    if(p->ring && !killed(p))
+      ringdrain();
   } else if((which_dev = devintr()) != 0){
-    // ok
+    if(which_dev == 2)
+      p->usage.utime++;
+  } else if((r_scause() == 13 || r_scause() == 15) &&
+            uvmfault(r_stval(), r_scause() == 15) == 0){
+    // first touch of a heap page, which is now allocated, or a
+    // store to a copy-on-write page, which now has its own copy.
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmafault(r_stval(), r_scause() == 12 ? PROT_EXEC :
+                                r_scause() == 13 ? PROT_READ : PROT_WRITE) == 0){
+    // a page of a memory-mapped file, now filled in.
   } else {
     printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
     printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
@@ -76,8 +103,9 @@ usertrap(void)
   if(killed(p))
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this is a timer interrupt and
+  // the process has used up its quantum.
+  if(which_dev == 2 && --mycpu()->slice <= 0)
     yield();
 
   usertrapret();
@@ -119,14 +147,37 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
+  // a thread counts itself as in user space before it looks at
+  // the TLB, and mm->lock keeps it from doing either while another
+  // thread changes the page table; see mmwait() in vm.c.
+  struct mm *mm = p->mm;
+  if(mm->ref > 1){
+    acquire(&mm->lock);
+    __sync_fetch_and_add(&mm->nuser, 1);
+    p->inuser = 1;
+  }
+
   // tell trampoline.S the user page table to switch to.
+  // with ASIDs, this CPU's TLB entries for the process
+  // survive until its page table changes; trampoline.S
+  // flushes the whole TLB with every switch otherwise.
   uint64 satp = MAKE_SATP(p->pagetable);
+  if(asids){
+    struct cpu *c = mycpu();
+    satp |= SATP_ASID(p->asid);
+    if(c->tlbgen[p->asid-1] != mm->tlbgen){
+      sfence_vma_asid(p->asid);
+      c->tlbgen[p->asid-1] = mm->tlbgen;
+    }
+  }
+  if(p->inuser)
+    release(&mm->lock);
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64, uint64))trampoline_userret)(satp, p->tfva);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -149,9 +200,12 @@ kerneltrap()
     printf("scause=0x%lx sepc=0x%lx stval=0x%lx\n", scause, r_sepc(), r_stval());
     panic("kerneltrap");
   }
-
-  // give up the CPU if this is a timer interrupt.
   if(which_dev == 2 && myproc() != 0)
+    myproc()->usage.stime++;
+
+  // give up the CPU if this is a timer interrupt and
+  // the process has used up its quantum.
+  if(which_dev == 2 && myproc() != 0 && --mycpu()->slice <= 0)
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -160,25 +214,80 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
-void
+// returns 1 if a clock tick has passed, 0 if this
+// interrupt is only for an alarm.
+int
 clockintr()
 {
-  if(cpuid() == 0){
-    acquire(&tickslock);
-    ticks++;
-    wakeup(&ticks);
-    release(&tickslock);
+  struct cpu *c = mycpu();
+  uint64 now = r_time();
+  uint64 soon;
+  int tick = 0, alarm = 0;
+
+  if(now >= c->nexttick){
+    if(cpuid() == 0){
+      acquire(&tickslock);
+      ticks++;
+      vtime->ticks = ticks;
+      release(&tickslock);
+    }
+    c->nexttick = now + TICKCYCLES;
+    tick = 1;
   }
 
+  if(c->alarm && c->alarm <= now){
+    c->alarm = 0;
+    alarm = 1;
+  }
+  if(cpuid() == 0 || alarm){
+    soon = timerexpire(now);
+    if(soon)
+      clockalarm(soon);
+  }
+  if((soon = profintr(now)) != 0)
+    clockalarm(soon);
+
   // ask for the next timer interrupt. this also clears
-  // the interrupt request. 1000000 is about a tenth
-  // of a second.
-  w_stimecmp(r_time() + 1000000);
+  // the interrupt request.
+  clockset(c->nexttick);
+  return tick;
+}
+
+// ask for a timer interrupt on this CPU at time when,
+// if that is before its next tick, so that timerexpire()
+// runs then.
+void
+clockalarm(uint64 when)
+{
+  struct cpu *c;
+
+  push_off();
+  c = mycpu();
+  if(when < c->nexttick && (c->alarm == 0 || when < c->alarm)){
+    c->alarm = when;
+    w_stimecmp(when);
+  }
+  pop_off();
+}
+
+// program this CPU's timer for when, or for its
+// alarm if that is sooner.
+void
+clockset(uint64 when)
+{
+  struct cpu *c;
+
+  push_off();
+  c = mycpu();
+  if(c->alarm && c->alarm < when)
+    when = c->alarm;
+  w_stimecmp(when);
+  pop_off();
 }
 
 // check if it's an external interrupt or software interrupt,
 // and handle it.
-// returns 2 if timer interrupt,
+// returns 2 if a clock tick,
 // 1 if other device,
 // 0 if not recognized.
 int
@@ -209,8 +318,7 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000005L){
     // timer interrupt.
-    clockintr();
-    return 2;
+    return clockintr() ? 2 : 1;
   } else {
     return 0;
   }
@@ -33,17 +33,19 @@
 #define LCR_BAUD_LATCH (1<<7) // special mode to set baud rate
 #define LSR 5                 // line status register
 #define LSR_RX_READY (1<<0)   // input is waiting to be read from RHR
-#define LSR_TX_IDLE (1<<5)    // THR can accept another character to send
+#define LSR_TX_IDLE (1<<5)    // THR and the transmit FIFO are empty
+#define FIFO_SIZE 16          // bytes the transmit FIFO holds
 
 #define ReadReg(reg) (*(Reg(reg)))
 #define WriteReg(reg, v) (*(Reg(reg)) = (v))
 
 // the transmit output buffer.
 struct spinlock uart_tx_lock;
-#define UART_TX_BUF_SIZE 32
+#define UART_TX_BUF_SIZE PGSIZE
 char uart_tx_buf[UART_TX_BUF_SIZE];
 uint64 uart_tx_w; // write next to uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE]
 uint64 uart_tx_r; // read next from uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE]
+int uart_tx_busy; // sending; its interrupt will get to the kernel log
 
 extern volatile int panicked; // from printf.c
 
@@ -77,28 +79,36 @@ uartinit(void)
   initlock(&uart_tx_lock, "uart");
 }
 
-// add a character to the output buffer and tell the
-// UART to start sending if it isn't already.
-// blocks if the output buffer is full.
+// add n bytes from buf to the output buffer and tell
+// the UART to start sending if it isn't already.
+// blocks while the output buffer is full.
 // because it may block, it can't be called
 // from interrupts; it's only suitable for use
 // by write().
 void
-uartputc(int c)
+uartwrite(char *buf, int n)
 {
+  int i;
+
   acquire(&uart_tx_lock);
 
   if(panicked){
     for(;;)
       ;
   }
-  while(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE){
-    // buffer is full.
-    // wait for uartstart() to open up space in the buffer.
-    sleep(&uart_tx_r, &uart_tx_lock);
+  i = 0;
+  while(i < n){
+    while(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE){
+      // buffer is full.
+      // wait for uartstart() to open up space in the buffer.
+      uartstart();
+      sleep(&uart_tx_r, &uart_tx_lock);
+    }
+    while(i < n && uart_tx_w != uart_tx_r + UART_TX_BUF_SIZE){
+      uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE] = buf[i++];
+      uart_tx_w += 1;
+    }
   }
-  uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE] = c;
-  uart_tx_w += 1;
   uartstart();
   release(&uart_tx_lock);
 }
@@ -126,35 +136,64 @@ uartputc_sync(int c)
   pop_off();
 }
 
-// if the UART is idle, and a character is waiting
-// in the transmit buffer, send it.
+// if the UART's transmit FIFO is empty, fill it with
+// what is waiting in the transmit buffer or the kernel log.
 // caller must hold uart_tx_lock.
 // called from both the top- and bottom-half.
 void
 uartstart()
 {
-  while(1){
-    if(uart_tx_w == uart_tx_r){
-      // transmit buffer is empty.
-      ReadReg(ISR);
-      return;
-    }
-    
-    if((ReadReg(LSR) & LSR_TX_IDLE) == 0){
-      // the UART transmit holding register is full,
-      // so we cannot give it another byte.
-      // it will interrupt when it's ready for a new byte.
-      return;
+  uint64 r;
+  int c, i;
+
+  if(panicked){
+    // panic() prints the rest of the log itself.
+    return;
+  }
+
+  if((ReadReg(LSR) & LSR_TX_IDLE) == 0){
+    // the UART is still sending what it has; it will
+    // interrupt when its FIFO is empty.
+    return;
+  }
+
+  r = uart_tx_r;
+  for(i = 0; i < FIFO_SIZE; i++){
+    if(uart_tx_w != uart_tx_r){
+      c = uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE];
+      uart_tx_r += 1;
+    } else if((c = klogc()) < 0){
+      if(i > 0)
+        break;
+      // nothing to send. look at the log once more after
+      // clearing busy, in case a printf() saw busy set
+      // and left its message to us.
+      __atomic_store_n(&uart_tx_busy, 0, __ATOMIC_SEQ_CST);
+      if((c = klogc()) < 0){
+        ReadReg(ISR);
+        return;
+      }
     }
-    
-    int c = uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE];
-    uart_tx_r += 1;
-    
-    // maybe uartputc() is waiting for space in the buffer.
-    wakeup(&uart_tx_r);
-    
+    __atomic_store_n(&uart_tx_busy, 1, __ATOMIC_SEQ_CST);
     WriteReg(THR, c);
   }
+
+  // maybe uartwrite() is waiting for space in the buffer.
+  if(uart_tx_r != r)
+    wakeup(&uart_tx_r);
+}
+
+// start sending the kernel log, unless the UART is busy
+// and so will get to it from its interrupt. called by
+// printf() once it has appended a message.
+void
+uartkick(void)
+{
+  if(__atomic_load_n(&uart_tx_busy, __ATOMIC_SEQ_CST))
+    return;
+  acquire(&uart_tx_lock);
+  uartstart();
+  release(&uart_tx_lock);
 }
 
 // read one input character from the UART.
@@ -29,6 +29,7 @@
 #define VIRTIO_MMIO_DRIVER_DESC_HIGH	0x094
 #define VIRTIO_MMIO_DEVICE_DESC_LOW	0x0a0 // physical address for used ring, write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration space
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -45,9 +46,15 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
+// offset of the 16-bit num_queues in a block
+// device's configuration space.
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES 34
+
+// this many virtio descriptors per queue.
 // must be a power of two.
-#define NUM 8
+// a one-block request uses three, so this allows
+// about 40 of those in flight at once.
+#define NUM 128
 
 // a single descriptor, from the spec.
 struct virtq_desc {
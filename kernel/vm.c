@@ -3,6 +3,9 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fcntl.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -11,18 +14,31 @@
  */
 pagetable_t kernel_pagetable;
 
+// does the hardware have enough ASIDs to give
+// every process its own? the kernel's is 0.
+int asids;
+
+// the last mm->tlbgen handed out. each change to a page
+// table gets a new one, never used before, so that a CPU's
+// c->tlbgen for an ASID can't match by chance after the
+// ASID's process moves to a different page table.
+uint64 tlbgens;
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static pte_t *walklevel(pagetable_t, uint64, int, int *);
+static int mapleaf(pagetable_t, uint64, uint64, int, int);
+static int megacopy(pagetable_t, uint64, uint64, int);
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kzalloc();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -43,9 +59,8 @@ kvmmake(void)
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // allocate and map a kernel stack for each process.
-  proc_mapstacks(kpgtbl);
-  
+  // procgrow() maps the kernel stacks as processes are made.
+
   return kpgtbl;
 }
 
@@ -68,6 +83,55 @@ kvminithart()
 
   // flush stale entries from the TLB.
   sfence_vma();
+
+  // the ASID bits the hardware implements read back as ones.
+  if(cpuid() == 0){
+    w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID(0xffff));
+    asids = (r_satp() >> 44 & 0xffff) >= NPROC;
+    w_satp(MAKE_SATP(kernel_pagetable));
+    sfence_vma();
+  }
+}
+
+// A new mm->tlbgen.
+uint64
+tlbnewgen(void)
+{
+  return __sync_add_and_fetch(&tlbgens, 1);
+}
+
+// The current process's page table has changed, so TLB
+// entries for its ASID are stale. usertrapret() flushes
+// them before the process next runs on each CPU, and so
+// do the other threads sharing the page table.
+void
+tlbstale(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable)
+    p->mm->tlbgen = tlbnewgen();
+}
+
+// There are no inter-processor interrupts to flush other CPUs'
+// TLBs, so before a change to a shared page table that removes a
+// page, or write access to one, wait until none of the threads
+// sharing it is in user space, where their TLB entries may be
+// stale; a clock tick soon brings each into the kernel. The
+// caller holds mm->lock, which keeps them from going back until
+// the change is made, and tlbstale() has them flush their TLBs.
+static void
+mmwait(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+  struct mm *mm;
+
+  if(p == 0 || p->pagetable != pagetable || (mm = p->mm)->ref == 1)
+    return;
+  if(!holding(&mm->lock))
+    panic("mmwait");
+  while(__atomic_load_n(&mm->nuser, __ATOMIC_ACQUIRE) > 0)
+    ;
 }
 
 // Return the address of the PTE in page table pagetable
@@ -82,57 +146,111 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+// A PTE at level 1 or 2 can also be a leaf, mapping a
+// 2-megabyte megapage or a 1-gigabyte page; then that
+// PTE is the one returned.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  int level = 0;
+
+  return walklevel(pagetable, va, alloc, &level);
+}
+
+// Like walk(), but stop at the PTE for va in the page-table
+// page at *level; sets *level to the level of the PTE
+// returned, which is higher if that PTE is a leaf.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > *level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(*pte & (PTE_R|PTE_W|PTE_X)){
+        *level = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(*level, va)];
 }
 
 // Look up a virtual address, return the physical address,
-// or 0 if not mapped.
+// or 0 if not mapped. Allocates a heap page that hasn't
+// been touched yet.
 // Can only be used to look up user pages.
 uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level = 0;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
-  if(pte == 0)
-    return 0;
-  if((*pte & PTE_V) == 0)
-    return 0;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0)
+    return uvmlazy(pagetable, va);
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  // the page within a bigger leaf.
+  pa = PTE2PA(*pte) + (PGROUNDDOWN(va) & ((1L << PXSHIFT(level)) - 1));
   return pa;
 }
 
 // add a mapping to the kernel page table.
+// uses megapages wherever va and pa are both
+// megapage-aligned and a whole megapage fits.
 // only used when booting.
 // does not flush TLB or enable paging.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 n;
+
+  while(sz > 0){
+    if(va % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && sz >= MEGAPGSIZE){
+      n = MEGAPGSIZE;
+      if(mapleaf(kpgtbl, va, pa, perm, 1) != 0)
+        panic("kvmmap");
+    } else {
+      n = MEGAPGSIZE - va % MEGAPGSIZE;
+      if(n > sz)
+        n = sz;
+      if(mappages(kpgtbl, va, n, pa, perm) != 0)
+        panic("kvmmap");
+    }
+    va += n;
+    pa += n;
+    sz -= n;
+  }
+}
+
+// Create a leaf PTE mapping va to pa at level, 0 for a
+// 4096-byte page or 1 for a megapage. va and pa must be
+// aligned to the page size. Returns 0 on success, -1 if
+// walk() couldn't allocate a needed page-table page.
+static int
+mapleaf(pagetable_t pagetable, uint64 va, uint64 pa, int perm, int level)
+{
+  pte_t *pte;
+  int l = level;
+
+  if((pte = walklevel(pagetable, va, 1, &l)) == 0)
+    return -1;
+  if(l != level || (*pte & PTE_V))
+    panic("mappages: remap");
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  return 0;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -172,30 +290,43 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that sbrk() added but were never
+// touched have no mapping, and are skipped. A megapage
+// must be removed whole (see uvmsplit()).
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
   uint64 a;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
+  mmwait(pagetable);
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+    level = 0;
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0 || (*pte & PTE_V) == 0)
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(level > 0){
+      if(level > 1 || a % MEGAPGSIZE != 0 || a + MEGAPGSIZE > va + npages*PGSIZE)
+        panic("uvmunmap: part of a megapage");
+      if(do_free)
+        kmegafree((void*)PTE2PA(*pte));
+      *pte = 0;
+      a += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
     }
     *pte = 0;
   }
+  tlbstale(pagetable);
 }
 
 // create an empty user page table.
@@ -204,10 +335,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kzalloc();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -221,8 +351,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kzalloc();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -240,12 +369,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kzalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -303,42 +431,236 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
+// Copy the megapage at pa to va in page table new.
+// Megapages aren't shared copy-on-write; the child
+// gets its own, or ordinary pages if there's no
+// megapage free. Returns 0 on success, -1 on failure.
+static int
+megacopy(pagetable_t new, uint64 va, uint64 pa, int flags)
+{
+  uint64 off;
+  char *mem;
+
+  if((mem = kmegalloc()) != 0){
+    memmove(mem, (char*)pa, MEGAPGSIZE);
+    if(mapleaf(new, va, (uint64)mem, flags, 1) == 0)
+      return 0;
+    kmegafree(mem);
+    return -1;
+  }
+  for(off = 0; off < MEGAPGSIZE; off += PGSIZE){
+    if((mem = kalloc()) == 0)
+      goto err;
+    memmove(mem, (char*)pa + off, PGSIZE);
+    if(mappages(new, va + off, PGSIZE, (uint64)mem, flags) != 0){
+      kfree(mem);
+      goto err;
+    }
+  }
+  return 0;
+
+ err:
+  uvmunmap(new, va, off / PGSIZE, 1);
+  return -1;
+}
+
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies the page table, but shares the
+// physical memory copy-on-write.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmcopyrange(old, new, 0, sz, 0);
+}
+
+// uvmcopy() for the pages from start to end. If shared,
+// writable pages stay writable, shared by both page tables,
+// instead of becoming copy-on-write.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int shared)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  int level;
+
+  mmwait(old);
+  for(i = start; i < end; i += PGSIZE){
+    level = 0;
+    if((pte = walklevel(old, i, 0, &level)) == 0 || (*pte & PTE_V) == 0)
+      continue;  // not touched yet
+    if(level > 0){
+      if(megacopy(new, i, PTE2PA(*pte), PTE_FLAGS(*pte)) != 0)
+        goto err;
+      i += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    // share the page; a writable one becomes copy-on-write
+    // in both page tables, and is copied by uvmcow() when
+    // either process writes it.
+    if((*pte & PTE_W) && !shared)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    kdup((void*)pa);
   }
+  tlbstale(old);
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Map zeroed megapages from oldsz, which must be
+// megapage-aligned, up to newsz, rounded up to a megapage.
+// Returns the new size, or 0 if the megapages ran out.
+uint64
+uvmmega(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
+{
+  char *mem;
+  uint64 a;
+
+  if(oldsz % MEGAPGSIZE)
+    panic("uvmmega: not aligned");
+  newsz = MEGAPGROUNDUP(newsz);
+  for(a = oldsz; a < newsz; a += MEGAPGSIZE){
+    if((mem = kmegalloc()) == 0)
+      goto err;
+    if(mapleaf(pagetable, a, (uint64)mem, PTE_R|PTE_W|PTE_U, 1) != 0){
+      kmegafree(mem);
+      goto err;
+    }
+  }
+  tlbstale(pagetable);
+  return newsz;
+
+ err:
+  if(a > oldsz)
+    uvmunmap(pagetable, oldsz, (a - oldsz) / PGSIZE, 1);
+  return 0;
+}
+
+// If va falls inside a megapage, rather than at its start,
+// replace the megapage with ordinary pages, so that the
+// part above va can be unmapped on its own.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pagetable_t pt;
+  pte_t *pte;
+  uint64 pa;
+  int level = 0;
+
+  va = PGROUNDUP(va);
+  if(va % MEGAPGSIZE == 0 || va >= MAXVA)
+    return 0;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0 || level != 1)
+    return 0;
+  if((pt = kzalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | PTE_FLAGS(*pte);
+  kmegasplit((void*)pa);
+  *pte = PA2PTE(pt) | PTE_V;
+  tlbstale(pagetable);
+  return 0;
+}
+
+// Allocate a zeroed page for the current process's heap
+// address va, which sbrk() added but which hasn't been
+// touched yet, and which isn't a page of the program that
+// exec() left for vmafault() to read in. Returns the page's
+// physical address, or 0 if va isn't such an address or
+// there's no memory.
+// Caller must hold p->mm->lock.
+uint64
+uvmlazy(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  char *mem;
+  pte_t *pte;
+
+  if(p == 0 || pagetable != p->pagetable || va >= p->mm->sz ||
+     vmafind(p->mm, va) != 0)
+    return 0;
+  va = PGROUNDDOWN(va);
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V))
+    return 0;
+  if((mem = kzalloc()) == 0)
+    return 0;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return 0;
+  }
+  tlbstale(pagetable);
+  return (uint64)mem;
+}
+
+// Give the process its own copy of the copy-on-write
+// page at va, after a store page fault or before copyout().
+// Returns 0 on success, -1 if va isn't a copy-on-write
+// page or there's no memory for the copy.
+// Caller must hold p->mm->lock, for the current process.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
+     (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  if(krefs((void*)pa) == 1){
+    // the other sharers are gone; just take the page over.
+    *pte = (*pte & ~PTE_COW) | PTE_W;
+    tlbstale(pagetable);
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  mmwait(pagetable);
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | ((PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W);
+  kfree((void*)pa);
+  tlbstale(pagetable);
+  return 0;
+}
+
+// A page fault at va in the current process: allocate va if
+// it's an untouched heap page and, for a store, copy it if
+// it's copy-on-write. Returns 0 if the access can now go
+// ahead, -1 if neither applies.
+int
+uvmfault(uint64 va, int write)
+{
+  struct proc *p = myproc();
+  int r;
+
+  acquire(&p->mm->lock);
+  if(uvmlazy(p->pagetable, va) != 0)
+    r = 0;
+  else if(write)
+    r = uvmcow(p->pagetable, va);
+  else
+    r = -1;
+  release(&p->mm->lock);
+  return r;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -352,6 +674,125 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// copyin(), copyout(), and copyinstr() look up each page of
+// the user range through a ucursor, which remembers the last
+// level-0 page-table page found, so that only the first page
+// of each 2-megabyte stretch needs a full walk(). For the
+// current process, they hold mm->lock from looking a page up
+// until they are done copying it, so that another thread can't
+// unmap it in between.
+struct ucursor {
+  pagetable_t pagetable;
+  struct mm *mm;  // the current process's, if pagetable is its
+  pte_t *l0;      // level-0 page-table page for va's in base
+  uint64 base;    // va >> PXSHIFT(1) of the pages l0 maps
+  int level;      // level of the PTE last returned
+};
+
+static void
+ucinit(struct ucursor *uc, pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  uc->pagetable = pagetable;
+  uc->mm = p && p->pagetable == pagetable ? p->mm : 0;
+  uc->l0 = 0;
+}
+
+static void
+uclock(struct ucursor *uc)
+{
+  if(uc->mm)
+    acquire(&uc->mm->lock);
+}
+
+static void
+ucunlock(struct ucursor *uc)
+{
+  if(uc->mm)
+    release(&uc->mm->lock);
+}
+
+static pte_t*
+uwalk(struct ucursor *uc, uint64 va)
+{
+  pte_t *pte;
+
+  uc->level = 0;
+  if(uc->l0 && (va >> PXSHIFT(1)) == uc->base)
+    return &uc->l0[PX(0, va)];
+  if((pte = walklevel(uc->pagetable, va, 0, &uc->level)) == 0)
+    return 0;
+  if(uc->level == 0){
+    uc->l0 = pte - PX(0, va);
+    uc->base = va >> PXSHIFT(1);
+  }
+  return pte;
+}
+
+// vmafault() for upage(), which must let go of mm->lock
+// while vmafault() reads the file.
+static int
+ucfault(struct ucursor *uc, uint64 va0, int access)
+{
+  int r;
+
+  if(uc->mm == 0)
+    return -1;
+  ucunlock(uc);
+  r = vmafault(va0, access);
+  uclock(uc);
+  return r;
+}
+
+// Return the physical address of the user page at va0,
+// page-aligned, allocating it if it's an untouched heap
+// page and, for a write, copying it if it's copy-on-write.
+// Returns 0 if the process can't access the page.
+// Caller must hold uclock().
+static uint64
+upage(struct ucursor *uc, uint64 va0, int write)
+{
+  pte_t *pte;
+
+  if(va0 >= MAXVA)
+    return 0;
+  pte = uwalk(uc, va0);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    if(uvmlazy(uc->pagetable, va0) == 0 &&
+       ucfault(uc, va0, write ? PROT_WRITE : PROT_READ) < 0)
+      return 0;
+    if((pte = uwalk(uc, va0)) == 0 || (*pte & PTE_V) == 0)
+      return 0;
+  }
+  if(write && (*pte & PTE_COW) && uvmcow(uc->pagetable, va0) < 0)
+    return 0;
+  if(write && (*pte & PTE_W) == 0)
+    ucfault(uc, va0, PROT_WRITE);  // a clean page of a shared mapping?
+  if((*pte & PTE_U) == 0 || (write && (*pte & PTE_W) == 0))
+    return 0;
+  return PTE2PA(*pte) + (va0 & ((1L << PXSHIFT(uc->level)) - 1));
+}
+
+// The physical address a store to user address va would
+// go to, after faulting the page in, and copying it if it's
+// copy-on-write, as copyout() would. Returns 0 if the
+// process can't write there.
+uint64
+uvmwaddr(pagetable_t pagetable, uint64 va)
+{
+  struct ucursor uc;
+  uint64 pa;
+
+  ucinit(&uc, pagetable);
+  uclock(&uc);
+  pa = upage(&uc, PGROUNDDOWN(va), 1);
+  ucunlock(&uc);
+  if(pa == 0)
+    return 0;
+  return pa + (va - PGROUNDDOWN(va));
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -359,21 +800,21 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
-  pte_t *pte;
+  struct ucursor uc;
 
+  ucinit(&uc, pagetable);
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    if(va0 >= MAXVA)
-      return -1;
-    pte = walk(pagetable, va0, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-       (*pte & PTE_W) == 0)
+    uclock(&uc);
+    if((pa0 = upage(&uc, va0, 1)) == 0){
+      ucunlock(&uc);
       return -1;
-    pa0 = PTE2PA(*pte);
+    }
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    ucunlock(&uc);
 
     len -= n;
     src += n;
@@ -389,16 +830,21 @@ int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
+  struct ucursor uc;
 
+  ucinit(&uc, pagetable);
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    uclock(&uc);
+    if((pa0 = upage(&uc, va0, 0)) == 0){
+      ucunlock(&uc);
       return -1;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    ucunlock(&uc);
 
     len -= n;
     dst += n;
@@ -416,12 +862,16 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
   int got_null = 0;
+  struct ucursor uc;
 
+  ucinit(&uc, pagetable);
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    uclock(&uc);
+    if((pa0 = upage(&uc, va0, 0)) == 0){
+      ucunlock(&uc);
       return -1;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
@@ -440,6 +890,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    ucunlock(&uc);
 
     srcva = va0 + PGSIZE;
   }
@@ -15,31 +15,56 @@
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define NINODES 200
+#define NINODES 1000
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+//
+// The image is built in memory and written out once at the
+// end, skipping the blocks that are still zero.
 
-int nbitmap = FSSIZE/BPB + 1;
+int fssize = FSSIZE;  // -s: blocks in the file system
+int nbitmap;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog;     // Number of log blocks: two halves, each a header and logsize blocks
+int logsize = LOGSIZE;
+int extents;  // -e: store files as extents
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
+// A directory entry to be written by wdir().
+struct ent {
+  ushort inum;
+  char name[DIRSIZ+1];
+};
+
 int fsfd;
+uchar *img;   // the whole image, fssize blocks
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
+// The blocks set aside by reserve() for the file being
+// written: its data from dnext, and then its indirect blocks
+// from mnext, so that the data is contiguous.
+int reserved;
+uint dnext, mnext;
+
 
 void balloc(int);
+void reserve(uint, int);
+uint newblock(int);
+int zeroblock(uint);
+void wimage(void);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint xmap(struct dinode *din, uint fbn);
+uint islot(uint bn, uint i, int meta);
+void wdir(uint inum, struct ent *de, int n);
 void die(const char *);
 
 // convert to riscv byte order
@@ -68,33 +93,63 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
-  char buf[BSIZE];
+  int i, cc, fd, nde;
+  uint rootino, inum, size, n;
+  struct ent *de;
+  char buf[BSIZE], *data;
   struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  for(;;){
+    if(argc > 2 && strcmp(argv[1], "-l") == 0){
+      logsize = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if(argc > 2 && strcmp(argv[1], "-s") == 0){
+      fssize = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if(argc > 1 && strcmp(argv[1], "-e") == 0){
+      extents = 1;
+      argc--;
+      argv++;
+    } else
+      break;
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-e] [-l logblocks] [-s blocks] fs.img files...\n");
+    exit(1);
+  }
+
+  if(logsize < MAXOPBLOCKS || logsize > LOGMAX){
+    fprintf(stderr, "mkfs: log blocks must be between %d and %d\n",
+            MAXOPBLOCKS, (int)LOGMAX);
     exit(1);
   }
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
-  assert((BSIZE % sizeof(struct dirent)) == 0);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
     die(argv[1]);
 
   // 1 fs block = 1 disk sector
+  nbitmap = fssize/BPB + 1;
+  nlog = 2*(logsize+1);
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  nblocks = fssize - nmeta;
+  if(nblocks <= 0){
+    fprintf(stderr, "mkfs: %d blocks is too small\n", fssize);
+    exit(1);
+  }
+  if((img = calloc(fssize, BSIZE)) == 0)
+    die("calloc");
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
   sb.ninodes = xint(NINODES);
   sb.nlog = xint(nlog);
@@ -103,13 +158,10 @@ main(int argc, char *argv[])
   sb.bmapstart = xint(2+nlog+ninodeblocks);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
-
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
   wsect(1, buf);
@@ -117,25 +169,23 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  // the root directory is written last, once its size is known.
+  de = calloc(argc, sizeof(*de));
+  if(de == 0)
+    die("calloc");
+  nde = 0;
+  de[nde].inum = rootino;
+  strcpy(de[nde++].name, ".");
+  de[nde].inum = rootino;
+  strcpy(de[nde++].name, "..");
 
   for(i = 2; i < argc; i++){
-    // get rid of "user/"
+    // get rid of "user/", "kernel/"
     char *shortname;
-    if(strncmp(argv[i], "user/", 5) == 0)
-      shortname = argv[i] + 5;
+    if((shortname = rindex(argv[i], '/')) != 0)
+      shortname++;
     else
       shortname = argv[i];
-    
-    assert(index(shortname, '/') == 0);
 
     if((fd = open(argv[i], 0)) < 0)
       die(argv[i]);
@@ -149,38 +199,114 @@ main(int argc, char *argv[])
 
     assert(strlen(shortname) <= DIRSIZ);
     
+    // files start out inline, as the kernel's do.
     inum = ialloc(T_FILE);
+    rinode(inum, &din);
+    din.flags = xint(extents ? I_INLINE|I_EXTENT : I_INLINE);
+    winode(inum, &din);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    de[nde].inum = inum;
+    strncpy(de[nde++].name, shortname, DIRSIZ);
 
-    while((cc = read(fd, buf, sizeof(buf))) > 0)
-      iappend(inum, buf, cc);
+    // the whole file, in one iappend(), into the blocks
+    // reserved for it.
+    if((size = lseek(fd, 0, SEEK_END)) == (uint)-1 || lseek(fd, 0, SEEK_SET) != 0)
+      die(argv[i]);
+    if((data = malloc(size + 1)) == 0)
+      die("malloc");
+    for(n = 0; n < size; n += cc)
+      if((cc = read(fd, data + n, size - n)) <= 0)
+        die(argv[i]);
+    reserve(size, extents);
+    iappend(inum, data, size);
+    reserved = 0;
+    free(data);
 
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  wdir(rootino, de, nde);
 
   balloc(freeblock);
 
+  wimage();
+
   exit(0);
 }
 
+// Set aside the blocks a file of size bytes will need, its
+// data blocks and then its indirect blocks, if it isn't
+// made of extents.
+void
+reserve(uint size, int ext)
+{
+  uint nd, nm;
+
+  nd = size <= NINLINE ? 0 : (size + BSIZE - 1) / BSIZE;
+  nm = 0;
+  if(!ext && nd > NDIRECT)
+    nm++;
+  if(!ext && nd > NDIRECT + NINDIRECT)
+    nm += 1 + (nd - NDIRECT - NINDIRECT + NINDIRECT - 1) / NINDIRECT;
+  if(freeblock + nd + nm > fssize){
+    fprintf(stderr, "mkfs: out of blocks\n");
+    exit(1);
+  }
+  dnext = freeblock;
+  mnext = freeblock + nd;
+  freeblock += nd + nm;
+  reserved = 1;
+}
+
+// A new block for the file being written: a data block,
+// or an indirect block if meta.
+uint
+newblock(int meta)
+{
+  if(reserved)
+    return meta ? mnext++ : dnext++;
+  if(freeblock >= fssize){
+    fprintf(stderr, "mkfs: out of blocks\n");
+    exit(1);
+  }
+  return freeblock++;
+}
+
+int
+zeroblock(uint b)
+{
+  static char zeroes[BSIZE];
+
+  return memcmp(img + (uint64)b*BSIZE, zeroes, BSIZE) == 0;
+}
+
+// Write the image to fsfd, in order, leaving holes in
+// place of runs of zero blocks.
+void
+wimage(void)
+{
+  uint b, e;
+  long n, off, len;
+
+  if(ftruncate(fsfd, (off_t)fssize * BSIZE) < 0)
+    die("ftruncate");
+  for(b = 0; b < fssize; b = e){
+    while(b < fssize && zeroblock(b))
+      b++;
+    for(e = b; e < fssize && !zeroblock(e); e++)
+      ;
+    len = (long)(e - b) * BSIZE;
+    for(off = 0; off < len; off += n)
+      if((n = pwrite(fsfd, img + (uint64)b*BSIZE + off, len - off, (off_t)b*BSIZE + off)) <= 0)
+        die("write");
+  }
+}
+
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(write(fsfd, buf, BSIZE) != BSIZE)
-    die("write");
+  assert(sec < fssize);
+  memmove(img + (uint64)sec * BSIZE, buf, BSIZE);
 }
 
 void
@@ -213,10 +339,8 @@ rinode(uint inum, struct dinode *ip)
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(read(fsfd, buf, BSIZE) != BSIZE)
-    die("read");
+  assert(sec < fssize);
+  memmove(buf, img + (uint64)sec * BSIZE, BSIZE);
 }
 
 uint
@@ -236,17 +360,17 @@ ialloc(ushort type)
 void
 balloc(int used)
 {
-  uchar buf[BSIZE];
+  uchar *bitmap;
   int i;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BPB);
-  bzero(buf, BSIZE);
+  assert(used <= nbitmap*BPB);
+  bitmap = img + (uint64)xint(sb.bmapstart) * BSIZE;
   for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    bitmap[i/8] = bitmap[i/8] | (0x1 << (i%8));
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+  printf("balloc: wrote %d bitmap blocks at sector %d\n",
+         (used + BPB - 1) / BPB, xint(sb.bmapstart));
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -258,35 +382,54 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
   off = xint(din.size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
+  if(xint(din.flags) & I_INLINE){
+    if(off + n <= NINLINE){
+      bcopy(p, (char*)din.addrs + off, n);
+      din.size = xint(off + n);
+      winode(inum, &din);
+      return;
+    }
+    // too big to stay inline: start over with blocks.
+    bcopy(din.addrs, buf, off);
+    bzero(din.addrs, sizeof(din.addrs));
+    din.flags = xint(xint(din.flags) & ~I_INLINE);
+    din.size = xint(0);
+    winode(inum, &din);
+    if(off > 0)
+      iappend(inum, buf, off);
+    rinode(inum, &din);
+  }
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    if(xint(din.flags) & I_EXTENT){
+      x = xmap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
+        din.addrs[fbn] = xint(newblock(0));
       }
       x = xint(din.addrs[fbn]);
-    } else {
+    } else if(fbn < NDIRECT + NINDIRECT){
       if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
+        din.addrs[NDIRECT] = xint(newblock(1));
       }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      x = islot(xint(din.addrs[NDIRECT]), fbn - NDIRECT, 0);
+    } else {
+      if(xint(din.addrs[NDIRECT+1]) == 0){
+        din.addrs[NDIRECT+1] = xint(newblock(1));
       }
-      x = xint(indirect[fbn-NDIRECT]);
+      x = islot(xint(din.addrs[NDIRECT+1]),
+                (fbn - NDIRECT - NINDIRECT) / NINDIRECT, 1);
+      x = islot(x, (fbn - NDIRECT - NINDIRECT) % NINDIRECT, 0);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
-    rsect(x, buf);
-    bcopy(p, buf + off - (fbn * BSIZE), n1);
-    wsect(x, buf);
+    assert(x < fssize);
+    bcopy(p, img + (uint64)x * BSIZE + off - (fbn * BSIZE), n1);
     n -= n1;
     off += n1;
     p += n1;
@@ -295,6 +438,150 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// Entry i of indirect block bn, allocated if missing:
+// an indirect block itself if meta.
+uint
+islot(uint bn, uint i, int meta)
+{
+  uint *indirect = (uint*)(img + (uint64)bn * BSIZE);
+
+  if(indirect[i] == 0)
+    indirect[i] = xint(newblock(meta));
+  return xint(indirect[i]);
+}
+
+// Block fbn of an extent inode, which is either mapped or
+// the next block past the end. Files are written one at a
+// time into blocks reserved in a row, so each normally gets
+// one extent.
+uint
+xmap(struct dinode *din, uint fbn)
+{
+  struct extent *x = (struct extent*)din->addrs;
+  uint i, base, b;
+
+  base = 0;
+  for(i = 0; i < NIEXTENT && xint(x[i].len) != 0; i++){
+    if(fbn < base + xint(x[i].len))
+      return xint(x[i].start) + fbn - base;
+    base += xint(x[i].len);
+  }
+  assert(fbn == base);
+  b = newblock(0);
+  if(i > 0 && xint(x[i-1].start) + xint(x[i-1].len) == b){
+    x[i-1].len = xint(xint(x[i-1].len) + 1);
+  } else {
+    assert(i < NIEXTENT);
+    x[i].start = xint(b);
+    x[i].len = xint(1);
+  }
+  return b;
+}
+
+// Must match dirhash() in kernel/fs.c.
+uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261;
+  for(i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// A directory block being filled by dput().
+struct dblock {
+  char data[BSIZE];
+  int used;     // bytes of dirents so far
+  int last;     // offset of the last one
+};
+
+// Append e to directory block b.
+// Returns -1 if it doesn't fit.
+int
+dput(struct dblock *b, struct ent *e)
+{
+  struct dirent *de;
+  int len = strlen(e->name);
+
+  if(b->used + DIRENTSIZE(len) > BSIZE)
+    return -1;
+  de = (struct dirent*)(b->data + b->used);
+  de->inum = xshort(e->inum);
+  de->reclen = xshort(DIRENTSIZE(len));
+  de->namelen = len;
+  memmove(de->name, e->name, len);
+  b->last = b->used;
+  b->used += DIRENTSIZE(len);
+  return 0;
+}
+
+// Stretch b's last dirent to the end of the block, or make
+// the block one free dirent if it has none.
+void
+dend(struct dblock *b)
+{
+  struct dirent *de = (struct dirent*)(b->data + b->last);
+
+  if(b->used == 0){
+    de->inum = 0;
+    de->namelen = 0;
+  }
+  de->reclen = xshort(BSIZE - b->last);
+}
+
+// Write the n entries de[] into directory inum: as a
+// linear directory if they fit in one block, otherwise
+// indexed, with the smallest number of buckets that
+// leaves none overflowing.
+void
+wdir(uint inum, struct ent *de, int n)
+{
+  static struct dblock bucket[1 << (DXMAXDEPTH-1)];
+  struct dblock index;
+  struct dinode din;
+  uint depth, s;
+  int i, full;
+
+  for(depth = 0; depth < DXMAXDEPTH; depth++){
+    bzero(bucket, sizeof(bucket));
+    full = 0;
+    for(i = 0; i < n && !full; i++)
+      if(dput(&bucket[dirhash(de[i].name) & ((1 << depth) - 1)], &de[i]) < 0)
+        full = 1;
+    if(!full)
+      break;
+  }
+  if(depth == DXMAXDEPTH)
+    die("wdir: too many directory entries");
+
+  if(depth == 0){
+    dend(&bucket[0]);
+    iappend(inum, bucket[0].data, BSIZE);
+    return;
+  }
+
+  bzero(&index, sizeof(index));
+  dend(&index);
+  index.data[DXBYTE(DXDEPTH)] = depth;
+  for(s = 0; s < (1 << depth); s++){
+    index.data[DXBYTE(DXSLOT(s))] = s + 1;
+    index.data[DXBYTE(DXLDEPTH(s + 1))] = depth;
+  }
+  iappend(inum, index.data, BSIZE);
+  for(s = 0; s < (1 << depth); s++){
+    dend(&bucket[s]);
+    iappend(inum, bucket[s].data, BSIZE);
+  }
+  rinode(inum, &din);
+  din.flags = xint(I_HASHDIR);
+  winode(inum, &din);
+}
+
 void
 die(const char *s)
 {
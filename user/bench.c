@@ -0,0 +1,346 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/stat.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+// Microbenchmarks: system calls, processes, pipes, files,
+// and memory.
+//
+// usage: bench [-j nproc] [name...]
+//
+// Runs the named benchmarks, or all of them, and prints a
+// line for each, of key=value pairs, for scripts to compare:
+//
+//   bench=pipe nproc=2 ops=4096 ns=31250000 ns_per_op=7629
+//
+// Each benchmark doubles its number of operations until a
+// run takes at least MINCYCLES. With -j, nproc copies of each
+// benchmark run at once, and ops and ns are their total and
+// the longest copy's time.
+
+#define MINCYCLES (TIMEHZ/20)  // 50ms
+#define FILESZ    (64*BSIZE)   // bytes in the file benchmarks' files
+
+char buf[8192];
+char name[16];        // this copy's file
+uint rnd = 1;
+
+uint
+rand(void)
+{
+  rnd = rnd * 1103515245 + 12345;
+  return rnd >> 8;
+}
+
+void
+die(char *what)
+{
+  fprintf(2, "bench: %s failed\n", what);
+  exit(1);
+}
+
+// A file to work on, FILESZ long.
+int
+benchfile(void)
+{
+  int fd, i;
+
+  if((fd = open(name, O_CREATE|O_RDWR)) < 0)
+    die("create");
+  memset(buf, 'b', BSIZE);
+  for(i = 0; i < FILESZ; i += BSIZE)
+    if(pwrite(fd, buf, BSIZE, i) != BSIZE)
+      die("write");
+  return fd;
+}
+
+void
+bnull(int n)
+{
+  for(int i = 0; i < n; i++)
+    getpid();
+}
+
+void
+bfork(int n)
+{
+  int pid;
+
+  for(int i = 0; i < n; i++){
+    if((pid = fork()) < 0)
+      die("fork");
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+}
+
+void
+bexec(int n)
+{
+  char *argv[] = { "bench", "-exit", 0 };
+  int pid;
+
+  for(int i = 0; i < n; i++){
+    if((pid = fork()) < 0)
+      die("fork");
+    if(pid == 0){
+      exec("bench", argv);
+      die("exec");
+    }
+    wait(0);
+  }
+}
+
+// a byte to a child and back.
+void
+bpipe(int n)
+{
+  int p[2], q[2], pid, i;
+  char c;
+
+  if(pipe(p) < 0 || pipe(q) < 0)
+    die("pipe");
+  if((pid = fork()) < 0)
+    die("fork");
+  if(pid == 0){
+    close(p[1]);
+    close(q[0]);
+    while(read(p[0], &c, 1) == 1)
+      write(q[1], &c, 1);
+    exit(0);
+  }
+  close(p[0]);
+  close(q[1]);
+  for(i = 0; i < n; i++){
+    if(write(p[1], "x", 1) != 1 || read(q[0], &c, 1) != 1)
+      die("pipe round trip");
+  }
+  close(p[1]);
+  close(q[0]);
+  wait(0);
+}
+
+// n writes of sizeof(buf) bytes to a child.
+void
+bpipebw(int n)
+{
+  int p[2], pid, i;
+
+  if(pipe(p) < 0)
+    die("pipe");
+  if((pid = fork()) < 0)
+    die("fork");
+  if(pid == 0){
+    close(p[1]);
+    while(read(p[0], buf, sizeof(buf)) > 0)
+      ;
+    exit(0);
+  }
+  close(p[0]);
+  for(i = 0; i < n; i++)
+    if(write(p[1], buf, sizeof(buf)) != sizeof(buf))
+      die("pipe write");
+  close(p[1]);
+  wait(0);
+}
+
+void
+bseqwrite(int n)
+{
+  int fd = benchfile();
+
+  for(int i = 0; i < n; i++)
+    if(pwrite(fd, buf, BSIZE, (i*BSIZE) % FILESZ) != BSIZE)
+      die("write");
+  close(fd);
+}
+
+void
+bseqread(int n)
+{
+  int fd = benchfile();
+
+  for(int i = 0; i < n; i++)
+    if(pread(fd, buf, BSIZE, (i*BSIZE) % FILESZ) != BSIZE)
+      die("read");
+  close(fd);
+}
+
+void
+brandwrite(int n)
+{
+  int fd = benchfile();
+
+  for(int i = 0; i < n; i++)
+    if(pwrite(fd, buf, BSIZE, rand() % (FILESZ/BSIZE) * BSIZE) != BSIZE)
+      die("write");
+  close(fd);
+}
+
+void
+brandread(int n)
+{
+  int fd = benchfile();
+
+  for(int i = 0; i < n; i++)
+    if(pread(fd, buf, BSIZE, rand() % (FILESZ/BSIZE) * BSIZE) != BSIZE)
+      die("read");
+  close(fd);
+}
+
+// create and unlink a file.
+void
+bcreate(int n)
+{
+  int fd;
+
+  for(int i = 0; i < n; i++){
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0)
+      die("create");
+    close(fd);
+    if(unlink(name) < 0)
+      die("unlink");
+  }
+}
+
+// grow the heap by a page, and touch it; every 256 pages,
+// give them back.
+void
+bsbrk(int n)
+{
+  char *p;
+  int i;
+
+  for(i = 0; i < n; i++){
+    if((p = sbrk(PGSIZE)) == (char*)-1)
+      die("sbrk");
+    *p = 1;
+    if(i % 256 == 255 || i == n-1)
+      if(sbrk(-(i % 256 + 1)*PGSIZE) == (char*)-1)
+        die("sbrk shrink");
+  }
+}
+
+struct bench {
+  char *name;
+  void (*fn)(int);
+  int bytes;        // per op, for bandwidth
+  int file;         // uses name, which it leaves behind
+} benches[] = {
+  { "null",      bnull,      0, 0 },
+  { "fork",      bfork,      0, 0 },
+  { "exec",      bexec,      0, 0 },
+  { "pipe",      bpipe,      0, 0 },
+  { "pipebw",    bpipebw,    sizeof(buf), 0 },
+  { "seqwrite",  bseqwrite,  BSIZE, 1 },
+  { "seqread",   bseqread,   BSIZE, 1 },
+  { "randwrite", brandwrite, BSIZE, 1 },
+  { "randread",  brandread,  BSIZE, 1 },
+  { "create",    bcreate,    0, 1 },
+  { "sbrk",      bsbrk,      0, 0 },
+};
+
+// Run b with more and more ops until it takes MINCYCLES;
+// return the ops and cycles of that run.
+void
+measure(struct bench *b, int *ops, uint64 *cycles)
+{
+  uint64 t0, t;
+  int n;
+
+  for(n = 1; ; n *= 2){
+    t0 = rdtime();
+    b->fn(n);
+    t = rdtime() - t0;
+    if(t >= MINCYCLES || n >= (1 << 24))
+      break;
+  }
+  if(b->file)
+    unlink(name);
+  *ops = n;
+  *cycles = t;
+}
+
+void
+run(struct bench *b, int nproc)
+{
+  struct { int ops; uint64 cycles; } r;
+  uint64 cycles, ns;
+  int p[2], i, ops;
+
+  ops = 0;
+  cycles = 0;
+  if(nproc == 1){
+    measure(b, &ops, &cycles);
+  } else {
+    if(pipe(p) < 0)
+      die("pipe");
+    for(i = 0; i < nproc; i++){
+      int pid = fork();
+      if(pid < 0)
+        die("fork");
+      if(pid == 0){
+        close(p[0]);
+        name[6] = 'a' + i;
+        rnd = i + 1;
+        measure(b, &r.ops, &r.cycles);
+        write(p[1], &r, sizeof(r));
+        exit(0);
+      }
+    }
+    close(p[1]);
+    while(read(p[0], &r, sizeof(r)) == sizeof(r)){
+      ops += r.ops;
+      if(r.cycles > cycles)
+        cycles = r.cycles;
+    }
+    close(p[0]);
+    for(i = 0; i < nproc; i++)
+      wait(0);
+  }
+
+  ns = cycles * (1000000000 / TIMEHZ);
+  printf("bench=%s nproc=%d ops=%d ns=%ld ns_per_op=%ld", b->name, nproc,
+         ops, ns, ops ? ns / ops : 0);
+  if(b->bytes && ns)
+    printf(" kb_per_s=%ld", (uint64)ops * b->bytes * 1000000 / (ns / 1000 + 1) / 1024);
+  printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, nproc, any;
+
+  if(argc == 2 && strcmp(argv[1], "-exit") == 0)
+    exit(0);  // for bexec
+
+  nproc = 1;
+  i = 1;
+  if(argc > 2 && strcmp(argv[1], "-j") == 0){
+    nproc = atoi(argv[2]);
+    i = 3;
+  }
+  if(nproc < 1 || nproc > 26){
+    fprintf(2, "usage: bench [-j nproc] [name...]\n");
+    exit(1);
+  }
+  strcpy(name, "benchfa");
+
+  any = i < argc;
+  for(j = 0; j < sizeof(benches)/sizeof(benches[0]); j++){
+    if(any){
+      int k;
+      for(k = i; k < argc && strcmp(argv[k], benches[j].name) != 0; k++)
+        ;
+      if(k == argc)
+        continue;
+    }
+    run(&benches[j], nproc);
+  }
+  exit(0);
+}
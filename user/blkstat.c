@@ -0,0 +1,26 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// print block I/O queue statistics for a disk,
+// the root disk by default.
+
+int
+main(int argc, char **argv)
+{
+  struct blkstat st;
+  int dev;
+
+  dev = argc > 1 ? atoi(argv[1]) : 1;
+  if(blkstat(dev, &st) < 0){
+    fprintf(2, "blkstat: no disk %d\n", dev);
+    exit(1);
+  }
+  printf("disk %d queues %d\n", st.dev, st.nqueue);
+  printf("queued %d max %d\n", st.depth, st.maxdepth);
+  printf("blocks %ld\n", st.nblock);
+  printf("requests %ld\n", st.nreq);
+  if(st.nreq > 0)
+    printf("blocks per request %ld.%ld\n", st.nblock / st.nreq, (st.nblock * 10 / st.nreq) % 10);
+  exit(0);
+}
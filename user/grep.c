@@ -1,36 +1,272 @@
 // Simple grep.  Only supports ^ . * $ operators.
+//
+// The pattern is compiled to a list of elements, each a
+// character or '.', maybe starred, which is run as an NFA
+// whose sets of states are cached as the states of a DFA,
+// built as the text needs them. Lines that can't hold the
+// literal characters every match starts with are skipped
+// without running it. The matches are those of the
+// Kernighan & Pike matcher at the end, which is still used
+// for patterns too long for the DFA.
 
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
 #include "user/user.h"
 
-char buf[1024];
+#define NELEM   63    // pattern elements the DFA handles
+#define NDSTATE 64    // DFA states cached
+#define ANY     256   // the element '.'
+
+char buf[32768];
+char obuf[4096];      // matching lines, to write
+int nobuf;
 int match(char*, char*);
 
+struct elem {
+  int c;              // character, or ANY
+  int star;
+} el[NELEM];
+int nel;
+int bol, eol;         // ^ and $
+char lit[NELEM];      // the characters every match starts with
+int nlit;
+int slow;             // too long; use match()
+
+// a DFA state: the set of NFA states, bit i for element i
+// next, and bit nel once they have all matched.
+struct dstate {
+  uint64 set;
+  short next[256];    // DFA state after each character, or -1
+} ds[NDSTATE];
+int nds;
+
+// Split pattern into elements, taking them apart in the
+// same order as matchhere() does.
+void
+compile(char *pat)
+{
+  int c, star;
+
+  if(*pat == '^'){
+    bol = 1;
+    pat++;
+  }
+  while(*pat){
+    if(pat[1] == '*'){
+      c = pat[0];
+      star = 1;
+      pat += 2;
+    } else if(pat[0] == '$' && pat[1] == '\0'){
+      eol = 1;
+      break;
+    } else {
+      c = pat[0];
+      star = 0;
+      pat++;
+    }
+    if(nel == NELEM){
+      slow = 1;
+      return;
+    }
+    el[nel].c = c == '.' ? ANY : (uchar)c;
+    el[nel].star = star;
+    nel++;
+  }
+  if(!bol)
+    for(nlit = 0; nlit < nel && !el[nlit].star && el[nlit].c != ANY; nlit++)
+      lit[nlit] = el[nlit].c;
+}
+
+// add the states a starred element can skip to.
+uint64
+closure(uint64 set)
+{
+  for(int i = 0; i < nel; i++)
+    if(((set >> i) & 1) && el[i].star)
+      set |= 1UL << (i+1);
+  return set;
+}
+
+// The DFA state for set, made if need be. Sets *flushed
+// if the cache had to be emptied to make room.
+int
+dfind(uint64 set, int *flushed)
+{
+  int i;
+
+  for(i = 0; i < nds; i++)
+    if(ds[i].set == set)
+      return i;
+  if(nds == NDSTATE){
+    nds = 0;
+    *flushed = 1;
+  }
+  ds[nds].set = set;
+  memset(ds[nds].next, 0xff, sizeof(ds[nds].next));
+  return nds++;
+}
+
+// The DFA state after state i reads c, which isn't '\0'.
+int
+dnext(int i, int c)
+{
+  uint64 set, t;
+  int j, flushed;
+
+  set = ds[i].set;
+  t = 0;
+  for(j = 0; j < nel; j++)
+    if(((set >> j) & 1) && (el[j].c == ANY || el[j].c == c))
+      t |= el[j].star ? 1UL << j : 1UL << (j+1);
+  if(!bol)
+    t |= 1;  // a match may start at the next character too
+  flushed = 0;
+  j = dfind(closure(t), &flushed);
+  if(!flushed)
+    ds[i].next[c] = j;
+  return j;
+}
+
+// Does the line from p to e match? It ends early at a '\0',
+// as a string would for match().
+int
+matchline(char *p, char *e)
+{
+  uint64 acc = 1UL << nel;
+  int s, j, flushed;
+
+  flushed = 0;
+  s = dfind(closure(1), &flushed);
+  for(; p < e && *p; p++){
+    if(!eol && (ds[s].set & acc))
+      return 1;
+    if((j = ds[s].next[(uchar)*p]) < 0)
+      j = dnext(s, (uchar)*p);
+    s = j;
+    if(ds[s].set == 0)
+      return 0;
+  }
+  return (ds[s].set & acc) != 0;
+}
+
+// The first c from p to e, or 0: eight bytes at a time,
+// once p is aligned, looking for a zero byte in each
+// word xor c in every byte.
+char*
+findc(char *p, char *e, int c)
+{
+  uint64 w, m;
+
+  m = 0x0101010101010101UL * (uchar)c;
+  for(; p < e && ((uint64)p & 7); p++)
+    if(*p == c)
+      return p;
+  for(; p + 8 <= e; p += 8){
+    w = *(uint64*)p ^ m;
+    if((w - 0x0101010101010101UL) & ~w & 0x8080808080808080UL)
+      break;
+  }
+  for(; p < e; p++)
+    if(*p == c)
+      return p;
+  return 0;
+}
+
+// The first copy of lit from p to e, or 0.
+char*
+findlit(char *p, char *e)
+{
+  while((p = findc(p, e, lit[0])) != 0){
+    if(e - p >= nlit && memcmp(p, lit, nlit) == 0)
+      return p;
+    p++;
+  }
+  return 0;
+}
+
+void
+flush(void)
+{
+  if(nobuf > 0)
+    write(1, obuf, nobuf);
+  nobuf = 0;
+}
+
+void
+emit(char *p, int n)
+{
+  if(n > sizeof(obuf)){
+    flush();
+    write(1, p, n);
+    return;
+  }
+  if(nobuf + n > sizeof(obuf))
+    flush();
+  memmove(obuf + nobuf, p, n);
+  nobuf += n;
+}
+
+int
+matches(char *pattern, char *p, char *q)
+{
+  char c;
+  int r;
+
+  if(!slow)
+    return matchline(p, q);
+  c = *q;
+  *q = '\0';
+  r = match(pattern, p);
+  *q = c;
+  return r;
+}
+
+// print the lines from buf to e, which ends with a newline,
+// that match.
+void
+grepbuf(char *pattern, char *e)
+{
+  char *p, *q, *h;
+
+  p = buf;
+  while(p < e){
+    if(nlit > 0 && !slow){
+      if((h = findlit(p, e)) == 0)
+        break;
+      while(h > p && h[-1] != '\n')
+        h--;
+      p = h;
+    }
+    q = findc(p, e, '\n');
+    if(matches(pattern, p, q))
+      emit(p, q+1 - p);
+    p = q+1;
+  }
+}
+
 void
 grep(char *pattern, int fd)
 {
   int n, m;
-  char *p, *q;
+  char *e;
 
   m = 0;
   while((n = read(fd, buf+m, sizeof(buf)-m-1)) > 0){
     m += n;
-    buf[m] = '\0';
-    p = buf;
-    while((q = strchr(p, '\n')) != 0){
-      *q = 0;
-      if(match(pattern, p)){
-        *q = '\n';
-        write(1, p, q+1 - p);
-      }
-      p = q+1;
-    }
-    if(m > 0){
-      m -= p - buf;
-      memmove(buf, p, m);
+    for(e = buf + m; e > buf && e[-1] != '\n'; e--)
+      ;
+    if(e == buf && m == sizeof(buf)-1){
+      // a line longer than buf; take it as a whole.
+      buf[m] = '\n';
+      e = buf + m + 1;
     }
+    grepbuf(pattern, e);
+    if(e > buf + m)
+      e = buf + m;
+    m -= e - buf;
+    memmove(buf, e, m);
+    flush();
   }
 }
 
@@ -45,6 +281,7 @@ main(int argc, char *argv[])
     exit(1);
   }
   pattern = argv[1];
+  compile(pattern);
 
   if(argc <= 2){
     grep(pattern, 0);
@@ -104,4 +341,3 @@ int matchstar(int c, char *re, char *text)
   }while(*text!='\0' && (*text++==c || c=='.'));
   return 0;
 }
-
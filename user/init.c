@@ -11,6 +11,15 @@
 
 char *argv[] = { "sh", 0 };
 
+// the files in /proc, by PROCFS minor.
+char *procfiles[NPROCFS] = {
+  [PROC_PROCS]  "/proc/procs",
+  [PROC_MEM]    "/proc/mem",
+  [PROC_BIO]    "/proc/bio",
+  [PROC_INODES] "/proc/inodes",
+  [PROC_LOG]    "/proc/log",
+};
+
 int
 main(void)
 {
@@ -23,6 +32,10 @@ main(void)
   dup(0);  // stdout
   dup(0);  // stderr
 
+  mkdir("/proc");
+  for(int i = 0; i < NPROCFS; i++)
+    mknod(procfiles[i], PROCFS, i);
+
   for(;;){
     printf("init: starting sh\n");
     pid = fork();
@@ -0,0 +1,37 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// print spinlock statistics, most contended first.
+
+struct lockstat st[NLOCKCLASS];
+
+int
+main(int argc, char **argv)
+{
+  struct lockstat t;
+  int i, j, n;
+
+  if((n = lockstat(st, NLOCKCLASS)) < 0){
+    fprintf(2, "lockstat: failed\n");
+    exit(1);
+  }
+  for(i = 1; i < n; i++){
+    t = st[i];
+    for(j = i; j > 0 && st[j-1].nspin < t.nspin; j--)
+      st[j] = st[j-1];
+    st[j] = t;
+  }
+  printf("name            acquires contended spins maxhold\n");
+  for(i = 0; i < n; i++){
+    if(st[i].nacquire == 0)
+      continue;
+    printf("%s", st[i].name);
+    for(j = strlen(st[i].name); j < 16; j++)
+      printf(" ");
+    printf("%ld %ld %ld %ld\n", st[i].nacquire, st[i].ncontend,
+           st[i].nspin, st[i].maxhold);
+  }
+  exit(0);
+}
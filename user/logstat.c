@@ -0,0 +1,25 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// print write-ahead log statistics.
+
+int
+main(int argc, char **argv)
+{
+  struct logstat st;
+
+  if(logstat(&st) < 0){
+    fprintf(2, "logstat: failed\n");
+    exit(1);
+  }
+  printf("log blocks per transaction %d\n", st.size);
+  printf("commits %ld\n", st.ncommit);
+  printf("blocks written %ld\n", st.nwrite);
+  printf("writes absorbed %ld\n", st.nabsorb);
+  if(st.ncommit > 0){
+    printf("blocks per commit %ld\n", st.nwrite / st.ncommit);
+    printf("commit cycles avg %ld max %ld\n", st.cycles / st.ncommit, st.maxcycles);
+  }
+  exit(0);
+}
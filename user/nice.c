@@ -0,0 +1,33 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// nice prio command [args...]: run command at static priority prio.
+// nice -p prio pid...: change the static priority of running processes.
+int
+main(int argc, char **argv)
+{
+  int i, prio;
+
+  if(argc >= 4 && strcmp(argv[1], "-p") == 0){
+    prio = atoi(argv[2]);
+    for(i = 3; i < argc; i++){
+      if(nice(atoi(argv[i]), prio) < 0)
+        fprintf(2, "nice: cannot set priority of %s\n", argv[i]);
+    }
+    exit(0);
+  }
+
+  if(argc < 3){
+    fprintf(2, "usage: nice prio command [args...]\n");
+    fprintf(2, "       nice -p prio pid...\n");
+    exit(1);
+  }
+  if(nice(0, atoi(argv[1])) < 0){
+    fprintf(2, "nice: bad priority %s\n", argv[1]);
+    exit(1);
+  }
+  exec(argv[2], argv+2);
+  fprintf(2, "nice: exec %s failed\n", argv[2]);
+  exit(1);
+}
@@ -0,0 +1,289 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// Profile a command: sample the pc of every hart while it
+// runs, then print the places most often sampled. Kernel pcs
+// are given by function, from kernel.sym; user pcs by process
+// and address, or by function if -u names the program's .sym
+// file. Samples are of the whole machine, not just the command.
+//
+// usage: prof [-k kernel.sym] [-u prog.sym] [-n lines] command [args...]
+
+#define NHIT    2048  // distinct places counted
+#define NSAMPLE 256   // samples read at a time
+
+struct sym {
+  uint64 addr;
+  char *name;
+};
+
+struct symtab {
+  struct sym *sym;  // sorted by addr
+  int n;
+};
+
+struct hit {
+  uint64 pc;        // the function's address, if known
+  int pid;          // 0 for the kernel
+  int n;
+  struct symtab *tab;
+};
+
+struct hit hits[NHIT];
+int nhit, nsample, nlost;
+struct symtab ksyms, usyms;
+struct profsample buf[NSAMPLE];
+
+uint64
+hex(char **pp)
+{
+  uint64 x;
+  char *p;
+  int c;
+
+  x = 0;
+  for(p = *pp; ; p++){
+    c = *p;
+    if(c >= '0' && c <= '9')
+      c -= '0';
+    else if(c >= 'a' && c <= 'f')
+      c -= 'a' - 10;
+    else
+      break;
+    x = x*16 + c;
+  }
+  *pp = p;
+  return x;
+}
+
+// Read a symbol file, lines of "address name" as the
+// Makefile writes them, into tab.
+int
+loadsyms(char *path, struct symtab *tab)
+{
+  struct stat st;
+  struct sym t;
+  char *text, *p, *e;
+  int fd, n, i, j, gap;
+
+  if((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  if(fstat(fd, &st) < 0 || (text = malloc(st.size + 1)) == 0){
+    close(fd);
+    return -1;
+  }
+  for(p = text; p < text + st.size; p += n)
+    if((n = read(fd, p, text + st.size - p)) <= 0)
+      break;
+  close(fd);
+  *p = '\0';
+
+  n = 0;
+  for(e = text; e < p; e++)
+    if(*e == '\n')
+      n++;
+  if((tab->sym = malloc((n+1) * sizeof(struct sym))) == 0)
+    return -1;
+  tab->n = 0;
+  for(e = text; *e; ){
+    t.addr = hex(&e);
+    if(*e == ' ')
+      e++;
+    t.name = e;
+    while(*e && *e != '\n')
+      e++;
+    if(*e)
+      *e++ = '\0';
+    if(t.addr != 0 && *t.name)
+      tab->sym[tab->n++] = t;
+  }
+
+  // shell sort, by address.
+  for(gap = tab->n/2; gap > 0; gap /= 2){
+    for(i = gap; i < tab->n; i++){
+      t = tab->sym[i];
+      for(j = i; j >= gap && tab->sym[j-gap].addr > t.addr; j -= gap)
+        tab->sym[j] = tab->sym[j-gap];
+      tab->sym[j] = t;
+    }
+  }
+  return 0;
+}
+
+// The symbol pc is in, or 0.
+struct sym*
+lookup(struct symtab *tab, uint64 pc)
+{
+  int lo, hi, mid;
+
+  if(tab->n == 0 || pc < tab->sym[0].addr)
+    return 0;
+  lo = 0;
+  hi = tab->n;
+  while(hi - lo > 1){
+    mid = (lo + hi) / 2;
+    if(tab->sym[mid].addr <= pc)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return &tab->sym[lo];
+}
+
+void
+count(struct profsample *s)
+{
+  struct symtab *tab;
+  struct sym *sym;
+  struct hit *h;
+  uint64 pc;
+  int pid, i;
+
+  nsample++;
+  tab = s->user ? &usyms : &ksyms;
+  pid = s->user ? s->pid : 0;
+  pc = s->pc;
+  if((sym = lookup(tab, pc)) != 0)
+    pc = sym->addr;
+  else
+    tab = 0;
+
+  i = (pc / 4 * 31 + pid) % NHIT;
+  for(h = &hits[i]; h->n; h = &hits[i = (i + 1) % NHIT]){
+    if(h->pc == pc && h->pid == pid){
+      h->n++;
+      return;
+    }
+  }
+  if(nhit >= NHIT*3/4){
+    nlost++;
+    return;
+  }
+  h->pc = pc;
+  h->pid = pid;
+  h->tab = tab;
+  h->n = 1;
+  nhit++;
+}
+
+void
+drain(void)
+{
+  int i, n;
+
+  while((n = prof(PROF_READ, buf, NSAMPLE)) > 0){
+    for(i = 0; i < n; i++)
+      count(&buf[i]);
+    if(n < NSAMPLE)
+      break;
+  }
+}
+
+void
+report(int nlines)
+{
+  struct hit t;
+  struct sym *sym;
+  int i, j, gap, n;
+
+  // compact the table, and sort it, most samples first.
+  n = 0;
+  for(i = 0; i < NHIT; i++)
+    if(hits[i].n)
+      hits[n++] = hits[i];
+  for(gap = n/2; gap > 0; gap /= 2){
+    for(i = gap; i < n; i++){
+      t = hits[i];
+      for(j = i; j >= gap && hits[j-gap].n < t.n; j -= gap)
+        hits[j] = hits[j-gap];
+      hits[j] = t;
+    }
+  }
+
+  if(nsample == 0){
+    printf("no samples\n");
+    return;
+  }
+  printf("samples\t%%\tpid\twhere\n");
+  for(i = 0; i < n && i < nlines; i++){
+    printf("%d\t%d\t", hits[i].n, hits[i].n * 100 / nsample);
+    if(hits[i].pid)
+      printf("%d\t", hits[i].pid);
+    else
+      printf("kernel\t");
+    if(hits[i].tab && (sym = lookup(hits[i].tab, hits[i].pc)) != 0)
+      printf("%s\n", sym->name);
+    else
+      printf("0x%lx\n", hits[i].pc);
+  }
+  if(nlost)
+    printf("%d samples in places not counted\n", nlost);
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *kpath, *upath;
+  struct pollfd pfd;
+  int p[2], pid, i, nlines, ndrop;
+  uint64 t0, t;
+
+  kpath = "/kernel.sym";
+  upath = 0;
+  nlines = 20;
+  for(i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2){
+    if(strcmp(argv[i], "-k") == 0)
+      kpath = argv[i+1];
+    else if(strcmp(argv[i], "-u") == 0)
+      upath = argv[i+1];
+    else if(strcmp(argv[i], "-n") == 0)
+      nlines = atoi(argv[i+1]);
+    else
+      break;
+  }
+  if(i >= argc || argv[i][0] == '-'){
+    fprintf(2, "usage: prof [-k kernel.sym] [-u prog.sym] [-n lines] command [args...]\n");
+    exit(1);
+  }
+  if(loadsyms(kpath, &ksyms) < 0)
+    fprintf(2, "prof: no kernel symbols from %s\n", kpath);
+  if(upath && loadsyms(upath, &usyms) < 0)
+    fprintf(2, "prof: no user symbols from %s\n", upath);
+
+  // the command holds the pipe's write end open until it
+  // exits, so that the poll() below wakes up then.
+  if(pipe(p) < 0 || prof(PROF_ON, 0, 0) < 0){
+    fprintf(2, "prof: cannot start\n");
+    exit(1);
+  }
+  t0 = nanotime();
+  if((pid = fork()) < 0){
+    fprintf(2, "prof: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(p[0]);
+    exec(argv[i], argv + i);
+    fprintf(2, "prof: exec %s failed\n", argv[i]);
+    exit(1);
+  }
+  close(p[1]);
+
+  // read the samples every 100ms, well before a ring fills.
+  pfd.fd = p[0];
+  pfd.events = POLLIN;
+  while(poll(&pfd, 1, 100) >= 0 && (pfd.revents & POLLHUP) == 0)
+    drain();
+  wait(0);
+  t = nanotime() - t0;
+  ndrop = prof(PROF_OFF, 0, 0);
+  drain();
+
+  report(nlines);
+  printf("%s ran for %ld.%ld ms\n", argv[i], t / 1000000, t / 100000 % 10);
+  if(ndrop)
+    printf("%d samples dropped\n", ndrop);
+  exit(0);
+}
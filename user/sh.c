@@ -12,6 +12,7 @@
 #define BACK  5
 
 #define MAXARGS 10
+#define MAXSFD  12  // fds the shell opens to spawn one command line
 
 struct cmd {
   int type;
@@ -52,6 +53,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
 void runcmd(struct cmd*) __attribute__((noreturn));
 
 // Execute cmd.  Never returns.
@@ -131,6 +133,106 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Simple commands, and pipelines of them, are started with
+// spawn() rather than fork() and exec(), which saves copying
+// the shell for each of them. The shell opens their pipes and
+// redirections' files itself, and passes them on as file
+// actions, closing all the others in each child.
+
+int sfd[MAXSFD];  // fds open for the command line being spawned
+int nsfd;
+
+// The command that cmd, maybe with redirections, runs,
+// or 0 if cmd isn't a simple command.
+struct execcmd*
+simplecmd(struct cmd *cmd)
+{
+  while(cmd->type == REDIR)
+    cmd = ((struct redircmd*)cmd)->cmd;
+  if(cmd->type != EXEC || ((struct execcmd*)cmd)->argv[0] == 0)
+    return 0;
+  return (struct execcmd*)cmd;
+}
+
+// Can cmd be run by spawn() alone?
+int
+spawnable(struct cmd *cmd)
+{
+  struct pipecmd *pcmd;
+
+  if(cmd->type == PIPE){
+    pcmd = (struct pipecmd*)cmd;
+    return simplecmd(pcmd->left) && spawnable(pcmd->right);
+  }
+  return simplecmd(cmd) != 0;
+}
+
+// Spawn cmd, a simple command, reading from in and writing
+// to out. Returns its pid, or -1.
+int
+spawn1(struct cmd *cmd, int in, int out)
+{
+  struct spawnact act[2*MAXSFD + 2];
+  struct execcmd *ecmd;
+  struct redircmd *rcmd;
+  int n, i, fd, pid, first;
+
+  n = 0;
+  if(in != 0)
+    act[n++] = (struct spawnact){ SPAWN_DUP2, in, 0 };
+  if(out != 1)
+    act[n++] = (struct spawnact){ SPAWN_DUP2, out, 1 };
+
+  // outermost first, so that the innermost wins, as in runcmd().
+  pid = -1;
+  first = nsfd;
+  for(; cmd->type == REDIR; cmd = rcmd->cmd){
+    rcmd = (struct redircmd*)cmd;
+    if(nsfd == MAXSFD || (fd = open(rcmd->file, rcmd->mode)) < 0){
+      fprintf(2, "open %s failed\n", rcmd->file);
+      goto out;
+    }
+    sfd[nsfd++] = fd;
+    act[n++] = (struct spawnact){ SPAWN_DUP2, fd, rcmd->fd };
+  }
+  for(i = 0; i < nsfd; i++)
+    act[n++] = (struct spawnact){ SPAWN_CLOSE, sfd[i], 0 };
+
+  ecmd = (struct execcmd*)cmd;
+  if((pid = spawn(ecmd->argv[0], ecmd->argv, act, n)) < 0)
+    fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+
+ out:
+  while(nsfd > first)
+    close(sfd[--nsfd]);
+  return pid;
+}
+
+// Spawn the commands of cmd, a pipeline, the first reading
+// from in. Returns how many were started.
+int
+spawnpipe(struct cmd *cmd, int in)
+{
+  struct pipecmd *pcmd;
+  int p[2], n;
+
+  if(cmd->type != PIPE)
+    return spawn1(cmd, in, 1) >= 0;
+
+  pcmd = (struct pipecmd*)cmd;
+  if(nsfd + 2 > MAXSFD || pipe(p) < 0){
+    fprintf(2, "pipe failed\n");
+    return 0;
+  }
+  sfd[nsfd++] = p[0];
+  sfd[nsfd++] = p[1];
+  n = spawn1(pcmd->left, in, p[1]) >= 0;
+  close(sfd[--nsfd]);  // p[1]
+  n += spawnpipe(pcmd->right, p[0]);
+  close(sfd[--nsfd]);  // p[0]
+  return n;
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -146,7 +248,8 @@ int
 main(void)
 {
   static char buf[100];
-  int fd;
+  struct cmd *cmd;
+  int fd, n;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -165,9 +268,17 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf));
-    wait(0);
+    if((cmd = parsecmd(buf)) == 0)
+      continue;
+    if(spawnable(cmd)){
+      for(n = spawnpipe(cmd, 0); n > 0; n--)
+        wait(0);
+    } else {
+      if(fork1() == 0)
+        runcmd(cmd);
+      wait(0);
+    }
+    freecmd(cmd);
   }
   exit(0);
 }
@@ -257,11 +368,58 @@ backcmd(struct cmd *subcmd)
   cmd->cmd = subcmd;
   return (struct cmd*)cmd;
 }
+void
+freecmd(struct cmd *cmd)
+{
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    freecmd(rcmd->cmd);
+    break;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+
+  case BACK:
+    bcmd = (struct backcmd*)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
 //PAGEBREAK!
 // Parsing
 
 char whitespace[] = " \t\r\n\v";
 char symbols[] = "<|>&;()";
+int badsyntax;
+
+// Report a syntax error, the first of a command line's;
+// parsing goes on, but the command won't run.
+void
+syntax(char *s)
+{
+  if(!badsyntax)
+    fprintf(2, "%s\n", s);
+  badsyntax = 1;
+}
 
 int
 gettoken(char **ps, char *es, char **q, char **eq)
@@ -331,12 +489,17 @@ parsecmd(char *s)
   char *es;
   struct cmd *cmd;
 
+  badsyntax = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && !badsyntax){
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(badsyntax){
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -380,8 +543,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -406,8 +571,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -432,13 +599,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
+    if(argc+1 >= MAXARGS){
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -0,0 +1,178 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/syscall.h"
+#include "user/user.h"
+
+// Print system call statistics: for the whole system, or
+// for one process with "sysstat pid", which counts its calls
+// only from the first time it is asked. "sysstat -t command
+// [args...]" runs the command and traces its system calls,
+// and those of the children it forks, like strace.
+
+struct call {
+  char *name;
+  int nargs;
+};
+
+struct call calls[NSYSCALL] = {
+[SYS_fork]      { "fork", 0 },
+[SYS_exit]      { "exit", 1 },
+[SYS_wait]      { "wait", 1 },
+[SYS_pipe]      { "pipe", 1 },
+[SYS_read]      { "read", 3 },
+[SYS_kill]      { "kill", 1 },
+[SYS_exec]      { "exec", 2 },
+[SYS_fstat]     { "fstat", 2 },
+[SYS_chdir]     { "chdir", 1 },
+[SYS_dup]       { "dup", 1 },
+[SYS_getpid]    { "getpid", 0 },
+[SYS_sbrk]      { "sbrk", 1 },
+[SYS_sleep]     { "sleep", 1 },
+[SYS_uptime]    { "uptime", 0 },
+[SYS_open]      { "open", 2 },
+[SYS_write]     { "write", 3 },
+[SYS_mknod]     { "mknod", 3 },
+[SYS_unlink]    { "unlink", 1 },
+[SYS_link]      { "link", 2 },
+[SYS_mkdir]     { "mkdir", 1 },
+[SYS_close]     { "close", 1 },
+[SYS_logstat]   { "logstat", 1 },
+[SYS_nice]      { "nice", 2 },
+[SYS_nanosleep] { "nanosleep", 1 },
+[SYS_hugesbrk]  { "hugesbrk", 1 },
+[SYS_mmap]      { "mmap", 6 },
+[SYS_munmap]    { "munmap", 2 },
+[SYS_fsync]     { "fsync", 1 },
+[SYS_splice]    { "splice", 3 },
+[SYS_poll]      { "poll", 3 },
+[SYS_readv]     { "readv", 3 },
+[SYS_writev]    { "writev", 3 },
+[SYS_pread]     { "pread", 4 },
+[SYS_pwrite]    { "pwrite", 4 },
+[SYS_ringsetup] { "ringsetup", 1 },
+[SYS_ringenter] { "ringenter", 0 },
+[SYS_clone]     { "clone", 3 },
+[SYS_futex]     { "futex", 3 },
+[SYS_lockstat]  { "lockstat", 2 },
+[SYS_blkstat]   { "blkstat", 2 },
+[SYS_prof]      { "prof", 3 },
+[SYS_sysstat]   { "sysstat", 3 },
+[SYS_trace]     { "trace", 1 },
+[SYS_traceread] { "traceread", 2 },
+[SYS_dmesg]     { "dmesg", 2 },
+[SYS_clocktime] { "clocktime", 0 },
+[SYS_spawn]     { "spawn", 4 },
+[SYS_getrusage] { "getrusage", 2 },
+};
+
+#define NREC 64
+
+struct sysstat st[NSYSCALL];
+struct tracerec rec[NREC];
+
+void
+stats(int pid)
+{
+  int i, n;
+
+  if((n = sysstat(pid, st, NSYSCALL)) < 0){
+    fprintf(2, "sysstat: no process %d\n", pid);
+    exit(1);
+  }
+  printf("call        calls cycles maxcycles avgcycles\n");
+  for(i = 1; i < n; i++){
+    if(st[i].ncall == 0)
+      continue;
+    if(calls[i].name)
+      printf("%s", calls[i].name);
+    else
+      printf("#%d", i);
+    for(int j = calls[i].name ? strlen(calls[i].name) : 3; j < 12; j++)
+      printf(" ");
+    printf("%ld %ld %ld %ld\n", st[i].ncall, st[i].cycles,
+           st[i].maxcycles, st[i].cycles / st[i].ncall);
+  }
+}
+
+// Print the traced calls waiting in the kernel,
+// oldest first.
+void
+drain(void)
+{
+  struct tracerec t;
+  int i, j, n, k;
+
+  while((n = traceread(rec, NREC)) > 0){
+    // each hart's records are in order, but not
+    // the harts' with each other.
+    for(i = 1; i < n; i++){
+      t = rec[i];
+      for(j = i; j > 0 && rec[j-1].time > t.time; j--)
+        rec[j] = rec[j-1];
+      rec[j] = t;
+    }
+    for(i = 0; i < n; i++){
+      if(rec[i].num > 0 && rec[i].num < NSYSCALL && calls[rec[i].num].name)
+        printf("%d %s(", rec[i].pid, calls[rec[i].num].name);
+      else
+        printf("%d #%d(", rec[i].pid, rec[i].num);
+      k = rec[i].num < NSYSCALL ? calls[rec[i].num].nargs : 0;
+      for(j = 0; j < k; j++)
+        printf(j ? ", 0x%lx" : "0x%lx", rec[i].arg[j]);
+      printf(") = %d  <%ld>\n", (int)rec[i].ret, rec[i].cycles);
+    }
+    if(n < NREC)
+      break;
+  }
+}
+
+void
+strace(char **argv)
+{
+  struct pollfd pfd;
+  int p[2], pid;
+
+  // the command holds the pipe's write end open until
+  // it exits, so that poll() wakes up then.
+  if(pipe(p) < 0){
+    fprintf(2, "sysstat: pipe failed\n");
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    fprintf(2, "sysstat: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(p[0]);
+    trace(~0L);
+    exec(argv[0], argv);
+    fprintf(2, "sysstat: exec %s failed\n", argv[0]);
+    exit(1);
+  }
+  close(p[1]);
+
+  pfd.fd = p[0];
+  pfd.events = POLLIN;
+  while(poll(&pfd, 1, 100) >= 0 && (pfd.revents & POLLHUP) == 0)
+    drain();
+  wait(0);
+  drain();
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc >= 3 && strcmp(argv[1], "-t") == 0){
+    strace(argv + 2);
+  } else if(argc == 2 && argv[1][0] != '-'){
+    stats(atoi(argv[1]));
+  } else if(argc == 1){
+    stats(-1);
+  } else {
+    fprintf(2, "usage: sysstat [pid] | sysstat -t command [args...]\n");
+    exit(1);
+  }
+  exit(0);
+}
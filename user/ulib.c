@@ -1,6 +1,9 @@
 #include "kernel/types.h"
+#include "kernel/param.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
 #include "user/user.h"
 
 //
@@ -43,14 +46,30 @@ strlen(const char *s)
   return n;
 }
 
+// memset, memmove, and memcmp work a uint64 at a time
+// where both pointers can be 8-byte aligned, like the
+// kernel's versions in kernel/string.c.
+
+#define WALIGNED(p) (((uint64)(p) & 7) == 0)
+
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 w;
+
+  for(; n > 0 && !WALIGNED(cdst); n--)
+    *cdst++ = c;
+  if(n >= 8){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    for(; n >= 8; n -= 8, cdst += 8)
+      *(uint64*)cdst = w;
   }
+  while(n-- > 0)
+    *cdst++ = c;
   return dst;
 }
 
@@ -115,11 +134,26 @@ memmove(void *vdst, const void *vsrc, int n)
   dst = vdst;
   src = vsrc;
   if (src > dst) {
+    if(WALIGNED((uint64)src ^ (uint64)dst)){
+      for(; n > 0 && !WALIGNED(dst); n--)
+        *dst++ = *src++;
+      for(; n >= 8; n -= 8, dst += 8, src += 8)
+        *(uint64*)dst = *(uint64*)src;
+    }
     while(n-- > 0)
       *dst++ = *src++;
   } else {
     dst += n;
     src += n;
+    if(WALIGNED((uint64)src ^ (uint64)dst)){
+      for(; n > 0 && !WALIGNED(dst); n--)
+        *--dst = *--src;
+      for(; n >= 8; n -= 8){
+        dst -= 8;
+        src -= 8;
+        *(uint64*)dst = *(uint64*)src;
+      }
+    }
     while(n-- > 0)
       *--dst = *--src;
   }
@@ -130,6 +164,13 @@ int
 memcmp(const void *s1, const void *s2, uint n)
 {
   const char *p1 = s1, *p2 = s2;
+  if(WALIGNED((uint64)p1 ^ (uint64)p2)){
+    for(; n > 0 && !WALIGNED(p1); n--, p1++, p2++)
+      if(*p1 != *p2)
+        return *p1 - *p2;
+    for(; n >= 8 && *(uint64*)p1 == *(uint64*)p2; n -= 8)
+      p1 += 8, p2 += 8;
+  }
   while (n-- > 0) {
     if (*p1 != *p2) {
       return *p1 - *p2;
@@ -145,3 +186,50 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// A mutex for threads made with clone(): *m is 0 if it's
+// free, 1 if it's held, and 2 if it's held and others may
+// be waiting in futex(), so that unlocking an uncontended
+// mutex needn't enter the kernel.
+void
+mutexlock(int *m)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(m, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = __sync_lock_test_and_set(m, 2);
+  while(c != 0){
+    futex(m, FUTEX_WAIT, 2);
+    c = __sync_lock_test_and_set(m, 2);
+  }
+}
+
+void
+mutexunlock(int *m)
+{
+  if(__sync_fetch_and_sub(m, 1) != 1){
+    *m = 0;
+    __sync_synchronize();
+    futex(m, FUTEX_WAKE, 0);
+  }
+}
+
+// the time CSR, which counts TIMEHZ cycles a second.
+uint64
+rdtime(void)
+{
+  return r_time();
+}
+
+// nanoseconds since boot, from the time CSR and the
+// kernel's clock page, without a system call.
+uint64
+nanotime(void)
+{
+  struct vtime *vt = (struct vtime*)TIMEPAGE;
+  uint64 t = r_time() - vt->boot;
+
+  return t / vt->hz * 1000000000 + t % vt->hz * 1000000000 / vt->hz;
+}
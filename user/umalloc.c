@@ -3,88 +3,173 @@
 #include "user/user.h"
 #include "kernel/param.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator.
+//
+// Small blocks come in power-of-two size classes, from 32 to
+// 2048 bytes, header included. Each class has a free list,
+// so malloc() and free() of a small block are O(1), and
+// carves new blocks with a bump pointer from arenas of
+// ARENA pages. A small block is only ever reused for its
+// own class.
+//
+// A large block is a run of whole pages. Free runs are kept
+// in address order and merged with their neighbours, and once
+// ARENA or more free pages end at the top of the heap, they
+// go back to the kernel with sbrk(). Since sbrk() only claims
+// addresses, and the kernel allocates pages when they're first
+// touched, growing the heap is cheap.
 
-typedef long Align;
+#define PGSIZE   4096
+#define NCLASS   7      // 32, 64, ..., 2048
+#define MINBLOCK 32
+#define ARENA    16     // pages
 
-union header {
-  struct {
-    union header *ptr;
-    uint size;
-  } s;
-  Align x;
+// Every block starts with a header. The 16 bytes keep
+// the memory malloc() returns 16-byte aligned.
+typedef struct header {
+  uint64 size;          // bytes in the block, header included
+  struct header *next;  // next free block of the class, if free
+} Header;
+
+// A run of free pages.
+struct run {
+  uint64 size;          // bytes, a multiple of PGSIZE
+  struct run *next;     // next free run, by address
 };
 
-typedef union header Header;
+static struct {
+  Header *free;         // free blocks
+  char *next;           // rest of the current arena
+  char *end;
+} cls[NCLASS];
 
-static Header base;
-static Header *freep;
+static struct run *runs;  // free page runs, lowest address first
 
-void
-free(void *ap)
+// Take n bytes of pages, n a multiple of PGSIZE, from the
+// free runs, or else from the kernel.
+static void*
+pgalloc(uint64 n)
 {
-  Header *bp, *p;
-
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
+  struct run *r, **pp, *last;
+  char *top, *p;
+  uint64 pad;
+
+  last = 0;
+  for(pp = &runs; (r = *pp) != 0; pp = &r->next){
+    if(r->size == n){
+      *pp = r->next;
+      return r;
+    }
+    if(r->size > n){
+      // take the end, so the run's header stays put.
+      r->size -= n;
+      return (char*)r + r->size;
+    }
+    last = r;
+  }
+
+  top = sbrk(0);
+  if(last && (char*)last + last->size == top){
+    // grow the free run at the top of the heap.
+    if(sbrk(n - last->size) == (char*)-1)
+      return 0;
+    for(pp = &runs; *pp != last; pp = &(*pp)->next)
+      ;
+    *pp = 0;
+    return last;
+  }
+  // keep the heap page-aligned, whatever else called sbrk().
+  pad = (PGSIZE - (uint64)top % PGSIZE) % PGSIZE;
+  if((p = sbrk(pad + n)) == (char*)-1)
+    return 0;
+  return p + pad;
 }
 
-static Header*
-morecore(uint nu)
+// Put n bytes of pages at p back on the free runs,
+// merging them with their neighbours, and give the
+// kernel back a big enough free run at the top.
+static void
+pgfree(void *p, uint64 n)
 {
-  char *p;
-  Header *hp;
+  struct run *r, *prev, *next, **pp;
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if(p == (char*)-1)
-    return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  r = (struct run*)p;
+  r->size = n;
+  prev = 0;
+  for(next = runs; next && next < r; next = next->next)
+    prev = next;
+  if(next && (char*)r + r->size == (char*)next){
+    r->size += next->size;
+    next = next->next;
+  }
+  r->next = next;
+  if(prev && (char*)prev + prev->size == (char*)r){
+    prev->size += r->size;
+    prev->next = r->next;
+    r = prev;
+  } else if(prev){
+    prev->next = r;
+  } else {
+    runs = r;
+  }
+
+  if(r->next == 0 && r->size >= ARENA*PGSIZE && (char*)r + r->size == sbrk(0)){
+    for(pp = &runs; *pp != r; pp = &(*pp)->next)
+      ;
+    if(sbrk(-(int)r->size) != (char*)-1)
+      *pp = 0;
+  }
+}
+
+void
+free(void *ap)
+{
+  Header *h;
+  int c;
+
+  if(ap == 0)
+    return;
+  h = (Header*)ap - 1;
+  if(h->size >= PGSIZE){
+    pgfree(h, h->size);
+    return;
+  }
+  for(c = 0; (MINBLOCK << c) < h->size; c++)
+    ;
+  h->next = cls[c].free;
+  cls[c].free = h;
 }
 
 void*
 malloc(uint nbytes)
 {
-  Header *p, *prevp;
-  uint nunits;
+  Header *h;
+  uint64 n;
+  int c;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  n = (uint64)nbytes + sizeof(Header);
+  if(n > (MINBLOCK << (NCLASS-1))){
+    n = (n + PGSIZE - 1) / PGSIZE * PGSIZE;
+    if((h = pgalloc(n)) == 0)
+      return 0;
+    h->size = n;
+    return (void*)(h + 1);
   }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void*)(p + 1);
-    }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
+
+  for(c = 0; (MINBLOCK << c) < n; c++)
+    ;
+  n = MINBLOCK << c;
+  if((h = cls[c].free) != 0){
+    cls[c].free = h->next;
+    return (void*)(h + 1);
+  }
+  if(cls[c].next + n > cls[c].end){
+    if((cls[c].next = pgalloc(ARENA*PGSIZE)) == 0)
+      return 0;
+    cls[c].end = cls[c].next + ARENA*PGSIZE;
   }
+  h = (Header*)cls[c].next;
+  cls[c].next += n;
+  h->size = n;
+  return (void*)(h + 1);
 }
@@ -1,4 +1,15 @@
 struct stat;
+struct logstat;
+struct lockstat;
+struct blkstat;
+struct profsample;
+struct sysstat;
+struct tracerec;
+struct pollfd;
+struct iovec;
+struct ring;
+struct spawnact;
+struct rusage;
 
 // system calls
 int fork(void);
@@ -22,6 +33,33 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int logstat(struct logstat*);
+int nice(int, int);
+int nanosleep(uint64);
+char* hugesbrk(int);
+void* mmap(void*, uint, int, int, int, uint);
+int munmap(void*, uint);
+int fsync(int);
+int splice(int, int, int);
+int poll(struct pollfd*, int, int);
+int readv(int, struct iovec*, int);
+int writev(int, struct iovec*, int);
+int pread(int, void*, int, uint);
+int pwrite(int, const void*, int, uint);
+int ringsetup(struct ring*);
+int ringenter(void);
+int clone(void (*)(void*), void*, void*);
+int futex(int*, int, int);
+int lockstat(struct lockstat*, int);
+int blkstat(int, struct blkstat*);
+int prof(int, struct profsample*, int);
+int sysstat(int, struct sysstat*, int);
+int trace(uint64);
+int traceread(struct tracerec*, int);
+int dmesg(char*, int);
+uint64 clocktime(void);
+int spawn(const char*, char**, struct spawnact*, int);
+int getrusage(int, struct rusage*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -37,6 +75,10 @@ void* memset(void*, int, uint);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+void mutexlock(int*);
+void mutexunlock(int*);
+uint64 rdtime(void);
+uint64 nanotime(void);
 
 // umalloc.c
 void* malloc(uint);
@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/ring.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -581,6 +582,9 @@ writetest(char *s)
 void
 writebig(char *s)
 {
+  // MAXFILE no longer fits on the disk; go well
+  // into the doubly-indirect blocks instead.
+  enum { N = NDIRECT + 2*NINDIRECT };
   int i, fd, n;
 
   fd = open("big", O_CREATE|O_RDWR);
@@ -589,7 +593,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < N; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed i=%d\n", s, i);
@@ -609,7 +613,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n != MAXFILE){
+      if(n != N){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -632,6 +636,59 @@ writebig(char *s)
   }
 }
 
+// an extent file bigger than the singly-indirect limit.
+void
+extentfile(char *s)
+{
+  enum { N = NDIRECT + NINDIRECT + 20 };
+  int i, fd, n;
+  struct stat st;
+
+  fd = open("extent", O_CREATE|O_RDWR|O_EXTENT);
+  if(fd < 0){
+    printf("%s: error: creat extent failed!\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    ((int*)buf)[0] = i;
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: error: write extent file failed i=%d\n", s, i);
+      exit(1);
+    }
+  }
+  if(fstat(fd, &st) < 0 || st.size != N*BSIZE){
+    printf("%s: extent file has wrong size\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("extent", O_RDONLY);
+  if(fd < 0){
+    printf("%s: error: open extent failed!\n", s);
+    exit(1);
+  }
+  for(n = 0; n < N; n++){
+    if(read(fd, buf, BSIZE) != BSIZE){
+      printf("%s: read extent failed at block %d\n", s, n);
+      exit(1);
+    }
+    if(((int*)buf)[0] != n){
+      printf("%s: read content of block %d is %d\n", s,
+             n, ((int*)buf)[0]);
+      exit(1);
+    }
+  }
+  if(read(fd, buf, BSIZE) != 0){
+    printf("%s: extent file too long\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("extent") < 0){
+    printf("%s: unlink extent failed\n", s);
+    exit(1);
+  }
+}
+
 // many creates, followed by unlink test
 void
 createtest(char *s)
@@ -733,6 +790,185 @@ exectest(char *s)
 
 }
 
+// copy file from to file to.
+static void
+copyfile(char *s, char *from, char *to)
+{
+  char buf[512];
+  int fd0, fd1, n;
+
+  fd0 = open(from, O_RDONLY);
+  fd1 = open(to, O_CREATE|O_TRUNC|O_WRONLY);
+  if(fd0 < 0 || fd1 < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  while((n = read(fd0, buf, sizeof(buf))) > 0){
+    if(write(fd1, buf, n) != n){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd0);
+  close(fd1);
+}
+
+// run argv[0] with its output going to file out,
+// and check that out says want.
+static void
+runto(char *s, char **argv, char *out, char *want)
+{
+  char buf[32];
+  int fd, n, pid, xstatus;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(1);
+    if(open(out, O_CREATE|O_TRUNC|O_WRONLY) != 1){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+    exec(argv[0], argv);
+    printf("%s: exec %s failed\n", s, argv[0]);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  fd = open(out, O_RDONLY);
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if(n < 0)
+    n = 0;
+  buf[n] = 0;
+  if(strcmp(buf, want) != 0){
+    printf("%s: %s said %s, not %s\n", s, argv[0], buf, want);
+    exit(1);
+  }
+}
+
+// exec() maps program pages from the page cache, so
+// rewriting a program must drop its cached pages.
+void
+execcache(char *s)
+{
+  char *echoargv[] = { "pcexec", "echoed", 0 };
+  char *catargv[] = { "pcexec", "pcin", 0 };
+  int fd, i;
+
+  copyfile(s, "echo", "pcexec");
+  for(i = 0; i < 3; i++)
+    runto(s, echoargv, "pcout", "echoed\n");
+
+  fd = open("pcin", O_CREATE|O_TRUNC|O_WRONLY);
+  if(fd < 0 || write(fd, "catted\n", 7) != 7){
+    printf("%s: write pcin failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  copyfile(s, "cat", "pcexec");
+  runto(s, catargv, "pcout", "catted\n");
+
+  unlink("pcexec");
+  unlink("pcin");
+  unlink("pcout");
+}
+
+// exec() leaves the program's pages to be read in when
+// touched: its text can't be written, and a forked child's
+// stores to its initialized data aren't seen by the parent.
+char execdata[3*PGSIZE] = { [0] = 'd', [PGSIZE] = 'd', [2*PGSIZE] = 'd' };
+
+void
+execpaging(char *s)
+{
+  int pid, xstatus, i;
+
+  pid = fork();
+  if(pid == 0){
+    *(volatile char*)execpaging = 0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: wrote the program's text\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid == 0){
+    for(i = 0; i < sizeof(execdata); i += PGSIZE)
+      execdata[i] = 'c';
+    exit(execdata[PGSIZE] == 'c' ? 0 : 1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child's store to data was lost\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(execdata); i += PGSIZE){
+    if(execdata[i] != 'd'){
+      printf("%s: child's store to data seen by parent\n", s);
+      exit(1);
+    }
+  }
+}
+
+// spawn() a child writing to a pipe, by file actions;
+// a failed spawn() leaves no child to wait for.
+void
+spawntest(char *s)
+{
+  char *argv[] = { "echo", "spawned", 0 };
+  struct spawnact act[3];
+  char buf[32];
+  int fds[2], pid, xstatus, n, cc;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  act[0] = (struct spawnact){ SPAWN_DUP2, fds[1], 1 };
+  act[1] = (struct spawnact){ SPAWN_CLOSE, fds[0], 0 };
+  act[2] = (struct spawnact){ SPAWN_CLOSE, fds[1], 0 };
+  if((pid = spawn("echo", argv, act, 3)) < 0){
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  n = 0;
+  while((cc = read(fds[0], buf + n, sizeof(buf) - 1 - n)) > 0)
+    n += cc;
+  close(fds[0]);
+  buf[n] = 0;
+  if(strcmp(buf, "spawned\n") != 0){
+    printf("%s: child wrote %s\n", s, buf);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait for spawned child failed\n", s);
+    exit(1);
+  }
+
+  if(spawn("nonexistent", argv, 0, 0) >= 0){
+    printf("%s: spawn of nonexistent succeeded\n", s);
+    exit(1);
+  }
+  act[0] = (struct spawnact){ SPAWN_CLOSE, 99, 0 };
+  if(spawn("echo", argv, act, 1) >= 0){
+    printf("%s: spawn with a bad fd succeeded\n", s);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: failed spawn left a child\n", s);
+    exit(1);
+  }
+}
+
 // simple fork and pipe read/write
 
 void
@@ -1399,10 +1635,9 @@ concreate(char *s)
   char file[3];
   int i, pid, n, fd;
   char fa[N];
-  struct {
-    ushort inum;
-    char name[DIRSIZ];
-  } de;
+  static char blk[BSIZE];
+  struct dirent *de;
+  int off;
 
   file[0] = 'C';
   file[2] = '\0';
@@ -1435,21 +1670,23 @@ concreate(char *s)
   memset(fa, 0, sizeof(fa));
   fd = open(".", 0);
   n = 0;
-  while(read(fd, &de, sizeof(de)) > 0){
-    if(de.inum == 0)
-      continue;
-    if(de.name[0] == 'C' && de.name[2] == '\0'){
-      i = de.name[1] - '0';
-      if(i < 0 || i >= sizeof(fa)){
-        printf("%s: concreate weird file %s\n", s, de.name);
-        exit(1);
-      }
-      if(fa[i]){
-        printf("%s: concreate duplicate file %s\n", s, de.name);
-        exit(1);
+  while(read(fd, blk, BSIZE) == BSIZE){
+    for(off = 0; off < BSIZE && (de = (struct dirent*)(blk + off))->reclen; off += de->reclen){
+      if(de->inum == 0)
+        continue;
+      if(de->namelen == 2 && de->name[0] == 'C'){
+        i = de->name[1] - '0';
+        if(i < 0 || i >= sizeof(fa)){
+          printf("%s: concreate weird file C%c\n", s, de->name[1]);
+          exit(1);
+        }
+        if(fa[i]){
+          printf("%s: concreate duplicate file C%c\n", s, de->name[1]);
+          exit(1);
+        }
+        fa[i] = 1;
+        n++;
       }
-      fa[i] = 1;
-      n++;
     }
   }
   close(fd);
@@ -1781,50 +2018,73 @@ bigfile(char *s)
   unlink("bigfile.dat");
 }
 
+// names of DIRSIZ characters work, and longer
+// ones are cut to DIRSIZ.
 void
-fourteen(char *s)
+longname(char *s)
 {
-  int fd;
+  char a[DIRSIZ+2], b[DIRSIZ+2], path[3*(DIRSIZ+2)];
+  int fd, i;
 
-  // DIRSIZ is 14.
+  for(i = 0; i < DIRSIZ+1; i++)
+    a[i] = b[i] = '0' + (i+1) % 10;
+  a[DIRSIZ] = '\0';       // a is DIRSIZ long
+  b[DIRSIZ+1] = '\0';     // b is one longer
 
-  if(mkdir("12345678901234") != 0){
-    printf("%s: mkdir 12345678901234 failed\n", s);
+  if(mkdir(a) != 0){
+    printf("%s: mkdir %s failed\n", s, a);
     exit(1);
   }
-  if(mkdir("12345678901234/123456789012345") != 0){
-    printf("%s: mkdir 12345678901234/123456789012345 failed\n", s);
+  strcpy(path, a);
+  strcpy(path + strlen(path), "/");
+  strcpy(path + strlen(path), b);
+  if(mkdir(path) != 0){
+    printf("%s: mkdir a/b failed\n", s);
     exit(1);
   }
-  fd = open("123456789012345/123456789012345/123456789012345", O_CREATE);
+  strcpy(path, b);
+  strcpy(path + strlen(path), "/");
+  strcpy(path + strlen(path), b);
+  strcpy(path + strlen(path), "/");
+  strcpy(path + strlen(path), b);
+  fd = open(path, O_CREATE);
   if(fd < 0){
-    printf("%s: create 123456789012345/123456789012345/123456789012345 failed\n", s);
+    printf("%s: create b/b/b failed\n", s);
     exit(1);
   }
   close(fd);
-  fd = open("12345678901234/12345678901234/12345678901234", 0);
+  strcpy(path, a);
+  strcpy(path + strlen(path), "/");
+  strcpy(path + strlen(path), a);
+  strcpy(path + strlen(path), "/");
+  strcpy(path + strlen(path), a);
+  fd = open(path, 0);
   if(fd < 0){
-    printf("%s: open 12345678901234/12345678901234/12345678901234 failed\n", s);
+    printf("%s: open a/a/a failed\n", s);
     exit(1);
   }
   close(fd);
 
-  if(mkdir("12345678901234/12345678901234") == 0){
-    printf("%s: mkdir 12345678901234/12345678901234 succeeded!\n", s);
-    exit(1);
-  }
-  if(mkdir("123456789012345/12345678901234") == 0){
-    printf("%s: mkdir 12345678901234/123456789012345 succeeded!\n", s);
+  strcpy(path, a);
+  strcpy(path + strlen(path), "/");
+  strcpy(path + strlen(path), a);
+  if(mkdir(path) == 0){
+    printf("%s: mkdir a/a succeeded!\n", s);
     exit(1);
   }
 
   // clean up
-  unlink("123456789012345/12345678901234");
-  unlink("12345678901234/12345678901234");
-  unlink("12345678901234/12345678901234/12345678901234");
-  unlink("123456789012345/123456789012345/123456789012345");
-  unlink("12345678901234/123456789012345");
-  unlink("12345678901234");
+  strcpy(path + strlen(path), "/");
+  strcpy(path + strlen(path), a);
+  unlink(path);
+  path[strlen(a)*2+1] = '\0';
+  unlink(path);
+  unlink(a);
+  fd = open(a, 0);
+  if(fd >= 0){
+    printf("%s: %s still exists\n", s, a);
+    exit(1);
+  }
 }
 
 void
@@ -1956,114 +2216,1523 @@ iref(char *s)
   chdir("/");
 }
 
-// test that fork fails gracefully
-// the forktest binary also does this, but it runs out of proc entries first.
-// inside the bigger usertests binary, we run out of memory first.
+// nice() sets and returns static priorities.
 void
-forktest(char *s)
+nicetest(char *s)
 {
-  enum{ N = 1000 };
-  int n, pid;
+  int pid, xstatus;
 
-  for(n=0; n<N; n++){
-    pid = fork();
-    if(pid < 0)
-      break;
-    if(pid == 0)
-      exit(0);
+  if(nice(0, NPRIO-1) != 0){
+    printf("%s: default priority is not 0\n", s);
+    exit(1);
   }
-
-  if (n == 0) {
-    printf("%s: no fork at all!\n", s);
+  if(nice(0, NPRIO) != -1 || nice(0, -1) != -1){
+    printf("%s: nice accepted a bad priority\n", s);
     exit(1);
   }
-
-  if(n == N){
-    printf("%s: fork claimed to work 1000 times!\n", s);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // children inherit the parent's priority.
+    exit(nice(0, 0) == NPRIO-1 ? 0 : 1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child did not inherit priority\n", s);
+    exit(1);
+  }
+  if(nice(0, 0) != NPRIO-1){
+    printf("%s: nice lost the priority\n", s);
     exit(1);
   }
+  if(nice(1000000, 0) != -1){
+    printf("%s: nice of a non-existent pid succeeded\n", s);
+    exit(1);
+  }
+}
 
-  for(; n > 0; n--){
-    if(wait(0) < 0){
-      printf("%s: wait stopped early\n", s);
+// a CPU-bound process, demoted to the lowest priority,
+// still runs while processes that keep sleeping keep the
+// top level of every CPU's queue busy.
+void
+boosttest(char *s)
+{
+  enum { NPAIR = NCPU + 1 };
+  int pids[2*NPAIR], a[2], b[2], done[2], i, n, spinner;
+  struct pollfd pfd;
+  struct rusage ru;
+  char c;
+
+  // each of a pair runs briefly, then sleeps until
+  // the other passes the byte back.
+  for(i = 0; i < NPAIR; i++){
+    if(pipe(a) < 0 || pipe(b) < 0){
+      printf("%s: pipe failed\n", s);
+      exit(1);
+    }
+    if((pids[2*i] = fork()) == 0){
+      while(write(a[1], "x", 1) == 1 && read(b[0], &c, 1) == 1)
+        ;
+      exit(0);
+    }
+    if((pids[2*i+1] = fork()) == 0){
+      while(read(a[0], &c, 1) == 1 && write(b[1], &c, 1) == 1)
+        ;
+      exit(0);
+    }
+    close(a[0]);
+    close(a[1]);
+    close(b[0]);
+    close(b[1]);
+    if(pids[2*i] < 0 || pids[2*i+1] < 0){
+      printf("%s: fork failed\n", s);
       exit(1);
     }
   }
 
-  if(wait(0) != -1){
-    printf("%s: wait got too many\n", s);
+  if(pipe(done) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if((spinner = fork()) == 0){
+    close(done[0]);
+    do
+      getrusage(RUSAGE_SELF, &ru);
+    while(ru.utime + ru.stime < 5);
+    write(done[1], "x", 1);
+    exit(0);
+  }
+  close(done[1]);
+  pfd.fd = done[0];
+  pfd.events = POLLIN;
+  n = poll(&pfd, 1, 30000);
+  close(done[0]);
+
+  for(i = 0; i < 2*NPAIR; i++)
+    kill(pids[i]);
+  if(spinner > 0)
+    kill(spinner);
+  while(wait(0) >= 0)
+    ;
+  if(spinner < 0 || n != 1){
+    printf("%s: spinning process starved\n", s);
     exit(1);
   }
 }
 
+// sleep() and nanosleep() wait about as long as asked,
+// including for less than a clock tick.
 void
-sbrkbasic(char *s)
+sleeptest(char *s)
 {
-  enum { TOOMUCH=1024*1024*1024};
-  int i, pid, xstatus;
-  char *c, *a, *b;
+  enum { N = 10 };
+  int i, pid, t0, xstatus;
 
-  // does sbrk() return the expected failure value?
-  pid = fork();
-  if(pid < 0){
-    printf("fork failed in sbrkbasic\n");
-    exit(1);
-  }
-  if(pid == 0){
-    a = sbrk(TOOMUCH);
-    if(a == (char*)0xffffffffffffffffL){
-      // it's OK if this fails.
-      exit(0);
+  // timed sleepers wake up independently.
+  t0 = uptime();
+  for(i = 0; i < N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
     }
-    
-    for(b = a; b < a+TOOMUCH; b += 4096){
-      *b = 99;
+    if(pid == 0){
+      sleep(1 + i % 3);
+      exit(0);
     }
-    
-    // we should not get here! either sbrk(TOOMUCH)
-    // should have failed, or (with lazy allocation)
-    // a pagefault should have killed this process.
-    exit(1);
   }
-
-  wait(&xstatus);
-  if(xstatus == 1){
-    printf("%s: too much memory allocated!\n", s);
+  for(i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  if(uptime() - t0 < 2){
+    printf("%s: sleep(3) returned early\n", s);
     exit(1);
   }
 
-  // can one sbrk() less than a page?
-  a = sbrk(0);
-  for(i = 0; i < 5000; i++){
-    b = sbrk(1);
-    if(b != a){
-      printf("%s: sbrk test failed %d %p %p\n", s, i, a, b);
+  // 20 sleeps of a millisecond shouldn't take 20 ticks.
+  t0 = uptime();
+  for(i = 0; i < 20; i++){
+    if(nanosleep(1000000) != 0){
+      printf("%s: nanosleep failed\n", s);
       exit(1);
     }
-    *b = 1;
-    a = b + 1;
   }
-  pid = fork();
-  if(pid < 0){
-    printf("%s: sbrk test fork failed\n", s);
+  if(uptime() - t0 >= 10){
+    printf("%s: short nanosleeps were rounded up to ticks\n", s);
     exit(1);
   }
-  c = sbrk(1);
-  c = sbrk(1);
-  if(c != a + 1){
-    printf("%s: sbrk test failed post-fork\n", s);
+
+  t0 = uptime();
+  nanosleep(250000000);
+  if(uptime() - t0 < 2){
+    printf("%s: nanosleep returned early\n", s);
     exit(1);
   }
-  if(pid == 0)
-    exit(0);
-  wait(&xstatus);
-  exit(xstatus);
 }
 
+// mmap() of a file: private mappings don't change it,
+// shared ones do once unmapped, and fork() shares them.
 void
-sbrkmuch(char *s)
+mmaptest(char *s)
 {
-  enum { BIG=100*1024*1024 };
+  enum { SZ = 2*PGSIZE + PGSIZE/2 };
+  char *p, buf[64];
+  int fd, i, pid, xstatus;
+
+  fd = open("mmapfile", O_CREATE|O_TRUNC|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    buf[0] = 'a' + i % 26;
+    if(write(fd, buf, 1) != 1){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    if(p[i] != 'a' + i % 26){
+      printf("%s: wrong mapped content at %d\n", s, i);
+      exit(1);
+    }
+  }
+  for(i = SZ; i < 3*PGSIZE; i++){
+    if(p[i] != 0){
+      printf("%s: mapping not zero past end of file\n", s);
+      exit(1);
+    }
+  }
+  p[0] = 'X';
+  if(munmap(p, SZ) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 'a'){
+    printf("%s: private store reached the file\n", s);
+    exit(1);
+  }
+  p[1] = 'Y';
+
+  // the store is to the cached page, so read() sees it at once.
+  if((i = open("mmapfile", O_RDONLY)) < 0 || read(i, buf, 2) != 2 || buf[1] != 'Y'){
+    printf("%s: read didn't see the shared store\n", s);
+    exit(1);
+  }
+  close(i);
+
+  // a child shares the parent's shared mapping.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(p[1] != 'Y')
+      exit(1);
+    p[PGSIZE] = 'Z';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child didn't see the mapping\n", s);
+    exit(1);
+  }
+  if(p[PGSIZE] != 'Z'){
+    printf("%s: parent didn't see the child's store\n", s);
+    exit(1);
+  }
+
+  // a system call can read from a page not yet touched.
+  if(write(fd, p + 2*PGSIZE, 10) != 10){
+    printf("%s: write from mapping failed\n", s);
+    exit(1);
+  }
+
+  // unmap the middle, then the rest.
+  if(munmap(p + PGSIZE, PGSIZE) != 0 || munmap(p, 3*PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, 2) != 2 || buf[0] != 'a' || buf[1] != 'Y'){
+    printf("%s: shared store didn't reach the file\n", s);
+    exit(1);
+  }
+  if(read(fd, buf, 1) != 1 || buf[0] != 'a' + 2 % 26){
+    printf("%s: wrong file content\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+}
+
+// metadata blocks just written back by a commit, or
+// prefetched by ialloc() and ifree(), read back right at
+// once, while the disk may still have them.
+void
+bcachewait(char *s)
+{
+  enum { N = 40 };
+  char name[8], buf[8];
+  struct stat st;
+  int fd, i, j;
+
+  if(mkdir("bcdir") != 0 || chdir("bcdir") != 0){
+    printf("%s: mkdir bcdir failed\n", s);
+    exit(1);
+  }
+  name[0] = 'f';
+  name[3] = '\0';
+  for(j = 0; j < 2; j++){
+    for(i = 0; i < N; i++){
+      name[1] = '0' + i / 10;
+      name[2] = '0' + i % 10;
+      fd = open(name, O_CREATE|O_RDWR);
+      if(fd < 0 || write(fd, name, 4) != 4 || fsync(fd) != 0){
+        printf("%s: create %s failed\n", s, name);
+        exit(1);
+      }
+      close(fd);
+      fd = open(name, O_RDONLY);
+      if(fd < 0 || fstat(fd, &st) != 0 || st.nlink != 1 || st.size != 4 ||
+         read(fd, buf, 4) != 4 || strcmp(buf, name) != 0){
+        printf("%s: %s read back wrong\n", s, name);
+        exit(1);
+      }
+      close(fd);
+    }
+    for(i = 0; i < N; i++){
+      name[1] = '0' + i / 10;
+      name[2] = '0' + i % 10;
+      if(unlink(name) != 0){
+        printf("%s: unlink %s failed\n", s, name);
+        exit(1);
+      }
+    }
+  }
+  if(chdir("..") != 0 || unlink("bcdir") != 0){
+    printf("%s: unlink bcdir failed\n", s);
+    exit(1);
+  }
+}
+
+// writes to a file are cached until fsync() or close(),
+// but read back at once, and reach the disk in a few
+// transactions rather than one per page.
+void
+fsynctest(char *s)
+{
+  enum { N = 8 };
+  static char buf[N*PGSIZE];
+  struct logstat ls0, ls1;
+  int fd, fd1, i, fds[2];
+
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 23;
+  fd = open("fsyncfile", O_CREATE|O_TRUNC|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  logstat(&ls0);
+  if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+
+  fd1 = open("fsyncfile", O_RDONLY);
+  memset(buf, 0, sizeof(buf));
+  if(read(fd1, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  close(fd1);
+  for(i = 0; i < sizeof(buf); i++){
+    if(buf[i] != 'a' + i % 23){
+      printf("%s: wrong content at %d before fsync\n", s, i);
+      exit(1);
+    }
+  }
+
+  if(fsync(fd) != 0){
+    printf("%s: fsync failed\n", s);
+    exit(1);
+  }
+  logstat(&ls1);
+  if(ls1.ncommit - ls0.ncommit > N){
+    printf("%s: %d commits for %d pages\n", s, (int)(ls1.ncommit - ls0.ncommit), N);
+    exit(1);
+  }
+  close(fd);
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[1]) != -1){
+    printf("%s: fsync of a pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  unlink("fsyncfile");
+}
+
+// a small file keeps its content in its inode until it
+// grows, and again after it's truncated.
+void
+inlinefile(char *s)
+{
+  enum { SMALL = 20, BIG = 3000 };
+  static char buf[BIG+1];
+  int fd, i, n, pass;
+
+  for(pass = 0; pass < 2; pass++){
+    fd = open("inlinefile", O_CREATE|O_TRUNC|O_RDWR);
+    if(fd < 0){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+    if(write(fd, "small file contents.", SMALL) != SMALL || fsync(fd) != 0){
+      printf("%s: small write failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    fd = open("inlinefile", O_RDONLY);
+    memset(buf, 0, sizeof(buf));
+    if((n = read(fd, buf, sizeof(buf))) != SMALL || memcmp(buf, "small file contents.", SMALL) != 0){
+      printf("%s: small read got %d bytes\n", s, n);
+      exit(1);
+    }
+    close(fd);
+
+    // grow it past the inode.
+    fd = open("inlinefile", O_RDWR);
+    for(i = 0; i < BIG - SMALL; i++)
+      buf[i] = 'a' + i % 26;
+    if(pwrite(fd, buf, BIG - SMALL, SMALL) != BIG - SMALL || fsync(fd) != 0){
+      printf("%s: big write failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    fd = open("inlinefile", O_RDONLY);
+    memset(buf, 0, sizeof(buf));
+    if((n = read(fd, buf, sizeof(buf))) != BIG){
+      printf("%s: big read got %d bytes\n", s, n);
+      exit(1);
+    }
+    if(memcmp(buf, "small file contents.", SMALL) != 0){
+      printf("%s: lost the inline content\n", s);
+      exit(1);
+    }
+    for(i = SMALL; i < BIG; i++){
+      if(buf[i] != 'a' + (i - SMALL) % 26){
+        printf("%s: wrong byte at %d\n", s, i);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+  unlink("inlinefile");
+}
+
+// the log's writes are contiguous, and the block queue
+// merges them into multi-block disk requests.
+void
+blkmerge(char *s)
+{
+  enum { N = 8 };
+  static char buf[N*PGSIZE];
+  struct blkstat bs0, bs1;
+  struct stat st;
+  int fd;
+
+  memset(buf, 'b', sizeof(buf));
+  fd = open("blkmergefile", O_CREATE|O_TRUNC|O_RDWR);
+  if(fd < 0 || fstat(fd, &st) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(blkstat(st.dev, &bs0) < 0){
+    printf("%s: blkstat failed\n", s);
+    exit(1);
+  }
+  if(write(fd, buf, sizeof(buf)) != sizeof(buf) || fsync(fd) != 0){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  blkstat(st.dev, &bs1);
+  close(fd);
+  unlink("blkmergefile");
+
+  if(bs1.nblock - bs0.nblock < N*(PGSIZE/BSIZE)){
+    printf("%s: only %d blocks written\n", s, (int)(bs1.nblock - bs0.nblock));
+    exit(1);
+  }
+  if(bs1.nreq - bs0.nreq >= bs1.nblock - bs0.nblock){
+    printf("%s: %d requests for %d blocks\n", s,
+           (int)(bs1.nreq - bs0.nreq), (int)(bs1.nblock - bs0.nblock));
+    exit(1);
+  }
+  if(blkstat(-1, &bs1) != -1){
+    printf("%s: blkstat of a bad disk succeeded\n", s);
+    exit(1);
+  }
+}
+
+// the profiler samples a process spinning in user space.
+void
+proftest(char *s)
+{
+  enum { N = 256 };
+  static struct profsample buf[N];
+  volatile int x;
+  int i, n, t0, mine;
+
+  if(prof(PROF_ON, 0, 0) != 0){
+    printf("%s: prof on failed\n", s);
+    exit(1);
+  }
+  for(t0 = uptime(); uptime() - t0 < 3; )
+    for(x = 0; x < 100000; x++)
+      ;
+  prof(PROF_OFF, 0, 0);
+
+  mine = 0;
+  while((n = prof(PROF_READ, buf, N)) > 0){
+    for(i = 0; i < n; i++)
+      if(buf[i].user && buf[i].pid == getpid())
+        mine++;
+  }
+  if(n < 0){
+    printf("%s: prof read failed\n", s);
+    exit(1);
+  }
+  if(mine == 0){
+    printf("%s: no samples of the spinning process\n", s);
+    exit(1);
+  }
+  if(prof(99, 0, 0) != -1){
+    printf("%s: bad prof() command succeeded\n", s);
+    exit(1);
+  }
+}
+
+// sysstat() counts a process's system calls, and trace()
+// records them, in a child it forks too.
+void
+sysstattest(char *s)
+{
+  enum { N = 20 };
+  static struct sysstat st0[NSYSCALL], st1[NSYSCALL];
+  static struct tracerec rec[NTRACE];
+  int i, n, pid, child, found, xstatus;
+
+  if(sysstat(0, st0, NSYSCALL) != NSYSCALL){
+    printf("%s: sysstat failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    getpid();
+  sysstat(0, st1, NSYSCALL);
+  if(st1[SYS_getpid].ncall - st0[SYS_getpid].ncall != N){
+    printf("%s: %d getpid()s counted, not %d\n", s,
+           (int)(st1[SYS_getpid].ncall - st0[SYS_getpid].ncall), N);
+    exit(1);
+  }
+  if(sysstat(-1, st1, NSYSCALL) != NSYSCALL ||
+     st1[SYS_getpid].ncall < st0[SYS_getpid].ncall + N){
+    printf("%s: system-wide sysstat wrong\n", s);
+    exit(1);
+  }
+
+  while(traceread(rec, NTRACE) > 0)
+    ;
+  pid = getpid();
+  trace(1L << SYS_getpid);
+  child = fork();
+  if(child == 0){
+    getpid();
+    exit(0);
+  }
+  getpid();
+  trace(0);
+  wait(&xstatus);
+
+  found = 0;
+  while((n = traceread(rec, NTRACE)) > 0){
+    for(i = 0; i < n; i++){
+      if(rec[i].num != SYS_getpid)
+        continue;
+      if(rec[i].pid != rec[i].ret){
+        printf("%s: traced getpid() returned %d in %d\n", s, (int)rec[i].ret, rec[i].pid);
+        exit(1);
+      }
+      if(rec[i].pid == pid)
+        found |= 1;
+      if(rec[i].pid == child)
+        found |= 2;
+    }
+  }
+  if(found != 3){
+    printf("%s: getpid()s not traced: %d\n", s, found);
+    exit(1);
+  }
+}
+
+// the kernel's complaint about a bad access ends up in
+// its log, for dmesg().
+void
+dmesgtest(char *s)
+{
+  static char buf[NCPU*KLOGSIZE + 1];
+  char want[32], *p;
+  int pid, n, i;
+
+  pid = fork();
+  if(pid == 0){
+    *(volatile char*)0xffffffffffffL = 1;
+    exit(0);
+  }
+  wait(0);
+
+  // "usertrap(): unexpected scause ... pid=N"
+  strcpy(want, "pid=");
+  p = want + strlen(want);
+  for(i = 1000000000; i > pid; i /= 10)
+    ;
+  for(; i > 0; i /= 10)
+    *p++ = '0' + (pid / i) % 10;
+  *p++ = '\n';
+  *p = '\0';
+
+  if((n = dmesg(buf, sizeof(buf) - 1)) <= 0){
+    printf("%s: dmesg returned %d\n", s, n);
+    exit(1);
+  }
+  buf[n] = '\0';
+  for(p = buf; *p; p++)
+    if(memcmp(p, want, strlen(want)) == 0)
+      return;
+  printf("%s: no message about pid %d in the log\n", s, pid);
+  exit(1);
+}
+
+// the clock user code reads without a system call keeps
+// time with clocktime(), resolves well within a tick, and
+// can't be written.
+void
+clocktest(char *s)
+{
+  struct vtime *vt = (struct vtime*)TIMEPAGE;
+  uint64 c0, c1, t0, t1, t2;
+  int i, pid, xstatus;
+
+  if(vt->hz != TIMEHZ){
+    printf("%s: clock page says %ld hz\n", s, vt->hz);
+    exit(1);
+  }
+  c0 = rdtime();
+  for(i = 0; (c1 = rdtime()) == c0 && i < 1000000; i++)
+    ;
+  if(c1 <= c0 || c1 - c0 >= TICKCYCLES){
+    printf("%s: time went from %ld to %ld\n", s, c0, c1);
+    exit(1);
+  }
+
+  t0 = nanotime();
+  t1 = clocktime();
+  t2 = nanotime();
+  if(t0 > t1 || t1 > t2){
+    printf("%s: nanotime %ld, clocktime %ld, nanotime %ld\n", s, t0, t1, t2);
+    exit(1);
+  }
+  sleep(2);
+  t1 = nanotime();
+  if(t1 - t2 < 2 * TICKCYCLES * (1000000000 / TIMEHZ) / 2){
+    printf("%s: sleep(2) took %ld ns\n", s, t1 - t2);
+    exit(1);
+  }
+  if(vt->ticks == 0 || vt->ticks > uptime()){
+    printf("%s: clock page has %ld ticks, uptime %d\n", s, vt->ticks, uptime());
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid == 0){
+    vt->boot = 0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: wrote the clock page\n", s);
+    exit(1);
+  }
+}
+
+// getrusage() counts this process's reads and writes, and
+// a child's memory, time, and sleeps once it is waited for.
+void
+rusagetest(char *s)
+{
+  struct rusage r0, r1;
+  char buf[512];
+  int fds[2], pid, xstatus, t0;
+  uint64 sz;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  getrusage(RUSAGE_SELF, &r0);
+  if(write(fds[1], buf, sizeof(buf)) != sizeof(buf) ||
+     read(fds[0], buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: pipe write/read failed\n", s);
+    exit(1);
+  }
+  getrusage(RUSAGE_SELF, &r1);
+  if(r1.nwrite - r0.nwrite < sizeof(buf) || r1.nread - r0.nread < sizeof(buf)){
+    printf("%s: counted %ld bytes written, %ld read\n", s,
+           r1.nwrite - r0.nwrite, r1.nread - r0.nread);
+    exit(1);
+  }
+
+  sz = (uint64)sbrk(0) + 10*PGSIZE;
+  pid = fork();
+  if(pid == 0){
+    sbrk(10*PGSIZE);
+    write(fds[1], buf, sizeof(buf));
+    for(t0 = uptime(); uptime() < t0 + 3; )
+      ;
+    sleep(1);
+    exit(0);
+  }
+  if(read(fds[0], buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: read from child failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  wait(&xstatus);
+  getrusage(RUSAGE_CHILDREN, &r1);
+  if(r1.nwrite < sizeof(buf) || r1.maxmem < sz || r1.nvcsw == 0 ||
+     r1.utime + r1.stime == 0){
+    printf("%s: child used %ld bytes written, %ld memory, %ld sleeps, %ld ticks\n",
+           s, r1.nwrite, r1.maxmem, r1.nvcsw, r1.utime + r1.stime);
+    exit(1);
+  }
+
+  if(getrusage(2, &r1) != -1){
+    printf("%s: getrusage(2) succeeded\n", s);
+    exit(1);
+  }
+}
+
+// /proc/procs, read a little at a time, lists this process
+// as running, and the other /proc files read.
+void
+procfs(char *s)
+{
+  static char buf[PGSIZE + 1];
+  char want[32], *p;
+  int fd, n, tot, pid, i;
+
+  if((fd = open("/proc/procs", O_RDONLY)) < 0){
+    printf("%s: open /proc/procs failed\n", s);
+    exit(1);
+  }
+  for(tot = 0; tot < PGSIZE && (n = read(fd, buf + tot, 7)) > 0; tot += n)
+    ;
+  close(fd);
+  buf[tot] = '\0';
+
+  pid = getpid();
+  p = want;
+  *p++ = '\n';
+  for(i = 1000000000; i > pid; i /= 10)
+    ;
+  for(; i > 0; i /= 10)
+    *p++ = '0' + (pid / i) % 10;
+  strcpy(p, " run ");
+  for(p = buf; *p; p++)
+    if(memcmp(p, want, strlen(want)) == 0)
+      break;
+  if(*p == '\0'){
+    printf("%s: pid %d not running in /proc/procs\n", s, pid);
+    exit(1);
+  }
+
+  if((fd = open("/proc/bio", O_RDONLY)) < 0 || read(fd, buf, PGSIZE) <= 0 ||
+     memcmp(buf, "bufs ", 5) != 0){
+    printf("%s: /proc/bio unreadable\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("/proc/bio", O_WRONLY)) >= 0 && write(fd, "x", 1) > 0){
+    printf("%s: /proc/bio written\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
+// splice() a file into a pipe in one process and out of
+// it into another file in a child.
+void
+splicetest(char *s)
+{
+  enum { SZ = 3*PGSIZE + 100 };
+  static char buf[SZ];
+  int fd, i, n, pid, xstatus, fds[2];
+
+  for(i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 19;
+  fd = open("splicein", O_CREATE|O_TRUNC|O_RDWR);
+  if(fd < 0 || write(fd, buf, SZ) != SZ){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(splice(fds[0], fds[1], 1) != -1){
+    printf("%s: splice of a pipe to itself succeeded\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[1]);
+    fd = open("spliceout", O_CREATE|O_TRUNC|O_WRONLY);
+    if(fd < 0)
+      exit(1);
+    while((n = splice(fds[0], fd, SZ)) > 0)
+      ;
+    exit(n == 0 ? 0 : 1);
+  }
+  close(fds[0]);
+  fd = open("splicein", O_RDONLY);
+  for(i = 0; i < SZ; i += n){
+    if((n = splice(fd, fds[1], SZ - i)) <= 0){
+      printf("%s: splice into pipe failed\n", s);
+      exit(1);
+    }
+  }
+  if(splice(fd, fds[1], 10) != 0){
+    printf("%s: splice past end of file\n", s);
+    exit(1);
+  }
+  close(fd);
+  close(fds[1]);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: splice out of pipe failed\n", s);
+    exit(1);
+  }
+
+  fd = open("spliceout", O_RDONLY);
+  memset(buf, 0, SZ);
+  if(read(fd, buf, SZ) != SZ || read(fd, buf, 1) != 0){
+    printf("%s: wrong spliced size\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < SZ; i++){
+    if(buf[i] != 'a' + i % 19){
+      printf("%s: wrong spliced content at %d\n", s, i);
+      exit(1);
+    }
+  }
+  unlink("splicein");
+  unlink("spliceout");
+}
+
+// poll() of two pipes, only one of which a child writes,
+// with and without a timeout.
+void
+polltest(char *s)
+{
+  struct pollfd pfd[3];
+  int a[2], b[2], pid, n, xstatus;
+  char c;
+
+  if(pipe(a) != 0 || pipe(b) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pfd[0].fd = a[0];
+  pfd[0].events = POLLIN;
+  pfd[1].fd = b[0];
+  pfd[1].events = POLLIN;
+  pfd[2].fd = b[1];
+  pfd[2].events = POLLOUT;
+  if(poll(pfd, 2, 0) != 0 || poll(pfd, 2, 100) != 0){
+    printf("%s: empty pipes ready\n", s);
+    exit(1);
+  }
+  if(poll(pfd, 3, -1) != 1 || pfd[2].revents != POLLOUT){
+    printf("%s: pipe not ready for writing\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    sleep(2);
+    write(b[1], "x", 1);
+    exit(0);
+  }
+  n = poll(pfd, 2, -1);
+  if(n != 1 || pfd[0].revents != 0 || pfd[1].revents != POLLIN){
+    printf("%s: poll returned %d, revents %d %d\n", s, n, pfd[0].revents, pfd[1].revents);
+    exit(1);
+  }
+  if(read(b[0], &c, 1) != 1 || c != 'x'){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+
+  // no writer left.
+  close(b[1]);
+  if(poll(pfd, 2, -1) != 1 || (pfd[1].revents & POLLHUP) == 0){
+    printf("%s: no POLLHUP\n", s);
+    exit(1);
+  }
+  pfd[0].fd = 99;
+  if(poll(pfd, 1, 0) != 1 || pfd[0].revents != POLLNVAL){
+    printf("%s: no POLLNVAL\n", s);
+    exit(1);
+  }
+  close(a[0]);
+  close(a[1]);
+  close(b[0]);
+}
+
+// writev()/readv() of several buffers, and pread()/pwrite(),
+// which leave the file offset alone.
+void
+iovtest(char *s)
+{
+  struct iovec iov[3];
+  char buf[32];
+  int fd, fds[2];
+
+  fd = open("iovfile", O_CREATE|O_TRUNC|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  iov[0].iov_base = "abc";
+  iov[0].iov_len = 3;
+  iov[1].iov_base = "";
+  iov[1].iov_len = 0;
+  iov[2].iov_base = "defgh";
+  iov[2].iov_len = 5;
+  if(writev(fd, iov, 3) != 8){
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fd, "XY", 2, 1) != 2 || write(fd, "i", 1) != 1){
+    printf("%s: pwrite failed\n", s);
+    exit(1);
+  }
+  memset(buf, 0, sizeof(buf));
+  if(pread(fd, buf, sizeof(buf), 0) != 9 || strcmp(buf, "aXYdefghi") != 0){
+    printf("%s: pread got %s\n", s, buf);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("iovfile", O_RDONLY);
+  memset(buf, 0, sizeof(buf));
+  iov[0].iov_base = buf;
+  iov[0].iov_len = 4;
+  iov[1].iov_base = buf + 10;
+  iov[1].iov_len = 10;
+  if(readv(fd, iov, 2) != 9 || memcmp(buf, "aXYd", 4) != 0 || strcmp(buf + 10, "efghi") != 0){
+    printf("%s: readv failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("iovfile");
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  iov[0].iov_base = "pi";
+  iov[0].iov_len = 2;
+  iov[1].iov_base = "pe";
+  iov[1].iov_len = 3;
+  if(writev(fds[1], iov, 2) != 5 || pwrite(fds[1], "x", 1, 0) != -1){
+    printf("%s: writev to pipe failed\n", s);
+    exit(1);
+  }
+  iov[0].iov_base = buf;
+  iov[0].iov_len = 1;
+  iov[1].iov_base = buf + 1;
+  iov[1].iov_len = sizeof(buf) - 1;
+  if(readv(fds[0], iov, 2) != 5 || strcmp(buf, "pipe") != 0){
+    printf("%s: readv from pipe failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+static void
+ringput(struct ring *r, int num, uint64 a0, uint64 a1, uint64 a2)
+{
+  struct sqe *e = &r->sq[r->sqtail % RINGSIZE];
+
+  e->num = num;
+  e->arg[0] = a0;
+  e->arg[1] = a1;
+  e->arg[2] = a2;
+  e->data = r->sqtail;
+  __sync_synchronize();
+  r->sqtail++;
+}
+
+// system calls queued in a ring run after the next
+// system call, or at ringenter().
+void
+ringtest(char *s)
+{
+  static struct ring r;
+  int fds[2], i;
+  char buf[4];
+
+  if(pipe(fds) != 0 || ringsetup(&r) != 0){
+    printf("%s: setup failed\n", s);
+    exit(1);
+  }
+  ringput(&r, SYS_getpid, 0, 0, 0);
+  ringput(&r, SYS_write, fds[1], (uint64)"ab", 2);
+  ringput(&r, SYS_fork, 0, 0, 0);
+  ringput(&r, SYS_close, fds[1], 0, 0);
+  if(ringenter() < 0 || r.sqhead != 4 || r.cqtail != 4){
+    printf("%s: ringenter ran %d\n", s, r.cqtail);
+    exit(1);
+  }
+  for(i = 0; i < 4; i++){
+    if(r.cq[i].data != i){
+      printf("%s: completion %d out of order\n", s, i);
+      exit(1);
+    }
+  }
+  if(r.cq[0].ret != getpid() || r.cq[1].ret != 2 || r.cq[2].ret != -1 || r.cq[3].ret != 0){
+    printf("%s: wrong results\n", s);
+    exit(1);
+  }
+  r.cqhead = 4;
+  if(read(fds[0], buf, sizeof(buf)) != 2 || read(fds[0], buf, 1) != 0){
+    printf("%s: ring write and close didn't happen\n", s);
+    exit(1);
+  }
+
+  // any system call runs the queue.
+  ringput(&r, SYS_close, fds[0], 0, 0);
+  getpid();
+  if(r.cqtail != 5 || r.cq[4].ret != 0 || close(fds[0]) != -1){
+    printf("%s: trap didn't run the ring\n", s);
+    exit(1);
+  }
+  ringsetup(0);
+}
+
+// the fd table grows past NOFILE, up to MAXOFILE,
+// and always hands out the lowest free fd.
+void
+manyfds(char *s)
+{
+  int fd, n, pid, xstatus;
+
+  for(n = 3; (fd = dup(0)) >= 0; n++){
+    if(fd != n){
+      printf("%s: dup returned %d, not %d\n", s, fd, n);
+      exit(1);
+    }
+  }
+  if(n != MAXOFILE){
+    printf("%s: only %d fds\n", s, n);
+    exit(1);
+  }
+  close(5);
+  close(NOFILE+100);
+  if(dup(0) != 5 || dup(0) != NOFILE+100 || dup(0) != -1){
+    printf("%s: lowest free fd not reused\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(close(MAXOFILE-1) != 0 || dup(0) != MAXOFILE-1)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child didn't inherit the fds\n", s);
+    exit(1);
+  }
+  for(fd = 3; fd < MAXOFILE; fd++)
+    close(fd);
+}
+
+#define NCLONE  4
+#define NCOUNT  2000
+
+char clonestack[NCLONE][PGSIZE] __attribute__((aligned(16)));
+int clonemutex, clonecount, clonego;
+
+void
+clonecounter(void *arg)
+{
+  int i;
+
+  // wait for the go-ahead in futex().
+  while(clonego == 0)
+    futex(&clonego, FUTEX_WAIT, 0);
+  for(i = 0; i < NCOUNT; i++){
+    mutexlock(&clonemutex);
+    clonecount++;
+    mutexunlock(&clonemutex);
+  }
+  // memory grown by a thread is seen by the others.
+  *(char**)arg = sbrk(PGSIZE);
+  **(char**)arg = 'x';
+  exit(0);
+}
+
+// threads made with clone() share memory,
+// and a futex mutex keeps their counts straight.
+void
+clonetest(char *s)
+{
+  char *mem[NCLONE];
+  int i, pid, xstatus;
+
+  for(i = 0; i < NCLONE; i++){
+    if(clone(clonecounter, &mem[i], clonestack[i] + PGSIZE) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  clonego = 1;
+  futex(&clonego, FUTEX_WAKE, 0);
+  for(i = 0; i < NCLONE; i++){
+    pid = wait(&xstatus);
+    if(pid < 0 || xstatus != 0){
+      printf("%s: thread failed\n", s);
+      exit(1);
+    }
+  }
+  if(clonecount != NCLONE*NCOUNT){
+    printf("%s: count %d, not %d\n", s, clonecount, NCLONE*NCOUNT);
+    exit(1);
+  }
+  for(i = 0; i < NCLONE; i++){
+    if(*mem[i] != 'x'){
+      printf("%s: thread's sbrk memory not shared\n", s);
+      exit(1);
+    }
+  }
+  if(futex((int*)(sbrk(0) + PGSIZE), FUTEX_WAKE, 0) != -1 || futex(&clonego, FUTEX_WAIT, 0) != -1){
+    printf("%s: futex didn't fail\n", s);
+    exit(1);
+  }
+}
+
+char futexpage[PGSIZE] __attribute__((aligned(PGSIZE)));
+int futexwoke;
+
+void
+futexwaiter(void *arg)
+{
+  while(*(volatile int*)futexpage == 0)
+    futex((int*)futexpage, FUTEX_WAIT, 0);
+  futexwoke = 1;
+  exit(0);
+}
+
+// a futex on a copy-on-write page, which the waker's
+// store to it copies, still wakes its waiter.
+void
+futexcow(char *s)
+{
+  int pid, tid, xstatus;
+
+  futexpage[0] = 0;  // fork() will share the page copy-on-write
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if((tid = clone(futexwaiter, 0, clonestack[0] + PGSIZE)) < 0)
+      exit(2);
+    sleep(2);
+    *(volatile int*)futexpage = 1;
+    futex((int*)futexpage, FUTEX_WAKE, 0);
+    sleep(5);
+    if(!futexwoke){
+      kill(tid);
+      wait(0);
+      exit(1);
+    }
+    wait(0);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: %s\n", s, xstatus == 1 ? "wakeup was lost" : "clone failed");
+    exit(1);
+  }
+}
+
+// lockstat() reports each lock name once,
+// and counts the acquires of its locks.
+uint64
+procacquires(char *s)
+{
+  static struct lockstat st[NLOCKCLASS];
+  int i, j, n;
+  uint64 r;
+
+  n = lockstat(st, NLOCKCLASS);
+  if(n <= 0 || n > NLOCKCLASS){
+    printf("%s: lockstat returned %d\n", s, n);
+    exit(1);
+  }
+  r = 0;
+  for(i = 0; i < n; i++){
+    for(j = 0; j < i; j++){
+      if(strcmp(st[i].name, st[j].name) == 0){
+        printf("%s: %s listed twice\n", s, st[i].name);
+        exit(1);
+      }
+    }
+    if(strcmp(st[i].name, "proc") == 0)
+      r = st[i].nacquire;
+  }
+  return r;
+}
+
+void
+lockstattest(char *s)
+{
+  uint64 n0, n1;
+  int i, pid;
+
+  n0 = procacquires(s);
+  for(i = 0; i < 4; i++){
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+  n1 = procacquires(s);
+  if(n1 <= n0){
+    printf("%s: proc lock acquires didn't go up\n", s);
+    exit(1);
+  }
+}
+
+// processes reading one file at once, with the inode
+// locked shared, all see the right content, while a
+// writer rewrites another part of it.
+void
+sharedread(char *s)
+{
+  enum { N = 4, SZ = 6*PGSIZE };
+  static char data[SZ];
+  int fd, i, j, pid, xstatus;
+
+  for(i = 0; i < SZ; i++)
+    data[i] = 'a' + i % 19;
+  fd = open("sharedfile", O_CREATE|O_TRUNC|O_RDWR);
+  if(fd < 0 || write(fd, data, SZ) != SZ){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(i = 0; i < N; i++){
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < 20; j++){
+        if((fd = open("sharedfile", O_RDONLY)) < 0)
+          exit(1);
+        memset(buf, 0, PGSIZE);
+        if(read(fd, buf, PGSIZE) != PGSIZE || memcmp(buf, data, PGSIZE) != 0)
+          exit(1);
+        close(fd);
+      }
+      exit(0);
+    }
+  }
+  fd = open("sharedfile", O_RDWR);
+  for(j = 0; j < 20; j++){
+    if(pwrite(fd, data, PGSIZE, SZ - PGSIZE) != PGSIZE){
+      printf("%s: pwrite failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  for(i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: a reader saw the wrong content\n", s);
+      exit(1);
+    }
+  }
+  unlink("sharedfile");
+}
+
+// malloc() hands out aligned, distinct small blocks and
+// reuses them once freed, and free() of a big block at the
+// top of the heap gives the memory back to the kernel.
+void
+malloctest(char *s)
+{
+  enum { N = 200 };
+  static char *p[N];
+  char *top, *big;
+  int i;
+
+  for(i = 0; i < N; i++){
+    if((p[i] = malloc(1 + i*10)) == 0 || (uint64)p[i] % 16 != 0){
+      printf("%s: malloc(%d) failed or misaligned\n", s, 1 + i*10);
+      exit(1);
+    }
+    memset(p[i], i, 1 + i*10);
+  }
+  for(i = 0; i < N; i++){
+    if(p[i][0] != (char)i || p[i][i*10] != (char)i){
+      printf("%s: block %d overwritten\n", s, i);
+      exit(1);
+    }
+  }
+  top = sbrk(0);
+  for(i = 0; i < N; i++)
+    free(p[i]);
+  for(i = 0; i < N; i++)
+    p[i] = malloc(1 + i*10);
+  if(sbrk(0) != top){
+    printf("%s: freed blocks not reused\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    free(p[i]);
+
+  top = sbrk(0);
+  if((big = malloc(1024*1024)) == 0){
+    printf("%s: malloc of 1MB failed\n", s);
+    exit(1);
+  }
+  big[0] = big[1024*1024-1] = 1;
+  free(big);
+  if(sbrk(0) >= top + 1024*1024){
+    printf("%s: free didn't shrink the heap\n", s);
+    exit(1);
+  }
+}
+
+// fork() of a process that uses most of memory only
+// works if the child shares the parent's pages.
+void
+cowfork(char *s)
+{
+  uint64 sz = (PHYSTOP - KERNBASE) / 3 * 2;
+  int pid, ppid, xstatus;
+  char *p, *q;
+
+  ppid = getpid();
+  p = sbrk(sz);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(q = p; q < p + sz; q += PGSIZE)
+    *(int*)q = ppid;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(q = p; q < p + sz; q += PGSIZE){
+      if(*(int*)q != ppid){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+    }
+    // these stores get the child its own copies.
+    for(q = p; q < p + 10*PGSIZE; q += PGSIZE)
+      *(int*)q = getpid();
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  for(q = p; q < p + sz; q += PGSIZE){
+    if(*(int*)q != ppid){
+      printf("%s: child's stores reached the parent\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-sz);
+}
+
+// test that fork fails gracefully
+// the forktest binary also does this, but it runs out of proc entries first.
+// inside the bigger usertests binary, we run out of memory first.
+void
+forktest(char *s)
+{
+  enum{ N = NPROC + 1000 };
+  int n, pid;
+
+  for(n=0; n<N; n++){
+    pid = fork();
+    if(pid < 0)
+      break;
+    if(pid == 0)
+      exit(0);
+  }
+
+  if (n == 0) {
+    printf("%s: no fork at all!\n", s);
+    exit(1);
+  }
+
+  if(n == N){
+    printf("%s: fork claimed to work %d times!\n", s, N);
+    exit(1);
+  }
+
+  for(; n > 0; n--){
+    if(wait(0) < 0){
+      printf("%s: wait stopped early\n", s);
+      exit(1);
+    }
+  }
+
+  if(wait(0) != -1){
+    printf("%s: wait got too many\n", s);
+    exit(1);
+  }
+}
+
+void
+sbrkbasic(char *s)
+{
+  enum { TOOMUCH=1024*1024*1024};
+  int i, pid, xstatus;
+  char *c, *a, *b;
+
+  // does sbrk() return the expected failure value?
+  pid = fork();
+  if(pid < 0){
+    printf("fork failed in sbrkbasic\n");
+    exit(1);
+  }
+  if(pid == 0){
+    a = sbrk(TOOMUCH);
+    if(a == (char*)0xffffffffffffffffL){
+      // it's OK if this fails.
+      exit(0);
+    }
+    
+    for(b = a; b < a+TOOMUCH; b += 4096){
+      *b = 99;
+    }
+    
+    // we should not get here! either sbrk(TOOMUCH)
+    // should have failed, or (with lazy allocation)
+    // a pagefault should have killed this process.
+    exit(1);
+  }
+
+  wait(&xstatus);
+  if(xstatus == 1){
+    printf("%s: too much memory allocated!\n", s);
+    exit(1);
+  }
+
+  // can one sbrk() less than a page?
+  a = sbrk(0);
+  for(i = 0; i < 5000; i++){
+    b = sbrk(1);
+    if(b != a){
+      printf("%s: sbrk test failed %d %p %p\n", s, i, a, b);
+      exit(1);
+    }
+    *b = 1;
+    a = b + 1;
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: sbrk test fork failed\n", s);
+    exit(1);
+  }
+  c = sbrk(1);
+  c = sbrk(1);
+  if(c != a + 1){
+    printf("%s: sbrk test failed post-fork\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(0);
+  wait(&xstatus);
+  exit(xstatus);
+}
+
+void
+sbrkmuch(char *s)
+{
+  enum { BIG=100*1024*1024 };
   char *c, *oldbrk, *a, *lastaddr, *p;
   uint64 amt;
 
@@ -2266,6 +3935,84 @@ sbrkarg(char *s)
   } 
 }
 
+// sbrk() only hands out addresses; a heap bigger than
+// physical memory is fine as long as little of it is touched.
+void
+sbrklazy(char *s)
+{
+  uint64 sz = 2 * (PHYSTOP - KERNBASE);
+  char *a, *q;
+
+  a = sbrk(sz);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk of more than physical memory failed\n", s);
+    exit(1);
+  }
+  for(q = a; q < a + sz; q += sz / 16){
+    if(*q != 0){
+      printf("%s: new heap page isn't zero\n", s);
+      exit(1);
+    }
+    *q = 1;
+  }
+  if(sbrk(-sz) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+}
+
+// hugesbrk() memory is megapage-aligned, survives fork(),
+// and can be shrunk back into the middle of a megapage.
+void
+hugeheap(char *s)
+{
+  enum { MEGA = 512*PGSIZE, SZ = 2*MEGA };
+  char *a, *q, *top;
+  int pid, xstatus;
+
+  sbrk(PGSIZE);  // make sure the heap needs aligning
+  a = hugesbrk(SZ);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: hugesbrk failed\n", s);
+    exit(1);
+  }
+  if((uint64)a % MEGA != 0 || sbrk(0) != a + SZ){
+    printf("%s: hugesbrk memory not aligned\n", s);
+    exit(1);
+  }
+  for(q = a; q < a + SZ; q += PGSIZE)
+    *(uint64*)q = (uint64)q;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(q = a; q < a + SZ; q += PGSIZE)
+      if(*(uint64*)q != (uint64)q)
+        exit(1);
+    *(uint64*)a = 0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || *(uint64*)a != (uint64)a){
+    printf("%s: fork didn't copy huge memory\n", s);
+    exit(1);
+  }
+
+  // shrink into the middle of the second megapage.
+  top = a + MEGA + MEGA/2;
+  sbrk(top - (a + SZ));
+  for(q = a; q < top; q += PGSIZE){
+    if(*(uint64*)q != (uint64)q){
+      printf("%s: shrink lost huge memory\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-(top - a));
+}
+
 void
 validatetest(char *s)
 {
@@ -2605,9 +4352,13 @@ struct test {
   {opentest, "opentest"},
   {writetest, "writetest"},
   {writebig, "writebig"},
+  {extentfile, "extentfile"},
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
+  {execcache, "execcache"},
+  {execpaging, "execpaging"},
+  {spawntest, "spawntest"},
   {pipe1, "pipe1"},
   {killstatus, "killstatus"},
   {preempt, "preempt"},
@@ -2628,17 +4379,44 @@ struct test {
   {subdir, "subdir"},
   {bigwrite, "bigwrite"},
   {bigfile, "bigfile"},
-  {fourteen, "fourteen"},
+  {longname, "longname"},
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
+  {nicetest, "nicetest"},
+  {boosttest, "boosttest"},
+  {sleeptest, "sleeptest"},
+  {cowfork, "cowfork"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
   {kernmem, "kernmem"},
   {MAXVAplus, "MAXVAplus"},
   {sbrkfail, "sbrkfail"},
   {sbrkarg, "sbrkarg"},
+  {sbrklazy, "sbrklazy"},
+  {hugeheap, "hugeheap"},
+  {mmaptest, "mmaptest"},
+  {fsynctest, "fsynctest"},
+  {bcachewait, "bcachewait"},
+  {blkmerge, "blkmerge"},
+  {proftest, "proftest"},
+  {sysstattest, "sysstattest"},
+  {dmesgtest, "dmesgtest"},
+  {clocktest, "clocktest"},
+  {rusagetest, "rusagetest"},
+  {procfs, "procfs"},
+  {inlinefile, "inlinefile"},
+  {splicetest, "splicetest"},
+  {polltest, "polltest"},
+  {iovtest, "iovtest"},
+  {ringtest, "ringtest"},
+  {manyfds, "manyfds"},
+  {clonetest, "clonetest"},
+  {futexcow, "futexcow"},
+  {lockstattest, "lockstattest"},
+  {sharedread, "sharedread"},
+  {malloctest, "malloctest"},
   {validatetest, "validatetest"},
   {bsstest, "bsstest"},
   {bigargtest, "bigargtest"},
@@ -2699,6 +4477,83 @@ bigdir(char *s)
   }
 }
 
+// a directory that outgrows one block becomes indexed;
+// it must still read as blocks of dirents.
+void
+indexdir(char *s)
+{
+  enum { N = 200 };
+  int i, fd, n, off;
+  char name[10];
+  static char blk[BSIZE];
+  struct dirent *de;
+
+  if(mkdir("idxd") != 0){
+    printf("%s: mkdir idxd failed\n", s);
+    exit(1);
+  }
+  name[0] = 'i';
+  name[1] = 'd';
+  name[2] = 'x';
+  name[3] = 'd';
+  name[4] = '/';
+  name[8] = '\0';
+  for(i = 0; i < N; i++){
+    name[5] = 'a' + i / 100;
+    name[6] = '0' + (i / 10) % 10;
+    name[7] = '0' + i % 10;
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+  for(i = 0; i < N; i += 7){
+    name[5] = 'a' + i / 100;
+    name[6] = '0' + (i / 10) % 10;
+    name[7] = '0' + i % 10;
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  if((fd = open("idxd", O_RDONLY)) < 0){
+    printf("%s: open idxd failed\n", s);
+    exit(1);
+  }
+  n = 0;
+  while(read(fd, blk, BSIZE) == BSIZE){
+    for(off = 0; off < BSIZE && (de = (struct dirent*)(blk + off))->reclen; off += de->reclen)
+      if(de->inum != 0)
+        n++;
+  }
+  close(fd);
+  if(n != N + 2){
+    printf("%s: idxd has %d entries, not %d\n", s, n, N + 2);
+    exit(1);
+  }
+
+  if(unlink("idxd") == 0){
+    printf("%s: unlink non-empty idxd succeeded\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    name[5] = 'a' + i / 100;
+    name[6] = '0' + (i / 10) % 10;
+    name[7] = '0' + i % 10;
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("idxd") != 0){
+    printf("%s: unlink idxd failed\n", s);
+    exit(1);
+  }
+}
+
 // concurrent writes to try to provoke deadlock in the virtio disk
 // driver.
 void
@@ -2941,6 +4796,7 @@ outofinodes(char *s)
 
 struct test slowtests[] = {
   {bigdir, "bigdir"},
+  {indexdir, "indexdir"},
   {manywrites, "manywrites"},
   {badwrite, "badwrite" },
   {execout, "execout"},
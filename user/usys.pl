@@ -36,3 +36,30 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("logstat");
+entry("nice");
+entry("nanosleep");
+entry("hugesbrk");
+entry("mmap");
+entry("munmap");
+entry("fsync");
+entry("splice");
+entry("poll");
+entry("readv");
+entry("writev");
+entry("pread");
+entry("pwrite");
+entry("ringsetup");
+entry("ringenter");
+entry("clone");
+entry("futex");
+entry("lockstat");
+entry("blkstat");
+entry("prof");
+entry("sysstat");
+entry("trace");
+entry("traceread");
+entry("dmesg");
+entry("clocktime");
+entry("spawn");
+entry("getrusage");